@@ -8,74 +8,71 @@
 
 LOG_MODULE_REGISTER(emulator, CONFIG_APP_LOG_LEVEL);
 
-#define READ_SIZE 200
 #define FILE_NAME_SIZE 40
 
 static emulator_sensor_t sensor;
 static char emulated_session_name[FILE_NAME_SIZE] = "/NAND:/SESSION1/SESSION.CSV";
 static uint32_t emulated_session_waiting_time = 1000000;
+static uint32_t emulated_session_start_ms;
 static float_t ts, last_ts;
-static char rd_buffer[READ_SIZE];
 static int session_type = 0;
+static bool session_sflp;
+static session_bin_header_t bin_header; // nb_channels is 0 when emulating a CSV session.
 
-static void _parse_line(char* buf, size_t len)
+/* Call the callbacks with a sample, val is indexed by session_channel_t. */
+static void _emit_sample(const float_t *val)
 {
-	int32_t val[13]; // ax, ay, az, gx, gy, gz, grotx, groty, grotz, grotw, gravx, gravy, gravz;
-	int8_t cnt = -1;
-	char *pt;
-    pt = strtok (buf,",");
-    while (pt != NULL) {
-		cnt++;
-        switch (cnt)
-		{
-		case 0:
-			ts = strtof(pt, NULL);
-			break;
-		case 1 ... 13:
-			val[cnt-1] = strtol(pt, NULL, 10);
-			break;
-
-		default:
-			LOG_WRN("Unhandled item in session");
-			break;
-		}
-        pt = strtok (NULL, ",");
-    }
-	if (session_type == cnt + 1)
+	ts = val[SESSION_CHANNEL_TS];
+	if (sensor.callbacks.emulator_ts_sample_cb)
 	{
-		// Call callback functions.
-		if (sensor.callbacks.emulator_ts_sample_cb)
-		{
-			(*sensor.callbacks.emulator_ts_sample_cb)(ts);
-		}
-		if (sensor.callbacks.emulator_acc_sample_cb)
-		{
-			(*sensor.callbacks.emulator_acc_sample_cb)((float_t)val[0], (float_t)val[1], (float_t)val[2]);
-		}
-		if (sensor.callbacks.emulator_gyro_sample_cb)
+		(*sensor.callbacks.emulator_ts_sample_cb)(ts);
+	}
+	if (sensor.callbacks.emulator_acc_sample_cb)
+	{
+		(*sensor.callbacks.emulator_acc_sample_cb)(val[SESSION_CHANNEL_ACC_X], val[SESSION_CHANNEL_ACC_Y], val[SESSION_CHANNEL_ACC_Z]);
+	}
+	if (sensor.callbacks.emulator_gyro_sample_cb)
+	{
+		(*sensor.callbacks.emulator_gyro_sample_cb)(val[SESSION_CHANNEL_GYRO_X], val[SESSION_CHANNEL_GYRO_Y], val[SESSION_CHANNEL_GYRO_Z]);
+	}
+	if (session_sflp)
+	{
+		// Only call these functions if needed.
+		if (sensor.callbacks.emulator_game_rot_sample_cb)
 		{
-			(*sensor.callbacks.emulator_gyro_sample_cb)((float_t)val[3], (float_t)val[4], (float_t)val[5]);
+			(*sensor.callbacks.emulator_game_rot_sample_cb)(val[SESSION_CHANNEL_GAME_ROT_X], val[SESSION_CHANNEL_GAME_ROT_Y], val[SESSION_CHANNEL_GAME_ROT_Z], val[SESSION_CHANNEL_GAME_ROT_W]);
 		}
-		if (session_type == EMULATOR_SESSION_HEADER_SFLP)
+		if (sensor.callbacks.emulator_gravity_sample_cb)
 		{
-			// Only call these functions if needed.
-			if (sensor.callbacks.emulator_game_rot_sample_cb)
-			{
-				(*sensor.callbacks.emulator_game_rot_sample_cb)((float_t)val[6], (float_t)val[7], (float_t)val[8], (float_t)val[9]);
-			}
-			if (sensor.callbacks.emulator_gravity_sample_cb)
-			{
-				(*sensor.callbacks.emulator_gravity_sample_cb)((float_t)val[10], (float_t)val[11], (float_t)val[12]);
-			}
+			(*sensor.callbacks.emulator_gravity_sample_cb)(val[SESSION_CHANNEL_GRAVITY_X], val[SESSION_CHANNEL_GRAVITY_Y], val[SESSION_CHANNEL_GRAVITY_Z]);
 		}
+	}
 
-		emulated_session_waiting_time = (uint32_t)(1000.0f * (ts - last_ts));
-		last_ts = ts;
+	emulated_session_waiting_time = (uint32_t)(1000.0f * (ts - last_ts));
+	last_ts = ts;
+}
+
+static void _parse_line(char* buf, size_t len)
+{
+	float_t val[SESSION_CHANNEL_NB];
+
+	int cnt = session_csv_parse_line(buf, val);
+	if (session_type == cnt)
+	{
+		_emit_sample(val);
 	} else {
-		LOG_ERR("Wrong number of elements! Expected %u, got %u", session_type, cnt + 1);
+		LOG_ERR("Wrong number of elements! Expected %u, got %i", session_type, cnt);
 	}
 }
 
+static void _parse_record(const uint8_t* buf)
+{
+	float_t val[SESSION_CHANNEL_NB] = {0};
+
+	session_bin_unpack_record(&bin_header, buf, val);
+	_emit_sample(val);
+}
+
 int emulator_set_session(char* file_path)
 {
 	if (strlen(file_path) > FILE_NAME_SIZE) {
@@ -86,6 +83,12 @@ int emulator_set_session(char* file_path)
 	return 0;
 }
 
+/* Start the next emulations at start_ms in the session, 0 to start at the beginning. */
+void emulator_set_start_time(uint32_t start_ms)
+{
+	emulated_session_start_ms = start_ms;
+}
+
 void emulator_init(emulator_cb_t cb)
 {
 	sensor.callbacks = cb;
@@ -94,7 +97,7 @@ void emulator_init(emulator_cb_t cb)
 int emulator_session_start()
 {
 	LOG_INF("Emulating file %s", emulated_session_name);
-	session_type = usb_mass_storage_get_session_header(emulated_session_name, usb_mass_storage_get_session_file_p());
+	session_type = usb_mass_storage_get_session_header(emulated_session_name, usb_mass_storage_get_session_file_p(), &bin_header);
 	ts = 0.0f;
 	last_ts = 0.0f;
 	if (session_type < 0)
@@ -103,7 +106,36 @@ int emulator_session_start()
 		return session_type;
 	}
 
-	if (session_type == EMULATOR_SESSION_HEADER_SFLP)
+	if (bin_header.nb_channels > 0 && bin_header.encoding != SESSION_BIN_ENCODING_RECORDS)
+	{
+		LOG_ERR("Only binary sessions made of records can be emulated");
+		usb_mass_storage_close_file(usb_mass_storage_get_session_file_p());
+		session_type = 0;
+		return -ENOTSUP;
+	}
+
+	if (emulated_session_start_ms > 0)
+	{
+		session_index_entry_t entry;
+		int res = usb_mass_storage_session_seek(emulated_session_name, usb_mass_storage_get_session_file_p(),
+							emulated_session_start_ms, &entry);
+		if (res < 0) {
+			LOG_WRN("Unable to seek to %u ms, emulating from the start (%i)", emulated_session_start_ms, res);
+		} else {
+			LOG_INF("Emulating from %u ms, at offset %u", entry.ts_ms, entry.offset);
+			// No wait before the first sample.
+			last_ts = (float_t)entry.ts_ms;
+		}
+	}
+
+	session_sflp = (bin_header.nb_channels == 0 && session_type >= EMULATOR_SESSION_HEADER_SFLP);
+	for (int ii = 0; ii < bin_header.nb_channels; ii++) {
+		if (bin_header.channels[ii].id == SESSION_CHANNEL_GAME_ROT_X) {
+			session_sflp = true;
+		}
+	}
+
+	if (session_sflp)
 	{
 		xiao_recording_state_t recording_state = state_machine_get_recording_state();
 		recording_state.sflp_enabled = true;
@@ -123,19 +155,32 @@ void emulator_session_stop()
 
 static void emulator_run(void *p1, void *p2, void *p3)
 {
+	session_reader_t *reader = usb_mass_storage_get_session_reader();
+	const uint8_t *record;
+	char *line;
 	int off = 0;
 
 	while(true) {
-		if (session_type > 0) {
-			off = usb_mass_storage_read_line(rd_buffer, READ_SIZE, 0, usb_mass_storage_get_session_file_p());
+		if (session_type > 0 && bin_header.nb_channels > 0) {
+			off = session_reader_record(reader, &record, bin_header.record_size);
+			if (off < 0)
+			{
+				LOG_INF("End of the emulated session (%i)", off);
+				session_type = 0;
+				state_machine_post_event(XIAO_EVENT_STOP_RECORDING);
+				continue;
+			}
+			_parse_record(record);
+		} else if (session_type > 0) {
+			off = session_reader_line(reader, &line);
 			if (off < 0)
 			{
+				LOG_INF("End of the emulated session (%i)", off);
 				session_type = 0;
 				state_machine_post_event(XIAO_EVENT_STOP_RECORDING);
 				continue;
 			}
-			rd_buffer[off] = 0;
-			_parse_line(rd_buffer, strlen(rd_buffer));
+			_parse_line(line, off);
 		} else {
 			if (session_type < 0) {
 				state_machine_post_event(XIAO_EVENT_STOP_RECORDING);
@@ -20,5 +20,6 @@ typedef struct {
 
 void emulator_init(emulator_cb_t cb);
 int emulator_set_session(char* file_path);
+void emulator_set_start_time(uint32_t start_ms);
 int emulator_session_start();
 void emulator_session_stop();
@@ -11,6 +11,7 @@
 #include <state_machine/state_machine.h>
 #include <battery/battery.h>
 #include <emulator/emulator.h>
+#include <session_encoder/session_encoder.h>
 
 #include <app_version.h>
 
@@ -18,6 +19,7 @@
 #include <app/lib/lsm6dsv16bx_fsm_config.h> // Include FSM configuration files
 #include <app/lib/xiao_smp_bluetooth.h>
 #include <app/lib/xiao_ble_shell.h>
+#include <app/lib/session_codec.h>
 
 #if defined(CONFIG_EDGE_IMPULSE)
 #include <edge-impulse/impulse.h>
@@ -91,11 +93,70 @@ static struct line l = {
 
 #define TXT_SIZE 200
 
+/* Format a session line at p: "ts,ax,ay,az,gx,gy,gz[,grotx,groty,grotz,grotw,gravx,gravy,gravz][,qvar]\n",
+ * followed by a NULL character. fields is set to the start of the line without the timestamp, as
+ * sent by the data forwarder. Returns the length of the line without the NULL character, or -E2BIG.
+ */
+static int format_line(char *p, char **fields, xiao_recording_state_t recording_state)
+{
+	char *start = p;
+	char *end = p + TXT_SIZE - 1; // Leave room for the NULL character.
+
+	p = session_csv_put_float(p, end, l.ts, 3);
+	*fields = (p != NULL) ? p + 1 : NULL;
+	p = session_csv_put_field(p, end, l.acc_x, 0);
+	p = session_csv_put_field(p, end, l.acc_y, 0);
+	p = session_csv_put_field(p, end, l.acc_z, 0);
+	p = session_csv_put_field(p, end, l.gyro_x, 0);
+	p = session_csv_put_field(p, end, l.gyro_y, 0);
+	p = session_csv_put_field(p, end, l.gyro_z, 0);
+	if (recording_state.sflp_enabled) {
+		p = session_csv_put_field(p, end, l.game_rot_x, 0);
+		p = session_csv_put_field(p, end, l.game_rot_y, 0);
+		p = session_csv_put_field(p, end, l.game_rot_z, 0);
+		p = session_csv_put_field(p, end, l.game_rot_w, 0);
+		p = session_csv_put_field(p, end, l.gravity_x, 0);
+		p = session_csv_put_field(p, end, l.gravity_y, 0);
+		p = session_csv_put_field(p, end, l.gravity_z, 0);
+	}
+	if (recording_state.qvar_enabled) {
+		p = session_csv_put_field(p, end, l.qvar, 0);
+	}
+
+	if (p == NULL || p >= end) {
+		return -E2BIG;
+	}
+	*p++ = '\n';
+	*p = 0;
+	return p - start;
+}
+
+/* Get the values of the current line, indexed by session_channel_t. */
+static void line_values(float_t *values)
+{
+	values[SESSION_CHANNEL_TS] = l.ts;
+	values[SESSION_CHANNEL_ACC_X] = l.acc_x;
+	values[SESSION_CHANNEL_ACC_Y] = l.acc_y;
+	values[SESSION_CHANNEL_ACC_Z] = l.acc_z;
+	values[SESSION_CHANNEL_GYRO_X] = l.gyro_x;
+	values[SESSION_CHANNEL_GYRO_Y] = l.gyro_y;
+	values[SESSION_CHANNEL_GYRO_Z] = l.gyro_z;
+	values[SESSION_CHANNEL_GAME_ROT_X] = l.game_rot_x;
+	values[SESSION_CHANNEL_GAME_ROT_Y] = l.game_rot_y;
+	values[SESSION_CHANNEL_GAME_ROT_Z] = l.game_rot_z;
+	values[SESSION_CHANNEL_GAME_ROT_W] = l.game_rot_w;
+	values[SESSION_CHANNEL_GRAVITY_X] = l.gravity_x;
+	values[SESSION_CHANNEL_GRAVITY_Y] = l.gravity_y;
+	values[SESSION_CHANNEL_GRAVITY_Z] = l.gravity_z;
+	values[SESSION_CHANNEL_QVAR] = l.qvar;
+}
+
 static void print_line_if_needed(){
 	char txt[TXT_SIZE];
-	char tmp_txt[TXT_SIZE];
-	char data_forwarded[TXT_SIZE];
+	char *line;
+	char *fields;
 	float_t ei_input_data[3];
+	float_t values[SESSION_CHANNEL_NB];
 
 	bool b = l.acc_updated && l.gyro_updated && l.ts_updated;
 	xiao_recording_state_t recording_state = state_machine_get_recording_state();
@@ -117,77 +178,66 @@ static void print_line_if_needed(){
 		ei_input_data[1] = l.acc_y;
 		ei_input_data[2] = l.acc_z;
 
-		int res;
-		if (!recording_state.emulation_enabled) // Only save to flash memory if emulation is not enabled.
+		bool save = !recording_state.emulation_enabled; // Only save to flash memory if emulation is not enabled.
+		// Samples read before the binary header and encoder are in place would corrupt the session.
+		save = save && state_machine_session_header_written();
+		if (save) {
+			line_values(values);
+		}
+		if (save && recording_state.bin_enabled)
 		{
-			res = snprintf(txt, TXT_SIZE, "%.3f,%.0f,%.0f,%.0f,%.0f,%.0f,%.0f", (double)l.ts, (double)l.acc_x, (double)l.acc_y, (double)l.acc_z, (double)l.gyro_x, (double)l.gyro_y, (double)l.gyro_z);
-			if (res < 0 || res >= TXT_SIZE) {
-				LOG_ERR("Encoding error happened (%i)", res);
+			int res = session_encoder_add(values);
+			if (res < 0 && res != -ENOBUFS) {
+				LOG_ERR("Unable to write to session file, ending session");
+				state_machine_post_event(XIAO_EVENT_STOP_RECORDING);
+				return;
+			}
+			if (res >= 0) {
+				usb_mass_storage_session_add_samples(1);
+				usb_mass_storage_session_summarize(values);
 			}
+			save = false; // Nothing more to save, the line is only formatted for the data forwarder.
+		}
 
-			if (recording_state.sflp_enabled) {
-				memset(tmp_txt, 0, TXT_SIZE);
-				memcpy(tmp_txt, txt, strlen(txt));
-				res = snprintf(txt, TXT_SIZE, "%s,%.0f,%.0f,%.0f,%.0f,%.0f,%.0f,%.0f", tmp_txt, (double)l.game_rot_x, (double)l.game_rot_y, (double)l.game_rot_z, (double)l.game_rot_w, (double)l.gravity_x, (double)l.gravity_y, (double)l.gravity_z);
-				if (res < 0 || res >= TXT_SIZE) {
-					LOG_ERR("Encoding error happened (%i)", res);
-				}
+		if (save || recording_state.data_forwarder_enabled)
+		{
+			if (save) {
+				usb_mass_storage_session_index((uint32_t)l.ts);
 			}
-			if (recording_state.qvar_enabled) {
-				memset(tmp_txt, 0, TXT_SIZE);
-				memcpy(tmp_txt, txt, strlen(txt));
-				res = snprintf(txt, TXT_SIZE, "%s,%.0f", tmp_txt, (double)l.qvar);
-				if (res < 0 || res >= TXT_SIZE) {
-					LOG_ERR("Encoding error happened (%i)", res);
-				}
+			// When saving, the line is formatted directly in the session write buffer.
+			line = save ? usb_mass_storage_session_reserve(TXT_SIZE) : txt;
+			bool dropped = (line == NULL);
+			if (dropped) {
+				// The storage is too slow, the line is only formatted to count the lost bytes.
+				line = txt;
 			}
-			memset(tmp_txt, 0, TXT_SIZE);
-			memcpy(tmp_txt, txt, strlen(txt));
-			res = snprintf(txt, TXT_SIZE, "%s\n", tmp_txt);
 
-			if (res < 0 || res >= TXT_SIZE) {
+			int res = format_line(line, &fields, recording_state);
+			if (res < 0) {
 				LOG_ERR("Encoding error happened (%i)", res);
-			} else {
-				res = usb_mass_storage_write_to_current_session(txt, strlen(txt));
-				if (res < 0) {
-					LOG_ERR("Unable to write to session file, ending session");
-					state_machine_post_event(XIAO_EVENT_STOP_RECORDING);
-				}
+				return;
 			}
-		}
 
-		if (recording_state.data_forwarder_enabled)
-		{
-			res = snprintf(data_forwarded, TXT_SIZE, "%.0f,%.0f,%.0f,%.0f,%.0f,%.0f", (double)l.acc_x, (double)l.acc_y, (double)l.acc_z, (double)l.gyro_x, (double)l.gyro_y, (double)l.gyro_z);
-			if (res < 0 || res >= TXT_SIZE) {
-				LOG_ERR("Encoding error happened for data forwarder (%i)", res);
-			}
-			if (recording_state.sflp_enabled)
+			// The forwarded line must be printed before the commit, which may flush the buffer.
+			if (recording_state.data_forwarder_enabled)
 			{
-				memset(tmp_txt, 0, TXT_SIZE);
-				memcpy(tmp_txt, data_forwarded, strlen(data_forwarded));
-				res = snprintf(data_forwarded, TXT_SIZE, "%s,%.0f,%.0f,%.0f,%.0f,%.0f,%.0f,%.0f", tmp_txt, (double)l.game_rot_x, (double)l.game_rot_y, (double)l.game_rot_z, (double)l.game_rot_w, (double)l.gravity_x, (double)l.gravity_y, (double)l.gravity_z);
-				if (res < 0 || res >= TXT_SIZE) {
-					LOG_ERR("Encoding error happened for data forwarder (sflp) (%i)", res);
-				}
+				printk("%s", fields);
 			}
-			if (recording_state.qvar_enabled)
+
+			if (save && dropped)
 			{
-				memset(tmp_txt, 0, TXT_SIZE);
-				memcpy(tmp_txt, data_forwarded, strlen(data_forwarded));
-				res = snprintf(data_forwarded, TXT_SIZE, "%s,%.0f", tmp_txt, (double)l.qvar);
-				if (res < 0 || res >= TXT_SIZE) {
-					LOG_ERR("Encoding error happened for data forwarder (qvar) (%i)", res);
+				usb_mass_storage_session_drop(res);
+			} else if (save)
+			{
+				res = usb_mass_storage_session_commit(res);
+				if (res < 0) {
+					LOG_ERR("Unable to write to session file, ending session");
+					state_machine_post_event(XIAO_EVENT_STOP_RECORDING);
+				} else {
+					usb_mass_storage_session_add_samples(1);
+					usb_mass_storage_session_summarize(values);
 				}
 			}
-			memset(tmp_txt, 0, TXT_SIZE);
-			memcpy(tmp_txt, data_forwarded, strlen(data_forwarded));
-			res = snprintf(data_forwarded, TXT_SIZE, "%s\n", tmp_txt);
-			if (res < 0 || res >= TXT_SIZE) {
-				LOG_ERR("Encoding error happened for data forwarder (newline) (%i)", res);
-			}
-
-			printk("%s", data_forwarded);
 		}
 
 #ifdef CONFIG_EDGE_IMPULSE
@@ -270,6 +320,22 @@ static void game_rot_received_cb(float_t x, float_t y, float_t z, float_t w)
 	print_line_if_needed();
 }
 
+static void fifo_raw_received_cb(uint8_t *word)
+{
+	if (!state_machine_session_header_written()) {
+		return;
+	}
+
+	int res = usb_mass_storage_write_to_current_session((char *)word, FIFO_WORD_SIZE);
+	if (res < 0 && res != -ENOBUFS) {
+		LOG_ERR("Unable to write to session file, ending session");
+		state_machine_post_event(XIAO_EVENT_STOP_RECORDING);
+	} else if (res == 0 && (word[0] >> 3) == LSM6DSV16BX_TIMESTAMP_TAG) {
+		// One timestamp word per sample.
+		usb_mass_storage_session_add_samples(1);
+	}
+}
+
 static void calib_res_cb(int result, float_t x, float_t y, float_t z)
 {
 	if (result)
@@ -374,6 +440,8 @@ int main(void)
 		.lsm6dsv16bx_game_rot_sample_cb = game_rot_received_cb,
 		.lsm6dsv16bx_calibration_result_cb = calib_res_cb,
 		.lsm6dsv16bx_sigmot_cb = sig_mot_cb,
+		.lsm6dsv16bx_fifo_raw_cb = fifo_raw_received_cb,
+		.lsm6dsv16bx_backpressure_cb = usb_mass_storage_session_backpressure,
 		.lsm6dsv16bx_fsm_cbs = {fsm_long_touch_cb, NULL, NULL, NULL, NULL, NULL, NULL, NULL},
 	};
 
@@ -0,0 +1,296 @@
+#include "session_encoder.h"
+#include <zephyr/logging/log.h>
+#include <usb_mass_storage/usb_mass_storage.h>
+
+LOG_MODULE_REGISTER(session_encoder, CONFIG_APP_LOG_LEVEL);
+
+#define LZ4_BENCHMARK_MAX_CHUNK_SIZE 1024
+
+static session_bin_encoding_t current_encoding;
+static uint32_t current_channels;
+static union {
+	session_delta_encoder_t delta;
+	session_column_encoder_t column;
+} block_encoder;
+// Also used by the LZ4 benchmark for its input and output.
+static uint8_t block[MAX(SESSION_ENCODER_BLOCK_SIZE, LZ4_BENCHMARK_MAX_CHUNK_SIZE + SESSION_LZ4_FRAME_MAX_SIZE(LZ4_BENCHMARK_MAX_CHUNK_SIZE))];
+static session_lz4_ctx_t bench_lz4_ctx;
+
+/* Initialize the block encoder of a delta or columnar session, with the steps of hdr. */
+static int _block_encoder_init(session_bin_encoding_t encoding, const session_bin_header_t *hdr)
+{
+	uint32_t channels = session_bin_header_channels(hdr);
+	int res;
+
+	switch (encoding) {
+	case SESSION_BIN_ENCODING_DELTA:
+		res = session_delta_encoder_init(&block_encoder.delta, channels, CONFIG_SESSION_DELTA_BLOCK_SAMPLES, block, sizeof(block));
+		return (res < 0) ? res : session_delta_encoder_set_steps(&block_encoder.delta, hdr);
+	case SESSION_BIN_ENCODING_COLUMNS:
+		res = session_column_encoder_init(&block_encoder.column, channels, CONFIG_SESSION_DELTA_BLOCK_SAMPLES, block, sizeof(block));
+		return (res < 0) ? res : session_column_encoder_set_steps(&block_encoder.column, hdr);
+	default:
+		return -ENOTSUP;
+	}
+}
+
+/* Returns 1 if the block is full. */
+static inline int _block_encode(session_bin_encoding_t encoding, const float_t *values)
+{
+	if (encoding == SESSION_BIN_ENCODING_COLUMNS) {
+		return session_column_encode(&block_encoder.column, values);
+	}
+	return session_delta_encode(&block_encoder.delta, values);
+}
+
+static inline bool _block_is_empty(session_bin_encoding_t encoding)
+{
+	if (encoding == SESSION_BIN_ENCODING_COLUMNS) {
+		return block_encoder.column.nb_samples == 0;
+	}
+	return block_encoder.delta.nb_samples == 0;
+}
+
+static inline size_t _block_finish(session_bin_encoding_t encoding)
+{
+	if (encoding == SESSION_BIN_ENCODING_COLUMNS) {
+		return session_column_block_finish(&block_encoder.column);
+	}
+	return session_delta_block_finish(&block_encoder.delta);
+}
+
+static int _write_block()
+{
+	size_t len = _block_finish(current_encoding);
+	if (len == 0) {
+		return 0;
+	}
+
+	return usb_mass_storage_write_to_current_session((char *)block, len);
+}
+
+/* Maximum error of each lossy channel, in the units of the CSV columns. */
+static const uint16_t lossy_max_errors[SESSION_CHANNEL_NB] = {
+	[SESSION_CHANNEL_ACC_X ... SESSION_CHANNEL_ACC_Z] = CONFIG_SESSION_LOSSY_ACC_MAX_ERROR,
+	[SESSION_CHANNEL_GYRO_X ... SESSION_CHANNEL_GYRO_Z] = CONFIG_SESSION_LOSSY_GYRO_MAX_ERROR,
+	[SESSION_CHANNEL_GAME_ROT_X ... SESSION_CHANNEL_GAME_ROT_W] = CONFIG_SESSION_LOSSY_GAME_ROT_MAX_ERROR,
+	[SESSION_CHANNEL_GRAVITY_X ... SESSION_CHANNEL_GRAVITY_Z] = CONFIG_SESSION_LOSSY_GRAVITY_MAX_ERROR,
+	[SESSION_CHANNEL_QVAR] = CONFIG_SESSION_LOSSY_QVAR_MAX_ERROR,
+};
+
+/* Set the quantization steps of the channels of hdr from the CONFIG_SESSION_LOSSY_*_MAX_ERROR
+ * options. The session must be delta encoded for the steps to be used.
+ */
+int session_encoder_set_lossy(session_bin_header_t *hdr)
+{
+	for (int ii = 0; ii < hdr->nb_channels; ii++) {
+		session_channel_t channel = hdr->channels[ii].id;
+		if (channel == SESSION_CHANNEL_TS) {
+			continue;
+		}
+
+		int res = session_bin_header_set_max_error(hdr, channel, lossy_max_errors[channel]);
+		if (res < 0) {
+			LOG_ERR("Failed to set the maximum error of channel %u (%i)", channel, res);
+			return res;
+		}
+	}
+	return 0;
+}
+
+/* Encode the samples of a binary session with the encoding and steps of hdr. The session header
+ * must already have been written.
+ */
+int session_encoder_start(const session_bin_header_t *hdr)
+{
+	current_channels = session_bin_header_channels(hdr);
+	current_encoding = hdr->encoding;
+
+	if (current_encoding == SESSION_BIN_ENCODING_RECORDS) {
+		return 0;
+	}
+
+	int res = _block_encoder_init(current_encoding, hdr);
+	if (res == -ENOTSUP) {
+		LOG_ERR("Unsupported session encoding %u", current_encoding);
+	}
+	return res;
+}
+
+/* Add a sample to the session, values are indexed by session_channel_t.
+ * Returns -ENOBUFS when the storage is too slow and the sample, or its whole block, was dropped.
+ */
+int session_encoder_add(const float_t *values)
+{
+	uint32_t ts_ms = (uint32_t)values[SESSION_CHANNEL_TS];
+
+	if (current_encoding != SESSION_BIN_ENCODING_RECORDS) {
+		// Only the first sample of a block can be decoded on its own.
+		if (_block_is_empty(current_encoding)) {
+			usb_mass_storage_session_index(ts_ms);
+		}
+		if (_block_encode(current_encoding, values) > 0) {
+			return _write_block();
+		}
+		return 0;
+	}
+
+	usb_mass_storage_session_index(ts_ms);
+	// Records are packed directly in the session write buffer.
+	uint8_t *record = (uint8_t *)usb_mass_storage_session_reserve(SESSION_BIN_RECORD_MAX_SIZE);
+	if (record == NULL) {
+		usb_mass_storage_session_drop(session_bin_record_size(current_channels));
+		return -ENOBUFS;
+	}
+
+	return usb_mass_storage_session_commit(session_bin_pack_record(current_channels, values, record));
+}
+
+/* Write the samples still held by the encoder, call before ending the session. */
+int session_encoder_stop()
+{
+	if (current_encoding != SESSION_BIN_ENCODING_RECORDS) {
+		return _write_block();
+	}
+	return 0;
+}
+
+/* Read the next sample of a CSV or record session. Returns the number of bytes read. */
+static int _read_sample(session_reader_t *reader, const session_bin_header_t *hdr, int nb_columns, float_t *values)
+{
+	if (hdr->nb_channels > 0) {
+		const uint8_t *record;
+		int res = session_reader_record(reader, &record, hdr->record_size);
+		if (res > 0) {
+			session_bin_unpack_record(hdr, record, values);
+		}
+		return res;
+	}
+
+	char *line;
+	int len = session_reader_line(reader, &line);
+	if (len < 0) {
+		return len;
+	}
+
+	int cnt = session_csv_parse_line(line, values);
+	if (cnt != nb_columns) {
+		LOG_ERR("Wrong number of elements! Expected %u, got %i", nb_columns, cnt);
+		return -EINVAL;
+	}
+	return len + 1;
+}
+
+/* Encode a recorded session with the given encoding, without writing it, and measure the result.
+ * When lossy is set, channels are quantized like session_encoder_set_lossy does.
+ * Must not be called during a recording.
+ */
+int session_encoder_benchmark(const char *path, session_bin_encoding_t encoding, bool lossy, session_encoder_stats_t *stats)
+{
+	session_bin_header_t hdr;
+	session_bin_header_t encoded_hdr;
+	float_t values[SESSION_CHANNEL_NB] = {0};
+	struct fs_file_t *f = usb_mass_storage_get_session_file_p();
+	uint32_t channels = 0;
+	uint32_t start;
+	int res;
+
+	if (encoding != SESSION_BIN_ENCODING_DELTA && encoding != SESSION_BIN_ENCODING_COLUMNS) {
+		return -ENOTSUP;
+	}
+
+	int nb_columns = usb_mass_storage_get_session_header(path, f, &hdr);
+	if (nb_columns < 0) {
+		return nb_columns;
+	}
+
+	if (hdr.nb_channels > 0) {
+		if (hdr.encoding != SESSION_BIN_ENCODING_RECORDS) {
+			LOG_ERR("Only CSV and record sessions can be benchmarked");
+			usb_mass_storage_close_file(f);
+			return -ENOTSUP;
+		}
+		channels = session_bin_header_channels(&hdr);
+	} else {
+		channels = (nb_columns == SESSION_FILE_NB_COLUMN_SFLP) ? SESSION_CHANNELS_SIMPLE | SESSION_CHANNELS_SFLP : SESSION_CHANNELS_SIMPLE;
+	}
+
+	memset(stats, 0, sizeof(session_encoder_stats_t));
+	res = session_bin_header_init(&encoded_hdr, channels);
+	if (res >= 0 && lossy) {
+		res = session_encoder_set_lossy(&encoded_hdr);
+	}
+	if (res >= 0) {
+		res = _block_encoder_init(encoding, &encoded_hdr);
+	}
+	if (res < 0) {
+		usb_mass_storage_close_file(f);
+		return res;
+	}
+
+	while ((res = _read_sample(usb_mass_storage_get_session_reader(), &hdr, nb_columns, values)) > 0) {
+		stats->input_size += res;
+		stats->nb_samples++;
+
+		start = k_cycle_get_32();
+		bool full = _block_encode(encoding, values) > 0;
+		size_t len = full ? _block_finish(encoding) : 0;
+		stats->cycles += k_cycle_get_32() - start;
+
+		stats->encoded_size += len;
+		stats->nb_blocks += full;
+	}
+
+	start = k_cycle_get_32();
+	size_t len = _block_finish(encoding);
+	stats->cycles += k_cycle_get_32() - start;
+	stats->encoded_size += len;
+	stats->nb_blocks += (len > 0);
+	stats->record_size = stats->nb_samples * session_bin_record_size(channels);
+
+	usb_mass_storage_close_file(f);
+	// The end of the file is reported as -ENOENT.
+	return (res == -ENOENT || res == 0) ? 0 : res;
+}
+
+/* Compress a file in chunks of chunk_size bytes (at most LZ4_BENCHMARK_MAX_CHUNK_SIZE), like the
+ * session write buffer is compressed when it is flushed, without writing the result.
+ * Must not be called during a recording.
+ */
+int session_encoder_benchmark_lz4(const char *path, size_t chunk_size, session_encoder_stats_t *stats)
+{
+	struct fs_file_t f;
+	uint8_t *chunk = block;
+	uint8_t *frame = &block[LZ4_BENCHMARK_MAX_CHUNK_SIZE];
+	int res;
+
+	if (chunk_size == 0 || chunk_size > LZ4_BENCHMARK_MAX_CHUNK_SIZE) {
+		return -EINVAL;
+	}
+
+	fs_file_t_init(&f);
+	res = fs_open(&f, path, FS_O_READ);
+	if (res != 0) {
+		LOG_ERR("Failed to open file %s (%i)", path, res);
+		return res;
+	}
+
+	memset(stats, 0, sizeof(session_encoder_stats_t));
+	while ((res = fs_read(&f, chunk, chunk_size)) > 0) {
+		stats->input_size += res;
+
+		uint32_t start = k_cycle_get_32();
+		int len = session_lz4_frame(&bench_lz4_ctx, chunk, res, frame);
+		stats->cycles += k_cycle_get_32() - start;
+
+		if (len < 0) {
+			res = len;
+			break;
+		}
+		stats->encoded_size += len;
+		stats->nb_blocks++;
+	}
+
+	fs_close(&f);
+	return (res < 0) ? res : 0;
+}
@@ -0,0 +1,22 @@
+#pragma once
+
+#include <zephyr/kernel.h>
+#include <app/lib/session_codec.h>
+
+#define SESSION_ENCODER_BLOCK_SIZE SESSION_COLUMN_BLOCK_MAX_SIZE(CONFIG_SESSION_DELTA_BLOCK_SAMPLES, SESSION_CHANNEL_NB)
+
+typedef struct {
+	uint32_t nb_samples;
+	uint32_t input_size; // Size of the session file, header excluded.
+	uint32_t record_size; // Size of the samples in the record encoding.
+	uint32_t encoded_size; // Size of the samples in the benchmarked encoding.
+	uint32_t nb_blocks;
+	uint32_t cycles; // Spent encoding the samples.
+} session_encoder_stats_t;
+
+int session_encoder_set_lossy(session_bin_header_t *hdr);
+int session_encoder_start(const session_bin_header_t *hdr);
+int session_encoder_add(const float_t *values);
+int session_encoder_stop();
+int session_encoder_benchmark(const char *path, session_bin_encoding_t encoding, bool lossy, session_encoder_stats_t *stats);
+int session_encoder_benchmark_lz4(const char *path, size_t chunk_size, session_encoder_stats_t *stats);
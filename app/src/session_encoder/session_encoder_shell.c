@@ -0,0 +1,91 @@
+#include <zephyr/kernel.h>
+#include "session_encoder.h"
+#include <zephyr/shell/shell.h>
+#include <state_machine/state_machine.h>
+
+#define BENCH_DELTA_STRING "delta"
+#define BENCH_LOSSY_STRING "lossy"
+#define BENCH_COLUMNS_STRING "columns"
+#define BENCH_LZ4_STRING "lz4"
+#define BENCH_LZ4_CHUNK_SIZE 1024 // About the size of a session write buffer flush.
+
+static int cmd_session_bench(const struct shell *sh, size_t argc, char **argv)
+{
+	session_encoder_stats_t stats;
+	session_bin_encoding_t encoding = SESSION_BIN_ENCODING_DELTA;
+	uint32_t exact_size = 0;
+	bool lossy = false;
+	bool lz4 = false;
+	int res;
+
+	if (state_machine_current_state() == RECORDING) {
+		shell_error(sh, "Cannot benchmark while recording or emulating");
+		return -EBUSY;
+	}
+
+	if (argc == 3) {
+		if (strcmp(argv[2], BENCH_LZ4_STRING) == 0) {
+			lz4 = true;
+		} else if (strcmp(argv[2], BENCH_LOSSY_STRING) == 0) {
+			lossy = true;
+		} else if (strcmp(argv[2], BENCH_COLUMNS_STRING) == 0) {
+			encoding = SESSION_BIN_ENCODING_COLUMNS;
+		} else if (strcmp(argv[2], BENCH_DELTA_STRING) != 0) {
+			shell_error(sh, "Unsupported encoding: %s", argv[2]);
+			return -EBADF;
+		}
+	}
+
+	if (lz4) {
+		shell_print(sh, "Compressing %s in chunks of %u bytes...", argv[1], BENCH_LZ4_CHUNK_SIZE);
+		res = session_encoder_benchmark_lz4(argv[1], BENCH_LZ4_CHUNK_SIZE, &stats);
+	} else {
+		shell_print(sh, "Encoding %s with %s%s blocks of %u samples...", argv[1], lossy ? "lossy " : "",
+			    (encoding == SESSION_BIN_ENCODING_COLUMNS) ? "columnar" : "delta", CONFIG_SESSION_DELTA_BLOCK_SAMPLES);
+		res = session_encoder_benchmark(argv[1], encoding, false, &stats);
+		if (res == 0 && lossy) {
+			// The exact encoding is the reference of the lossy one.
+			exact_size = stats.encoded_size;
+			res = session_encoder_benchmark(argv[1], SESSION_BIN_ENCODING_DELTA, true, &stats);
+		}
+	}
+	if (res) {
+		shell_error(sh, "Failed to benchmark session (%i)", res);
+		return res;
+	}
+	if (stats.input_size == 0 || stats.encoded_size == 0) {
+		shell_warn(sh, "Empty session");
+		return 0;
+	}
+
+	uint32_t us = MAX(k_cyc_to_us_floor32(stats.cycles), 1);
+	if (lz4) {
+		shell_print(sh, "chunks: %u, input: %u B, compressed: %u B", stats.nb_blocks, stats.input_size, stats.encoded_size);
+		shell_print(sh, "ratio: %u.%02u", stats.input_size / stats.encoded_size, (100 * stats.input_size / stats.encoded_size) % 100);
+		shell_print(sh, "compress: %u cycles/byte, %u kB/s", stats.cycles / stats.input_size,
+			    (uint32_t)((uint64_t)stats.input_size * 1000 / us));
+		return 0;
+	}
+
+	shell_print(sh, "samples: %u, blocks: %u", stats.nb_samples, stats.nb_blocks);
+	shell_print(sh, "input: %u B, records: %u B, encoded: %u B", stats.input_size, stats.record_size, stats.encoded_size);
+	shell_print(sh, "ratio vs input: %u.%02u, vs records: %u.%02u",
+		    stats.input_size / stats.encoded_size, (100 * stats.input_size / stats.encoded_size) % 100,
+		    stats.record_size / stats.encoded_size, (100 * stats.record_size / stats.encoded_size) % 100);
+	shell_print(sh, "encode: %u cycles/sample (%u us/sample)", stats.cycles / stats.nb_samples,
+		    k_cyc_to_us_floor32(stats.cycles / stats.nb_samples));
+	if (lossy) {
+		shell_print(sh, "exact: %u B, lossy saves %u%% (acc %u mg, gyro %u mdps, game rotation %u, gravity %u mg, qvar %u mV)",
+			    exact_size, exact_size > stats.encoded_size ? 100 * (exact_size - stats.encoded_size) / exact_size : 0,
+			    CONFIG_SESSION_LOSSY_ACC_MAX_ERROR, CONFIG_SESSION_LOSSY_GYRO_MAX_ERROR,
+			    CONFIG_SESSION_LOSSY_GAME_ROT_MAX_ERROR, CONFIG_SESSION_LOSSY_GRAVITY_MAX_ERROR,
+			    CONFIG_SESSION_LOSSY_QVAR_MAX_ERROR);
+	}
+	return 0;
+}
+
+SHELL_STATIC_SUBCMD_SET_CREATE(sub_session,
+	SHELL_CMD_ARG(bench, NULL, "Measure the encoding of a recorded session: bench <path> [delta|columns|lossy|lz4]. delta (default), columns and lossy need a CSV or BIN records session, lz4 compresses any file.", cmd_session_bench, 2, 1),
+	SHELL_SUBCMD_SET_END /* Array terminated. */
+);
+SHELL_CMD_REGISTER(session, &sub_session, "Session commands", NULL);
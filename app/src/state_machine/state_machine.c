@@ -1,16 +1,22 @@
 #include "state_machine.h"
 #include <zephyr/smf.h>
 #include <zephyr/logging/log.h>
+#include <stdio.h>
+
+#include <app_version.h>
 
 #include <app/lib/lsm6dsv16bx.h>
 #include <app/lib/xiao_smp_bluetooth.h>
 #include <usb_mass_storage/usb_mass_storage.h>
 #include <edge-impulse/impulse.h>
 #include <emulator/emulator.h>
+#include <session_encoder/session_encoder.h>
 #include <ui/ui.h>
 
 LOG_MODULE_REGISTER(state_machine, CONFIG_APP_LOG_LEVEL);
 
+#define CSV_FIELD_MAX_SIZE 8 // Sign, up to 6 characters and the separator.
+
 /* User defined object */
 struct s_object {
     /* This must be first */
@@ -26,7 +32,9 @@ struct s_object {
 /* Forward declaration of state table */
 static const struct smf_state xiao_states[];
 static xiao_state_t current_state;
-static xiao_recording_state_t recording_state = {.sflp_enabled = false, .data_forwarder_enabled = false, .edge_impulse_enabled = false, .qvar_enabled = false, .emulation_enabled = false,};
+static xiao_recording_state_t recording_state = {.sflp_enabled = false, .data_forwarder_enabled = false, .edge_impulse_enabled = false, .qvar_enabled = false, .emulation_enabled = false, .raw_enabled = false, .bin_enabled = false, .bin_encoding = SESSION_BIN_ENCODING_RECORDS, .compression_enabled = false, .lossy_enabled = false,};
+// Set once the session header is written: samples read from the FIFO before are dropped.
+static atomic_t session_header_written;
 
 void state_machine_timer_expired_work_handler(struct k_work *work)
 {
@@ -83,6 +91,9 @@ static void idle_entry(void *o)
     LOG_INF("Entering IDLE state.");
     current_state = IDLE;
     k_timer_start(&timer_state_machine, K_SECONDS(CONFIG_IDLE_STATE_TIMEOUT), K_NO_WAIT);
+#ifdef CONFIG_SESSION_PREERASE
+	usb_mass_storage_set_lazy_erase(true); // No session is recorded while idle.
+#endif
 	ui_set_rgb_on(  /*Red*/0,
                     /*Green*/smp_bluetooth_connected() ? 0 : UI_COLOR_MAX,
                     /*Blue*/smp_bluetooth_connected() ? UI_COLOR_MAX : 0,
@@ -108,6 +119,175 @@ static void idle_run(void *o)
 static void idle_exit(void *o)
 {
 	k_timer_stop(&timer_state_machine);
+#ifdef CONFIG_SESSION_PREERASE
+	usb_mass_storage_set_lazy_erase(false);
+#endif
+}
+
+static void _write_session_metadata()
+{
+	char meta[SESSION_META_SIZE];
+	lsm6dsv16bx_filter_t filter = lsm6dsv16bx_get_filter();
+
+	int len = snprintf(meta, SESSION_META_SIZE,
+			"raw=%u\nbin=%u\nencoding=%u\nlossy=%u\nlz4=%u\nsflp=%u\nqvar=%u\nxl_lp2=%u\nxl_hp=%u\nxl_bandwidth=%u\ngy_lp1=%u\ngy_lp1_bandwidth=%u\nsettling_mask=%u,%u,%u\n",
+			recording_state.raw_enabled, recording_state.bin_enabled, recording_state.bin_encoding, recording_state.lossy_enabled, recording_state.compression_enabled, recording_state.sflp_enabled, recording_state.qvar_enabled,
+			filter.xl_lp2_enabled, filter.xl_hp_enabled, filter.xl_bandwidth,
+			filter.gy_lp1_enabled, filter.gy_lp1_bandwidth,
+			filter.settling_mask.drdy, filter.settling_mask.irq_xl, filter.settling_mask.irq_g);
+	if (len < 0 || len >= SESSION_META_SIZE) {
+		LOG_ERR("Encoding error happened for session metadata (%i)", len);
+		return;
+	}
+
+	int res = usb_mass_storage_write_session_metadata(meta, len);
+	if (res != 0) {
+		LOG_ERR("Failed to write session metadata (%i)", res);
+	}
+}
+
+static void _write_csv_header()
+{
+	int res;
+
+	res = usb_mass_storage_write_to_current_session(SESSION_FILE_HEADER_SIMPLE, strlen(SESSION_FILE_HEADER_SIMPLE));
+	if (res != 0){
+		LOG_ERR("Failed to write session header to session file (simple)");
+	}
+	if (recording_state.sflp_enabled || recording_state.data_forwarder_enabled)
+	{
+		res = usb_mass_storage_write_to_current_session(SESSION_FILE_HEADER_SFLP, strlen(SESSION_FILE_HEADER_SFLP));
+		if (res != 0){
+			LOG_ERR("Failed to write session header to session file (SFLP)");
+		}
+	}
+	if (recording_state.qvar_enabled || recording_state.data_forwarder_enabled)
+	{
+		res = usb_mass_storage_write_to_current_session(SESSION_FILE_HEADER_QVAR, strlen(SESSION_FILE_HEADER_QVAR));
+		if (res != 0){
+			LOG_ERR("Failed to write session header to session file (QVar)");
+		}
+	}
+	res = usb_mass_storage_write_to_current_session(SESSION_FILE_HEADER_NEWLINE, strlen(SESSION_FILE_HEADER_NEWLINE));
+	if (res != 0){
+		LOG_ERR("Failed to write session header to session file (Newline)");
+	}
+}
+
+static void _write_raw_header()
+{
+	lsm6dsv16bx_raw_header_t header;
+
+	int res = lsm6dsv16bx_get_raw_header(&header);
+	if (res != 0) {
+		LOG_ERR("Failed to get raw capture header (%i)", res);
+		return;
+	}
+
+	header.flags = 0;
+	if (recording_state.sflp_enabled) {
+		header.flags |= SESSION_RAW_FLAG_SFLP | SESSION_RAW_FLAG_SFLP_HEADER;
+	}
+	if (recording_state.qvar_enabled) {
+		header.flags |= SESSION_RAW_FLAG_QVAR | SESSION_RAW_FLAG_QVAR_HEADER;
+	}
+
+	res = usb_mass_storage_write_to_current_session((char *)&header, sizeof(header));
+	if (res != 0) {
+		LOG_ERR("Failed to write raw capture header to session file (%i)", res);
+	}
+}
+
+static void _write_bin_header()
+{
+	session_bin_header_t header;
+
+	int res = session_bin_header_init(&header, state_machine_get_session_channels());
+	if (res < 0) {
+		LOG_ERR("Failed to initialize binary session header (%i)", res);
+		return;
+	}
+	header.encoding = recording_state.bin_encoding;
+	if (recording_state.lossy_enabled) {
+		res = session_encoder_set_lossy(&header);
+		if (res < 0) {
+			LOG_ERR("Failed to set lossy channels, recording exact values (%i)", res);
+			session_bin_header_init(&header, state_machine_get_session_channels());
+			header.encoding = recording_state.bin_encoding;
+		}
+	}
+
+	lsm6dsv16bx_odr_t odr = lsm6dsv16bx_get_odr();
+	lsm6dsv16bx_scale_t scale = lsm6dsv16bx_get_scale();
+	lsm6dsv16bx_filter_t filter = lsm6dsv16bx_get_filter();
+
+	header.fw_version = APPVERSION;
+	strncpy(header.fw_version_str, APP_VERSION_STRING, SESSION_BIN_FW_VERSION_SIZE);
+	header.odr_xl_hz = odr.xl_hz;
+	header.odr_gy_hz = odr.gy_hz;
+	header.odr_sflp_hz = odr.sflp_hz;
+	header.xl_scale = scale.xl_scale;
+	header.gy_scale = scale.gy_scale;
+	float x, y, z;
+	lsm6dsv16bx_get_gbias(&x, &y, &z);
+	header.gbias_mdps[0] = x;
+	header.gbias_mdps[1] = y;
+	header.gbias_mdps[2] = z;
+	header.xl_lp2_enabled = filter.xl_lp2_enabled;
+	header.xl_hp_enabled = filter.xl_hp_enabled;
+	header.xl_bandwidth = filter.xl_bandwidth;
+	header.gy_lp1_enabled = filter.gy_lp1_enabled;
+	header.gy_lp1_bandwidth = filter.gy_lp1_bandwidth;
+	header.settling_mask = filter.settling_mask.drdy;
+
+	res = usb_mass_storage_write_to_current_session((char *)&header, header.header_size);
+	if (res != 0) {
+		LOG_ERR("Failed to write binary header to session file (%i)", res);
+	}
+
+	res = session_encoder_start(&header);
+	if (res != 0) {
+		LOG_ERR("Failed to start session encoder (%i)", res);
+	}
+}
+
+/* Summarize and preview the channels of the session, counting the samples within 1% of the full
+ * scale of the accelerometer and of the gyroscope as clipped.
+ */
+static void _start_session_summary()
+{
+	lsm6dsv16bx_scale_t scale = lsm6dsv16bx_get_scale();
+	float_t xl_limit = 0.99f * scale.xl_conversion_function(INT16_MAX);
+	float_t gy_limit = 0.99f * scale.gy_conversion_function(INT16_MAX);
+
+	usb_mass_storage_session_summary_start(state_machine_get_session_channels());
+	usb_mass_storage_session_preview_start(state_machine_get_session_channels());
+	for (session_channel_t ch = SESSION_CHANNEL_ACC_X; ch <= SESSION_CHANNEL_ACC_Z; ch++) {
+		usb_mass_storage_session_summary_set_clip(ch, xl_limit);
+	}
+	for (session_channel_t ch = SESSION_CHANNEL_GYRO_X; ch <= SESSION_CHANNEL_GYRO_Z; ch++) {
+		usb_mass_storage_session_summary_set_clip(ch, gy_limit);
+	}
+}
+
+/* Upper estimate of the data rate of the session in bytes per second, to preallocate its file. */
+static uint32_t _session_data_rate()
+{
+	uint32_t channels = state_machine_get_session_channels();
+	// Rates set by lsm6dsv16bx_start_acquisition: 120 Hz with SFLP, 240 Hz otherwise.
+	uint32_t hz = recording_state.sflp_enabled ? 120 : 240;
+	size_t sample_size;
+
+	if (recording_state.raw_enabled) {
+		// Accelerometer, gyroscope and timestamp words, and the SFLP and QVar ones.
+		sample_size = FIFO_WORD_SIZE * (3 + (recording_state.sflp_enabled ? 2 : 0) + (recording_state.qvar_enabled ? 1 : 0));
+	} else if (recording_state.bin_enabled) {
+		// Delta encoded and columnar blocks are smaller than records, except for noise.
+		sample_size = session_bin_record_size(channels);
+	} else {
+		sample_size = __builtin_popcount(channels) * CSV_FIELD_MAX_SIZE;
+	}
+	return hz * sample_size;
 }
 
 /* State RECORDING */
@@ -125,35 +305,40 @@ static void recording_entry(void *o)
 			return;
 		}
 	} else {
-		res = usb_mass_storage_create_session();
+		session_format_t format = SESSION_FORMAT_CSV;
+		if (recording_state.raw_enabled) {
+			format = SESSION_FORMAT_RAW;
+		} else if (recording_state.bin_enabled) {
+			format = SESSION_FORMAT_BIN;
+		}
+
+		atomic_clear(&session_header_written);
+		res = usb_mass_storage_create_session(format, recording_state.compression_enabled, _session_data_rate());
 		if (res < 0) {
 			LOG_ERR("Unable to create session (%i)", res);
 		}
+		if (res >= 0 && !recording_state.raw_enabled) {
+			_start_session_summary();
+		}
 
-        res = usb_mass_storage_write_to_current_session(SESSION_FILE_HEADER_SIMPLE, strlen(SESSION_FILE_HEADER_SIMPLE));
-        if (res != 0){
-            LOG_ERR("Failed to write session header to session file (simple)");
-        }
-		if (recording_state.sflp_enabled || recording_state.data_forwarder_enabled)
+		_write_session_metadata();
+
+		if (recording_state.raw_enabled)
 		{
-			res = usb_mass_storage_write_to_current_session(SESSION_FILE_HEADER_SFLP, strlen(SESSION_FILE_HEADER_SFLP));
-			if (res != 0){
-				LOG_ERR("Failed to write session header to session file (SFLP)");
-			}
-		}
-        if (recording_state.qvar_enabled || recording_state.data_forwarder_enabled)
+			lsm6dsv16bx_start_acquisition(false, recording_state.sflp_enabled, recording_state.qvar_enabled, true);
+			_write_raw_header();
+		} else if (recording_state.bin_enabled)
 		{
-			res = usb_mass_storage_write_to_current_session(SESSION_FILE_HEADER_QVAR, strlen(SESSION_FILE_HEADER_QVAR));
-			if (res != 0){
-				LOG_ERR("Failed to write session header to session file (QVar)");
-			}
+			// The header holds the rates set when starting the acquisition.
+			lsm6dsv16bx_start_acquisition(false, recording_state.sflp_enabled, recording_state.qvar_enabled, false);
+			_write_bin_header();
+		} else {
+			_write_csv_header();
+			lsm6dsv16bx_start_acquisition(false, recording_state.sflp_enabled, recording_state.qvar_enabled, false);
 		}
-        res = usb_mass_storage_write_to_current_session(SESSION_FILE_HEADER_NEWLINE, strlen(SESSION_FILE_HEADER_NEWLINE));
-        if (res != 0){
-            LOG_ERR("Failed to write session header to session file (Newline)");
-        }
-
-	    lsm6dsv16bx_start_acquisition(false, recording_state.sflp_enabled, recording_state.qvar_enabled);
+		// The FIFO is read by the system workqueue, which preempts this thread as soon as the
+		// acquisition starts, but the header must come first in the session.
+		atomic_set(&session_header_written, 1);
 	}
 
 #ifdef CONFIG_EDGE_IMPULSE
@@ -193,6 +378,12 @@ static void recording_exit(void *o)
 		emulator_session_stop();
 	} else {
 		lsm6dsv16bx_reset();
+		if (recording_state.bin_enabled) {
+			int res = session_encoder_stop();
+			if (res) {
+				LOG_ERR("Unable to write the last samples of the session (%i)", res);
+			}
+		}
 		int res = usb_mass_storage_end_current_session();
 		if (res) {
 			LOG_ERR("Unable to end session (%i)", res);
@@ -253,11 +444,30 @@ int state_machine_set_recording_state(xiao_recording_state_t state)
 	return 0;
 }
 
+bool state_machine_session_header_written()
+{
+	return atomic_get(&session_header_written) != 0;
+}
+
 xiao_recording_state_t state_machine_get_recording_state()
 {
 	return recording_state;
 }
 
+/* Channels recorded in a binary session with the current recording state. */
+uint32_t state_machine_get_session_channels()
+{
+	uint32_t channels = SESSION_CHANNELS_SIMPLE;
+
+	if (recording_state.sflp_enabled) {
+		channels |= SESSION_CHANNELS_SFLP;
+	}
+	if (recording_state.qvar_enabled) {
+		channels |= SESSION_CHANNELS_QVAR;
+	}
+	return channels;
+}
+
 /* Initialize the state machine */
 int state_machine_init(xiao_state_t starting_state)
 {
@@ -1,6 +1,7 @@
 #pragma once
 #include <zephyr/kernel.h>
 #include <zephyr/sys/util_macro.h>
+#include <app/lib/session_codec.h>
 
 /* List of events */
 typedef enum {
@@ -17,6 +18,19 @@ typedef enum {
 #define EDGE_IMPULSE_STRING "edge_impulse"
 #define QVAR_STRING "qvar"
 #define EMULATION_STRING "emulation"
+#define RAW_STRING "raw"
+#define BIN_STRING "bin"
+#define DELTA_STRING "delta"
+#define COLUMNS_STRING "columns"
+#define LOSSY_STRING "lossy"
+#define LZ4_STRING "lz4"
+
+#define FILTER_XL_LP2_STRING "xl_lp2"
+#define FILTER_XL_HP_STRING "xl_hp"
+#define FILTER_GY_LP1_STRING "gy_lp1"
+#define FILTER_SETTLING_STRING "settling"
+#define FILTER_ON_STRING "on"
+#define FILTER_OFF_STRING "off"
 
 typedef struct
 {
@@ -25,6 +39,11 @@ typedef struct
 	bool edge_impulse_enabled;
 	bool qvar_enabled;
 	bool emulation_enabled;
+	bool raw_enabled;
+	bool bin_enabled;
+	session_bin_encoding_t bin_encoding;
+	bool compression_enabled;
+	bool lossy_enabled;
 } xiao_recording_state_t;
 
 /* List of states */
@@ -42,3 +61,5 @@ int state_machine_post_event(xiao_event_t event);
 xiao_state_t state_machine_current_state(void);
 int state_machine_set_recording_state(xiao_recording_state_t state);
 xiao_recording_state_t state_machine_get_recording_state();
+bool state_machine_session_header_written();
+uint32_t state_machine_get_session_channels();
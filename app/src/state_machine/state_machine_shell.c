@@ -2,6 +2,8 @@
 #include "state_machine.h"
 #include <zephyr/shell/shell.h>
 #include <emulator/emulator.h>
+#include <app/lib/lsm6dsv16bx.h>
+#include <stdlib.h>
 
 static void _if_off_then_wake_up(const struct shell *sh)
 {
@@ -25,7 +27,7 @@ static int cmd_recording_start(const struct shell *sh, size_t argc, char **argv)
 
 	_if_off_then_wake_up(sh);
 
-	xiao_recording_state_t wanted_state = {.sflp_enabled = false, .data_forwarder_enabled = false, .edge_impulse_enabled = false, .qvar_enabled = false, .emulation_enabled = false,};
+	xiao_recording_state_t wanted_state = {.sflp_enabled = false, .data_forwarder_enabled = false, .edge_impulse_enabled = false, .qvar_enabled = false, .emulation_enabled = false, .raw_enabled = false, .bin_enabled = false, .bin_encoding = SESSION_BIN_ENCODING_RECORDS, .compression_enabled = false, .lossy_enabled = false,};
 	for (int ii = 1; ii < argc; ii++)
 	{
 		if (strcmp(argv[ii], SFLP_STRING) == 0)
@@ -52,11 +54,54 @@ static int cmd_recording_start(const struct shell *sh, size_t argc, char **argv)
 		{
 			shell_print(sh, "Emulation enabled");
 			wanted_state.emulation_enabled = true;
+		} else if (strcmp(argv[ii], RAW_STRING) == 0)
+		{
+			shell_print(sh, "Raw FIFO capture enabled");
+			wanted_state.raw_enabled = true;
+		} else if (strcmp(argv[ii], BIN_STRING) == 0)
+		{
+			shell_print(sh, "Binary session format enabled");
+			wanted_state.bin_enabled = true;
+		} else if (strcmp(argv[ii], DELTA_STRING) == 0)
+		{
+			shell_print(sh, "Binary session format with delta encoding enabled");
+			wanted_state.bin_enabled = true;
+			wanted_state.bin_encoding = SESSION_BIN_ENCODING_DELTA;
+		} else if (strcmp(argv[ii], COLUMNS_STRING) == 0)
+		{
+			shell_print(sh, "Binary session format with columnar encoding enabled");
+			wanted_state.bin_enabled = true;
+			wanted_state.bin_encoding = SESSION_BIN_ENCODING_COLUMNS;
+		} else if (strcmp(argv[ii], LOSSY_STRING) == 0)
+		{
+			shell_print(sh, "Binary session format with lossy encoding enabled");
+			wanted_state.bin_enabled = true;
+			wanted_state.lossy_enabled = true;
+		} else if (strcmp(argv[ii], LZ4_STRING) == 0)
+		{
+			shell_print(sh, "Session compression enabled");
+			wanted_state.compression_enabled = true;
 		} else {
 			shell_error(sh, "Unsupported option: %s", argv[ii]);
 			return -EBADF;
 		}
 	}
+
+	if (wanted_state.raw_enabled && (wanted_state.data_forwarder_enabled || wanted_state.edge_impulse_enabled || wanted_state.emulation_enabled))
+	{
+		shell_error(sh, "Raw FIFO capture does not decode data, it cannot be used with data_forwarder, edge_impulse or emulation");
+		return -EINVAL;
+	}
+	if (wanted_state.raw_enabled && wanted_state.bin_enabled)
+	{
+		shell_error(sh, "Only one session format can be selected: raw, bin, delta, columns or lossy");
+		return -EINVAL;
+	}
+	if (wanted_state.lossy_enabled && wanted_state.bin_encoding == SESSION_BIN_ENCODING_RECORDS)
+	{
+		// Records are never quantized, lossy sessions are delta encoded unless columns is selected.
+		wanted_state.bin_encoding = SESSION_BIN_ENCODING_DELTA;
+	}
 	state_machine_set_recording_state(wanted_state);
 
 	state_machine_post_event(XIAO_EVENT_START_RECORDING);
@@ -74,9 +119,82 @@ static int cmd_recording_stop(const struct shell *sh, size_t argc, char **argv)
 	return 0;
 }
 
+/* Parse a filter bandwidth (0-7) or "off". Returns the bandwidth, or -1 if the filter is disabled. */
+static int _parse_filter_bandwidth(const struct shell *sh, char *arg)
+{
+	if (strcmp(arg, FILTER_OFF_STRING) == 0)
+	{
+		return -1;
+	}
+
+	char *end;
+	long bw = strtol(arg, &end, 10);
+	if (*end != 0 || bw < 0 || bw > 7)
+	{
+		shell_error(sh, "Bandwidth must be between 0 and 7, or %s: %s", FILTER_OFF_STRING, arg);
+		return -EINVAL;
+	}
+	return bw;
+}
+
+static int cmd_recording_filter(const struct shell *sh, size_t argc, char **argv)
+{
+	lsm6dsv16bx_filter_t filter = lsm6dsv16bx_get_filter();
+
+	if (argc == 3)
+	{
+		if (strcmp(argv[1], FILTER_SETTLING_STRING) == 0)
+		{
+			bool enable = (strcmp(argv[2], FILTER_ON_STRING) == 0);
+			if (!enable && strcmp(argv[2], FILTER_OFF_STRING) != 0)
+			{
+				shell_error(sh, "Settling must be %s or %s: %s", FILTER_ON_STRING, FILTER_OFF_STRING, argv[2]);
+				return -EINVAL;
+			}
+			filter.settling_mask.drdy = enable;
+			filter.settling_mask.irq_xl = enable;
+			filter.settling_mask.irq_g = enable;
+		} else {
+			int bw = _parse_filter_bandwidth(sh, argv[2]);
+			if (bw < -1)
+			{
+				return bw;
+			}
+
+			if (strcmp(argv[1], FILTER_XL_LP2_STRING) == 0)
+			{
+				filter.xl_lp2_enabled = (bw >= 0);
+				filter.xl_bandwidth = (bw >= 0) ? bw : filter.xl_bandwidth;
+			} else if (strcmp(argv[1], FILTER_XL_HP_STRING) == 0)
+			{
+				filter.xl_hp_enabled = (bw >= 0);
+				filter.xl_bandwidth = (bw >= 0) ? bw : filter.xl_bandwidth;
+			} else if (strcmp(argv[1], FILTER_GY_LP1_STRING) == 0)
+			{
+				filter.gy_lp1_enabled = (bw >= 0);
+				filter.gy_lp1_bandwidth = (bw >= 0) ? bw : filter.gy_lp1_bandwidth;
+			} else {
+				shell_error(sh, "Unsupported filter: %s", argv[1]);
+				return -EBADF;
+			}
+		}
+		lsm6dsv16bx_set_filter(filter);
+	} else if (argc != 1)
+	{
+		shell_error(sh, "Usage: recording filter [<xl_lp2|xl_hp|gy_lp1> <0-7|off>] [settling <on|off>]");
+		return -EINVAL;
+	}
+
+	shell_print(sh, "xl_lp2: %s, xl_hp: %s, xl bandwidth: %u", filter.xl_lp2_enabled ? "on" : "off", filter.xl_hp_enabled ? "on" : "off", filter.xl_bandwidth);
+	shell_print(sh, "gy_lp1: %s, gy_lp1 bandwidth: %u", filter.gy_lp1_enabled ? "on" : "off", filter.gy_lp1_bandwidth);
+	shell_print(sh, "settling mask: %s", filter.settling_mask.drdy ? FILTER_ON_STRING : FILTER_OFF_STRING);
+	return 0;
+}
+
 SHELL_STATIC_SUBCMD_SET_CREATE(sub_recording,
-	SHELL_CMD(start, NULL, "Start recording. Use sflp, data_forwarder, edge_impulse and/or gbias to enable corresponding options", cmd_recording_start),
+	SHELL_CMD(start, NULL, "Start recording. Use sflp, data_forwarder, edge_impulse, qvar and/or raw, bin, delta or columns, and lossy and lz4 to enable corresponding options", cmd_recording_start),
 	SHELL_CMD(stop, NULL, "Stop recording.", cmd_recording_stop),
+	SHELL_CMD_ARG(filter, NULL, "Show or set the on-sensor filters applied to the next recording: xl_lp2, xl_hp or gy_lp1 with a bandwidth (0-7) or off, settling on or off.", cmd_recording_filter, 1, 2),
 	SHELL_SUBCMD_SET_END /* Array terminated. */
 );
 SHELL_CMD_REGISTER(recording, &sub_recording, "Recording commands", NULL);
@@ -112,9 +230,6 @@ SHELL_CMD_REGISTER(cal, &sub_calibrating, "Calibrating commands", NULL);
 
 static int cmd_emulating_start(const struct shell *sh, size_t argc, char **argv)
 {
-	ARG_UNUSED(argc);
-	ARG_UNUSED(argv);
-
 	_if_off_then_wake_up(sh);
 
 	int res = emulator_set_session(argv[1]);
@@ -122,6 +237,7 @@ static int cmd_emulating_start(const struct shell *sh, size_t argc, char **argv)
 		shell_error(sh, "%s", "Cannot set Emulator session");
 		return res;
 	}
+	emulator_set_start_time((argc > 2) ? strtoul(argv[2], NULL, 10) : 0);
 
 	char *cmd[2] = {"start", "emulation"};
 	cmd_recording_start(sh, 2, cmd);
@@ -139,7 +255,8 @@ static int cmd_emulating_stop(const struct shell *sh, size_t argc, char **argv)
 }
 
 SHELL_STATIC_SUBCMD_SET_CREATE(sub_emulating,
-	SHELL_CMD_ARG(start, NULL, "Start emulating. Specify the full path of the emulated file as argument", cmd_emulating_start, 2, 0),
+	SHELL_CMD_ARG(start, NULL, "Start emulating. Specify the full path of the emulated file as argument, "
+		      "and optionally the time to start at in ms", cmd_emulating_start, 2, 1),
 	SHELL_CMD(stop, NULL, "Stop emulating.", cmd_emulating_stop),
 	SHELL_SUBCMD_SET_END /* Array terminated. */
 );
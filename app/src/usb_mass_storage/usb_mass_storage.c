@@ -10,6 +10,17 @@
 #include <errno.h>
 #include <stdlib.h>
 #include <app/lib/fit_sdk.h>
+#include <app/lib/session_ring.h>
+#include <app/lib/session_log.h>
+#include <zephyr/sys/byteorder.h>
+#include <zephyr/sys/crc.h>
+#include <zephyr/storage/disk_access.h>
+#include <zephyr/pm/device_runtime.h>
+#include <app/lib/session_meta_cache.h>
+#ifdef CONFIG_MCUMGR_GRP_FS_FILE_ACCESS_HOOK
+#include <zephyr/mgmt/mcumgr/mgmt/callbacks.h>
+#include <zephyr/mgmt/mcumgr/grp/fs_mgmt/fs_mgmt_callbacks.h>
+#endif
 
 LOG_MODULE_REGISTER(mass_storage, CONFIG_APP_LOG_LEVEL);
 
@@ -23,15 +34,51 @@ fit_sdk_file_mgmt_t file_mgmt = {
 };
 
 static struct fs_mount_t fs_mnt;
+static FATFS fat_fs;
+static const struct flash_area *data_fa;
+static bool usb_connected = false;
 static struct fs_file_t current_session_file;
 static char current_session_path[MAX_PATH];
+static char current_session_dir[MAX_PATH];
 static struct fs_file_t calibration_file;
 static int current_session_nb = 0;
 
 static char session_wr_buffer[SESSION_WR_BUFFER_SIZE];
 static size_t session_wr_buffer_len = 0;
+static bool session_compressed = false;
+static session_format_t session_format = SESSION_FORMAT_CSV;
+static bool session_preallocated = false;
+static session_lz4_ctx_t session_lz4_ctx;
+// Compressed frames have any size, they are gathered here to be written in whole chunks too.
+static uint8_t session_out[CONFIG_SESSION_WRITER_CHUNK_SIZE + SESSION_LZ4_FRAME_MAX_SIZE(CONFIG_SESSION_WRITER_CHUNK_SIZE)];
+static size_t session_out_len;
+// Bytes added to the session, before compression: the offset of the next sample in the file.
+static uint32_t session_data_len;
+// Sessions are read back in large blocks, by the emulator and the benchmarks.
+static uint8_t session_read_buffer[SESSION_READER_BUFFER_SIZE] __aligned(4);
+static session_reader_t session_reader;
+
+// Flushed session data waits in the ring until the writer thread writes it to the file.
+static uint8_t session_ring_buf[CONFIG_SESSION_WRITER_RING_SIZE];
+static session_ring_t session_ring;
+static session_writer_stats_t writer_stats;
+static atomic_t writer_error;
+static atomic_t writer_flush;
+static uint32_t session_start_ms;
+
+BUILD_ASSERT(IS_POWER_OF_TWO(CONFIG_SESSION_WRITER_RING_SIZE), "The session ring size must be a power of two");
+BUILD_ASSERT(IS_POWER_OF_TWO(CONFIG_SESSION_WRITER_CHUNK_SIZE), "The session chunk size must be a power of two");
+BUILD_ASSERT(CONFIG_SESSION_WRITER_RING_SIZE >= 2 * CONFIG_SESSION_WRITER_CHUNK_SIZE,
+	     "The session ring must hold a chunk being written and the next one");
+#ifdef CONFIG_SESSION_BURST_WRITE
+BUILD_ASSERT(CONFIG_SESSION_BURST_SIZE >= CONFIG_SESSION_WRITER_CHUNK_SIZE &&
+		     CONFIG_SESSION_BURST_SIZE <= CONFIG_SESSION_WRITER_RING_SIZE / 2,
+	     "A burst must hold a chunk, and leave half of the session ring to the producer");
+#endif
 
 K_SEM_DEFINE(write_sem, 1, 1);
+K_SEM_DEFINE(writer_sem, 0, 1);
+K_SEM_DEFINE(writer_drained_sem, 0, 1);
 
 struct fs_file_t* usb_mass_storage_get_session_file_p()
 {
@@ -43,6 +90,374 @@ struct fs_file_t* usb_mass_storage_get_calibration_file_p()
 	return &calibration_file;
 }
 
+/* The file system and USB use the disk DATA_DISK_NAME, which puts the metadata cache in front of
+ * the data partition. Both access it from their own threads.
+ */
+K_MUTEX_DEFINE(data_disk_lock);
+
+/* The data disk reads and programs the partition itself rather than through the flash disk
+ * DATA_FLASH_DISK_NAME, whose block cache would keep copies of the blocks the session extents and
+ * the eraser access directly: the flash disk is only used for its geometry. A write erases and
+ * programs each erase block it covers, the sectors it does not cover being read back first.
+ * Call with data_disk_lock.
+ */
+static uint8_t flash_block_buf[DATA_PARTITION_ERASE_BLOCK_SIZE] __aligned(4);
+
+static int _flash_disk_read(void *ctx, uint8_t *buf, uint32_t sector, uint32_t count)
+{
+	return flash_area_read(data_fa, (off_t)sector * DATA_PARTITION_SECTOR_SIZE, buf,
+			       count * DATA_PARTITION_SECTOR_SIZE);
+}
+
+static int _flash_disk_write(void *ctx, const uint8_t *buf, uint32_t sector, uint32_t count)
+{
+	while (count > 0) {
+		off_t offset = (off_t)sector * DATA_PARTITION_SECTOR_SIZE;
+		off_t block = ROUND_DOWN(offset, DATA_PARTITION_ERASE_BLOCK_SIZE);
+		size_t first = offset - block;
+		size_t len = MIN(count * DATA_PARTITION_SECTOR_SIZE, DATA_PARTITION_ERASE_BLOCK_SIZE - first);
+		const uint8_t *data = buf;
+		int res;
+
+		if (len < DATA_PARTITION_ERASE_BLOCK_SIZE) {
+			res = flash_area_read(data_fa, block, flash_block_buf, DATA_PARTITION_ERASE_BLOCK_SIZE);
+			if (res != 0) {
+				return res;
+			}
+			memcpy(&flash_block_buf[first], buf, len);
+			data = flash_block_buf;
+		}
+		res = flash_area_erase(data_fa, block, DATA_PARTITION_ERASE_BLOCK_SIZE);
+		if (res == 0) {
+			res = flash_area_write(data_fa, block, data, DATA_PARTITION_ERASE_BLOCK_SIZE);
+		}
+		if (res != 0) {
+			return res;
+		}
+
+		buf += len;
+		sector += len / DATA_PARTITION_SECTOR_SIZE;
+		count -= len / DATA_PARTITION_SECTOR_SIZE;
+	}
+	return 0;
+}
+
+#ifdef CONFIG_STORAGE_META_CACHE
+/* The FAT and directory sectors stay in the cache until their line is evicted, the session ends,
+ * or CONFIG_STORAGE_META_CACHE_FLUSH_MS after they were first written. Outside sessions, they are
+ * also written back when the file system syncs. File data is written through.
+ */
+static session_meta_cache_t meta_cache;
+static bool meta_cache_recording; // Protected by data_disk_lock.
+static session_meta_cache_entry_t meta_cache_entries[CONFIG_STORAGE_META_CACHE_LINES];
+static uint8_t meta_cache_buf[CONFIG_STORAGE_META_CACHE_LINES * DATA_PARTITION_ERASE_BLOCK_SIZE] __aligned(4);
+
+static void meta_cache_flush_work_handler(struct k_work *work);
+K_WORK_DELAYABLE_DEFINE(meta_cache_flush_work, meta_cache_flush_work_handler);
+
+/* Write the metadata cached so far to the flash. */
+static int meta_cache_flush()
+{
+	k_mutex_lock(&data_disk_lock, K_FOREVER);
+	int res = session_meta_cache_flush(&meta_cache);
+	k_mutex_unlock(&data_disk_lock);
+	if (res < 0) {
+		LOG_ERR("Failed to write the file system metadata (%i)", res);
+	}
+	return res;
+}
+
+static void meta_cache_flush_work_handler(struct k_work *work)
+{
+	meta_cache_flush();
+}
+
+/* A file system sync makes the metadata durable, unless a session is recorded. */
+static void meta_cache_sync()
+{
+	k_mutex_lock(&data_disk_lock, K_FOREVER);
+	bool recording = meta_cache_recording;
+	k_mutex_unlock(&data_disk_lock);
+	if (!recording) {
+		meta_cache_flush();
+	}
+}
+
+static void meta_cache_set_recording(bool recording)
+{
+	k_mutex_lock(&data_disk_lock, K_FOREVER);
+	meta_cache_recording = recording;
+	k_mutex_unlock(&data_disk_lock);
+}
+
+/* Drop the cached sectors of len bytes at offset in the data partition, written to the flash
+ * without the disk.
+ */
+static void meta_cache_invalidate(off_t offset, size_t len)
+{
+	k_mutex_lock(&data_disk_lock, K_FOREVER);
+	session_meta_cache_invalidate(&meta_cache, offset / DATA_PARTITION_SECTOR_SIZE,
+				      DIV_ROUND_UP(len, DATA_PARTITION_SECTOR_SIZE));
+	k_mutex_unlock(&data_disk_lock);
+}
+
+void usb_mass_storage_get_meta_cache_stats(session_meta_cache_stats_t *stats)
+{
+	k_mutex_lock(&data_disk_lock, K_FOREVER);
+	memcpy(stats, &meta_cache.stats, sizeof(session_meta_cache_stats_t));
+	k_mutex_unlock(&data_disk_lock);
+}
+#else
+static int meta_cache_flush()
+{
+	return 0;
+}
+
+static void meta_cache_sync()
+{
+}
+
+static void meta_cache_set_recording(bool recording)
+{
+}
+
+void usb_mass_storage_get_meta_cache_stats(session_meta_cache_stats_t *stats)
+{
+	memset(stats, 0, sizeof(session_meta_cache_stats_t));
+}
+#endif
+
+static storage_read_stats_t read_stats;
+#ifdef CONFIG_SESSION_PREERASE
+static int64_t data_disk_write_time; // Uptime of the last write, protected by data_disk_lock.
+#endif
+
+// Called with data_disk_lock held.
+static int _data_disk_read(uint8_t *buf, uint32_t sector, uint32_t count)
+{
+#ifdef CONFIG_STORAGE_META_CACHE
+	return session_meta_cache_read(&meta_cache, buf, sector, count);
+#else
+	return _flash_disk_read(NULL, buf, sector, count);
+#endif
+}
+
+#ifdef CONFIG_STORAGE_READ_AHEAD
+/* USB mass storage reads the disk a few sectors at a time. Once the host has read
+ * CONFIG_STORAGE_READ_AHEAD_TRIGGER bytes in sequence, like when it copies a session, the next
+ * CONFIG_STORAGE_READ_AHEAD_SIZE bytes are read at once into a dedicated buffer, which serves the
+ * following reads. Writes drop the sectors they overlap. The buffer is only used while USB is
+ * connected and no session is recorded.
+ */
+#define READ_AHEAD_SECTORS (CONFIG_STORAGE_READ_AHEAD_SIZE / DATA_PARTITION_SECTOR_SIZE)
+#define READ_AHEAD_TRIGGER_SECTORS (CONFIG_STORAGE_READ_AHEAD_TRIGGER / DATA_PARTITION_SECTOR_SIZE)
+#define READ_AHEAD_ALIGN_SECTORS (DATA_PARTITION_ERASE_BLOCK_SIZE / DATA_PARTITION_SECTOR_SIZE)
+
+BUILD_ASSERT(CONFIG_STORAGE_READ_AHEAD_SIZE % DATA_PARTITION_ERASE_BLOCK_SIZE == 0,
+	     "The read-ahead buffer must hold whole erase blocks");
+
+static uint8_t read_ahead_buf[CONFIG_STORAGE_READ_AHEAD_SIZE] __aligned(4);
+static uint32_t read_ahead_start;  // First sector in the buffer.
+static uint32_t read_ahead_count;  // Sectors in the buffer, 0 when it is empty.
+static uint32_t read_ahead_next;   // Sector following the last read.
+static uint32_t read_ahead_streak; // Sectors read in sequence up to read_ahead_next.
+static bool read_ahead_usb;
+static bool read_ahead_recording;
+
+static void _read_ahead_invalidate(uint32_t sector, uint32_t count)
+{
+	if (sector < read_ahead_start + read_ahead_count && sector + count > read_ahead_start) {
+		read_ahead_count = 0;
+	}
+}
+
+/* Serve a read from the buffer, filling it first if the read is part of a long enough sequence.
+ * Called with data_disk_lock held. Returns 0, -ENOENT if the read must go to the disk, or a read
+ * error.
+ */
+static int _read_ahead_read(uint8_t *buf, uint32_t sector, uint32_t count)
+{
+	bool sequential = (sector == read_ahead_next);
+
+	read_ahead_streak = sequential ? read_ahead_streak + count : count;
+	read_ahead_next = sector + count;
+	if (!read_ahead_usb || read_ahead_recording) {
+		return -ENOENT;
+	}
+
+	if (sector < read_ahead_start || sector + count > read_ahead_start + read_ahead_count) {
+		if (!sequential || read_ahead_streak < READ_AHEAD_TRIGGER_SECTORS) {
+			return -ENOENT;
+		}
+
+		// Whole erase blocks bypass the metadata cache, which still patches its dirty lines in.
+		uint32_t start = ROUND_DOWN(sector, READ_AHEAD_ALIGN_SECTORS);
+		uint32_t n = MIN(READ_AHEAD_SECTORS, data_fa->fa_size / DATA_PARTITION_SECTOR_SIZE - start);
+		if (sector + count > start + n) {
+			return -ENOENT;
+		}
+
+		read_ahead_count = 0;
+		int res = _data_disk_read(read_ahead_buf, start, n);
+		if (res < 0) {
+			return res;
+		}
+		read_ahead_start = start;
+		read_ahead_count = n;
+		read_stats.read_ahead_fills++;
+	}
+
+	memcpy(buf, &read_ahead_buf[(sector - read_ahead_start) * DATA_PARTITION_SECTOR_SIZE],
+	       count * DATA_PARTITION_SECTOR_SIZE);
+	read_stats.read_ahead_sectors += count;
+	return 0;
+}
+
+static void read_ahead_set_usb(bool connected)
+{
+	k_mutex_lock(&data_disk_lock, K_FOREVER);
+	read_ahead_usb = connected;
+	read_ahead_count = 0;
+	k_mutex_unlock(&data_disk_lock);
+}
+
+static void read_ahead_set_recording(bool recording)
+{
+	k_mutex_lock(&data_disk_lock, K_FOREVER);
+	read_ahead_recording = recording;
+	read_ahead_count = 0;
+	k_mutex_unlock(&data_disk_lock);
+}
+#else
+static void read_ahead_set_usb(bool connected)
+{
+}
+
+static void read_ahead_set_recording(bool recording)
+{
+}
+#endif
+
+/* Statistics of the disk reads since USB was connected, by USB and the file system. */
+void usb_mass_storage_get_read_stats(storage_read_stats_t *stats)
+{
+	k_mutex_lock(&data_disk_lock, K_FOREVER);
+	memcpy(stats, &read_stats, sizeof(storage_read_stats_t));
+	k_mutex_unlock(&data_disk_lock);
+}
+
+static int data_disk_init(struct disk_info *disk)
+{
+	return disk_access_init(DATA_FLASH_DISK_NAME);
+}
+
+static int data_disk_status(struct disk_info *disk)
+{
+	return disk_access_status(DATA_FLASH_DISK_NAME);
+}
+
+#ifdef CONFIG_STORAGE_IO_SCHEDULER
+extern const k_tid_t session_writer_thread;
+#endif
+
+static int data_disk_read(struct disk_info *disk, uint8_t *buf, uint32_t sector, uint32_t count)
+{
+#ifdef CONFIG_STORAGE_IO_SCHEDULER
+	// USB mass storage reads come straight to the disk, they are scheduled here. The wait is
+	// bounded so that the host does not time out, and the writer never waits for itself.
+	if (usb_connected && k_current_get() != session_writer_thread) {
+		usb_mass_storage_io_wait(STORAGE_IO_INTERACTIVE, K_MSEC(CONFIG_STORAGE_IO_TRANSFER_TIMEOUT_MS));
+	}
+#endif
+	k_mutex_lock(&data_disk_lock, K_FOREVER);
+	uint32_t start = k_cycle_get_32();
+#ifdef CONFIG_STORAGE_READ_AHEAD
+	int res = _read_ahead_read(buf, sector, count);
+	if (res == -ENOENT) {
+		res = _data_disk_read(buf, sector, count);
+	}
+#else
+	int res = _data_disk_read(buf, sector, count);
+#endif
+	read_stats.reads++;
+	read_stats.bytes += count * DATA_PARTITION_SECTOR_SIZE;
+	read_stats.busy_us += k_cyc_to_us_floor32(k_cycle_get_32() - start);
+	k_mutex_unlock(&data_disk_lock);
+	return res;
+}
+
+static int data_disk_write(struct disk_info *disk, const uint8_t *buf, uint32_t sector, uint32_t count)
+{
+	k_mutex_lock(&data_disk_lock, K_FOREVER);
+#ifdef CONFIG_SESSION_PREERASE
+	data_disk_write_time = k_uptime_get();
+#endif
+#ifdef CONFIG_STORAGE_READ_AHEAD
+	_read_ahead_invalidate(sector, count);
+#endif
+#ifdef CONFIG_STORAGE_META_CACHE
+	// FatFs writes the FAT and the directories from its window, the file data from the file
+	// buffers or the caller's: only the window is cached, USB writes never are.
+	int res = (buf == fat_fs.win) ? session_meta_cache_write(&meta_cache, buf, sector, count)
+				      : session_meta_cache_write_through(&meta_cache, buf, sector, count);
+	bool dirty = session_meta_cache_dirty(&meta_cache) > 0;
+	k_mutex_unlock(&data_disk_lock);
+	if (dirty) {
+		// Not rescheduled when already pending: nothing stays cached longer than the delay.
+		k_work_schedule(&meta_cache_flush_work, K_MSEC(CONFIG_STORAGE_META_CACHE_FLUSH_MS));
+	}
+#else
+	int res = _flash_disk_write(NULL, buf, sector, count);
+	k_mutex_unlock(&data_disk_lock);
+#endif
+	return res;
+}
+
+static int data_disk_ioctl(struct disk_info *disk, uint8_t cmd, void *buf)
+{
+	if (cmd == DISK_IOCTL_CTRL_DEINIT) {
+		meta_cache_flush();
+	} else if (cmd == DISK_IOCTL_CTRL_SYNC) {
+		// FatFs syncs the disk on every f_sync and fs_close.
+		meta_cache_sync();
+	}
+	return disk_access_ioctl(DATA_FLASH_DISK_NAME, cmd, buf);
+}
+
+static const struct disk_operations data_disk_ops = {
+	.init = data_disk_init,
+	.status = data_disk_status,
+	.read = data_disk_read,
+	.write = data_disk_write,
+	.ioctl = data_disk_ioctl,
+};
+
+static struct disk_info data_disk = {
+	.name = DATA_DISK_NAME,
+	.ops = &data_disk_ops,
+};
+
+static int setup_data_disk()
+{
+#ifdef CONFIG_STORAGE_META_CACHE
+	session_meta_cache_init(&meta_cache, _flash_disk_read, _flash_disk_write, NULL, meta_cache_entries,
+				meta_cache_buf, ARRAY_SIZE(meta_cache_entries), DATA_PARTITION_SECTOR_SIZE,
+				DATA_PARTITION_ERASE_BLOCK_SIZE / DATA_PARTITION_SECTOR_SIZE);
+#endif
+	// The flash disk must not be registered under the name of the disk in front of it.
+	int res = disk_access_init(DATA_FLASH_DISK_NAME);
+	if (res != 0) {
+		LOG_ERR("Flash disk %s not available (%i)", DATA_FLASH_DISK_NAME, res);
+		return -ENODEV;
+	}
+	res = disk_access_register(&data_disk);
+	if (res != 0) {
+		LOG_ERR("Failed to register disk %s (%i)", DATA_DISK_NAME, res);
+		return res;
+	}
+	return 0;
+}
+
 static int setup_flash(struct fs_mount_t *mnt)
 {
 	int rc = 0;
@@ -64,6 +479,8 @@ static int setup_flash(struct fs_mount_t *mnt)
 
 	if (rc < 0) {
 		flash_area_close(pfa);
+	} else {
+		data_fa = pfa;
 	}
 	return rc;
 }
@@ -72,8 +489,6 @@ static int mount_app_fs(struct fs_mount_t *mnt)
 {
 	int rc;
 
-	static FATFS fat_fs;
-
 	mnt->type = FS_FATFS;
 	mnt->fs_data = &fat_fs;
 	mnt->mnt_point = MOUNT_POINT;
@@ -83,7 +498,7 @@ static int mount_app_fs(struct fs_mount_t *mnt)
 	return rc;
 }
 
-static void setup_disk(void)
+static int setup_disk(void)
 {
 	struct fs_mount_t *mp = &fs_mnt;
 	struct fs_statvfs sbuf;
@@ -92,27 +507,31 @@ static void setup_disk(void)
 	rc = setup_flash(mp);
 	if (rc < 0) {
 		LOG_ERR("Failed to setup flash area");
-		return;
+		return 0;
+	}
+
+	// Without it, neither the file system nor USB have a disk.
+	rc = setup_data_disk();
+	if (rc < 0) {
+		return rc;
 	}
 
 	if (!IS_ENABLED(CONFIG_FAT_FILESYSTEM_ELM)) {
 		LOG_INF("No compatible file system selected");
-		return;
+		return 0;
 	}
 
 	rc = mount_app_fs(mp);
 	if (rc < 0) {
 		LOG_ERR("Failed to mount filesystem");
-		return;
+		return 0;
 	}
 
 	rc = fs_statvfs(mp->mnt_point, &sbuf);
 	if (rc < 0) {
 		LOG_ERR("FAIL: statvfs: %d", rc);
-		return;
 	}
-
-	return;
+	return 0;
 }
 
 /* List dir entry by path
@@ -224,7 +643,8 @@ int usb_mass_storage_create_file(const char *path, const char *filename, struct
 int usb_mass_storage_write_to_file(char* data, size_t len, struct fs_file_t *f, bool erase_content)
 {
 	// Take a semaphore in order to prevent end session to happen during a write.
-	if (k_sem_take(&write_sem, K_NO_WAIT) != 0) {
+	// The session writer thread may be writing a chunk, which is worth waiting for.
+	if (k_sem_take(&write_sem, K_FOREVER) != 0) {
         LOG_ERR("Unable to write data, semaphore is unavailable!");
 		return -EINPROGRESS;
     }
@@ -255,71 +675,73 @@ int usb_mass_storage_write_to_file(char* data, size_t len, struct fs_file_t *f,
 	return (res < 0 ? res : 0);
 }
 
-int usb_mass_storage_get_session_header(const char* path, struct fs_file_t *f)
+/* Read callback of the session reader, ctx is the open session file. */
+static int _session_read(void *ctx, void *data, size_t len)
+{
+	// A session may be recording while another one is read back.
+	usb_mass_storage_io_wait(STORAGE_IO_INTERACTIVE, K_FOREVER);
+	return fs_read((struct fs_file_t *)ctx, data, len);
+}
+
+/* Open the session file at path and read its header through the session reader, which then
+ * returns the records or the lines of samples.
+ * Returns the number of channels of a binary session (bin_header is then set), or the number of
+ * columns of a CSV session.
+ */
+int usb_mass_storage_get_session_header(const char* path, struct fs_file_t *f, session_bin_header_t *bin_header)
 {
+	const uint8_t *data;
+	char *line;
+
 	int ret = fs_open(f, path, FS_O_READ);
 	if (ret != 0) {
 		LOG_ERR("Failed to open file %s (%i)", path, ret);
 		return ret;
 	}
+	session_reader_init(&session_reader, _session_read, f, session_read_buffer, sizeof(session_read_buffer),
+			    DATA_PARTITION_SECTOR_SIZE);
 
-	char file_content[strlen(SESSION_FILE_HEADER_SFLP)];
-	int size_read = fs_read(f, file_content, strlen(SESSION_FILE_HEADER_SFLP));
+	int size_read = session_reader_peek(&session_reader, &data, sizeof(session_bin_header_t));
 	if (size_read < 0)
 	{
 		LOG_ERR("Failed to read session file %i", size_read);
 		return size_read;
 	}
 
-	if (strncmp(file_content, SESSION_FILE_HEADER_SIMPLE, strlen(SESSION_FILE_HEADER_SIMPLE)) == 0) {
-		ret = fs_seek(&current_session_file, strlen(SESSION_FILE_HEADER_SIMPLE), FS_SEEK_SET);
-		if (ret){
-			LOG_ERR("Error when seeking simple file %i", ret);
+	memset(bin_header, 0, sizeof(session_bin_header_t));
+	if (size_read >= strlen(SESSION_LZ4_MAGIC) && memcmp(data, SESSION_LZ4_MAGIC, strlen(SESSION_LZ4_MAGIC)) == 0) {
+		LOG_ERR("Compressed sessions must be decompressed on the host");
+		return -ENOTSUP;
+	} else if (size_read >= strlen(SESSION_BIN_MAGIC) && memcmp(data, SESSION_BIN_MAGIC, strlen(SESSION_BIN_MAGIC)) == 0) {
+		ret = session_bin_header_load(bin_header, data, size_read);
+		if (ret < 0) {
+			LOG_ERR("Unsupported binary session header (%i)", ret);
+			return ret;
 		}
-		return SESSION_FILE_NB_COLUMN_SIMPLE;
-	} else if (strncmp(file_content, SESSION_FILE_HEADER_SFLP, strlen(SESSION_FILE_HEADER_SFLP)) == 0)
-	{
-		ret = fs_seek(&current_session_file, strlen(SESSION_FILE_HEADER_SFLP), FS_SEEK_SET);
-		if (ret){
-			LOG_ERR("Error when seeking SFLP file %i", ret);
+		session_reader_consume(&session_reader, ret);
+		return bin_header->nb_channels;
+	} else if (size_read >= strlen(SESSION_FILE_HEADER_SIMPLE) &&
+		   strncmp((const char *)data, SESSION_FILE_HEADER_SIMPLE, strlen(SESSION_FILE_HEADER_SIMPLE)) == 0) {
+		ret = session_reader_line(&session_reader, &line);
+		if (ret < 0) {
+			LOG_ERR("Failed to read the CSV header %i", ret);
+			return ret;
+		}
+		// One column more than the separators: 7 for a simple session, 14 with SFLP.
+		int nb_columns = 1;
+		for (char *p = line; *p != 0; p++) {
+			nb_columns += (*p == ',');
 		}
-		return SESSION_FILE_NB_COLUMN_SFLP;
+		return nb_columns;
 	} else {
 		LOG_ERR("Session header not corresponding to a known file");
 		return -ENOTSUP;
 	}
 }
 
-int usb_mass_storage_read_line(char* data, size_t len, size_t offset, struct fs_file_t *f)
+session_reader_t* usb_mass_storage_get_session_reader()
 {
-	char file_content[200];
-	int size_read = fs_read(f, file_content, len);
-	if (size_read < 0)
-	{
-		LOG_ERR("Failed to read session file %i", size_read);
-		data = NULL;
-		return size_read;
-	} else if (size_read == 0) {
-		LOG_ERR("Nothing read from file");
-		data = NULL;
-		return -EBADF;
-	}
-
-	for (int ii = 0; ii < size_read; ii++) {
-		if (file_content[ii] == '\n'){
-			memcpy(data, file_content, ii);
-
-			int ret = fs_seek(&current_session_file, -(size_read - (ii + 1)), FS_SEEK_CUR);
-			if (ret){
-				LOG_ERR("Error when seeking file %i", ret);
-			}
-			return ii;
-		}
-	}
-
-	LOG_WRN("Detected end of file");
-	data = NULL;
-	return -EBADF;
+	return &session_reader;
 }
 
 int usb_mass_storage_close_file(struct fs_file_t *f)
@@ -356,132 +778,1933 @@ int usb_mass_storage_create_dir(const char *path){
 	return 0;
 }
 
-static int get_session_nb(const char *path){
-	int res;
+static const char *session_file_names[] = {
+	[SESSION_FORMAT_CSV] = SESSION_FILE_NAME SESSION_FILE_EXTENSION,
+	[SESSION_FORMAT_RAW] = SESSION_FILE_NAME SESSION_FILE_EXTENSION_RAW,
+	[SESSION_FORMAT_BIN] = SESSION_FILE_NAME SESSION_FILE_EXTENSION_BIN,
+};
+
+#define SESSION_CATALOG_PATH MOUNT_POINT "/" SESSION_CATALOG_FILE_NAME
+#define SESSION_CATALOG_ENTRY_OFFSET(index) (sizeof(session_catalog_header_t) + (index) * sizeof(session_catalog_entry_t))
+
+static session_catalog_header_t catalog_header;
+static session_catalog_entry_t current_entry;
+static uint32_t current_entry_index;
+// Set when the host may have changed the disk, the catalog is then rebuilt before it is used.
+static bool catalog_stale = false;
+static uint32_t session_samples;
+
+/* Write len bytes of data at offset in the catalog file. */
+static int catalog_write(off_t offset, const void *data, size_t len)
+{
+	struct fs_file_t f;
+
+	fs_file_t_init(&f);
+	int res = fs_open(&f, SESSION_CATALOG_PATH, FS_O_CREATE | FS_O_RDWR);
+	if (res != 0) {
+		LOG_ERR("Failed to open session catalog (%i)", res);
+		return res;
+	}
+
+	res = fs_seek(&f, offset, FS_SEEK_SET);
+	if (res == 0) {
+		ssize_t written = fs_write(&f, data, len);
+		res = (written < 0) ? written : (written < len ? -ENOSPC : 0);
+	}
+	if (res != 0) {
+		LOG_ERR("Failed to write session catalog (%i)", res);
+	}
+
+	int close_res = fs_close(&f);
+	return (res != 0 ? res : close_res);
+}
+
+/* Find the data file of session nb, to rebuild its catalog entry. */
+static void catalog_find_session_file(session_catalog_entry_t *entry)
+{
+	static struct fs_dirent file_info;
+	char path[MAX_PATH];
+
+	for (size_t ii = 0; ii <= ARRAY_SIZE(session_file_names); ii++) {
+		bool compressed = (ii == ARRAY_SIZE(session_file_names));
+		const char *name = compressed ? SESSION_FILE_NAME SESSION_FILE_EXTENSION_LZ4 : session_file_names[ii];
+
+		snprintf(path, sizeof(path), "%s/%s%u/%s", MOUNT_POINT, SESSION_DIR_NAME, entry->nb, name);
+		if (fs_stat(path, &file_info) == 0) {
+			strncpy(entry->file_name, name, sizeof(entry->file_name) - 1);
+			entry->size = file_info.size;
+			entry->format = compressed ? SESSION_FORMAT_CSV : ii;
+			entry->flags = compressed ? SESSION_CATALOG_FLAG_COMPRESSED : 0;
+			return;
+		}
+	}
+}
+
+/* Rebuild the catalog from the SESSIONn directories of the disk, when it is missing or does not
+ * match the disk. Only the number, data file and size of the sessions are found again, their
+ * entries are not flagged as closed.
+ */
+static int catalog_rebuild(void)
+{
 	struct fs_dir_t dirp;
 	static struct fs_dirent entry;
-	int count = 0;
+	int res;
 
-	fs_dir_t_init(&dirp);
+	catalog_header = (session_catalog_header_t){
+		.magic = SESSION_CATALOG_MAGIC,
+		.version = SESSION_CATALOG_VERSION,
+		.entry_size = sizeof(session_catalog_entry_t),
+		.count = 0,
+		.next_nb = 1,
+	};
 
-	/* Verify fs_opendir() */
-	res = fs_opendir(&dirp, path);
+	fs_unlink(SESSION_CATALOG_PATH);
+
+	fs_dir_t_init(&dirp);
+	res = fs_opendir(&dirp, MOUNT_POINT);
 	if (res) {
-		LOG_ERR("Error opening dir %s [%d]", path, res);
+		LOG_ERR("Error opening dir %s [%d]", MOUNT_POINT, res);
 		return res;
 	}
 
-	int session_nb = 0;
 	for (;;) {
-		/* Verify fs_readdir() */
 		res = fs_readdir(&dirp, &entry);
-
 		/* entry.name[0] == 0 means end-of-dir */
-		/* In that case, create session_0 dir. */
 		if (res || entry.name[0] == 0) {
 			break;
 		}
 
-		if (entry.type == FS_DIR_ENTRY_DIR) {
-			if (strncmp(entry.name, SESSION_DIR_NAME, strlen(SESSION_DIR_NAME)) == 0) {
-				errno = 0;
-				uintmax_t tmp = strtoumax(&entry.name[strlen(SESSION_DIR_NAME)], NULL, 10); // Get directory number as uint
-				if (tmp == UINTMAX_MAX && errno == ERANGE){
-					LOG_ERR("Could not find directory number.");
-				} else {
-					if (tmp > session_nb) {
-						session_nb = tmp;
-					}
-				}
-			}
-		} else {
+		if (entry.type != FS_DIR_ENTRY_DIR || strncmp(entry.name, SESSION_DIR_NAME, strlen(SESSION_DIR_NAME)) != 0) {
+			continue;
+		}
+
+		char *end;
+		unsigned long nb = strtoul(&entry.name[strlen(SESSION_DIR_NAME)], &end, 10);
+		if (*end != 0 || nb == 0 || nb >= UINT32_MAX) {
+			continue;
+		}
+
+		session_catalog_entry_t session = {.nb = nb, .format = SESSION_FORMAT_CSV};
+		catalog_find_session_file(&session);
+		if (catalog_write(SESSION_CATALOG_ENTRY_OFFSET(catalog_header.count), &session, sizeof(session)) == 0) {
+			catalog_header.count++;
 		}
-		count++;
+		catalog_header.next_nb = MAX(catalog_header.next_nb, nb + 1);
 	}
 
-	/* Verify fs_closedir() */
-	res = fs_closedir(&dirp);
-	if (res != 0) {
+	int close_res = fs_closedir(&dirp);
+	if (close_res != 0) {
 		LOG_ERR("Error while closing dir");
-		return res;
 	}
 
-	// At this point, session_nb is equal to the highest dir number.
-	// Increment it to create new folder.
-	session_nb++;
-	return session_nb;
+	res = catalog_write(0, &catalog_header, sizeof(catalog_header));
+	LOG_INF("Session catalog rebuilt: %u sessions", catalog_header.count);
+	return res;
 }
 
-int usb_mass_storage_create_session()
+/* Read the catalog header, and rebuild the catalog if it does not match its file. */
+static int catalog_load(void)
 {
-	struct fs_mount_t *mp = &fs_mnt;
-	memset(session_wr_buffer, 0, SESSION_WR_BUFFER_SIZE);
-	session_wr_buffer_len = 0;
+	static struct fs_dirent file_info;
+	struct fs_file_t f;
 
-	char path[MAX_PATH];
-	int base = 0;
+	fs_file_t_init(&f);
+	int res = fs_open(&f, SESSION_CATALOG_PATH, FS_O_READ);
+	if (res == 0) {
+		ssize_t size_read = fs_read(&f, &catalog_header, sizeof(catalog_header));
+		fs_close(&f);
+
+		if (size_read == sizeof(catalog_header) && catalog_header.magic == SESSION_CATALOG_MAGIC &&
+		    catalog_header.version == SESSION_CATALOG_VERSION &&
+		    catalog_header.entry_size == sizeof(session_catalog_entry_t) &&
+		    fs_stat(SESSION_CATALOG_PATH, &file_info) == 0 &&
+		    file_info.size == SESSION_CATALOG_ENTRY_OFFSET(catalog_header.count)) {
+			LOG_INF("Session catalog: %u sessions, next is %u", catalog_header.count, catalog_header.next_nb);
+			return 0;
+		}
+	}
 
-	int nb = get_session_nb(mp->mnt_point);
-	if (nb < 0){
-		LOG_ERR("Unable to get session number.");
-		return nb;
+	LOG_WRN("Session catalog missing or invalid, rebuilding it");
+	return catalog_rebuild();
+}
+
+/* Fill in the catalog entry of the session which just ended. */
+static void catalog_close_session(void)
+{
+	if (current_entry.nb == 0) {
+		return;
 	}
-	int length = snprintf( NULL, 0, "%d", nb);
-	char* nb_str = malloc(length + 1 + strlen(SESSION_DIR_NAME));
-	snprintf(nb_str, length + 1 + strlen(SESSION_DIR_NAME), "%s%d", SESSION_DIR_NAME, nb);
 
-	strncpy(path, mp->mnt_point, sizeof(path));
-	base += strlen(mp->mnt_point);
+	current_entry.duration_ms = k_uptime_get_32() - current_entry.start_ms;
+	current_entry.samples = session_samples;
+	current_entry.size = writer_stats.bytes_written;
+	current_entry.flags |= SESSION_CATALOG_FLAG_CLOSED;
+	catalog_write(SESSION_CATALOG_ENTRY_OFFSET(current_entry_index), &current_entry, sizeof(current_entry));
+	current_entry.nb = 0;
+}
+
+/* Count nb samples stored in the current session, for its catalog entry. */
+void usb_mass_storage_session_add_samples(uint32_t nb)
+{
+	session_samples += nb;
+}
 
-	path[base++] = '/';
-	path[base] = 0;
+uint32_t usb_mass_storage_get_session_count()
+{
+	return catalog_header.count;
+}
 
-	strcat(path, nb_str);
-	base += strlen(nb_str);
-	free(nb_str);
+/* Read the catalog entry of the index-th session created. */
+int usb_mass_storage_get_session_entry(uint32_t index, session_catalog_entry_t *entry)
+{
+	struct fs_file_t f;
 
-	int res = usb_mass_storage_create_dir(path);
-	if (res != 0){
-		LOG_ERR("Failed to create dir %s", path);
-		return res;
+	if (index >= catalog_header.count) {
+		return -EINVAL;
 	}
 
-	res = usb_mass_storage_create_file(path, SESSION_FILE_NAME SESSION_FILE_EXTENSION, &current_session_file, true);
+	fs_file_t_init(&f);
+	int res = fs_open(&f, SESSION_CATALOG_PATH, FS_O_READ);
 	if (res != 0) {
-		LOG_ERR("Failed to create data_file %s (%i)", path, res);
+		LOG_ERR("Failed to open session catalog (%i)", res);
 		return res;
 	}
 
-	current_session_nb = nb;
+	res = fs_seek(&f, SESSION_CATALOG_ENTRY_OFFSET(index), FS_SEEK_SET);
+	if (res == 0) {
+		ssize_t size_read = fs_read(&f, entry, sizeof(*entry));
+		res = (size_read < 0) ? size_read : (size_read < sizeof(*entry) ? -EIO : 0);
+	}
 
-	return nb;
+	fs_close(&f);
+	return res;
 }
 
-int usb_mass_storage_end_current_session(){
-	// Take a semaphore in order to prevent end session to happen during a write.
+/* Set sidecar to the path of the file name next to the session file at path.
+ * sidecar must hold MAX_PATH bytes.
+ */
+static __maybe_unused int sidecar_path(const char *path, const char *name, char *sidecar)
+{
+	const char *sep = strrchr(path, '/');
+	if (sep == NULL || (sep - path) + 1 + strlen(name) >= MAX_PATH) {
+		return -EINVAL;
+	}
+	snprintf(sidecar, MAX_PATH, "%.*s/%s", (int)(sep - path), path, name);
+	return 0;
+}
+
+#ifdef CONFIG_SESSION_CRC
+/* The CRC of each chunk written to the session file is stored in SESSION.CRC, so that the session
+ * can be verified later without reading back every chunk while recording. The CRCs are written
+ * SESSION_CRC_BUFFER_ENTRIES at a time, by the writer thread.
+ */
+static struct fs_file_t session_crc_file;
+static uint32_t session_crc_buf[SESSION_CRC_BUFFER_ENTRIES];
+static size_t session_crc_len;
+
+static void session_crc_open(const char *path)
+{
+	session_crc_header_t header = {
+		.magic = SESSION_CRC_MAGIC,
+		.chunk_size = sys_cpu_to_le32(CONFIG_SESSION_WRITER_CHUNK_SIZE),
+	};
+
+	session_crc_len = 0;
+	int res = usb_mass_storage_create_file(path, SESSION_CRC_FILE_NAME, &session_crc_file, true);
+	if (res == 0) {
+		res = usb_mass_storage_write_to_file((char *)&header, sizeof(header), &session_crc_file, false);
+		if (res != 0) {
+			fs_close(&session_crc_file);
+		}
+	}
+	if (res != 0) {
+		// Not fatal, the session is recorded without its CRCs.
+		LOG_WRN("Unable to create the session CRC file (%i)", res);
+		fs_file_t_init(&session_crc_file);
+	}
+}
+
+static void session_crc_flush()
+{
+	if (session_crc_len == 0) {
+		return;
+	}
+
+	int res = usb_mass_storage_write_to_file((char *)session_crc_buf, session_crc_len * sizeof(uint32_t),
+						 &session_crc_file, false);
+	if (res != 0) {
+		LOG_ERR("Failed to write session CRCs (%i)", res);
+	}
+	session_crc_len = 0;
+}
+
+static void session_crc_add(const uint8_t *data, size_t len)
+{
+	if (session_crc_file.mp == NULL) {
+		return;
+	}
+
+	session_crc_buf[session_crc_len++] = sys_cpu_to_le32(crc32_ieee(data, len));
+	if (session_crc_len == ARRAY_SIZE(session_crc_buf)) {
+		session_crc_flush();
+	}
+}
+
+static void session_crc_close()
+{
+	if (session_crc_file.mp == NULL) {
+		return;
+	}
+
+	session_crc_flush();
+	int res = fs_close(&session_crc_file);
+	if (res != 0) {
+		LOG_WRN("Unable to close the session CRC file (%i)", res);
+	}
+	fs_file_t_init(&session_crc_file);
+}
+
+/* Check the session file at path against the CRC of each of its chunks, in SESSION.CRC next to it,
+ * and call cb with each corrupted chunk. nb_chunks is set to the number of chunks checked: the
+ * last CRCs of a session interrupted by a reset are missing.
+ * Returns the number of corrupted chunks, or a negative error code.
+ */
+int usb_mass_storage_verify_session(const char *path, session_verify_cb_t cb, void *ctx, uint32_t *nb_chunks)
+{
+	static uint8_t buf[SESSION_VERIFY_BUFFER_SIZE];
+	char crc_path[MAX_PATH];
+	session_crc_header_t header;
+	struct fs_file_t f, crc_f;
+	int corrupted = 0;
+
+	if (sidecar_path(path, SESSION_CRC_FILE_NAME, crc_path) < 0) {
+		return -EINVAL;
+	}
+
+	fs_file_t_init(&f);
+	fs_file_t_init(&crc_f);
+	int res = fs_open(&crc_f, crc_path, FS_O_READ);
+	if (res != 0) {
+		LOG_ERR("Failed to open %s (%i)", crc_path, res);
+		return res;
+	}
+	res = fs_open(&f, path, FS_O_READ);
+	if (res != 0) {
+		LOG_ERR("Failed to open %s (%i)", path, res);
+		fs_close(&crc_f);
+		return res;
+	}
+
+	*nb_chunks = 0;
+	if (fs_read(&crc_f, &header, sizeof(header)) != sizeof(header) ||
+	    memcmp(header.magic, SESSION_CRC_MAGIC, sizeof(header.magic)) != 0 || header.chunk_size == 0) {
+		LOG_ERR("Invalid session CRC file %s", crc_path);
+		res = -EINVAL;
+	}
+
+	uint32_t chunk_size = sys_le32_to_cpu(header.chunk_size);
+	while (res == 0) {
+		uint32_t expected, crc = 0, len = 0;
+
+		usb_mass_storage_io_wait(STORAGE_IO_INTERACTIVE, K_FOREVER);
+		if (fs_read(&crc_f, &expected, sizeof(expected)) != sizeof(expected)) {
+			break;
+		}
+		while (len < chunk_size) {
+			ssize_t size_read = fs_read(&f, buf, MIN(sizeof(buf), chunk_size - len));
+			if (size_read <= 0) {
+				res = size_read;
+				break;
+			}
+			crc = crc32_ieee_update(crc, buf, size_read);
+			len += size_read;
+		}
+		if (len == 0) {
+			break;
+		}
+
+		if (crc != sys_le32_to_cpu(expected)) {
+			corrupted++;
+			if (cb) {
+				cb(*nb_chunks, *nb_chunks * chunk_size, ctx);
+			}
+		}
+		(*nb_chunks)++;
+	}
+
+	fs_close(&f);
+	fs_close(&crc_f);
+	if (res < 0) {
+		LOG_ERR("Failed to verify %s (%i)", path, res);
+		return res;
+	}
+	return corrupted;
+}
+#else
+int usb_mass_storage_verify_session(const char *path, session_verify_cb_t cb, void *ctx, uint32_t *nb_chunks)
+{
+	return -ENOTSUP;
+}
+#endif
+
+#if defined(CONFIG_SESSION_INDEX) || defined(CONFIG_SESSION_PREVIEW)
+/* A file next to the session file which the producer fills through its own ring, and which the
+ * writer thread appends the ring to, like the session file itself.
+ */
+typedef struct {
+	struct fs_file_t file;
+	session_ring_t ring;
+	const char *name;
+} session_sidecar_t;
+
+/* Create the file name next to the session file in dir, starting with header. Not fatal: the
+ * sidecar stays closed, and the session is recorded without it.
+ */
+static void sidecar_open(session_sidecar_t *sidecar, const char *dir, const char *name, uint8_t *ring_buf,
+			 size_t ring_size, const void *header, size_t header_len)
+{
+	session_ring_init(&sidecar->ring, ring_buf, ring_size);
+	sidecar->name = name;
+	int res = usb_mass_storage_create_file(dir, name, &sidecar->file, true);
+	if (res == 0) {
+		res = usb_mass_storage_write_to_file((char *)header, header_len, &sidecar->file, false);
+		if (res != 0) {
+			fs_close(&sidecar->file);
+		}
+	}
+	if (res != 0) {
+		LOG_WRN("Unable to create %s (%i)", name, res);
+		fs_file_t_init(&sidecar->file);
+	}
+}
+
+static bool sidecar_is_open(const session_sidecar_t *sidecar)
+{
+	return sidecar->file.mp != NULL;
+}
+
+/* Writer thread: append the ring to the file once it is half full, or all of it at the end of
+ * the session.
+ */
+static void sidecar_write(session_sidecar_t *sidecar, bool all)
+{
+	const uint8_t *data;
+
+	if (!sidecar_is_open(sidecar)) {
+		return;
+	}
+	if (!all && session_ring_used(&sidecar->ring) < sidecar->ring.size / 2) {
+		return;
+	}
+
+	size_t len;
+	while ((len = session_ring_peek(&sidecar->ring, &data)) > 0) {
+		int res = usb_mass_storage_write_to_file((char *)data, len, &sidecar->file, false);
+		if (res != 0) {
+			LOG_ERR("Failed to write %s (%i)", sidecar->name, res);
+		}
+		session_ring_consume(&sidecar->ring, len);
+	}
+}
+
+static void sidecar_close(session_sidecar_t *sidecar)
+{
+	if (!sidecar_is_open(sidecar)) {
+		return;
+	}
+
+	// The writer thread has written the ring when the session ring was drained.
+	int res = fs_close(&sidecar->file);
+	if (res != 0) {
+		LOG_WRN("Unable to close %s (%i)", sidecar->name, res);
+	}
+	fs_file_t_init(&sidecar->file);
+}
+#endif
+
+#ifdef CONFIG_SESSION_INDEX
+/* The producer adds an entry to the index of the session at most every
+ * CONFIG_SESSION_INDEX_INTERVAL_MS, with the offset of the next sample it adds. The entries go
+ * through their own ring to the writer thread, which appends them to SESSION.IDX.
+ */
+static session_sidecar_t session_index_sidecar;
+static uint8_t session_index_ring_buf[SESSION_INDEX_RING_SIZE];
+static uint32_t session_index_next_ms;
+static bool session_index_started;
+
+BUILD_ASSERT(IS_POWER_OF_TWO(SESSION_INDEX_RING_SIZE), "The session index ring size must be a power of two");
+
+static void session_index_open(const char *path)
+{
+	session_index_header_t header = {
+		.magic = SESSION_INDEX_MAGIC,
+		.interval_ms = sys_cpu_to_le32(CONFIG_SESSION_INDEX_INTERVAL_MS),
+	};
+
+	session_index_started = false;
+	// Not fatal, the session can still be read from its start.
+	sidecar_open(&session_index_sidecar, path, SESSION_INDEX_FILE_NAME, session_index_ring_buf,
+		     sizeof(session_index_ring_buf), &header, sizeof(header));
+}
+
+/* Index the next sample added to the session, ts_ms being its timestamp. Call it before adding
+ * any sample that can be decoded on its own: a CSV line, a record or the first sample of a block.
+ */
+void usb_mass_storage_session_index(uint32_t ts_ms)
+{
+	if (!sidecar_is_open(&session_index_sidecar) || (session_index_started && ts_ms < session_index_next_ms)) {
+		return;
+	}
+
+	session_index_entry_t entry = {
+		.ts_ms = sys_cpu_to_le32(ts_ms),
+		.offset = sys_cpu_to_le32(session_data_len),
+	};
+	// A full ring only makes the index sparser.
+	if (session_ring_put(&session_index_sidecar.ring, &entry, sizeof(entry)) == 0) {
+		session_index_next_ms = ts_ms + CONFIG_SESSION_INDEX_INTERVAL_MS;
+		session_index_started = true;
+	}
+}
+
+static int _index_read(void *ctx, uint32_t index, session_index_entry_t *entry)
+{
+	struct fs_file_t *f = ctx;
+
+	int res = fs_seek(f, sizeof(session_index_header_t) + index * sizeof(*entry), FS_SEEK_SET);
+	if (res != 0) {
+		return res;
+	}
+	ssize_t size_read = fs_read(f, entry, sizeof(*entry));
+	if (size_read != sizeof(*entry)) {
+		return (size_read < 0) ? size_read : -EIO;
+	}
+	entry->ts_ms = sys_le32_to_cpu(entry->ts_ms);
+	entry->offset = sys_le32_to_cpu(entry->offset);
+	return 0;
+}
+
+/* Find the last sample indexed at or before ts_ms in the session file at path, from SESSION.IDX
+ * next to it. Returns the number of the entry, -ENOENT if the session has no index, or a
+ * negative error code.
+ */
+int usb_mass_storage_find_session_index(const char *path, uint32_t ts_ms, session_index_entry_t *entry)
+{
+	char index_path[MAX_PATH];
+	session_index_header_t header;
+	struct fs_dirent dirent;
+	struct fs_file_t f;
+
+	if (sidecar_path(path, SESSION_INDEX_FILE_NAME, index_path) < 0) {
+		return -EINVAL;
+	}
+	int res = fs_stat(index_path, &dirent);
+	if (res != 0) {
+		return -ENOENT;
+	}
+
+	fs_file_t_init(&f);
+	res = fs_open(&f, index_path, FS_O_READ);
+	if (res != 0) {
+		LOG_ERR("Failed to open %s (%i)", index_path, res);
+		return res;
+	}
+	if (fs_read(&f, &header, sizeof(header)) != sizeof(header) ||
+	    memcmp(header.magic, SESSION_INDEX_MAGIC, sizeof(header.magic)) != 0) {
+		LOG_ERR("Invalid session index %s", index_path);
+		fs_close(&f);
+		return -EINVAL;
+	}
+
+	// A reset can leave a partial entry at the end.
+	uint32_t nb_entries = (dirent.size - sizeof(header)) / sizeof(session_index_entry_t);
+	res = session_index_find(_index_read, &f, nb_entries, ts_ms, entry);
+	fs_close(&f);
+	return res;
+}
+
+/* Move the session opened by usb_mass_storage_get_session_header to the last sample indexed at or
+ * before ts_ms, the session reader then returns the samples from there.
+ */
+int usb_mass_storage_session_seek(const char *path, struct fs_file_t *f, uint32_t ts_ms, session_index_entry_t *entry)
+{
+	int res = usb_mass_storage_find_session_index(path, ts_ms, entry);
+	if (res < 0) {
+		return res;
+	}
+
+	res = fs_seek(f, entry->offset, FS_SEEK_SET);
+	if (res != 0) {
+		LOG_ERR("Failed to seek to offset %u (%i)", entry->offset, res);
+		return res;
+	}
+	session_reader_restart(&session_reader, entry->offset);
+	return 0;
+}
+#else
+void usb_mass_storage_session_index(uint32_t ts_ms)
+{
+}
+
+int usb_mass_storage_find_session_index(const char *path, uint32_t ts_ms, session_index_entry_t *entry)
+{
+	return -ENOTSUP;
+}
+
+int usb_mass_storage_session_seek(const char *path, struct fs_file_t *f, uint32_t ts_ms, session_index_entry_t *entry)
+{
+	return -ENOTSUP;
+}
+#endif
+
+#ifdef CONFIG_SESSION_SUMMARY
+/* The summary of the current session is computed sample by sample, and written to SESSION.SUM
+ * next to the session file when the session ends.
+ */
+static session_summary_t session_summary;
+static bool session_summary_started;
+
+/* Summarize the channels of channel_mask of the samples added to the current session. */
+void usb_mass_storage_session_summary_start(uint32_t channel_mask)
+{
+	session_summary_init(&session_summary, channel_mask);
+	session_summary_started = true;
+}
+
+void usb_mass_storage_session_summary_set_clip(session_channel_t channel, float_t limit)
+{
+	session_summary_set_clip(&session_summary, channel, limit);
+}
+
+static void session_summary_write()
+{
+	session_summary_record_t record;
+	struct fs_file_t f;
+
+	if (!session_summary_started) {
+		return;
+	}
+	session_summary_started = false;
+	session_summary_get(&session_summary, &record);
+
+	// Not fatal, the session is complete without its summary.
+	int res = usb_mass_storage_create_file(current_session_dir, SESSION_SUMMARY_FILE_NAME, &f, true);
+	if (res == 0) {
+		res = usb_mass_storage_write_to_file((char *)&record, sizeof(record), &f, true);
+		fs_close(&f);
+	}
+	if (res != 0) {
+		LOG_WRN("Unable to write the session summary (%i)", res);
+	}
+}
+
+/* Read the summary of session number nb. Returns 0, -ENOENT if the session has no summary, or a
+ * negative error code.
+ */
+int usb_mass_storage_read_session_summary(uint32_t nb, session_summary_record_t *record)
+{
+	char path[MAX_PATH];
+	struct fs_file_t f;
+
+	snprintf(path, sizeof(path), "%s/%s%u/%s", MOUNT_POINT, SESSION_DIR_NAME, nb, SESSION_SUMMARY_FILE_NAME);
+	fs_file_t_init(&f);
+	int res = fs_open(&f, path, FS_O_READ);
+	if (res != 0) {
+		return -ENOENT;
+	}
+
+	ssize_t size_read = fs_read(&f, record, sizeof(*record));
+	fs_close(&f);
+	if (size_read < 0) {
+		return size_read;
+	}
+	if (size_read != sizeof(*record) || memcmp(record->magic, SESSION_SUMMARY_MAGIC, sizeof(record->magic)) != 0 ||
+	    record->version != SESSION_SUMMARY_VERSION) {
+		LOG_ERR("Invalid session summary %s", path);
+		return -EINVAL;
+	}
+	return 0;
+}
+#else
+void usb_mass_storage_session_summary_start(uint32_t channel_mask)
+{
+}
+
+void usb_mass_storage_session_summary_set_clip(session_channel_t channel, float_t limit)
+{
+}
+
+int usb_mass_storage_read_session_summary(uint32_t nb, session_summary_record_t *record)
+{
+	return -ENOTSUP;
+}
+#endif
+
+#ifdef CONFIG_SESSION_PREVIEW
+/* The preview of the current session is computed sample by sample by the producer. The windows
+ * of each level go through their own ring to the writer thread, which appends them to their file.
+ */
+static session_preview_t session_preview;
+static bool session_preview_started;
+static session_sidecar_t session_preview_sidecars[SESSION_PREVIEW_LEVELS];
+static uint8_t session_preview_ring_buf[SESSION_PREVIEW_RING_SIZE];
+static uint8_t session_preview_top_ring_buf[SESSION_PREVIEW_TOP_RING_SIZE];
+static uint8_t *const session_preview_ring_bufs[SESSION_PREVIEW_LEVELS] = {
+	session_preview_ring_buf,
+	session_preview_top_ring_buf,
+};
+static const size_t session_preview_ring_sizes[SESSION_PREVIEW_LEVELS] = {
+	sizeof(session_preview_ring_buf),
+	sizeof(session_preview_top_ring_buf),
+};
+static const char *const session_preview_file_names[SESSION_PREVIEW_LEVELS] = SESSION_PREVIEW_FILE_NAMES;
+
+BUILD_ASSERT(IS_POWER_OF_TWO(SESSION_PREVIEW_RING_SIZE) && IS_POWER_OF_TWO(SESSION_PREVIEW_TOP_RING_SIZE),
+	     "The session preview ring sizes must be powers of two");
+
+/* Preview the channels of channel_mask of the samples added to the current session. */
+void usb_mass_storage_session_preview_start(uint32_t channel_mask)
+{
+	struct __packed {
+		session_preview_header_t preview;
+		session_bin_header_t bin;
+	} header;
+
+	session_preview_started = false;
+	if (current_session_file.mp == NULL) {
+		// Sessions recorded to the session log have no directory of their own yet.
+		return;
+	}
+
+	session_preview_init(&session_preview, channel_mask);
+	memset(&header, 0, sizeof(header));
+	int len = session_bin_header_init(&header.bin, session_preview.channels);
+	if (len < 0) {
+		LOG_ERR("Invalid session preview channels 0x%x (%i)", channel_mask, len);
+		return;
+	}
+
+	for (int ii = 0; ii < SESSION_PREVIEW_LEVELS; ii++) {
+		session_preview_header(&header.preview, ii);
+		header.preview.decimation = sys_cpu_to_le16(header.preview.decimation);
+		sidecar_open(&session_preview_sidecars[ii], current_session_dir, session_preview_file_names[ii],
+			     session_preview_ring_bufs[ii], session_preview_ring_sizes[ii], &header,
+			     sizeof(header.preview) + len);
+	}
+	session_preview_started = true;
+}
+
+/* Producer: put the windows of levels to their rings. A full ring loses the window, which leaves
+ * a gap in the timestamps of the preview.
+ */
+static void session_preview_put(uint32_t levels)
+{
+	uint8_t records[3 * SESSION_BIN_RECORD_MAX_SIZE];
+
+	for (; levels; levels &= levels - 1) {
+		int level = __builtin_ctz(levels);
+		size_t len = session_preview_pack(&session_preview, level, records);
+
+		session_ring_put(&session_preview_sidecars[level].ring, records, len);
+	}
+}
+
+static void session_preview_close()
+{
+	uint8_t records[3 * SESSION_BIN_RECORD_MAX_SIZE];
+
+	if (!session_preview_started) {
+		return;
+	}
+	session_preview_started = false;
+
+	// The writer thread is idle once the session ring is drained, the partial windows left at the
+	// end are written directly.
+	for (uint32_t levels = session_preview_finish(&session_preview); levels; levels &= levels - 1) {
+		int level = __builtin_ctz(levels);
+		session_sidecar_t *sidecar = &session_preview_sidecars[level];
+
+		if (sidecar_is_open(sidecar)) {
+			size_t len = session_preview_pack(&session_preview, level, records);
+			int res = usb_mass_storage_write_to_file((char *)records, len, &sidecar->file, false);
+			if (res != 0) {
+				LOG_WRN("Unable to write the end of %s (%i)", sidecar->name, res);
+			}
+		}
+	}
+	for (int ii = 0; ii < SESSION_PREVIEW_LEVELS; ii++) {
+		sidecar_close(&session_preview_sidecars[ii]);
+	}
+}
+#else
+void usb_mass_storage_session_preview_start(uint32_t channel_mask)
+{
+}
+#endif
+
+/* Add a sample stored in the current session to its summary and its preview, values are indexed
+ * by session_channel_t.
+ */
+void usb_mass_storage_session_summarize(const float_t *values)
+{
+#ifdef CONFIG_SESSION_SUMMARY
+	if (session_summary_started) {
+		session_summary_add(&session_summary, values);
+	}
+#endif
+#ifdef CONFIG_SESSION_PREVIEW
+	if (session_preview_started) {
+		session_preview_put(session_preview_add(&session_preview, values));
+	}
+#endif
+}
+
+#ifdef CONFIG_SESSION_PREERASE
+/* The disk layer erases each block before writing it. The data of preallocated sessions is written
+ * directly to the flash instead, in blocks erased beforehand by the eraser thread: it keeps
+ * CONFIG_SESSION_PREERASE_BLOCKS erased ahead of the writer, and when no session is recorded, it
+ * erases the free clusters left by deleted sessions.
+ */
+typedef struct {
+	off_t start;		// Offset of the extent in the data partition, 0 when not written directly.
+	size_t size;
+	atomic_t written;	// Only written by the writer thread.
+	size_t erased;		// Protected by eraser_lock.
+} session_extent_t;
+
+static session_extent_t session_extent;
+static session_eraser_stats_t eraser_stats;
+static bool lazy_erase_enabled = false;
+static uint32_t lazy_erase_block;
+static uint8_t erase_check_buf[256];
+
+K_MUTEX_DEFINE(eraser_lock);
+K_SEM_DEFINE(eraser_sem, 0, 1);
+
+static bool _block_is_blank(off_t offset)
+{
+	for (size_t ii = 0; ii < DATA_PARTITION_ERASE_BLOCK_SIZE; ii += sizeof(erase_check_buf)) {
+		if (flash_area_read(data_fa, offset + ii, erase_check_buf, sizeof(erase_check_buf)) != 0) {
+			return false;
+		}
+		for (size_t jj = 0; jj < sizeof(erase_check_buf); jj++) {
+			if (erase_check_buf[jj] != 0xFF) {
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+/* Erase a block unless it is already blank. Returns 1 when it was erased. Call with eraser_lock. */
+static int _erase_block(off_t offset)
+{
+	if (_block_is_blank(offset)) {
+		return 0;
+	}
+
+	int res = flash_area_erase(data_fa, offset, DATA_PARTITION_ERASE_BLOCK_SIZE);
+	if (res != 0) {
+		LOG_ERR("Failed to erase flash block at 0x%lx (%i)", (long)offset, res);
+		return res;
+	}
+	return 1;
+}
+
+/* Erase the session extent up to len bytes from its start, and return the number of blocks erased. */
+static int erase_session_extent(size_t len)
+{
+	int count = 0;
+
+	k_mutex_lock(&eraser_lock, K_FOREVER);
+	while (session_extent.erased < MIN(len, session_extent.size)) {
+		int res = _erase_block(session_extent.start + session_extent.erased);
+		if (res < 0) {
+			count = res;
+			break;
+		}
+		count += res;
+		session_extent.erased += DATA_PARTITION_ERASE_BLOCK_SIZE;
+	}
+	k_mutex_unlock(&eraser_lock);
+	return count;
+}
+
+static uint8_t fat_sector_buf[DATA_PARTITION_SECTOR_SIZE];
+static LBA_t fat_sector; // Sector in fat_sector_buf, 0 when it is empty.
+
+/* Read len bytes of the FAT from offset through the metadata cache, which may hold FAT sectors
+ * not written back yet. Call with data_disk_lock.
+ */
+static int _fat_read(FATFS *fs, uint32_t offset, uint8_t *buf, size_t len)
+{
+	for (size_t ii = 0; ii < len; ii++, offset++) {
+		LBA_t sector = fs->fatbase + offset / DATA_PARTITION_SECTOR_SIZE;
+
+		if (sector != fat_sector) {
+			fat_sector = 0;
+			int res = _data_disk_read(fat_sector_buf, sector, 1);
+			if (res < 0) {
+				return res;
+			}
+			fat_sector = sector;
+		}
+		buf[ii] = fat_sector_buf[offset % DATA_PARTITION_SECTOR_SIZE];
+	}
+	return 0;
+}
+
+/* Call with data_disk_lock. */
+static bool _cluster_is_free(FATFS *fs, DWORD clst)
+{
+	uint8_t entry[4];
+	uint32_t val;
+
+	switch (fs->fs_type) {
+	case FS_FAT12:
+		if (_fat_read(fs, clst + clst / 2, entry, 2) != 0) {
+			return false;
+		}
+		val = sys_get_le16(entry);
+		val = (clst & 1) ? val >> 4 : val & 0xFFF;
+		break;
+	case FS_FAT16:
+		if (_fat_read(fs, clst * 2, entry, 2) != 0) {
+			return false;
+		}
+		val = sys_get_le16(entry);
+		break;
+	case FS_FAT32:
+		if (_fat_read(fs, clst * 4, entry, 4) != 0) {
+			return false;
+		}
+		val = sys_get_le32(entry) & 0x0FFFFFFF;
+		break;
+	default:
+		return false;
+	}
+	return val == 0;
+}
+
+/* Erase the next block of the data area if all of its clusters are free. Returns 1 while blocks
+ * are left to check, 0 once all of them have been checked, and -EBUSY while files are written:
+ * MCUmgr uploads and the other files written while idle allocate their clusters in the FatFs
+ * window, and only a synced FAT tells which clusters are free. Call with eraser_lock.
+ */
+static int _lazy_erase_next_block()
+{
+	FATFS *fs = &fat_fs;
+	off_t data = (off_t)fs->database * DATA_PARTITION_SECTOR_SIZE;
+	size_t cluster_size = (size_t)fs->csize * DATA_PARTITION_SECTOR_SIZE;
+	uint32_t nb_blocks = (uint64_t)(fs->n_fatent - 2) * cluster_size / DATA_PARTITION_ERASE_BLOCK_SIZE;
+
+	if (fs->fs_type == 0 || data % DATA_PARTITION_ERASE_BLOCK_SIZE || lazy_erase_block >= nb_blocks) {
+		return 0;
+	}
+
+	// The file system cannot write while the block is checked and erased, a later write to one of
+	// its clusters reprograms the block anyway.
+	k_mutex_lock(&data_disk_lock, K_FOREVER);
+	if (fs->wflag || k_uptime_get() - data_disk_write_time < SESSION_ERASER_SETTLE_MS) {
+		k_mutex_unlock(&data_disk_lock);
+		return -EBUSY;
+	}
+
+	// The FAT may have changed since the previous block.
+	fat_sector = 0;
+	uint32_t offset = lazy_erase_block * DATA_PARTITION_ERASE_BLOCK_SIZE;
+	DWORD first = 2 + offset / cluster_size;
+	DWORD last = 2 + (offset + DATA_PARTITION_ERASE_BLOCK_SIZE - 1) / cluster_size;
+	bool all_free = true;
+	for (DWORD clst = first; clst <= last && all_free; clst++) {
+		all_free = _cluster_is_free(fs, clst);
+	}
+
+	if (all_free && _erase_block(data + offset) > 0) {
+		eraser_stats.lazy_erased++;
+#ifdef CONFIG_STORAGE_META_CACHE
+		// Sectors of deleted directories cached there must not be written back.
+		session_meta_cache_invalidate(&meta_cache, (data + offset) / DATA_PARTITION_SECTOR_SIZE,
+					      DATA_PARTITION_ERASE_BLOCK_SIZE / DATA_PARTITION_SECTOR_SIZE);
+#endif
+	}
+	lazy_erase_block++;
+	k_mutex_unlock(&data_disk_lock);
+	return 1;
+}
+
+static void session_eraser_run(void *p1, void *p2, void *p3)
+{
+	for (;;) {
+		k_timeout_t timeout = K_FOREVER;
+
+		k_mutex_lock(&eraser_lock, K_FOREVER);
+		if (session_extent.size) {
+			size_t target = MIN(atomic_get(&session_extent.written) +
+					    CONFIG_SESSION_PREERASE_BLOCKS * DATA_PARTITION_ERASE_BLOCK_SIZE, session_extent.size);
+			if (session_extent.erased < target) {
+				if (_erase_block(session_extent.start + session_extent.erased) > 0) {
+					eraser_stats.erased_ahead++;
+				}
+				session_extent.erased += DATA_PARTITION_ERASE_BLOCK_SIZE;
+				timeout = K_NO_WAIT;
+			}
+		} else if (lazy_erase_enabled && !usb_connected) {
+			// The host may write to the disk when it is connected.
+			if (usb_mass_storage_io_wait(STORAGE_IO_BACKGROUND, K_NO_WAIT) != 0) {
+				// The session writer or a read has the storage.
+				timeout = K_MSEC(SESSION_ERASER_RETRY_MS);
+			} else {
+				int res = _lazy_erase_next_block();
+				if (res == -EBUSY) {
+					timeout = K_MSEC(SESSION_ERASER_RETRY_MS);
+				} else if (res > 0) {
+					timeout = K_NO_WAIT;
+				}
+			}
+		}
+		k_mutex_unlock(&eraser_lock);
+
+		// Wait for the writer, or for the next idle window.
+		k_sem_take(&eraser_sem, timeout);
+	}
+}
+
+K_THREAD_DEFINE(session_eraser_thread, SESSION_ERASER_THREAD_STACK_SIZE, session_eraser_run, NULL, NULL, NULL, SESSION_ERASER_THREAD_PRIORITY, 0, 0);
+
+/* Allow the eraser thread to erase free clusters, while no session is recorded. Once disabled, no
+ * block is being erased anymore.
+ */
+void usb_mass_storage_set_lazy_erase(bool enable)
+{
+	k_mutex_lock(&eraser_lock, K_FOREVER);
+	lazy_erase_enabled = enable;
+	if (enable) {
+		// Sessions may have been deleted, check all the blocks again.
+		lazy_erase_block = 0;
+	}
+	k_mutex_unlock(&eraser_lock);
+	k_sem_give(&eraser_sem);
+}
+
+void usb_mass_storage_get_eraser_stats(session_eraser_stats_t *stats)
+{
+	memcpy(stats, &eraser_stats, sizeof(session_eraser_stats_t));
+}
+
+/* Write the session data directly to the extent, once its blocks are erased.
+ * Coherency: the only copies of the flash are the metadata cache and the read-ahead buffer, the
+ * data disk not going through the flash disk cache. Blocks written or erased directly must be
+ * dropped from the metadata cache, the read-ahead buffer being unused while recording.
+ */
+static int write_session_extent(const uint8_t *data, size_t len)
+{
+	size_t written = atomic_get(&session_extent.written);
+
+	int res = erase_session_extent(written + len);
+	if (res < 0) {
+		return res;
+	}
+	if (res > 0) {
+		// The eraser thread did not keep up, the writer waited for the erase.
+		eraser_stats.stalls++;
+	}
+
+	res = flash_area_write(data_fa, session_extent.start + written, data, len);
+	if (res != 0) {
+		LOG_ERR("Failed to write session data to flash (%i)", res);
+		return res;
+	}
+#ifdef CONFIG_STORAGE_META_CACHE
+	// The host or the emulator may have read the live session through the disk.
+	meta_cache_invalidate(session_extent.start + written, len);
+#endif
+
+	atomic_set(&session_extent.written, written + len);
+	k_sem_give(&eraser_sem);
+	return 0;
+}
+
+/* Stop writing directly to the extent, the rest of the session goes through the file system. */
+static void end_session_extent()
+{
+	k_mutex_lock(&eraser_lock, K_FOREVER);
+	session_extent.size = 0;
+	k_mutex_unlock(&eraser_lock);
+
+	int res = fs_seek(&current_session_file, atomic_get(&session_extent.written), FS_SEEK_SET);
+	if (res) {
+		LOG_ERR("Could not seek to the end of the session data (%i)", res);
+	}
+}
+#endif
+
+#ifdef CONFIG_SESSION_PREALLOCATE
+/* Allocate the session file as a contiguous extent, large enough for CONFIG_SESSION_PREALLOCATE_SECONDS
+ * of data at data_rate bytes per second, within CONFIG_SESSION_PREALLOCATE_FREE_PERCENT of the free space.
+ * The data is then written without updating the FAT, and the file is truncated when the session ends.
+ */
+static int preallocate_session_file(uint32_t data_rate)
+{
+	struct fs_statvfs sbuf;
+
+	int res = fs_statvfs(fs_mnt.mnt_point, &sbuf);
+	if (res < 0) {
+		LOG_ERR("FAIL: statvfs: %d", res);
+		return res;
+	}
+
+	uint64_t free_size = (uint64_t)sbuf.f_bfree * sbuf.f_frsize;
+	uint64_t size = MIN((uint64_t)data_rate * CONFIG_SESSION_PREALLOCATE_SECONDS,
+			    free_size * CONFIG_SESSION_PREALLOCATE_FREE_PERCENT / 100);
+	size = ROUND_DOWN(size, sbuf.f_frsize);
+	if (size == 0) {
+		return 0;
+	}
+
+	FRESULT fr = f_expand((FIL *)current_session_file.filep, size, 1);
+	if (fr != FR_OK) {
+		LOG_WRN("Unable to preallocate %llu bytes for the session (%i), the file grows as it is written", size, fr);
+		return -EIO;
+	}
+
+	LOG_INF("Preallocated %llu bytes for the session", size);
+	session_preallocated = true;
+
+#ifdef CONFIG_SESSION_PREERASE
+	// The extent is written directly when its blocks are erase blocks of the flash.
+	FIL *fp = (FIL *)current_session_file.filep;
+	FATFS *fs = fp->obj.fs;
+	off_t start = (off_t)(fs->database + (LBA_t)fs->csize * (fp->obj.sclust - 2)) * DATA_PARTITION_SECTOR_SIZE;
+	if (data_fa && start % DATA_PARTITION_ERASE_BLOCK_SIZE == 0) {
+#ifdef CONFIG_STORAGE_META_CACHE
+		// Sectors of deleted files cached there must not be written back over the session.
+		meta_cache_invalidate(start, ROUND_DOWN(size, DATA_PARTITION_ERASE_BLOCK_SIZE));
+#endif
+		k_mutex_lock(&eraser_lock, K_FOREVER);
+		session_extent.start = start;
+		session_extent.size = ROUND_DOWN(size, DATA_PARTITION_ERASE_BLOCK_SIZE);
+		session_extent.erased = 0;
+		atomic_set(&session_extent.written, 0);
+		k_mutex_unlock(&eraser_lock);
+		k_sem_give(&eraser_sem);
+	} else {
+		LOG_WRN("Session file is not aligned on erase blocks, format the storage to write it directly");
+	}
+#endif
+	return 0;
+}
+#endif
+
+#ifdef CONFIG_SESSION_LOG_STORE
+/* The session data is appended to a log on its own partition, only the session directory and its
+ * metadata are written to the FAT disk while recording. The log is copied to the session files
+ * before USB is enabled, so that the host finds them on the disk.
+ */
+static session_log_t session_log;
+static bool session_log_mounted = false;
+static bool session_in_log = false;
+
+static int _log_read(void *ctx, uint32_t offset, void *data, size_t len)
+{
+	return flash_area_read(ctx, offset, data, len);
+}
+
+static int _log_write(void *ctx, uint32_t offset, const void *data, size_t len)
+{
+	return flash_area_write(ctx, offset, data, len);
+}
+
+static int _log_erase(void *ctx, uint32_t offset, size_t len)
+{
+	return flash_area_erase(ctx, offset, len);
+}
+
+static session_log_flash_t session_log_flash = {
+	.read = _log_read,
+	.write = _log_write,
+	.erase = _log_erase,
+	.block_size = DATA_PARTITION_ERASE_BLOCK_SIZE,
+};
+
+static void setup_session_log(void)
+{
+	const struct flash_area *pfa;
+
+	int res = flash_area_open(SESSION_LOG_PARTITION_ID, &pfa);
+	if (res < 0) {
+		LOG_ERR("Failed to open session log partition (%i)", res);
+		return;
+	}
+
+	session_log_flash.ctx = (void *)pfa;
+	session_log_flash.size = ROUND_DOWN(pfa->fa_size, DATA_PARTITION_ERASE_BLOCK_SIZE);
+	res = session_log_mount(&session_log, &session_log_flash);
+	if (res < 0) {
+		LOG_ERR("Failed to mount session log (%i)", res);
+		flash_area_close(pfa);
+		return;
+	}
+
+	session_log_mounted = true;
+	LOG_INF("Session log mounted, %u blocks, head %u", session_log.nb_blocks, session_log.head);
+}
+
+/* Open the file of session, named by its START record, to write the data exported from the log
+ * from offset, the size of the data exported before. Whatever an interrupted export wrote past it
+ * is truncated, so that retrying does not duplicate records.
+ */
+static int open_exported_session(uint32_t session, const char *file_name, off_t offset, struct fs_file_t *f)
+{
+	char path[MAX_PATH];
+
+	snprintf(path, sizeof(path), "%s/%s%u", MOUNT_POINT, SESSION_DIR_NAME, session);
+	int res = fs_mkdir(path);
+	if (res != 0 && res != -EEXIST) {
+		LOG_ERR("Failed to create dir %s (%i)", path, res);
+		return res;
+	}
+
+	snprintf(path, sizeof(path), "%s/%s%u/%s", MOUNT_POINT, SESSION_DIR_NAME, session, file_name);
+	fs_file_t_init(f);
+	res = fs_open(f, path, FS_O_CREATE | FS_O_WRITE);
+	if (res != 0) {
+		LOG_ERR("Failed to open %s (%i)", path, res);
+		return res;
+	}
+
+	res = fs_truncate(f, offset);
+	res = res ? res : fs_seek(f, offset, FS_SEEK_SET);
+	if (res != 0) {
+		LOG_ERR("Failed to resume %s at %u (%i)", path, (uint32_t)offset, res);
+		fs_close(f);
+	}
+	return res;
+}
+
+/* Copy the records of the session log which have not been exported yet to their session files,
+ * and flag them as exported once the file is synced. Sessions whose START record has been
+ * overwritten are skipped.
+ * Returns the number of records exported, or a negative error code.
+ */
+int usb_mass_storage_export_session_log()
+{
+	static uint8_t buf[SESSION_LOG_EXPORT_BUFFER_SIZE];
+	static char file_name[MAX_PATH];
+	session_log_cursor_t cursor;
+	session_log_record_header_t hdr;
+	struct fs_file_t f;
+	bool named = false, opened = false;
+	uint32_t session = 0;
+	uint32_t offset = 0; // Data of the session exported before.
+	int exported = 0;
+	int res;
+
+	if (!session_log_mounted) {
+		return -ENODEV;
+	}
+	if (session_in_log || usb_connected) {
+		LOG_ERR("Unable to export the session log while recording or connected to USB");
+		return -EBUSY;
+	}
+
+	session_log_cursor_init(&session_log, &cursor);
+	while ((res = session_log_next(&session_log, &cursor, &hdr)) != -ENOENT) {
+		if (res == -EBADMSG) {
+			LOG_WRN("Skipping corrupted session log record at 0x%x", cursor.record);
+			continue;
+		}
+		if (res < 0) {
+			break;
+		}
+
+		if (hdr.type == SESSION_LOG_RECORD_START) {
+			if (opened) {
+				fs_close(&f);
+				opened = false;
+			}
+			// The file is only opened if some of its data was not exported yet.
+			session = hdr.session;
+			offset = 0;
+			named = hdr.len < sizeof(file_name) &&
+				session_log_read(&session_log, &cursor, 0, file_name, hdr.len) == 0;
+			file_name[named ? hdr.len : 0] = 0;
+		} else if (!named || hdr.session != session) {
+			continue;
+		} else if (!(hdr.flags & SESSION_LOG_FLAG_EXPORTED)) {
+			offset += hdr.len;
+			continue;
+		} else {
+			if (!opened) {
+				res = open_exported_session(session, file_name, offset, &f);
+				if (res < 0) {
+					break;
+				}
+				opened = true;
+			}
+			for (uint32_t done = 0; res >= 0 && done < hdr.len; done += sizeof(buf)) {
+				size_t len = MIN(sizeof(buf), hdr.len - done);
+				res = session_log_read(&session_log, &cursor, done, buf, len);
+				if (res == 0) {
+					ssize_t written = fs_write(&f, buf, len);
+					res = (written < 0) ? written : (written < len ? -ENOSPC : 0);
+				}
+			}
+			// The record is only flagged as exported once its data is on the disk.
+			res = res ? res : fs_sync(&f);
+			if (res < 0) {
+				LOG_ERR("Failed to export session %u (%i)", session, res);
+				break;
+			}
+			offset += hdr.len;
+		}
+
+		if (hdr.flags & SESSION_LOG_FLAG_EXPORTED) {
+			res = session_log_clear_flags(&session_log, &cursor, SESSION_LOG_FLAG_EXPORTED);
+			if (res < 0) {
+				break;
+			}
+			exported++;
+		}
+	}
+
+	if (opened) {
+		fs_close(&f);
+	}
+	if (res < 0 && res != -ENOENT) {
+		LOG_ERR("Failed to export the session log (%i)", res);
+		return res;
+	}
+
+	LOG_INF("%i session log records exported", exported);
+	return exported;
+}
+#endif
+
+/* Create a new session directory and file. When compressed is set, the data written to the session
+ * is compressed each time the write buffer is flushed, and the file gets the .LZ4 extension.
+ * data_rate is an upper estimate of the session data rate in bytes per second, used to
+ * preallocate the file, or 0.
+ */
+int usb_mass_storage_create_session(session_format_t format, bool compressed, uint32_t data_rate)
+{
+	struct fs_mount_t *mp = &fs_mnt;
+	memset(session_wr_buffer, 0, SESSION_WR_BUFFER_SIZE);
+	session_wr_buffer_len = 0;
+	session_data_len = 0;
+	session_compressed = false;
+#ifdef CONFIG_SESSION_SUMMARY
+	session_summary_started = false;
+#endif
+#ifdef CONFIG_SESSION_PREVIEW
+	session_preview_started = false;
+#endif
+	session_preallocated = false;
+	session_format = format;
+
+	read_ahead_set_recording(true);
+	meta_cache_set_recording(true);
+
+	// The writer thread is idle between sessions, the ring can be reset.
+	session_ring_init(&session_ring, session_ring_buf, sizeof(session_ring_buf));
+	memset(&writer_stats, 0, sizeof(writer_stats));
+	session_start_ms = k_uptime_get_32();
+	atomic_set(&writer_error, 0);
+
+	char path[MAX_PATH];
+
+	current_entry.nb = 0;
+	if (catalog_stale) {
+		// A valid header does not tell which SESSIONn directories the host added or deleted.
+		LOG_INF("Disk changed by USB, rebuilding the session catalog");
+		catalog_rebuild();
+		catalog_stale = false;
+	} else if (catalog_header.magic != SESSION_CATALOG_MAGIC) {
+		catalog_load();
+	}
+	if (catalog_header.magic != SESSION_CATALOG_MAGIC) {
+		LOG_ERR("Unable to get session number.");
+		return -ENOENT;
+	}
+	int nb = catalog_header.next_nb;
+	int res;
+
+	// The catalog gives the next number, a directory left by a catalog rebuilt without it is skipped.
+	do {
+		snprintf(path, sizeof(path), "%s/%s%d", mp->mnt_point, SESSION_DIR_NAME, nb);
+		res = fs_mkdir(path);
+	} while (res == -EEXIST && ++nb < catalog_header.next_nb + SESSION_CATALOG_MAX_SKIPPED);
+	if (res != 0){
+		LOG_ERR("Failed to create dir %s (%i)", path, res);
+		return res;
+	}
+
+	strncpy(current_session_dir, path, sizeof(current_session_dir));
+
+	const char *file_name = compressed ? SESSION_FILE_NAME SESSION_FILE_EXTENSION_LZ4 : session_file_names[format];
+#ifdef CONFIG_SESSION_LOG_STORE
+	if (session_log_mounted) {
+		// The file is created when the log is exported, under the name of the START record.
+		res = session_log_append(&session_log, SESSION_LOG_RECORD_START, nb, file_name, strlen(file_name));
+		session_in_log = (res == 0);
+		data_rate = 0;
+	} else
+#endif
+	{
+		res = usb_mass_storage_create_file(path, file_name, &current_session_file, true);
+	}
+	if (res != 0) {
+		LOG_ERR("Failed to create data_file %s (%i)", path, res);
+		return res;
+	}
+
+#ifdef CONFIG_SESSION_PREALLOCATE
+	if (data_rate) {
+		// Not fatal, the session is recorded in a file growing cluster by cluster instead.
+		preallocate_session_file(data_rate);
+	}
+#endif
+
+#ifdef CONFIG_SESSION_CRC
+	if (current_session_file.mp != NULL) {
+		session_crc_open(path);
+	}
+#endif
+#ifdef CONFIG_SESSION_INDEX
+	// Offsets in a compressed session would need its frames to be decompressed.
+	if (current_session_file.mp != NULL && !compressed && format != SESSION_FORMAT_RAW) {
+		session_index_open(path);
+	}
+#endif
+
+	// The magic is written with the first frames, so that chunks stay aligned in the file.
+	session_out_len = 0;
+	if (compressed) {
+		memcpy(session_out, SESSION_LZ4_MAGIC, strlen(SESSION_LZ4_MAGIC));
+		session_out_len = strlen(SESSION_LZ4_MAGIC);
+		session_compressed = true;
+	}
+
+	current_session_nb = nb;
+
+	current_entry = (session_catalog_entry_t){
+		.nb = nb,
+		.start_ms = k_uptime_get_32(),
+		.format = format,
+		.flags = compressed ? SESSION_CATALOG_FLAG_COMPRESSED : 0,
+	};
+	strncpy(current_entry.file_name, file_name, sizeof(current_entry.file_name) - 1);
+#ifdef CONFIG_SESSION_LOG_STORE
+	if (session_in_log) {
+		current_entry.flags |= SESSION_CATALOG_FLAG_LOG;
+	}
+#endif
+	session_samples = 0;
+	current_entry_index = catalog_header.count;
+	catalog_header.count++;
+	catalog_header.next_nb = nb + 1;
+	// Not fatal, the catalog is rebuilt from the directories if it does not match them.
+	if (catalog_write(SESSION_CATALOG_ENTRY_OFFSET(current_entry_index), &current_entry, sizeof(current_entry)) == 0) {
+		catalog_write(0, &catalog_header, sizeof(catalog_header));
+	}
+
+	return nb;
+}
+
+/* Write len bytes at the end of the session file, a whole chunk except at the end of the session. */
+static int write_session_file(const uint8_t *data, size_t len)
+{
+	int res;
+	uint32_t start = k_cycle_get_32();
+#ifdef CONFIG_SESSION_PREERASE
+	if (session_extent.size && atomic_get(&session_extent.written) + len > session_extent.size) {
+		end_session_extent();
+	}
+#endif
+#ifdef CONFIG_SESSION_LOG_STORE
+	if (session_in_log) {
+		res = session_log_append(&session_log, SESSION_LOG_RECORD_DATA, current_session_nb, data, len);
+	} else
+#endif
+#ifdef CONFIG_SESSION_PREERASE
+	if (session_extent.size) {
+		res = write_session_extent(data, len);
+	} else
+#endif
+	{
+		res = usb_mass_storage_write_to_file((char *)data, len, &current_session_file, false);
+	}
+	uint32_t write_us = k_cyc_to_us_floor32(k_cycle_get_32() - start);
+	if (res < 0) {
+		LOG_ERR("Failed to write data to current session file (%i)", res);
+		return res;
+	}
+
+#ifdef CONFIG_SESSION_CRC
+	session_crc_add(data, len);
+#endif
+
+	writer_stats.writes++;
+	writer_stats.bytes_written += len;
+	writer_stats.max_write_us = MAX(writer_stats.max_write_us, write_us);
+	writer_stats.total_write_us += write_us;
+
+#ifdef CONFIG_CHECK_SESSION_DATA_DURING
+	static char read[CONFIG_SESSION_WRITER_CHUNK_SIZE];
+
+#ifdef CONFIG_SESSION_LOG_STORE
+	if (session_in_log) {
+		// Each record is checked against its CRC when the log is exported.
+		return res;
+	}
+#endif
+
+#ifdef CONFIG_SESSION_PREERASE
+	if (session_extent.size) {
+		size_t written = atomic_get(&session_extent.written);
+		res = flash_area_read(data_fa, session_extent.start + written - len, read, len);
+		if (res != 0 || memcmp(read, data, len) != 0) {
+			LOG_ERR("Corrupted data (%i)", res);
+		}
+		return res;
+	}
+#endif
+
+	// The end of a preallocated file is not the end of the data, seek from the write position.
+	off_t pos = fs_tell(&current_session_file);
+	res= fs_seek(&current_session_file, pos - len, FS_SEEK_SET);
+	if (res) {
+		LOG_WRN("Could not seek current session file -%u from write position (%i)", len, res);
+	}
+	int size_read = fs_read(&current_session_file, read, len);
+	if (size_read < 0)
+	{
+		LOG_ERR("Error while reading from file");
+	}
+	if (memcmp(read, data, MAX(size_read, 0)) != 0){
+		LOG_ERR("Corrupted data");
+		LOG_HEXDUMP_ERR(read, size_read, "read");
+		LOG_HEXDUMP_ERR(data, size_read, "session chunk");
+	}
+	res = fs_seek(&current_session_file, pos, FS_SEEK_SET);
+	if (res) {
+		LOG_ERR("Could not seek back to write position (%i)", res);
+	}
+#endif
+
+	return res;
+}
+
+/* Write a chunk of the ring to the session file. For compressed sessions, the chunk is compressed
+ * in a frame, and the frames are written once they fill a chunk.
+ */
+static int write_session_chunk(const uint8_t *chunk, size_t len)
+{
+	if (!session_compressed) {
+		return write_session_file(chunk, len);
+	}
+
+	int res = session_lz4_frame(&session_lz4_ctx, chunk, len, &session_out[session_out_len]);
+	if (res < 0) {
+		LOG_ERR("Failed to compress session data (%i)", res);
+		return res;
+	}
+	session_out_len += res;
+
+	while (session_out_len >= CONFIG_SESSION_WRITER_CHUNK_SIZE) {
+		res = write_session_file(session_out, CONFIG_SESSION_WRITER_CHUNK_SIZE);
+		// Carry the rest over to the next chunk, even on error to keep the frames whole.
+		session_out_len -= CONFIG_SESSION_WRITER_CHUNK_SIZE;
+		memmove(session_out, &session_out[CONFIG_SESSION_WRITER_CHUNK_SIZE], session_out_len);
+		if (res < 0) {
+			return res;
+		}
+	}
+	return 0;
+}
+
+#ifdef CONFIG_SESSION_FLASH_POWER_DOWN
+/* With runtime power management, the flash driver puts the flash in deep power-down whenever it
+ * is not used. The writer keeps it awake for a whole burst, instead of waking it for each write.
+ */
+static const struct device *const data_flash_dev = DEVICE_DT_GET(DT_CHOSEN(nordic_pm_ext_flash));
+
+static void setup_flash_power_down()
+{
+	int res = pm_device_runtime_enable(data_flash_dev);
+	if (res != 0) {
+		LOG_WRN("Unable to power the flash down between writes (%i)", res);
+	}
+}
+#endif
+
+static uint32_t flash_burst_start;
+
+static void flash_burst_begin()
+{
+#ifdef CONFIG_SESSION_FLASH_POWER_DOWN
+	pm_device_runtime_get(data_flash_dev);
+#endif
+	flash_burst_start = k_cycle_get_32();
+}
+
+static void flash_burst_end()
+{
+	writer_stats.bursts++;
+	writer_stats.flash_awake_us += k_cyc_to_us_floor32(k_cycle_get_32() - flash_burst_start);
+#ifdef CONFIG_SESSION_FLASH_POWER_DOWN
+	pm_device_runtime_put(data_flash_dev);
+#endif
+}
+
+/* Estimate the energy used by the flash during a session of duration_ms, in nJ: the time it was
+ * awake for the bursts at the active current, the rest at the deep power-down current, or at the
+ * standby current when power_down is not set.
+ */
+uint64_t usb_mass_storage_flash_energy_nj(const session_writer_stats_t *stats, uint32_t duration_ms, bool power_down)
+{
+	uint64_t awake_us = stats->flash_awake_us;
+	uint64_t total_us = MAX((uint64_t)duration_ms * 1000, awake_us);
+	uint32_t idle_ua = power_down ? SESSION_FLASH_DPD_UA : SESSION_FLASH_STANDBY_UA;
+
+	// mV * uA * us = fJ.
+	return ((uint64_t)SESSION_FLASH_ACTIVE_UA * awake_us + (uint64_t)idle_ua * (total_us - awake_us)) *
+	       SESSION_FLASH_VOLTAGE_MV / 1000000;
+}
+
+#ifdef CONFIG_STORAGE_IO_SCHEDULER
+/* Reads wait for the session writer while it writes, or while its ring fills up, so that they never
+ * make it drop session data. Background I/O also waits for the reads. The file system serializes
+ * the I/O itself: the scheduler only decides who gets it next, one read or erase at a time.
+ */
+#define STORAGE_IO_READ_THROTTLE_LEVEL \
+	MAX(CONFIG_SESSION_WRITER_RING_SIZE / 100 * CONFIG_STORAGE_IO_READ_THROTTLE, CONFIG_SESSION_WRITER_CHUNK_SIZE)
+
+K_MUTEX_DEFINE(io_lock);
+K_CONDVAR_DEFINE(io_cond);
+static bool io_writing;		// Protected by io_lock.
+static uint32_t io_reads_waiting; // Protected by io_lock.
+static storage_io_stats_t io_stats;
+
+/* Call with io_lock. */
+static bool _io_may_run(storage_io_class_t io_class)
+{
+	size_t used = session_ring_used(&session_ring);
+
+	switch (io_class) {
+	case STORAGE_IO_INTERACTIVE:
+		return !io_writing && used < STORAGE_IO_READ_THROTTLE_LEVEL;
+	case STORAGE_IO_BACKGROUND:
+		return !io_writing && used < CONFIG_SESSION_WRITER_CHUNK_SIZE && io_reads_waiting == 0;
+	default:
+		return true;
+	}
+}
+
+/* Wait until I/O of io_class may run, for at most timeout. Returns 0, or -EAGAIN when it still
+ * has to wait.
+ */
+int usb_mass_storage_io_wait(storage_io_class_t io_class, k_timeout_t timeout)
+{
+	k_timepoint_t end = sys_timepoint_calc(timeout);
+	int res = 0;
+
+	k_mutex_lock(&io_lock, K_FOREVER);
+	if (_io_may_run(io_class)) {
+		k_mutex_unlock(&io_lock);
+		return 0;
+	}
+
+	int64_t start = k_uptime_get();
+	io_stats.waits[io_class]++;
+	if (io_class == STORAGE_IO_INTERACTIVE) {
+		io_reads_waiting++;
+	}
+	while (!_io_may_run(io_class)) {
+		if (k_condvar_wait(&io_cond, &io_lock, sys_timepoint_timeout(end)) != 0) {
+			res = _io_may_run(io_class) ? 0 : -EAGAIN;
+			break;
+		}
+	}
+	if (io_class == STORAGE_IO_INTERACTIVE) {
+		io_reads_waiting--;
+		// Background I/O may run once no read waits.
+		k_condvar_broadcast(&io_cond);
+	}
+	if (res != 0 && !K_TIMEOUT_EQ(timeout, K_NO_WAIT)) {
+		io_stats.timeouts++;
+	}
+	io_stats.max_wait_ms = MAX(io_stats.max_wait_ms, (uint32_t)(k_uptime_get() - start));
+	k_mutex_unlock(&io_lock);
+	return res;
+}
+
+/* Writer thread: hold the other I/O back while the ring is written. */
+static void io_set_writing(bool writing)
+{
+	k_mutex_lock(&io_lock, K_FOREVER);
+	io_writing = writing;
+	if (!writing) {
+		k_condvar_broadcast(&io_cond);
+	}
+	k_mutex_unlock(&io_lock);
+}
+
+void usb_mass_storage_get_io_stats(storage_io_stats_t *stats)
+{
+	k_mutex_lock(&io_lock, K_FOREVER);
+	memcpy(stats, &io_stats, sizeof(storage_io_stats_t));
+	k_mutex_unlock(&io_lock);
+}
+#else
+int usb_mass_storage_io_wait(storage_io_class_t io_class, k_timeout_t timeout)
+{
+	return 0;
+}
+
+static void io_set_writing(bool writing)
+{
+}
+
+void usb_mass_storage_get_io_stats(storage_io_stats_t *stats)
+{
+	memset(stats, 0, sizeof(storage_io_stats_t));
+}
+#endif
+
+/* Write the ring to the session file in chunks of CONFIG_SESSION_WRITER_CHUNK_SIZE, so that the
+ * producer never waits for the flash. The ring size being a multiple of the chunk size, chunks
+ * never wrap around and every write is a whole chunk at an offset multiple of the chunk size in
+ * the file: FatFs and the disk cache then never read, modify and write back a partial sector or
+ * erase block. Only when the session ends is the rest of the ring written.
+ */
+static void session_writer_run(void *p1, void *p2, void *p3)
+{
+	for (;;) {
+#ifdef CONFIG_SESSION_BURST_WRITE
+		// The producer wakes the writer once a burst is ready, the timeout bounds the time whole
+		// chunks wait in RAM, lost on a reset.
+		k_sem_take(&writer_sem, K_MSEC(CONFIG_SESSION_BURST_MAX_DELAY_MS));
+#else
+		k_sem_take(&writer_sem, K_FOREVER);
+#endif
+
+		// Read the flag before the ring, everything pushed before it was set is written.
+		atomic_val_t flush = atomic_get(&writer_flush);
+		size_t min_len = (flush == SESSION_WRITER_FLUSH_ALL) ? 1 : CONFIG_SESSION_WRITER_CHUNK_SIZE;
+		if (!flush && session_ring_used(&session_ring) < min_len) {
+			continue;
+		}
+
+		io_set_writing(true);
+		flash_burst_begin();
+
+		while (session_ring_used(&session_ring) >= min_len) {
+			const uint8_t *data;
+			size_t len = MIN(session_ring_peek(&session_ring, &data), CONFIG_SESSION_WRITER_CHUNK_SIZE);
+
+			int res = write_session_chunk(data, len);
+			if (res < 0) {
+				// Reported to the producer on its next flush, which ends the session.
+				atomic_set(&writer_error, res);
+			}
+			session_ring_consume(&session_ring, len);
+		}
+
+#ifdef CONFIG_SESSION_INDEX
+		sidecar_write(&session_index_sidecar, flush == SESSION_WRITER_FLUSH_ALL);
+#endif
+#ifdef CONFIG_SESSION_PREVIEW
+		for (int ii = 0; ii < SESSION_PREVIEW_LEVELS; ii++) {
+			sidecar_write(&session_preview_sidecars[ii], flush == SESSION_WRITER_FLUSH_ALL);
+		}
+#endif
+
+		if (flush == SESSION_WRITER_FLUSH_ALL && session_out_len > 0) {
+			int res = write_session_file(session_out, session_out_len);
+			if (res < 0) {
+				atomic_set(&writer_error, res);
+			}
+			session_out_len = 0;
+		}
+
+		flash_burst_end();
+		io_set_writing(false);
+
+		if (flush) {
+			atomic_set(&writer_flush, 0);
+			k_sem_give(&writer_drained_sem);
+		}
+	}
+}
+
+K_THREAD_DEFINE(session_writer_thread, SESSION_WRITER_THREAD_STACK_SIZE, session_writer_run, NULL, NULL, NULL, SESSION_WRITER_THREAD_PRIORITY, 0, 0);
+
+/* Move as much of the session buffer as the ring can take, and wake the writer thread once a
+ * chunk is ready. What does not fit stays at the start of the buffer for the next flush.
+ */
+static int flush_session_buffer()
+{
+	int res = atomic_get(&writer_error);
+	if (res < 0) {
+		return res;
+	}
+
+	if (session_wr_buffer_len == 0) {
+		return 0;
+	}
+
+	// Only the writer thread changes the space, it can only grow before the put.
+	size_t len = MIN(session_wr_buffer_len, session_ring_space(&session_ring));
+	if (len < session_wr_buffer_len) {
+		writer_stats.stalls++;
+	}
+	if (len > 0) {
+		session_ring_put(&session_ring, session_wr_buffer, len);
+		session_wr_buffer_len -= len;
+		memmove(session_wr_buffer, &session_wr_buffer[len], session_wr_buffer_len);
+	}
+
+	size_t used = session_ring_used(&session_ring);
+	writer_stats.ring_high_water = MAX(writer_stats.ring_high_water, used);
+	if (used >= SESSION_WRITER_WAKE_LEVEL) {
+		k_sem_give(&writer_sem);
+	}
+	return 0;
+}
+
+/* Wait for the writer thread to write the whole chunks of the ring, or everything with all. */
+static void drain_session_ring(bool all)
+{
+	atomic_set(&writer_flush, all ? SESSION_WRITER_FLUSH_ALL : SESSION_WRITER_FLUSH_CHUNKS);
+	k_sem_give(&writer_sem);
+	k_sem_take(&writer_drained_sem, K_FOREVER);
+}
+
+/* True when the ring is filling up faster than the writer thread empties it. The producer should
+ * then hold its data back where it can, instead of having it dropped by the next writes.
+ */
+bool usb_mass_storage_session_backpressure()
+{
+	return session_ring_used(&session_ring) >= SESSION_WRITER_BACKPRESSURE_LEVEL;
+}
+
+/* Count len bytes of session data that could not be stored. */
+void usb_mass_storage_session_drop(size_t len)
+{
+	if (writer_stats.lost_bytes == 0) {
+		LOG_WRN("Session writer is too slow, dropping session data");
+	}
+	writer_stats.drops++;
+	writer_stats.lost_bytes += len;
+}
+
+void usb_mass_storage_get_writer_stats(session_writer_stats_t *stats)
+{
+	memcpy(stats, &writer_stats, sizeof(session_writer_stats_t));
+	if (current_session_file.mp != NULL) {
+		stats->duration_ms = k_uptime_get_32() - session_start_ms;
+	}
+}
+
+int usb_mass_storage_end_current_session(){
+	// Write the end of the session, which has not reached the flush threshold.
+	// The ring may not take all of it before the writer thread has written its whole chunks.
+	int flush_res = flush_session_buffer();
+	while (flush_res == 0 && session_wr_buffer_len > 0) {
+		drain_session_ring(false);
+		flush_res = flush_session_buffer();
+	}
+	drain_session_ring(true);
+	if (flush_res == 0) {
+		flush_res = atomic_get(&writer_error);
+	}
+	if (flush_res < 0) {
+		LOG_ERR("Failed to write the end of the session (%i)", flush_res);
+	}
+
+	LOG_INF("Session written in %u chunks (%u bytes, %u us max per chunk), ring high-water mark %u bytes, %u stalls",
+		writer_stats.writes, writer_stats.bytes_written, writer_stats.max_write_us,
+		writer_stats.ring_high_water, writer_stats.stalls);
+	writer_stats.duration_ms = k_uptime_get_32() - session_start_ms;
+	if (writer_stats.bytes_written) {
+		LOG_INF("Flash awake %u ms in %u bursts, about %u nJ per byte stored",
+			(uint32_t)(writer_stats.flash_awake_us / 1000), writer_stats.bursts,
+			(uint32_t)(usb_mass_storage_flash_energy_nj(&writer_stats, writer_stats.duration_ms,
+							 IS_ENABLED(CONFIG_SESSION_FLASH_POWER_DOWN)) /
+				writer_stats.bytes_written);
+	}
+	if (writer_stats.lost_bytes) {
+		LOG_WRN("%u bytes of session data lost in %u writes", writer_stats.lost_bytes, writer_stats.drops);
+	}
+	catalog_close_session();
+#ifdef CONFIG_SESSION_CRC
+	session_crc_close();
+#endif
+#ifdef CONFIG_SESSION_INDEX
+	sidecar_close(&session_index_sidecar);
+#endif
+#ifdef CONFIG_SESSION_PREVIEW
+	session_preview_close();
+#endif
+#ifdef CONFIG_SESSION_SUMMARY
+	session_summary_write();
+#endif
+
+	read_ahead_set_recording(false);
+	meta_cache_set_recording(false);
+
+	// Take a semaphore in order to prevent end session to happen during a write.
 	if (k_sem_take(&write_sem, K_FOREVER) != 0) {
         LOG_ERR("Semaphore not available!");
 		return -EINPROGRESS;
     }
 
+#ifdef CONFIG_SESSION_LOG_STORE
+	if (session_in_log) {
+		// No file to close, the log is written as it goes.
+		session_in_log = false;
+		k_sem_give(&write_sem);
+		return 0;
+	}
+#endif
+
+#ifdef CONFIG_SESSION_PREERASE
+	if (session_extent.size) {
+		// Position the file after the data written directly.
+		end_session_extent();
+	}
+#endif
+
+	if (session_preallocated) {
+		// Give back the space preallocated after the data.
+		int res = fs_truncate(&current_session_file, fs_tell(&current_session_file));
+		if (res != 0) {
+			LOG_ERR("Unable to truncate session file (%i)", res);
+		}
+	}
+
 #ifdef CONFIG_CHECK_SESSION_DATA_AFTER
 	char read[SESSION_WR_BUFFER_THRESHOLD];
 
 	k_msleep(1000);
 
-	int size_read;
-	if (fs_seek(&current_session_file, 0, FS_SEEK_SET)){
-		LOG_ERR("error when seeking");
-	}
-	do {
-		size_read = fs_read(&current_session_file, read, SESSION_WR_BUFFER_THRESHOLD);
-		for (int ii = 0; ii < size_read; ii++) {
-			if (read[ii] == 0xFF) {
-				LOG_ERR("Corrupted data before closing file");
-				break;
-			}
+	// Erased flash (0xFF) can only be told apart from the data of text sessions.
+	if (!session_compressed && session_format == SESSION_FORMAT_CSV) {
+		int size_read;
+		if (fs_seek(&current_session_file, 0, FS_SEEK_SET)){
+			LOG_ERR("error when seeking");
 		}
-	} while (size_read == SESSION_WR_BUFFER_THRESHOLD);
+		do {
+			size_read = fs_read(&current_session_file, read, SESSION_WR_BUFFER_THRESHOLD);
+			for (int ii = 0; ii < size_read; ii++) {
+				if (read[ii] == 0xFF) {
+					LOG_ERR("Corrupted data before closing file");
+					break;
+				}
+			}
+		} while (size_read == SESSION_WR_BUFFER_THRESHOLD);
+	}
 #endif
 
 	int res = fs_close(&current_session_file);
@@ -489,59 +2712,167 @@ int usb_mass_storage_end_current_session(){
 		LOG_WRN("Unable to close acc file (%i)", res);
 		return res;
 	}
+	// The session is complete on the flash once its metadata is.
+	meta_cache_flush();
 
 	k_sem_give(&write_sem);
 	return 0;
 }
 
-int usb_mass_storage_write_to_current_session(char* data, size_t len){
-	int res = 0;
+/* Get a pointer to at least len free bytes in the session write buffer, so that data can be
+ * formatted in place. The data is added to the session by usb_mass_storage_session_commit.
+ * Returns NULL when neither the buffer nor the ring have room left: the data should then be
+ * counted with usb_mass_storage_session_drop, and the session can go on.
+ */
+char* usb_mass_storage_session_reserve(size_t len)
+{
+	if (session_wr_buffer_len + len >= SESSION_WR_BUFFER_SIZE)
+	{
+		// Make room by moving what the ring can take.
+		flush_session_buffer();
+	}
 
 	if (session_wr_buffer_len + len >= SESSION_WR_BUFFER_SIZE)
 	{
-		LOG_ERR("Write buffer too small to fit incoming data! Resetting buffer.");
-		session_wr_buffer_len = 0;
-		return -E2BIG;
+		return NULL;
 	}
 
-	memcpy(&session_wr_buffer[session_wr_buffer_len], data, len);
-	session_wr_buffer_len += len;
+	return &session_wr_buffer[session_wr_buffer_len];
+}
 
-	if (session_wr_buffer_len >= SESSION_WR_BUFFER_THRESHOLD)
-	{
-		res = usb_mass_storage_write_to_file(session_wr_buffer, session_wr_buffer_len, &current_session_file, false);
+/* Add data to the session, all of it or none. Returns -ENOBUFS when the buffer and the ring have
+ * no room for it: the data is counted as lost, and the session can go on.
+ */
+int usb_mass_storage_write_to_current_session(char* data, size_t len){
+	// Each flush moves what the ring can take, so everything fits if there is room for it now.
+	if (len > session_ring_space(&session_ring) + SESSION_WR_BUFFER_SIZE - 1 - session_wr_buffer_len) {
+		usb_mass_storage_session_drop(len);
+		return -ENOBUFS;
+	}
+
+	// Data larger than the room left after a flush is written in several chunks.
+	while (len > 0) {
+		size_t chunk = MIN(len, SESSION_WR_BUFFER_SIZE - SESSION_WR_BUFFER_THRESHOLD - 1);
+		char *p = usb_mass_storage_session_reserve(chunk);
+		if (p == NULL) {
+			return -E2BIG;
+		}
+
+		memcpy(p, data, chunk);
+		int res = usb_mass_storage_session_commit(chunk);
 		if (res < 0) {
-			LOG_ERR("Failed to write data to current session file (%i)", res);
 			return res;
 		}
+		data += chunk;
+		len -= chunk;
+	}
+	return 0;
+}
 
-#ifdef CONFIG_CHECK_SESSION_DATA_AFTER
-		char read[SESSION_WR_BUFFER_SIZE];
+int usb_mass_storage_session_commit(size_t len){
+	session_wr_buffer_len += len;
+	session_data_len += len;
 
-		res= fs_seek(&current_session_file, -session_wr_buffer_len, FS_SEEK_END);
-		if (res) {
-			LOG_WRN("Could not seek current session file -SESSION_WR_BUFFER_THRESHOLD from end of file (%i)", res);
-		}
-		int size_read = fs_read(&current_session_file, read, session_wr_buffer_len);
-		if (size_read < 0)
-		{
-			LOG_ERR("Error while reading from file");
-		}
-		if (strncmp(read, session_wr_buffer, size_read) != 0){
-			LOG_ERR("Corrupted data");
-			LOG_HEXDUMP_ERR(read, size_read, "read");
-			LOG_HEXDUMP_ERR(session_wr_buffer, size_read, "session_wr_buffer");
-		}
-		res = fs_seek(&current_session_file, 0, FS_SEEK_END);
-		if (res) {
-			LOG_ERR("Could not seek back to end of file (%i)", res);
+	if (session_wr_buffer_len >= SESSION_WR_BUFFER_THRESHOLD)
+	{
+		return flush_session_buffer();
+	}
+
+	return 0;
+}
+
+/* Write a metadata file next to the current session file, describing how the session was recorded. */
+int usb_mass_storage_write_session_metadata(char* data, size_t len)
+{
+	struct fs_file_t f;
+
+	int res = usb_mass_storage_create_file(current_session_dir, SESSION_META_FILE_NAME, &f, true);
+	if (res != 0) {
+		LOG_ERR("Failed to create metadata file in %s (%i)", current_session_dir, res);
+		return res;
+	}
+
+	res = usb_mass_storage_write_to_file(data, len, &f, true);
+	if (res != 0) {
+		LOG_ERR("Failed to write metadata file (%i)", res);
+	}
+
+	int close_res = usb_mass_storage_close_file(&f);
+	return (res != 0 ? res : close_res);
+}
+
+/* Format the data partition for sessions: a single FAT to update, clusters of
+ * CONFIG_SESSION_FAT_CLUSTER_SIZE and a data area aligned on the erase blocks of the flash.
+ */
+int usb_mass_storage_format()
+{
+	MKFS_PARM parm = {
+		.fmt = FM_ANY | FM_SFD,
+		.n_fat = 1,
+		.align = DATA_PARTITION_ERASE_BLOCK_SIZE / DATA_PARTITION_SECTOR_SIZE,
+		.au_size = CONFIG_SESSION_FAT_CLUSTER_SIZE,
+	};
+
+	if (current_session_file.mp != NULL) {
+		LOG_ERR("Unable to format storage during a session");
+		return -EBUSY;
+	}
+#ifdef CONFIG_SESSION_LOG_STORE
+	if (session_in_log) {
+		LOG_ERR("Unable to format storage during a session");
+		return -EBUSY;
+	}
+#endif
+	// Like the lazy eraser, leave the disk alone while the host has it mounted and caches its FAT.
+	if (usb_connected) {
+		LOG_ERR("Unable to format storage while connected to USB");
+		return -EBUSY;
+	}
+
+#ifdef CONFIG_SESSION_PREERASE
+	k_mutex_lock(&eraser_lock, K_FOREVER);
+	lazy_erase_block = 0;
+#endif
+	int res = fs_unmount(&fs_mnt);
+	if (res < 0) {
+		LOG_ERR("Failed to unmount filesystem (%i)", res);
+#ifdef CONFIG_SESSION_PREERASE
+		k_mutex_unlock(&eraser_lock);
+#endif
+		return res;
+	}
+
+	// The disk is named after the mount point, without the leading slash.
+	res = fs_mkfs(FS_FATFS, (uintptr_t)&MOUNT_POINT[1], &parm, 0);
+	if (res < 0) {
+		LOG_ERR("Failed to format storage (%i)", res);
+	} else {
+		res = meta_cache_flush();
+	}
+
+	int mount_res = mount_app_fs(&fs_mnt);
+#ifdef CONFIG_SESSION_PREERASE
+	k_mutex_unlock(&eraser_lock);
+#endif
+#ifdef CONFIG_SESSION_LOG_STORE
+	if (res == 0 && session_log_mounted) {
+		// The sessions of the log are erased with the others.
+		res = session_log_clear(&session_log);
+		if (res < 0) {
+			LOG_ERR("Failed to clear the session log (%i)", res);
 		}
+	}
 #endif
+	if (mount_res < 0) {
+		LOG_ERR("Failed to mount filesystem (%i)", mount_res);
+		return mount_res;
+	}
 
-		// Resetting buffer after writing it to flash
-		session_wr_buffer_len = 0;
+	if (res == 0) {
+		res = catalog_rebuild();
 	}
 
+	LOG_INF("Storage formatted with %u bytes clusters", CONFIG_SESSION_FAT_CLUSTER_SIZE);
 	return res;
 }
 
@@ -601,10 +2932,24 @@ static void udc_status_cb(enum usb_dc_status_code status, const uint8_t *param)
 	{
 	case USB_DC_CONNECTED:
 		LOG_INF("My USB device connected");
+		usb_connected = true;
+		catalog_stale = true;
+		k_mutex_lock(&data_disk_lock, K_FOREVER);
+		memset(&read_stats, 0, sizeof(read_stats));
+		k_mutex_unlock(&data_disk_lock);
+		read_ahead_set_usb(true);
 		break;
 
 	case USB_DC_DISCONNECTED:
 		LOG_INF("My USB device disconnected");
+		usb_connected = false;
+		read_ahead_set_usb(false);
+		// Unplugged, the device may lose power at any time.
+		meta_cache_flush();
+#ifdef CONFIG_SESSION_PREERASE
+		// The host may have deleted sessions.
+		usb_mass_storage_set_lazy_erase(lazy_erase_enabled);
+#endif
 		break;
 
 	case USB_DC_CONFIGURED:
@@ -621,13 +2966,56 @@ static void udc_status_cb(enum usb_dc_status_code status, const uint8_t *param)
 
 int usb_mass_storage_create_fit_example_file(){
 	fs_file_t_init(&fit_file);
+#ifdef CONFIG_SESSION_PREERASE
+	// Clusters allocated to the file look free until it is closed.
+	k_mutex_lock(&eraser_lock, K_FOREVER);
+#endif
 	fit_sdk_test(&fit_file, "/NAND:/TEST.FIT", FS_O_CREATE | FS_O_RDWR);
+#ifdef CONFIG_SESSION_PREERASE
+	k_mutex_unlock(&eraser_lock);
+#endif
 	return 0;
 }
 
+#if defined(CONFIG_MCUMGR_GRP_FS_FILE_ACCESS_HOOK) && defined(CONFIG_STORAGE_IO_SCHEDULER)
+/* MCUmgr file transfers are interactive I/O. A request which waits too long fails with a busy
+ * error, which the client retries.
+ */
+static enum mgmt_cb_return fs_mgmt_access_cb(uint32_t event, enum mgmt_cb_return prev_status, int32_t *rc,
+					     uint16_t *group, bool *abort_more, void *data, size_t data_size)
+{
+	if (usb_mass_storage_io_wait(STORAGE_IO_INTERACTIVE, K_MSEC(CONFIG_STORAGE_IO_TRANSFER_TIMEOUT_MS)) != 0) {
+		*rc = MGMT_ERR_EBUSY;
+		return MGMT_CB_ERROR_RC;
+	}
+	return MGMT_CB_OK;
+}
+
+static struct mgmt_callback fs_mgmt_access_callback = {
+	.callback = fs_mgmt_access_cb,
+	.event_id = MGMT_EVT_OP_FS_MGMT_FILE_ACCESS,
+};
+#endif
+
 int usb_mass_storage_init() {
 
-	setup_disk();
+	int res = setup_disk();
+	if (res < 0) {
+		return res;
+	}
+
+#ifdef CONFIG_SESSION_LOG_STORE
+	// Before the host can see the disk.
+	setup_session_log();
+	usb_mass_storage_export_session_log();
+#endif
+	catalog_load();
+#ifdef CONFIG_SESSION_FLASH_POWER_DOWN
+	setup_flash_power_down();
+#endif
+#if defined(CONFIG_MCUMGR_GRP_FS_FILE_ACCESS_HOOK) && defined(CONFIG_STORAGE_IO_SCHEDULER)
+	mgmt_callback_register(&fs_mgmt_access_callback);
+#endif
 
 #if CONFIG_USB_DEVICE_INITIALIZE_AT_BOOT == 0
 	int ret = usb_enable(udc_status_cb);
@@ -1,17 +1,35 @@
 #pragma once
 
+#include <zephyr/kernel.h>
 #include <zephyr/storage/flash_map.h>
 #include <zephyr/fs/fs.h>
+#include <app/lib/session_codec.h>
+#include <app/lib/session_reader.h>
+#include <app/lib/session_index.h>
+#include <app/lib/session_summary.h>
+#include <app/lib/session_preview.h>
+#include <app/lib/session_meta_cache.h>
 
 #define MOUNT_POINT "/NAND:"
+#define DATA_DISK_NAME "NAND"		// Used by the file system and USB, through the metadata cache.
+#define DATA_FLASH_DISK_NAME "FLASH"	// The zephyr,flash-disk of the data partition.
 
 #define DATA_PARTITION		data_partition
 #define DATA_PARTITION_ID	FIXED_PARTITION_ID(DATA_PARTITION)
+#define DATA_PARTITION_SECTOR_SIZE		512
+#define DATA_PARTITION_ERASE_BLOCK_SIZE	4096
+#define SESSION_LOG_PARTITION		session_log_partition
+#define SESSION_LOG_PARTITION_ID	FIXED_PARTITION_ID(SESSION_LOG_PARTITION)
+#define SESSION_LOG_EXPORT_BUFFER_SIZE	256
+#define SESSION_READER_BUFFER_SIZE	4096
 #define SESSION_DIR_NAME		"SESSION"
 #define MAX_PATH				128
 
 #define SESSION_FILE_NAME		"SESSION"
 #define SESSION_FILE_EXTENSION	".CSV"
+#define SESSION_FILE_EXTENSION_RAW	".RAW"
+#define SESSION_FILE_EXTENSION_BIN	".BIN"
+#define SESSION_FILE_EXTENSION_LZ4	".LZ4"
 #define SESSION_FILE_HEADER_SIMPLE		"ts,ax,ay,az,gx,gy,gz"
 #define SESSION_FILE_HEADER_SFLP		",grotx,groty,grotz,grotw,gravx,gravy,gravz"
 #define SESSION_FILE_HEADER_QVAR		",qvar"
@@ -19,6 +37,37 @@
 #define SESSION_FILE_NB_COLUMN_SIMPLE	7
 #define SESSION_FILE_NB_COLUMN_SFLP		14
 
+/* Flags stored in the raw capture header, describing the CSV the FIFO words decode to. */
+#define SESSION_RAW_FLAG_SFLP			BIT(0)
+#define SESSION_RAW_FLAG_QVAR			BIT(1)
+#define SESSION_RAW_FLAG_SFLP_HEADER	BIT(2)
+#define SESSION_RAW_FLAG_QVAR_HEADER	BIT(3)
+
+#define SESSION_META_FILE_NAME	"META.TXT"
+#define SESSION_META_SIZE		256
+
+#define SESSION_CRC_FILE_NAME		"SESSION.CRC"
+#define SESSION_CRC_MAGIC			"XCRC"
+#define SESSION_CRC_BUFFER_ENTRIES	256
+#define SESSION_VERIFY_BUFFER_SIZE	256
+#define SESSION_INDEX_FILE_NAME		"SESSION.IDX"
+#define SESSION_INDEX_RING_SIZE		512 // Power of two.
+#define SESSION_SUMMARY_FILE_NAME	"SESSION.SUM"
+#define SESSION_PREVIEW_FILE_NAMES	{"PREV16.BIN", "PREV256.BIN"} // One per level.
+#define SESSION_PREVIEW_RING_SIZE	4096 // Power of two, a level 0 window every 16 samples.
+#define SESSION_PREVIEW_TOP_RING_SIZE	512 // Power of two, a level 1 window every 256 samples.
+
+#define SESSION_CATALOG_FILE_NAME	"SESSIONS.CAT"
+#define SESSION_CATALOG_MAGIC		0x54414353 // "SCAT"
+#define SESSION_CATALOG_VERSION		1
+#define SESSION_CATALOG_FILE_NAME_SIZE	14
+#define SESSION_CATALOG_MAX_SKIPPED		16
+
+/* Flags of a session catalog entry. */
+#define SESSION_CATALOG_FLAG_COMPRESSED	BIT(0)
+#define SESSION_CATALOG_FLAG_CLOSED		BIT(1) // Ended by the device, duration and samples are known.
+#define SESSION_CATALOG_FLAG_LOG		BIT(2) // Recorded to the session log.
+
 #define CALIBRATION_FILE_NAME	"CAL.TXT"
 #define CALIBRATION_FILE_SIZE	29
 #define CALIBRATION_DATA_SIZE	7
@@ -29,18 +78,153 @@
 #define SESSION_WR_BUFFER_SIZE 2048
 #define SESSION_WR_BUFFER_THRESHOLD 1024
 
+#define SESSION_WRITER_THREAD_STACK_SIZE 2048
+#define SESSION_WRITER_THREAD_PRIORITY 6
+#define SESSION_WRITER_BACKPRESSURE_LEVEL (CONFIG_SESSION_WRITER_RING_SIZE * 3 / 4)
+#ifdef CONFIG_SESSION_BURST_WRITE
+#define SESSION_WRITER_WAKE_LEVEL CONFIG_SESSION_BURST_SIZE // Bytes in the ring waking the writer.
+#else
+#define SESSION_WRITER_WAKE_LEVEL CONFIG_SESSION_WRITER_CHUNK_SIZE
+#endif
+#define SESSION_ERASER_THREAD_STACK_SIZE 1024
+#define SESSION_ERASER_THREAD_PRIORITY K_LOWEST_APPLICATION_THREAD_PRIO
+#define SESSION_ERASER_RETRY_MS 100 // Between two tries of a deferred background erase.
+#define SESSION_ERASER_SETTLE_MS 1000 // Without file system writes before free clusters are erased.
+
+#define SESSION_WRITER_FLUSH_CHUNKS 1
+#define SESSION_WRITER_FLUSH_ALL 2
+
+// Typical supply currents of the QSPI flash, for the energy estimates.
+#define SESSION_FLASH_ACTIVE_UA 20000 // Programming or erasing.
+#define SESSION_FLASH_STANDBY_UA 10
+#define SESSION_FLASH_DPD_UA 1 // Deep power-down.
+#define SESSION_FLASH_VOLTAGE_MV 3300
+
+typedef enum {
+	SESSION_FORMAT_CSV,
+	SESSION_FORMAT_RAW,
+	SESSION_FORMAT_BIN,
+} session_format_t;
+
+/* The session catalog is a file at the root of the disk, made of a header followed by one entry per
+ * session, in the order they were created. It is read by the host like the sessions, or over
+ * MCUmgr with the file system group.
+ */
+typedef struct __packed {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t entry_size;
+	uint32_t count;		// Number of entries.
+	uint32_t next_nb;	// Number of the next session.
+} session_catalog_header_t;
+
+typedef struct __packed {
+	uint32_t nb;			// Session stored in SESSIONn.
+	uint32_t start_ms;		// Uptime when the session started, the device has no calendar clock.
+	uint32_t duration_ms;
+	uint32_t samples;
+	uint32_t size;			// Bytes of session data, after compression. 0 until the session is closed.
+	uint8_t format;			// session_format_t
+	uint8_t flags;			// SESSION_CATALOG_FLAG_*
+	char file_name[SESSION_CATALOG_FILE_NAME_SIZE]; // Data file in SESSIONn, NULL-terminated.
+} session_catalog_entry_t;
+
+/* Header of SESSION.CRC, followed by the little-endian CRC-32 of each chunk of the session file,
+ * chunk_size bytes except for the last one.
+ */
+typedef struct __packed {
+	char magic[4];
+	uint32_t chunk_size;
+} session_crc_header_t;
+
+/* Called by usb_mass_storage_verify_session with each corrupted chunk. */
+typedef void (*session_verify_cb_t)(uint32_t chunk, uint32_t offset, void *ctx);
+
+/* Statistics of the session writer thread, reset when a session is created. */
+typedef struct {
+	uint32_t ring_high_water;	// Highest number of bytes waiting in the ring.
+	uint32_t stalls;			// Flushes that did not fit in the ring.
+	uint32_t drops;				// Writes dropped because the buffer and the ring were full.
+	uint32_t lost_bytes;		// Bytes of the dropped writes.
+	uint32_t writes;			// Number of chunks written to the file.
+	uint32_t bytes_written;		// Bytes written to the file, after compression.
+	uint32_t max_write_us;		// Longest chunk write.
+	uint64_t total_write_us;	// Time spent writing chunks.
+	uint32_t bursts;			// Times the writer woke the flash to write the ring.
+	uint64_t flash_awake_us;	// Time the flash was kept awake for the bursts.
+	uint32_t duration_ms;		// Time since the session was created, until it ended.
+} session_writer_stats_t;
+
+/* Classes of storage I/O, by decreasing priority. */
+typedef enum {
+	STORAGE_IO_RECORDING,	// The session writer thread.
+	STORAGE_IO_INTERACTIVE, // Reads someone waits for: emulator, storage verify, MCUmgr transfers.
+	STORAGE_IO_BACKGROUND,	// Erasing free clusters.
+	STORAGE_IO_CLASS_NB,
+} storage_io_class_t;
+
+/* Statistics of the storage I/O scheduler, since boot. */
+typedef struct {
+	uint32_t waits[STORAGE_IO_CLASS_NB]; // I/O delayed for a higher priority class.
+	uint32_t timeouts;					  // I/O given up after waiting.
+	uint32_t max_wait_ms;				  // Longest delay.
+} storage_io_stats_t;
+
+/* Statistics of the disk reads, by USB and the file system, since USB was connected. */
+typedef struct {
+	uint32_t reads;
+	uint64_t bytes;
+	uint64_t busy_us;			// Time spent reading, the read throughput is bytes / busy_us.
+	uint32_t read_ahead_fills;	// Read-ahead buffers read from the flash.
+	uint32_t read_ahead_sectors; // Sectors read from the read-ahead buffer.
+} storage_read_stats_t;
+
+/* Statistics of the flash eraser thread, since boot. */
+typedef struct {
+	uint32_t erased_ahead;		// Blocks erased ahead of the session writer.
+	uint32_t stalls;			// Writes which had to erase their blocks.
+	uint32_t lazy_erased;		// Free blocks erased while idle.
+} session_eraser_stats_t;
+
 int usb_mass_storage_init();
 int usb_mass_storage_lsdir(const char *path);
 int usb_mass_storage_create_file(const char *path, const char *filename, struct fs_file_t *f, bool keep_open);
 int usb_mass_storage_create_dir(const char *path);
 int usb_mass_storage_write_to_file(char* data, size_t len, struct fs_file_t *f, bool erase_content);
-int usb_mass_storage_get_session_header(const char* data, struct fs_file_t *f);
-int usb_mass_storage_read_line(char* data, size_t len, size_t offset, struct fs_file_t *f);
+int usb_mass_storage_get_session_header(const char* data, struct fs_file_t *f, session_bin_header_t *bin_header);
 int usb_mass_storage_close_file(struct fs_file_t *f);
-int usb_mass_storage_create_session();
+int usb_mass_storage_create_session(session_format_t format, bool compressed, uint32_t data_rate);
 int usb_mass_storage_end_current_session();
 int usb_mass_storage_write_to_current_session(char* data, size_t len);
+char* usb_mass_storage_session_reserve(size_t len);
+int usb_mass_storage_session_commit(size_t len);
+void usb_mass_storage_session_drop(size_t len);
+bool usb_mass_storage_session_backpressure();
+int usb_mass_storage_write_session_metadata(char* data, size_t len);
+void usb_mass_storage_get_writer_stats(session_writer_stats_t *stats);
+uint64_t usb_mass_storage_flash_energy_nj(const session_writer_stats_t *stats, uint32_t duration_ms, bool power_down);
+int usb_mass_storage_format();
+void usb_mass_storage_set_lazy_erase(bool enable);
+void usb_mass_storage_get_eraser_stats(session_eraser_stats_t *stats);
+int usb_mass_storage_io_wait(storage_io_class_t io_class, k_timeout_t timeout);
+void usb_mass_storage_get_io_stats(storage_io_stats_t *stats);
+void usb_mass_storage_get_read_stats(storage_read_stats_t *stats);
+void usb_mass_storage_get_meta_cache_stats(session_meta_cache_stats_t *stats);
+int usb_mass_storage_export_session_log();
+void usb_mass_storage_session_add_samples(uint32_t nb);
+uint32_t usb_mass_storage_get_session_count();
+int usb_mass_storage_get_session_entry(uint32_t index, session_catalog_entry_t *entry);
+int usb_mass_storage_verify_session(const char *path, session_verify_cb_t cb, void *ctx, uint32_t *nb_chunks);
+void usb_mass_storage_session_index(uint32_t ts_ms);
+int usb_mass_storage_find_session_index(const char *path, uint32_t ts_ms, session_index_entry_t *entry);
+void usb_mass_storage_session_summary_start(uint32_t channel_mask);
+void usb_mass_storage_session_summary_set_clip(session_channel_t channel, float_t limit);
+void usb_mass_storage_session_summarize(const float_t *values);
+void usb_mass_storage_session_preview_start(uint32_t channel_mask);
+int usb_mass_storage_read_session_summary(uint32_t nb, session_summary_record_t *record);
+int usb_mass_storage_session_seek(const char *path, struct fs_file_t *f, uint32_t ts_ms, session_index_entry_t *entry);
 int usb_mass_storage_check_calibration_file_contents(float *x, float *y, float *z);
 struct fs_file_t* usb_mass_storage_get_session_file_p();
+session_reader_t* usb_mass_storage_get_session_reader();
 struct fs_file_t* usb_mass_storage_get_calibration_file_p();
 int usb_mass_storage_create_fit_example_file();
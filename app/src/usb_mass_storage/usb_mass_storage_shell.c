@@ -1,6 +1,8 @@
 #include <zephyr/kernel.h>
 #include "usb_mass_storage.h"
+#include <state_machine/state_machine.h>
 #include <zephyr/shell/shell.h>
+#include <stdlib.h>
 
 static int cmd_fit(const struct shell *sh, size_t argc, char **argv)
 {
@@ -15,3 +17,205 @@ static int cmd_fit(const struct shell *sh, size_t argc, char **argv)
 }
 
 SHELL_CMD_REGISTER(fit, NULL, "Storage commands", cmd_fit);
+
+static int cmd_storage_stats(const struct shell *sh, size_t argc, char **argv)
+{
+	session_writer_stats_t stats;
+	usb_mass_storage_get_writer_stats(&stats);
+
+	shell_print(sh, "Chunks written: %u (%u bytes)", stats.writes, stats.bytes_written);
+	shell_print(sh, "Write time: %u us max, %u us average", stats.max_write_us,
+		    stats.writes ? (uint32_t)(stats.total_write_us / stats.writes) : 0);
+	shell_print(sh, "Ring high-water mark: %u / %u bytes", stats.ring_high_water, CONFIG_SESSION_WRITER_RING_SIZE);
+	shell_print(sh, "Stalls: %u", stats.stalls);
+	shell_print(sh, "Lost: %u bytes in %u writes", stats.lost_bytes, stats.drops);
+	shell_print(sh, "Flash awake: %u ms in %u bursts, over %u ms", (uint32_t)(stats.flash_awake_us / 1000),
+		    stats.bursts, stats.duration_ms);
+	if (stats.bytes_written) {
+		// Estimates from typical currents, powering the flash down between bursts or leaving it in standby.
+		shell_print(sh, "Flash energy: about %u nJ per byte stored, %u nJ without deep power-down",
+			    (uint32_t)(usb_mass_storage_flash_energy_nj(&stats, stats.duration_ms,
+									 IS_ENABLED(CONFIG_SESSION_FLASH_POWER_DOWN)) /
+				       stats.bytes_written),
+			    (uint32_t)(usb_mass_storage_flash_energy_nj(&stats, stats.duration_ms, false) /
+				       stats.bytes_written));
+	}
+
+#ifdef CONFIG_SESSION_PREERASE
+	session_eraser_stats_t eraser;
+	usb_mass_storage_get_eraser_stats(&eraser);
+	shell_print(sh, "Blocks erased ahead: %u, erase stalls: %u, free blocks erased: %u",
+		    eraser.erased_ahead, eraser.stalls, eraser.lazy_erased);
+#endif
+
+#ifdef CONFIG_STORAGE_IO_SCHEDULER
+	storage_io_stats_t io;
+	usb_mass_storage_get_io_stats(&io);
+	shell_print(sh, "I/O delayed: %u reads, %u background, %u timeouts, %u ms max",
+		    io.waits[STORAGE_IO_INTERACTIVE], io.waits[STORAGE_IO_BACKGROUND], io.timeouts, io.max_wait_ms);
+#endif
+
+	storage_read_stats_t reads;
+	usb_mass_storage_get_read_stats(&reads);
+	shell_print(sh, "Disk reads: %u (%u KB) at %u KB/s, read-ahead: %u sectors from %u fills", reads.reads,
+		    (uint32_t)(reads.bytes / 1024),
+		    reads.busy_us ? (uint32_t)(reads.bytes * 1000000 / 1024 / reads.busy_us) : 0,
+		    reads.read_ahead_sectors, reads.read_ahead_fills);
+
+#ifdef CONFIG_STORAGE_META_CACHE
+	session_meta_cache_stats_t meta;
+	usb_mass_storage_get_meta_cache_stats(&meta);
+	uint32_t accesses = meta.hits + meta.misses;
+	shell_print(sh, "Metadata cache: %u%% hits (%u / %u), %u lines written in %u flushes and %u evictions, "
+		    "%u bypassed, %u written through",
+		    accesses ? meta.hits * 100 / accesses : 0, meta.hits, accesses, meta.lines_written, meta.flushes,
+		    meta.evictions, meta.bypassed, meta.written_through);
+#endif
+	return 0;
+}
+
+static int cmd_storage_format(const struct shell *sh, size_t argc, char **argv)
+{
+	if (state_machine_current_state() == RECORDING) {
+		shell_error(sh, "Unable to format storage while recording");
+		return -EBUSY;
+	}
+
+	int res = usb_mass_storage_format();
+	if (res) {
+		shell_error(sh, "Failed to format storage (%i)", res);
+		return res;
+	}
+
+	shell_print(sh, "Storage formatted with %u bytes clusters", CONFIG_SESSION_FAT_CLUSTER_SIZE);
+	return 0;
+}
+
+static int cmd_storage_list(const struct shell *sh, size_t argc, char **argv)
+{
+	session_catalog_entry_t entry;
+	uint32_t count = usb_mass_storage_get_session_count();
+
+	for (uint32_t ii = 0; ii < count; ii++) {
+		int res = usb_mass_storage_get_session_entry(ii, &entry);
+		if (res) {
+			shell_error(sh, "Failed to read the session catalog (%i)", res);
+			return res;
+		}
+
+		if (entry.flags & SESSION_CATALOG_FLAG_CLOSED) {
+			shell_print(sh, "%s%u/%s: %u bytes, %u samples, %u.%03u s, started %u s after boot%s", SESSION_DIR_NAME,
+				    entry.nb, entry.file_name, entry.size, entry.samples, entry.duration_ms / 1000,
+				    entry.duration_ms % 1000, entry.start_ms / 1000,
+				    (entry.flags & SESSION_CATALOG_FLAG_LOG) ? ", in the session log" : "");
+		} else {
+			// Recording, interrupted by a reset, or found again when the catalog was rebuilt.
+			shell_print(sh, "%s%u/%s: %u bytes, not closed", SESSION_DIR_NAME, entry.nb, entry.file_name, entry.size);
+		}
+	}
+	shell_print(sh, "%u sessions", count);
+	return 0;
+}
+
+static void print_corrupted_chunk(uint32_t chunk, uint32_t offset, void *ctx)
+{
+	const struct shell *sh = ctx;
+
+	shell_warn(sh, "Chunk %u at offset %u is corrupted", chunk, offset);
+}
+
+static int cmd_storage_verify(const struct shell *sh, size_t argc, char **argv)
+{
+	uint32_t nb_chunks;
+
+	if (state_machine_current_state() == RECORDING) {
+		shell_error(sh, "Unable to verify a session while recording");
+		return -EBUSY;
+	}
+
+	int res = usb_mass_storage_verify_session(argv[1], print_corrupted_chunk, (void *)sh, &nb_chunks);
+	if (res < 0) {
+		shell_error(sh, "Failed to verify %s (%i)", argv[1], res);
+		return res;
+	}
+
+	shell_print(sh, "%u chunks verified, %i corrupted", nb_chunks, res);
+	return 0;
+}
+
+/* CSV columns of the session channels, indexed by session_channel_t. */
+static const char *const channel_names[SESSION_CHANNEL_NB] = {
+	"ts", "ax", "ay", "az", "gx", "gy", "gz", "grotx", "groty", "grotz", "grotw", "gravx", "gravy", "gravz", "qvar",
+};
+
+static int cmd_storage_summary(const struct shell *sh, size_t argc, char **argv)
+{
+	session_summary_record_t record;
+	uint32_t nb = strtoul(argv[1], NULL, 10);
+
+	int res = usb_mass_storage_read_session_summary(nb, &record);
+	if (res < 0) {
+		shell_error(sh, "Failed to read the summary of session %u (%i)", nb, res);
+		return res;
+	}
+
+	shell_print(sh, "%u samples, %.3f s", record.nb_samples,
+		    (double)(record.last_ts_ms - record.first_ts_ms) / 1000.0);
+	for (int ii = 0; ii < SESSION_CHANNEL_NB; ii++) {
+		const session_summary_channel_t *ch = &record.channel[ii];
+		if (!(record.channels & BIT(ii))) {
+			continue;
+		}
+		shell_print(sh, "%s: min %.0f, max %.0f, mean %.1f, rms %.1f, %u clipped", channel_names[ii],
+			    (double)ch->min, (double)ch->max, (double)ch->mean, (double)ch->rms, ch->clipped);
+	}
+	return 0;
+}
+
+static int cmd_storage_seek(const struct shell *sh, size_t argc, char **argv)
+{
+	session_index_entry_t entry;
+	uint32_t ts_ms = strtoul(argv[2], NULL, 10);
+
+	int res = usb_mass_storage_find_session_index(argv[1], ts_ms, &entry);
+	if (res < 0) {
+		shell_error(sh, "Failed to find %u ms in the index of %s (%i)", ts_ms, argv[1], res);
+		return res;
+	}
+
+	shell_print(sh, "Sample at %u ms, offset %u (entry %i)", entry.ts_ms, entry.offset, res);
+	return 0;
+}
+
+#ifdef CONFIG_SESSION_LOG_STORE
+static int cmd_storage_export(const struct shell *sh, size_t argc, char **argv)
+{
+	if (state_machine_current_state() == RECORDING) {
+		shell_error(sh, "Unable to export the session log while recording");
+		return -EBUSY;
+	}
+
+	int res = usb_mass_storage_export_session_log();
+	if (res < 0) {
+		shell_error(sh, "Failed to export the session log (%i)", res);
+		return res;
+	}
+
+	shell_print(sh, "%i session log records exported", res);
+	return 0;
+}
+#endif
+
+SHELL_STATIC_SUBCMD_SET_CREATE(sub_storage,
+	SHELL_CMD(stats, NULL, "Print the session writer statistics of the current or last session.", cmd_storage_stats),
+	SHELL_CMD(list, NULL, "List the sessions of the session catalog.", cmd_storage_list),
+	SHELL_CMD_ARG(verify, NULL, "Check a session file against the CRCs of its chunks: verify <path>", cmd_storage_verify, 2, 0),
+	SHELL_CMD_ARG(summary, NULL, "Print the summary of a session: summary <session number>", cmd_storage_summary, 2, 0),
+	SHELL_CMD_ARG(seek, NULL, "Find the offset of the last sample indexed before a time: seek <path> <ms>", cmd_storage_seek, 3, 0),
+	SHELL_CMD(format, NULL, "Erase all sessions and format the storage for sessions. Eject the USB drive first.", cmd_storage_format),
+#ifdef CONFIG_SESSION_LOG_STORE
+	SHELL_CMD(export, NULL, "Copy the sessions of the session log to their files. Unplug USB first.", cmd_storage_export),
+#endif
+	SHELL_SUBCMD_SET_END /* Array terminated. */
+);
+SHELL_CMD_REGISTER(storage, &sub_storage, "Storage commands", NULL);
@@ -19,6 +19,14 @@ typedef struct {
 
 #define BOOT_TIME 10 //ms
 #define FIFO_WATERMARK 200
+#define FIFO_WORD_SIZE 7 // 1 tag byte + 6 data bytes
+#define FIFO_BACKPRESSURE_MAX_LEVEL 400 // Words left in the FIFO under backpressure, before reading it anyway.
+#define FIFO_BACKPRESSURE_RETRY_MS 20
+
+#define LSM6DSV16BX_RAW_HEADER_MAGIC "LSMR"
+#define LSM6DSV16BX_RAW_HEADER_VERSION 1
+/* FIFO_CTRL1 (0x07) to CTRL10 (0x19) */
+#define LSM6DSV16BX_RAW_HEADER_NB_REGS 19
 
 typedef struct {
 	bool gbias_enabled;
@@ -41,6 +49,7 @@ typedef struct {
 	bool fsm_enabled;
 	lsm6dsv16bx_calib_state_t calib;
 	bool int2_on_int1;
+	bool raw_fifo_enabled;
 } lsm6dsv16bx_state_t;
 
 typedef struct {
@@ -53,6 +62,8 @@ typedef struct {
 	void (*lsm6dsv16bx_gravity_sample_cb)(float_t, float_t, float_t);
 	void (*lsm6dsv16bx_calibration_result_cb)(int, float_t, float_t, float_t);
 	void (*lsm6dsv16bx_sigmot_cb)();
+	void (*lsm6dsv16bx_fifo_raw_cb)(uint8_t*); // Called with FIFO_WORD_SIZE bytes when raw FIFO capture is enabled.
+	bool (*lsm6dsv16bx_backpressure_cb)(); // When it returns true, the FIFO is read later, unless it is nearly full.
 	void (*lsm6dsv16bx_fsm_cbs[LSM6DSV16BX_FSM_ALG_MAX_NB])(uint8_t);
 } lsm6dsv16bx_cb_t;
 
@@ -69,6 +80,54 @@ typedef struct {
 	float_t (*gy_conversion_function)(int16_t);
 } lsm6dsv16bx_scale_t;
 
+/* On-sensor filter chain applied at the start of each acquisition.
+ * xl_hp_enabled takes precedence over xl_lp2_enabled, both use xl_bandwidth.
+ */
+typedef struct {
+	bool xl_lp2_enabled;
+	bool xl_hp_enabled;
+	lsm6dsv16bx_filt_xl_lp2_bandwidth_t xl_bandwidth;
+	bool gy_lp1_enabled;
+	lsm6dsv16bx_filt_gy_lp1_bandwidth_t gy_lp1_bandwidth;
+	lsm6dsv16bx_filt_settling_mask_t settling_mask;
+} lsm6dsv16bx_filter_t;
+
+/* FIFO batching rates of the current acquisition, in Hz. 0 when the data is not batched. */
+typedef struct {
+	uint16_t xl_hz;
+	uint16_t gy_hz;
+	uint16_t sflp_hz;
+} lsm6dsv16bx_odr_t;
+
+/* Header describing a raw FIFO capture, so that the FIFO words can be decoded off-device.
+ * Sensitivities are the values used by the conversion functions, gbias is in dps.
+ */
+typedef struct __packed {
+	char magic[4];
+	uint8_t version;
+	uint8_t header_size;
+	uint8_t whoami;
+	uint8_t flags; // Set by the application.
+	uint8_t xl_scale;
+	uint8_t gy_scale;
+	uint8_t samples_discarded;
+	uint8_t regs[LSM6DSV16BX_RAW_HEADER_NB_REGS];
+	float xl_sensitivity_mg;
+	float gy_sensitivity_mdps;
+	float gravity_sensitivity_mg;
+	float qvar_lsb_per_mv;
+	uint32_t ts_resolution_ns;
+	float gbias[3];
+	uint8_t tag_xl;
+	uint8_t tag_gy;
+	uint8_t tag_ts;
+	uint8_t tag_game_rot;
+	uint8_t tag_gravity;
+	uint8_t tag_gbias;
+	uint8_t tag_qvar;
+	uint8_t reserved;
+} lsm6dsv16bx_raw_header_t;
+
 typedef struct {
 	stmdev_ctx_t dev_ctx;
 	uint8_t whoamI;
@@ -77,13 +136,21 @@ typedef struct {
 	uint8_t nb_samples_to_discard;
 	lsm6dsv16bx_fsm_cfg_t fsm_configs;
 	lsm6dsv16bx_scale_t scale;
+	lsm6dsv16bx_filter_t filter;
+	lsm6dsv16bx_odr_t odr;
 } lsm6dsv16bx_sensor_t;
 
 void lsm6dsv16bx_init(lsm6dsv16bx_cb_t cb, lsm6dsv16bx_fsm_cfg_t fsm_cfg);
 void lsm6dsv16bx_int1_irq(struct k_work *item);
-int lsm6dsv16bx_start_acquisition(bool enable_gbias, bool enable_sflp, bool enable_qvar);
+int lsm6dsv16bx_start_acquisition(bool enable_gbias, bool enable_sflp, bool enable_qvar, bool enable_raw_fifo);
 int lsm6dsv16bx_reset();
 int lsm6dsv16bx_start_calibration();
 int lsm6dsv16bx_start_significant_motion_detection();
 int lsm6dsv16bx_start_fsm(uint8_t* fsm_alg_nb, uint8_t n);
 void lsm6dsv16bx_set_gbias(float x, float y, float z);
+void lsm6dsv16bx_get_gbias(float *x, float *y, float *z);
+void lsm6dsv16bx_set_filter(lsm6dsv16bx_filter_t filter);
+lsm6dsv16bx_filter_t lsm6dsv16bx_get_filter();
+lsm6dsv16bx_scale_t lsm6dsv16bx_get_scale();
+lsm6dsv16bx_odr_t lsm6dsv16bx_get_odr();
+int lsm6dsv16bx_get_raw_header(lsm6dsv16bx_raw_header_t *header);
@@ -0,0 +1,307 @@
+#pragma once
+
+#include <zephyr/kernel.h>
+#include <math.h>
+
+/* Longest field written by session_csv_put_float, sign and separator included. */
+#define SESSION_CSV_FIELD_MAX_SIZE 24
+
+/* Write val like printf("%.<decimals>f") at p, without using floating point printf.
+ * decimals must be between 0 and 3. Exact ties are rounded to even, like printf does.
+ * Returns a pointer past the last written character, or NULL if p is NULL or the field
+ * does not fit before end. Nothing is written past end, and the output is not NULL-terminated.
+ */
+char *session_csv_put_float(char *p, char *end, float_t val, uint8_t decimals);
+
+/* Same as session_csv_put_float, preceded by a ',' separator. */
+char *session_csv_put_field(char *p, char *end, float_t val, uint8_t decimals);
+
+/* Parse a NULL-terminated CSV session line (without its newline) into values, indexed by
+ * session_channel_t since the columns are in the same order. line is modified.
+ * Returns the number of columns, or -E2BIG if there are more than SESSION_CHANNEL_NB.
+ */
+int session_csv_parse_line(char *line, float_t *values);
+
+#define SESSION_BIN_MAGIC "XSES"
+#define SESSION_BIN_VERSION 2
+#define SESSION_BIN_FW_VERSION_SIZE 16
+
+/* Channels a binary session can hold. Values are stored in the units of the CSV columns:
+ * ms for the timestamp, mg, mdps, quaternion x1000 and mV.
+ */
+typedef enum {
+	SESSION_CHANNEL_TS,
+	SESSION_CHANNEL_ACC_X,
+	SESSION_CHANNEL_ACC_Y,
+	SESSION_CHANNEL_ACC_Z,
+	SESSION_CHANNEL_GYRO_X,
+	SESSION_CHANNEL_GYRO_Y,
+	SESSION_CHANNEL_GYRO_Z,
+	SESSION_CHANNEL_GAME_ROT_X,
+	SESSION_CHANNEL_GAME_ROT_Y,
+	SESSION_CHANNEL_GAME_ROT_Z,
+	SESSION_CHANNEL_GAME_ROT_W,
+	SESSION_CHANNEL_GRAVITY_X,
+	SESSION_CHANNEL_GRAVITY_Y,
+	SESSION_CHANNEL_GRAVITY_Z,
+	SESSION_CHANNEL_QVAR,
+	SESSION_CHANNEL_NB,
+} session_channel_t;
+
+#define SESSION_CHANNELS_SIMPLE	(BIT(SESSION_CHANNEL_TS) | GENMASK(SESSION_CHANNEL_GYRO_Z, SESSION_CHANNEL_ACC_X))
+#define SESSION_CHANNELS_SFLP	GENMASK(SESSION_CHANNEL_GRAVITY_Z, SESSION_CHANNEL_GAME_ROT_X)
+#define SESSION_CHANNELS_QVAR	BIT(SESSION_CHANNEL_QVAR)
+
+typedef enum {
+	SESSION_BIN_TYPE_F32,
+	SESSION_BIN_TYPE_I16,
+	SESSION_BIN_TYPE_I32,
+} session_bin_type_t;
+
+/* Sample encodings of a binary session. */
+typedef enum {
+	SESSION_BIN_ENCODING_RECORDS, // Fixed-size records, one per line of the CSV format.
+	SESSION_BIN_ENCODING_DELTA, // Blocks of zigzag varint deltas, see session_delta_encoder_t.
+	SESSION_BIN_ENCODING_COLUMNS, // Blocks of per-channel delta chunks, see session_column_encoder_t.
+} session_bin_encoding_t;
+
+typedef struct __packed {
+	uint8_t id; // session_channel_t
+	uint8_t type; // session_bin_type_t
+	float scale; // Multiply the value by scale to get it in SI-like units (g, dps, quaternion, V, s).
+	uint16_t step; // Multiply the stored integer by step to get the value, more than 1 in lossy sessions.
+} session_bin_channel_t;
+
+/* Header at the start of a binary session, all fields are little-endian.
+ * Only the first header_size bytes are written: the channel list is cut to nb_channels entries.
+ */
+typedef struct __packed {
+	char magic[4];
+	uint8_t version;
+	uint8_t encoding; // session_bin_encoding_t
+	uint16_t header_size;
+	uint16_t record_size;
+	uint8_t nb_channels;
+	uint8_t reserved;
+	uint32_t fw_version; // APPVERSION
+	char fw_version_str[SESSION_BIN_FW_VERSION_SIZE]; // APP_VERSION_STRING, NULL-padded
+	uint16_t odr_xl_hz;
+	uint16_t odr_gy_hz;
+	uint16_t odr_sflp_hz;
+	uint8_t xl_scale; // lsm6dsv16bx_xl_full_scale_t
+	uint8_t gy_scale; // lsm6dsv16bx_gy_full_scale_t
+	float gbias_mdps[3];
+	uint8_t xl_lp2_enabled;
+	uint8_t xl_hp_enabled;
+	uint8_t xl_bandwidth;
+	uint8_t gy_lp1_enabled;
+	uint8_t gy_lp1_bandwidth;
+	uint8_t settling_mask;
+	session_bin_channel_t channels[SESSION_CHANNEL_NB];
+} session_bin_header_t;
+
+#define SESSION_BIN_HEADER_MIN_SIZE offsetof(session_bin_header_t, channels)
+/* Largest record, with all channels enabled. */
+#define SESSION_BIN_RECORD_MAX_SIZE 38
+
+/* Initialize the magic, version and channel fields of hdr for the channels in channel_mask
+ * (BIT(session_channel_t)), with exact values (step 1). The other fields are zeroed and left to the caller.
+ * Returns the header size, or -EINVAL if the mask is empty or has unknown channels.
+ */
+int session_bin_header_init(session_bin_header_t *hdr, uint32_t channel_mask);
+
+/* Check that the first len bytes of hdr hold a supported binary session header.
+ * Returns the header size or a negative errno code.
+ */
+int session_bin_header_check(const session_bin_header_t *hdr, size_t len);
+
+/* Check the first len bytes of data like session_bin_header_check and copy the header to hdr.
+ * Older versions are converted to the current layout, version 1 channels get a step of 1.
+ * Returns the size of the header in data or a negative errno code.
+ */
+int session_bin_header_load(session_bin_header_t *hdr, const void *data, size_t len);
+
+/* Make channel lossy: its values are quantized with a step of 2 * max_error + 1, so that each
+ * decoded value is at most max_error away from the exact one. Only delta encoded sessions are
+ * quantized, see session_delta_encoder_set_steps. A max_error of 0 makes the channel exact.
+ * Returns 0, or -EINVAL if the channel is not in hdr, is the timestamp, or max_error is too large.
+ */
+int session_bin_header_set_max_error(session_bin_header_t *hdr, session_channel_t channel, uint16_t max_error);
+
+/* Channels of hdr, as a mask of BIT(session_channel_t). */
+uint32_t session_bin_header_channels(const session_bin_header_t *hdr);
+
+/* Size of a record holding the channels of channel_mask. */
+size_t session_bin_record_size(uint32_t channel_mask);
+
+/* Pack the channels of channel_mask from values (indexed by session_channel_t) into a record
+ * at out, in the layout described by session_bin_header_init. Integer channels are rounded
+ * half to even and saturated, and never quantized. Returns the record size.
+ */
+size_t session_bin_pack_record(uint32_t channel_mask, const float_t *values, uint8_t *out);
+
+/* Unpack a record laid out as described by hdr into values (indexed by session_channel_t).
+ * Values of channels absent from the record are left untouched. Returns the record size.
+ */
+size_t session_bin_unpack_record(const session_bin_header_t *hdr, const uint8_t *in, float_t *values);
+
+/* Delta blocks: a little-endian header (payload size and number of samples, 16 bits each)
+ * followed by the samples, each channel as a zigzag varint. The first sample of a block is a
+ * keyframe holding the values, the next ones hold the difference with the previous sample.
+ * Values are the integers of the record format divided by the channel step, the float bits for
+ * the timestamp.
+ */
+#define SESSION_DELTA_BLOCK_HEADER_SIZE 4
+#define SESSION_DELTA_VALUE_MAX_SIZE 5
+#define SESSION_DELTA_BLOCK_MAX_SIZE(nb_samples, nb_channels) \
+	(SESSION_DELTA_BLOCK_HEADER_SIZE + (nb_samples) * (nb_channels) * SESSION_DELTA_VALUE_MAX_SIZE)
+
+typedef struct {
+	uint32_t channels;
+	uint8_t nb_channels;
+	uint16_t max_samples;
+	uint16_t nb_samples;
+	uint8_t *buf;
+	size_t len;
+	int32_t prev[SESSION_CHANNEL_NB];
+	uint16_t step[SESSION_CHANNEL_NB];
+} session_delta_encoder_t;
+
+typedef struct {
+	const session_bin_header_t *hdr;
+	const uint8_t *p;
+	const uint8_t *end;
+	uint16_t nb_samples;
+	uint16_t sample;
+	int32_t prev[SESSION_CHANNEL_NB];
+} session_delta_decoder_t;
+
+/* Initialize an encoder writing blocks of the channels of channel_mask to buf.
+ * A block holds at most max_samples samples, and never more than fits in size bytes.
+ * Returns 0, or -EINVAL if size cannot hold a single sample.
+ */
+int session_delta_encoder_init(session_delta_encoder_t *enc, uint32_t channel_mask, uint16_t max_samples,
+			       uint8_t *buf, size_t size);
+
+/* Quantize the samples with the steps of the channels of hdr, which must describe the channels of
+ * the encoder. Call before the first sample. Returns 0, or -EINVAL if the channels differ.
+ */
+int session_delta_encoder_set_steps(session_delta_encoder_t *enc, const session_bin_header_t *hdr);
+
+/* Add a sample (values indexed by session_channel_t) to the current block.
+ * Returns 1 if the block is full and must be finished before the next sample, 0 otherwise.
+ */
+int session_delta_encode(session_delta_encoder_t *enc, const float_t *values);
+
+/* Write the block header and return the block size, 0 if the block is empty. The block is at the
+ * start of the encoder buffer and must be used before the next call to session_delta_encode.
+ */
+size_t session_delta_block_finish(session_delta_encoder_t *enc);
+
+/* Start decoding the block at the start of data, len bytes long.
+ * Returns the size of the whole block, or -EAGAIN if len is too small to hold it, or -EINVAL.
+ */
+int session_delta_decoder_init(session_delta_decoder_t *dec, const session_bin_header_t *hdr,
+			       const uint8_t *data, size_t len);
+
+/* Decode the next sample of the block into values (indexed by session_channel_t).
+ * Returns 0, -ENODATA at the end of the block, or -EINVAL if the block is corrupted.
+ */
+int session_delta_decode(session_delta_decoder_t *dec, float_t *values);
+
+/* Columnar blocks: the delta block header, a directory holding the size of each channel chunk
+ * (16 bits little-endian, in the order of the header channels), then the chunks. A chunk holds the
+ * samples of the block for one channel, as zigzag varints: the value of the first sample, then the
+ * differences with the previous one, like delta blocks. A channel can be read from the block header
+ * and directory alone, without reading the other chunks.
+ */
+#define SESSION_COLUMN_DIR_ENTRY_SIZE 2
+#define SESSION_COLUMN_BLOCK_MAX_SIZE(nb_samples, nb_channels) \
+	(SESSION_DELTA_BLOCK_MAX_SIZE(nb_samples, nb_channels) + (nb_channels) * SESSION_COLUMN_DIR_ENTRY_SIZE)
+
+typedef struct {
+	uint32_t channels;
+	uint8_t nb_channels;
+	uint16_t max_samples;
+	uint16_t nb_samples;
+	uint8_t *buf;
+	uint16_t len[SESSION_CHANNEL_NB]; // Size of each chunk, in the order of the channels.
+	int32_t prev[SESSION_CHANNEL_NB];
+	uint16_t step[SESSION_CHANNEL_NB];
+} session_column_encoder_t;
+
+typedef struct {
+	const session_bin_header_t *hdr;
+	uint32_t channels;
+	const uint8_t *p[SESSION_CHANNEL_NB]; // Next value of each chunk, in the order of the header channels.
+	const uint8_t *end[SESSION_CHANNEL_NB];
+	uint16_t nb_samples;
+	uint16_t sample;
+	int32_t prev[SESSION_CHANNEL_NB];
+} session_column_decoder_t;
+
+/* Same as session_delta_encoder_init, for columnar blocks. Until the block is finished, each chunk
+ * is written in its own part of buf, sized for max_samples samples.
+ */
+int session_column_encoder_init(session_column_encoder_t *enc, uint32_t channel_mask, uint16_t max_samples,
+				uint8_t *buf, size_t size);
+
+/* Same as session_delta_encoder_set_steps. */
+int session_column_encoder_set_steps(session_column_encoder_t *enc, const session_bin_header_t *hdr);
+
+/* Same as session_delta_encode. */
+int session_column_encode(session_column_encoder_t *enc, const float_t *values);
+
+/* Move the chunks after the directory and return the block size, 0 if the block is empty. The block
+ * is at the start of the encoder buffer and must be used before the next call to session_column_encode.
+ */
+size_t session_column_block_finish(session_column_encoder_t *enc);
+
+/* Locate the chunk of channel in the block at the start of data, len bytes long. Only the block
+ * header and directory are needed. Returns the size of the whole block and sets offset and size
+ * to the position of the chunk in the block, -EAGAIN if len does not hold the directory,
+ * -ENOENT if the channel is not in the session, or -EINVAL.
+ */
+int session_column_find_chunk(const session_bin_header_t *hdr, const uint8_t *data, size_t len,
+			      session_channel_t channel, size_t *offset, size_t *size);
+
+/* Start decoding the channels of channel_mask (all the channels of the session if 0) in the block
+ * at the start of data, len bytes long. Returns the size of the whole block, or -EAGAIN if len is
+ * too small to hold it, or -EINVAL.
+ */
+int session_column_decoder_init(session_column_decoder_t *dec, const session_bin_header_t *hdr, uint32_t channel_mask,
+				const uint8_t *data, size_t len);
+
+/* Decode the next sample of the block into values (indexed by session_channel_t). Only the decoded
+ * channels are written. Returns 0, -ENODATA at the end of the block, or -EINVAL if it is corrupted.
+ */
+int session_column_decode(session_column_decoder_t *dec, float_t *values);
+
+/* Compressed sessions start with SESSION_LZ4_MAGIC, followed by frames. Each frame has a
+ * little-endian header (uncompressed size, then stored size, 16 bits each) and its data: an LZ4
+ * block, or the data itself when SESSION_LZ4_FRAME_STORED is set in the stored size.
+ */
+#define SESSION_LZ4_MAGIC "SLZ4"
+#define SESSION_LZ4_FRAME_HEADER_SIZE 4
+#define SESSION_LZ4_FRAME_STORED BIT(15)
+#define SESSION_LZ4_FRAME_MAX_DATA_SIZE (SESSION_LZ4_FRAME_STORED - 1)
+/* Room needed to frame len bytes, when they cannot be compressed. */
+#define SESSION_LZ4_FRAME_MAX_SIZE(len) (SESSION_LZ4_FRAME_HEADER_SIZE + (len))
+#define SESSION_LZ4_HASH_LOG 10
+
+/* Hash table of the compressor, kept by the caller so that it is not on the stack. */
+typedef struct {
+	uint16_t table[BIT(SESSION_LZ4_HASH_LOG)];
+} session_lz4_ctx_t;
+
+/* Compress len bytes of src (1 to SESSION_LZ4_FRAME_MAX_DATA_SIZE) into a frame at dst,
+ * which must hold SESSION_LZ4_FRAME_MAX_SIZE(len) bytes. Data that does not compress is stored.
+ * Returns the frame size, or -EINVAL.
+ */
+int session_lz4_frame(session_lz4_ctx_t *ctx, const uint8_t *src, size_t len, uint8_t *dst);
+
+/* Decode the frame at the start of src, len bytes long, into dst of dst_size bytes.
+ * Returns the uncompressed size and sets frame_size to the size of the frame, -EAGAIN if len is
+ * too small to hold the frame, or -EINVAL if the frame is corrupted or does not fit in dst.
+ */
+int session_lz4_unframe(const uint8_t *src, size_t len, uint8_t *dst, size_t dst_size, size_t *frame_size);
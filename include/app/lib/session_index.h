@@ -0,0 +1,33 @@
+#pragma once
+
+#include <zephyr/kernel.h>
+
+/* Sparse index of a session, mapping the timestamp of a sample to its offset in the session file.
+ *
+ * The index is a file made of a header followed by entries in increasing timestamp order, all
+ * little-endian. Each entry points to a sample which can be decoded on its own: a CSV line, a
+ * record, or the first sample of a delta or columnar block. Finding a timestamp then takes
+ * log2(entries) reads, instead of decoding the session from its start.
+ */
+
+#define SESSION_INDEX_MAGIC "XIDX"
+
+typedef struct __packed {
+	char magic[4];		  // SESSION_INDEX_MAGIC
+	uint32_t interval_ms; // Minimum time between two entries.
+} session_index_header_t;
+
+typedef struct __packed {
+	uint32_t ts_ms;	 // Timestamp of the sample, in ms.
+	uint32_t offset; // Offset of the sample in the session file.
+} session_index_entry_t;
+
+/* Read entry number index of the index, in CPU byte order. Returns 0 or a negative errno. */
+typedef int (*session_index_read_t)(void *ctx, uint32_t index, session_index_entry_t *entry);
+
+/* Find the last of nb_entries entries with a timestamp not after ts_ms, or the first entry when
+ * ts_ms is before all of them, by binary search.
+ * Returns the number of the entry found, -ENOENT if the index is empty, or a read error.
+ */
+int session_index_find(session_index_read_t read, void *ctx, uint32_t nb_entries, uint32_t ts_ms,
+		       session_index_entry_t *entry);
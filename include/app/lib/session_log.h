@@ -0,0 +1,110 @@
+#pragma once
+
+#include <zephyr/kernel.h>
+
+/* Append-only log of session data on a raw flash area, used as a ring of erase blocks.
+ *
+ * Each erase block starts with a block header holding a sequence number, incremented every time
+ * a block is opened, so that mounting only needs to read the header of each block to find the
+ * newest one. Session data follows in records, which never straddle two blocks. Records are
+ * aligned on SESSION_LOG_ALIGN bytes and each one has its own CRC-32, a torn record left by a
+ * reset is detected and skipped. When the log is full, the oldest block is erased and reused.
+ *
+ * The flash must behave like NOR flash: erased bytes read 0xff, and programming only clears bits.
+ */
+
+#define SESSION_LOG_BLOCK_MAGIC 0x474f4c53 // "SLOG"
+#define SESSION_LOG_RECORD_MAGIC 0x5253	   // "SR"
+#define SESSION_LOG_ALIGN 4
+
+typedef enum {
+	SESSION_LOG_RECORD_START = 1, // First record of a session, its data is the session metadata.
+	SESSION_LOG_RECORD_DATA = 2,
+} session_log_record_type_t;
+
+/* Cleared in the flags of a record once it has been copied elsewhere. */
+#define SESSION_LOG_FLAG_EXPORTED BIT(0)
+
+typedef struct __packed {
+	uint32_t magic;
+	uint32_t seq;
+	uint32_t reserved;
+	uint32_t crc; // CRC-32 of the fields above.
+} session_log_block_header_t;
+
+typedef struct __packed {
+	uint16_t magic;
+	uint8_t type; // session_log_record_type_t
+	uint8_t reserved;
+	uint16_t len; // Data length, the record is padded to SESSION_LOG_ALIGN.
+	uint16_t reserved2;
+	uint32_t session;
+	uint32_t crc;	// CRC-32 of the fields above and of the data.
+	uint32_t flags; // Programmed after the record, not covered by the CRC. Erased: 0xffffffff.
+} session_log_record_header_t;
+
+/* Access to the flash area holding the log. Offsets are relative to the start of the area.
+ * Functions return 0 or a negative errno.
+ */
+typedef struct {
+	int (*read)(void *ctx, uint32_t offset, void *data, size_t len);
+	int (*write)(void *ctx, uint32_t offset, const void *data, size_t len);
+	int (*erase)(void *ctx, uint32_t offset, size_t len);
+	void *ctx;
+	uint32_t size;		  // Multiple of block_size.
+	uint32_t block_size;  // Erase block size, at most 64 KB.
+} session_log_flash_t;
+
+typedef struct {
+	const session_log_flash_t *flash;
+	uint32_t nb_blocks;
+	uint32_t head;	   // Block being written.
+	uint32_t head_off; // Offset of the next record in the head block.
+	uint32_t seq;	   // Sequence number of the head block, 0 if the log is empty.
+} session_log_t;
+
+/* Position of a record, from session_log_next. */
+typedef struct {
+	uint32_t block;	 // Block being read.
+	uint32_t off;	 // Offset of the next record in the block.
+	uint32_t count;	 // Blocks left to read, including the current one.
+	uint32_t record; // Offset of the last record returned, from the start of the area.
+	uint32_t len;	 // Data length of the last record returned.
+} session_log_cursor_t;
+
+/* Find the head of the log by reading the header of each block, then the end of the records
+ * of the head block. An area without any valid block is an empty log, nothing is erased.
+ * Returns 0, -EINVAL if the flash geometry is not supported, or a flash error.
+ */
+int session_log_mount(session_log_t *log, const session_log_flash_t *flash);
+
+/* Erase every block holding a header, and leave the log empty. */
+int session_log_clear(session_log_t *log);
+
+/* Append a record of the given type. Data larger than a record is split over several DATA
+ * records, while a START record must fit in one. A new block is opened when the head block
+ * is full, erasing the oldest one if needed.
+ * Returns 0, -EMSGSIZE if a START record is too large, or a flash error.
+ */
+int session_log_append(session_log_t *log, session_log_record_type_t type, uint32_t session,
+		       const void *data, size_t len);
+
+/* Largest data that fits in one record. */
+size_t session_log_record_max_size(const session_log_t *log);
+
+/* Start reading the records of the log, from the oldest one. */
+void session_log_cursor_init(const session_log_t *log, session_log_cursor_t *cursor);
+
+/* Read the header of the next record into hdr, and check its data against its CRC.
+ * The data can then be read with session_log_read.
+ * Returns 0, -EBADMSG if the record is corrupted (the cursor still moves past it), -ENOENT
+ * after the last record, or a flash error.
+ */
+int session_log_next(const session_log_t *log, session_log_cursor_t *cursor, session_log_record_header_t *hdr);
+
+/* Read len bytes of the data of the record last returned by session_log_next, from offset. */
+int session_log_read(const session_log_t *log, const session_log_cursor_t *cursor, uint32_t offset,
+		     void *data, size_t len);
+
+/* Clear flags, like SESSION_LOG_FLAG_EXPORTED, in the record last returned by session_log_next. */
+int session_log_clear_flags(const session_log_t *log, const session_log_cursor_t *cursor, uint32_t flags);
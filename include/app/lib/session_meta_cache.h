@@ -0,0 +1,77 @@
+#pragma once
+
+#include <zephyr/kernel.h>
+
+/* Write-back cache of the small disk accesses of the file system, in front of a flash disk.
+ *
+ * FatFs reads and writes the FAT and the directories a sector at a time, and every sector written
+ * to a flash disk costs an erase and a program of its whole erase block. The cache holds lines of
+ * line_sectors sectors, one erase block each, and writes them back only when they are evicted or
+ * flushed: the updates of a line between two flushes cost one erase. Accesses covering whole
+ * lines, the session data written in chunks, go straight to the disk, the cached lines they
+ * overlap being kept up to date.
+ */
+
+/* Read or write count sectors of the disk from sector. Returns 0 or a negative errno. */
+typedef int (*session_meta_cache_read_t)(void *ctx, uint8_t *buf, uint32_t sector, uint32_t count);
+typedef int (*session_meta_cache_write_t)(void *ctx, const uint8_t *buf, uint32_t sector, uint32_t count);
+
+typedef struct {
+	uint32_t line; // First sector / line_sectors.
+	uint32_t used; // Time of the last access, for LRU eviction.
+	bool valid;
+	bool dirty;
+} session_meta_cache_entry_t;
+
+typedef struct {
+	uint32_t hits;		   // Small accesses to a cached line.
+	uint32_t misses;	   // Small accesses which read their line.
+	uint32_t bypassed;	   // Whole lines read or written straight to the disk.
+	uint32_t written_through; // Writes sent to the disk by session_meta_cache_write_through.
+	uint32_t evictions;	   // Dirty lines written back to make room.
+	uint32_t flushes;	   // Flushes which wrote lines.
+	uint32_t lines_written; // Lines written back, evicted or flushed.
+} session_meta_cache_stats_t;
+
+typedef struct {
+	session_meta_cache_read_t read;
+	session_meta_cache_write_t write;
+	void *ctx;
+	session_meta_cache_entry_t *entries;
+	uint8_t *buf; // nb_entries lines.
+	uint32_t nb_entries;
+	uint32_t sector_size;
+	uint32_t line_sectors;
+	uint32_t clock;
+	session_meta_cache_stats_t stats;
+} session_meta_cache_t;
+
+/* Cache the disk accessed with read and write in nb_entries lines of line_sectors sectors, using
+ * entries and buf, which holds nb_entries * line_sectors * sector_size bytes.
+ * Returns 0, or -EINVAL if there is no line.
+ */
+int session_meta_cache_init(session_meta_cache_t *cache, session_meta_cache_read_t read,
+			    session_meta_cache_write_t write, void *ctx, session_meta_cache_entry_t *entries,
+			    uint8_t *buf, uint32_t nb_entries, uint32_t sector_size, uint32_t line_sectors);
+
+int session_meta_cache_read(session_meta_cache_t *cache, uint8_t *buf, uint32_t sector, uint32_t count);
+int session_meta_cache_write(session_meta_cache_t *cache, const uint8_t *buf, uint32_t sector, uint32_t count);
+
+/* Write count sectors from sector to the disk without caching them, the cached lines they overlap
+ * being kept up to date. For the data which must reach the disk when written.
+ */
+int session_meta_cache_write_through(session_meta_cache_t *cache, const uint8_t *buf, uint32_t sector,
+				     uint32_t count);
+
+/* Write the dirty lines back, in the order of the disk. Returns the number of lines written, or
+ * the first write error, the lines which failed staying dirty.
+ */
+int session_meta_cache_flush(session_meta_cache_t *cache);
+
+/* Drop the lines overlapping count sectors from sector, dirty or not, after the disk was written
+ * there without the cache.
+ */
+void session_meta_cache_invalidate(session_meta_cache_t *cache, uint32_t sector, uint32_t count);
+
+/* Number of dirty lines. */
+uint32_t session_meta_cache_dirty(const session_meta_cache_t *cache);
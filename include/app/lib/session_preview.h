@@ -0,0 +1,67 @@
+#pragma once
+
+#include <app/lib/session_codec.h>
+
+/* Decimated overview of a session, computed sample by sample while recording.
+ *
+ * Level 0 summarizes windows of SESSION_PREVIEW_FACTOR samples, and each next level windows of
+ * SESSION_PREVIEW_FACTOR windows of the level below. Each window is stored as three records laid
+ * out like the records of a binary session: the minimum, maximum and mean of each channel. The
+ * timestamp of the minimum record is the first one of the window, the one of the maximum record
+ * the last one, and the mean record holds the mean timestamp.
+ *
+ * A preview file starts with a session_preview_header_t, followed by the binary session header
+ * of its channels and by the records of the windows.
+ */
+
+#define SESSION_PREVIEW_MAGIC "XPRV"
+#define SESSION_PREVIEW_VERSION 1
+#define SESSION_PREVIEW_LEVELS 2
+#define SESSION_PREVIEW_FACTOR 16
+
+typedef struct __packed {
+	char magic[4]; // SESSION_PREVIEW_MAGIC
+	uint8_t version;
+	uint8_t level;
+	uint16_t decimation; // Samples per window.
+} session_preview_header_t;
+
+typedef struct {
+	float_t min[SESSION_CHANNEL_NB];
+	float_t max[SESSION_CHANNEL_NB];
+	float_t sum[SESSION_CHANNEL_NB];
+	float_t first_ts;
+	float_t last_ts;
+	uint32_t samples; // Samples in the window.
+	uint32_t count;	  // Samples, or windows of the level below, in the window.
+} session_preview_window_t;
+
+typedef struct {
+	uint32_t channels; // Channels of the records, always with the timestamp.
+	session_preview_window_t windows[SESSION_PREVIEW_LEVELS];
+} session_preview_t;
+
+/* Start an empty preview of the channels of channel_mask. */
+void session_preview_init(session_preview_t *preview, uint32_t channel_mask);
+
+/* Fill hdr with the preview header of level. */
+void session_preview_header(session_preview_header_t *hdr, int level);
+
+/* Size of the records of a window. */
+size_t session_preview_window_size(const session_preview_t *preview);
+
+/* Add a sample, values are indexed by session_channel_t.
+ * Returns the mask of the levels (BIT(level)) whose window the sample completed. These windows
+ * must be packed with session_preview_pack before the next sample is added.
+ */
+uint32_t session_preview_add(session_preview_t *preview, const float_t *values);
+
+/* Complete the windows left partially filled at the end of the session, once.
+ * Returns the mask of the levels with a window to pack.
+ */
+uint32_t session_preview_finish(session_preview_t *preview);
+
+/* Pack the records of the last window of level to out, which must hold
+ * session_preview_window_size bytes. Returns their size.
+ */
+size_t session_preview_pack(const session_preview_t *preview, int level, uint8_t *out);
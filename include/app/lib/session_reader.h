@@ -0,0 +1,60 @@
+#pragma once
+
+#include <zephyr/kernel.h>
+
+/* Buffered reader of a session file, for CSV lines and binary records.
+ *
+ * The file is read in large blocks into one buffer, and lines and records are returned as
+ * pointers into it, so that they can be parsed in place without any copy. Reads end on multiples
+ * of block_size in the file, a file system then reads whole sectors straight to the buffer.
+ * A line or a record stays valid until the next call on the reader.
+ */
+
+/* Read up to len bytes at the current position of ctx.
+ * Returns the number of bytes read, 0 at the end of the file, or a negative errno.
+ */
+typedef int (*session_reader_read_t)(void *ctx, void *data, size_t len);
+
+typedef struct {
+	session_reader_read_t read;
+	void *ctx;
+	uint8_t *buf;
+	uint32_t size;		 // Longest line or record.
+	uint32_t block_size; // Alignment of the reads in the file.
+	uint32_t start;		 // First byte not returned yet.
+	uint32_t end;		 // End of the bytes read.
+	uint32_t scanned;	 // Bytes after start searched for a newline.
+	uint32_t pos;		 // Offset in the file of buf[end].
+	bool eof;
+} session_reader_t;
+
+/* Read from the start of a file with read, using size bytes of buf.
+ * Returns 0, or -EINVAL if size is smaller than block_size.
+ */
+int session_reader_init(session_reader_t *reader, session_reader_read_t read, void *ctx,
+			uint8_t *buf, size_t size, size_t block_size);
+
+/* Drop the buffered bytes, after the file was moved to pos by the caller. */
+void session_reader_restart(session_reader_t *reader, uint32_t pos);
+
+/* Point data to the next bytes of the file, reading it if fewer than len are buffered.
+ * Returns how many bytes data points to, at most len and fewer only at the end of the file,
+ * or a negative errno. The bytes are not consumed.
+ */
+int session_reader_peek(session_reader_t *reader, const uint8_t **data, size_t len);
+
+/* Skip len bytes, at most what session_reader_peek returned. */
+void session_reader_consume(session_reader_t *reader, size_t len);
+
+/* Point record to the next len bytes of the file and consume them.
+ * Returns len, -ENOENT if fewer than len bytes are left, -E2BIG if len is larger than the
+ * buffer, or a read error.
+ */
+int session_reader_record(session_reader_t *reader, const uint8_t **record, size_t len);
+
+/* Point line to the next line of the file and consume it. The newline, and a carriage return
+ * before it, are replaced by a NUL. The last line does not need a newline.
+ * Returns the length of the line, -ENOENT at the end of the file, -E2BIG if the line does not
+ * fit in the buffer, or a read error.
+ */
+int session_reader_line(session_reader_t *reader, char **line);
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <zephyr/kernel.h>
+#include <zephyr/sys/atomic.h>
+
+/* Lock-free byte ring between a single producer and a single consumer, which can run in different
+ * threads without any lock: head is only written by the producer, tail by the consumer.
+ * Both count the bytes that went through the ring, and wrap around at 2^32.
+ */
+typedef struct {
+	uint8_t *buf;
+	uint32_t size; // Power of two.
+	atomic_t head;
+	atomic_t tail;
+} session_ring_t;
+
+/* Initialize an empty ring using size bytes of buf. Returns 0, or -EINVAL if size is not a power of two. */
+int session_ring_init(session_ring_t *ring, uint8_t *buf, size_t size);
+
+/* Number of bytes in the ring. */
+size_t session_ring_used(const session_ring_t *ring);
+
+/* Number of bytes that can be put in the ring. */
+size_t session_ring_space(const session_ring_t *ring);
+
+/* Producer: copy len bytes of data to the ring, all of them or none.
+ * Returns 0, or -ENOSPC if there is not enough room.
+ */
+int session_ring_put(session_ring_t *ring, const void *data, size_t len);
+
+/* Consumer: point data to the oldest bytes of the ring, and return how many of them are
+ * contiguous. They stay in the ring until session_ring_consume is called.
+ */
+size_t session_ring_peek(const session_ring_t *ring, const uint8_t **data);
+
+/* Consumer: remove len bytes, at most what session_ring_peek returned, from the ring. */
+void session_ring_consume(session_ring_t *ring, size_t len);
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <app/lib/session_codec.h>
+
+/* Statistics of a session, computed sample by sample while recording, in constant memory.
+ *
+ * Sums are accumulated in single precision over SESSION_SUMMARY_BLOCK_SAMPLES samples, then added
+ * to double precision totals: the FPU only does single precision, and a float sum of a long
+ * session would lose the small values.
+ */
+
+#define SESSION_SUMMARY_MAGIC "XSUM"
+#define SESSION_SUMMARY_VERSION 1
+#define SESSION_SUMMARY_BLOCK_SAMPLES 256
+
+typedef struct __packed {
+	float min;
+	float max;
+	float mean;
+	float rms;
+	uint32_t clipped; // Samples at the clipping limit of the channel, or beyond.
+} session_summary_channel_t;
+
+/* Summary of a session, as stored in its summary file, little-endian. */
+typedef struct __packed {
+	char magic[4]; // SESSION_SUMMARY_MAGIC
+	uint8_t version;
+	uint8_t nb_channels; // SESSION_CHANNEL_NB
+	uint16_t size;		 // Size of this record.
+	uint32_t channels;	 // Summarized channels, a mask of session_channel_t.
+	uint32_t nb_samples;
+	float first_ts_ms;
+	float last_ts_ms;
+	// Indexed by session_channel_t, zero for the timestamp and the channels not summarized.
+	session_summary_channel_t channel[SESSION_CHANNEL_NB];
+} session_summary_record_t;
+
+typedef struct {
+	uint32_t channels;
+	uint32_t nb_samples;
+	float_t first_ts;
+	float_t last_ts;
+	float_t min[SESSION_CHANNEL_NB];
+	float_t max[SESSION_CHANNEL_NB];
+	float_t clip[SESSION_CHANNEL_NB]; // 0 when the channel does not clip.
+	uint32_t clipped[SESSION_CHANNEL_NB];
+	uint32_t block_samples;
+	float_t block_sum[SESSION_CHANNEL_NB];
+	float_t block_sum_sq[SESSION_CHANNEL_NB];
+	double sum[SESSION_CHANNEL_NB];
+	double sum_sq[SESSION_CHANNEL_NB];
+} session_summary_t;
+
+/* Start an empty summary of the channels of channel_mask. */
+void session_summary_init(session_summary_t *summary, uint32_t channel_mask);
+
+/* Count the samples of channel whose absolute value reaches limit as clipped. */
+void session_summary_set_clip(session_summary_t *summary, session_channel_t channel, float_t limit);
+
+/* Add a sample, values are indexed by session_channel_t. */
+void session_summary_add(session_summary_t *summary, const float_t *values);
+
+/* Fill record with the summary of the samples added so far. */
+void session_summary_get(const session_summary_t *summary, session_summary_record_t *record);
@@ -3,6 +3,7 @@
 #include "platform_interface/platform_interface.h"
 #include "lsm6dsv16bx_sflp_utils.h"
 #include <zephyr/kernel.h>
+#include <math.h>
 
 #include <zephyr/logging/log.h>
 
@@ -19,6 +20,7 @@ static lsm6dsv16bx_sflp_gbias_t gbias = {.gbias_x = 0, .gbias_y = 0, .gbias_z =
 static lsm6dsv16bx_ah_qvar_mode_t qvar_mode;
 
 static struct k_work imu_int1_work;
+static struct k_work_delayable imu_fifo_retry_work;
 
 // Interrupt 1 init
 static const struct gpio_dt_spec imu_int_1 =
@@ -85,11 +87,52 @@ void _calibration_timer_cb(struct k_timer *dummy)
 	k_work_submit(&calibration_timer_work);
 }
 
-int lsm6dsv16bx_start_acquisition(bool enable_gbias, bool enable_sflp, bool enable_qvar)
+static int _apply_filter(const lsm6dsv16bx_filter_t *filter)
+{
+	int ret;
+
+	/* Mask accelerometer and gyroscope data until the settling of the sensors filter is completed */
+	ret = lsm6dsv16bx_filt_settling_mask_set(&sensor.dev_ctx, filter->settling_mask);
+	if (ret) {
+		LOG_ERR("lsm6dsv16bx_filt_settling_mask_set (%i)", ret);
+		return ret;
+	}
+
+	/* LPF2 and HPF share the same bandwidth field, HPF takes precedence when both are enabled */
+	ret = lsm6dsv16bx_filt_xl_lp2_bandwidth_set(&sensor.dev_ctx, filter->xl_bandwidth);
+	if (ret) {
+		LOG_ERR("lsm6dsv16bx_filt_xl_lp2_bandwidth_set (%i)", ret);
+		return ret;
+	}
+	ret = lsm6dsv16bx_filt_xl_lp2_set(&sensor.dev_ctx, filter->xl_lp2_enabled);
+	if (ret) {
+		LOG_ERR("lsm6dsv16bx_filt_xl_lp2_set (%i)", ret);
+		return ret;
+	}
+	ret = lsm6dsv16bx_filt_xl_hp_set(&sensor.dev_ctx, filter->xl_hp_enabled);
+	if (ret) {
+		LOG_ERR("lsm6dsv16bx_filt_xl_hp_set (%i)", ret);
+		return ret;
+	}
+
+	ret = lsm6dsv16bx_filt_gy_lp1_bandwidth_set(&sensor.dev_ctx, filter->gy_lp1_bandwidth);
+	if (ret) {
+		LOG_ERR("lsm6dsv16bx_filt_gy_lp1_bandwidth_set (%i)", ret);
+		return ret;
+	}
+	ret = lsm6dsv16bx_filt_gy_lp1_set(&sensor.dev_ctx, filter->gy_lp1_enabled);
+	if (ret) {
+		LOG_ERR("lsm6dsv16bx_filt_gy_lp1_set (%i)", ret);
+		return ret;
+	}
+
+	return 0;
+}
+
+int lsm6dsv16bx_start_acquisition(bool enable_gbias, bool enable_sflp, bool enable_qvar, bool enable_raw_fifo)
 {
 	lsm6dsv16bx_pin_int_route_t pin1_int = {0};
 	lsm6dsv16bx_fifo_sflp_raw_t fifo_sflp = {0};
-	lsm6dsv16bx_filt_settling_mask_t filt_settling_mask = {0};
 	int ret;
 
 	/* Enable Block Data Update */
@@ -128,10 +171,15 @@ int lsm6dsv16bx_start_acquisition(bool enable_gbias, bool enable_sflp, bool enab
 	uint8_t xl_sampling_frequency = LSM6DSV16BX_XL_BATCHED_AT_120Hz;
 	uint8_t g_sampling_frequency = LSM6DSV16BX_XL_BATCHED_AT_120Hz;
 	uint8_t sflp_sampling_frequency = LSM6DSV16BX_SFLP_120Hz;
+	sensor.odr.xl_hz = 120;
+	sensor.odr.gy_hz = 120;
+	sensor.odr.sflp_hz = enable_sflp ? 120 : 0;
 	if (!enable_sflp && !enable_gbias)
 	{
 		xl_sampling_frequency = LSM6DSV16BX_XL_BATCHED_AT_240Hz;
 		g_sampling_frequency = LSM6DSV16BX_XL_BATCHED_AT_240Hz;
+		sensor.odr.xl_hz = 240;
+		sensor.odr.gy_hz = 240;
 	}
 	/* Set FIFO batch XL/Gyro ODR to specified frequency */
 	ret = lsm6dsv16bx_fifo_xl_batch_set(&sensor.dev_ctx, xl_sampling_frequency);
@@ -190,16 +238,11 @@ int lsm6dsv16bx_start_acquisition(bool enable_gbias, bool enable_sflp, bool enab
 
 	sensor.state.xl_enabled = true;
 	sensor.state.gy_enabled = true;
-	/* Mask accelerometer and gyroscope data until the settling of the sensors filter is completed */
-  	filt_settling_mask.drdy = PROPERTY_ENABLE;
-  	filt_settling_mask.irq_xl = PROPERTY_ENABLE;
-  	filt_settling_mask.irq_g = PROPERTY_ENABLE;
-  	ret = lsm6dsv16bx_filt_settling_mask_set(&sensor.dev_ctx, filt_settling_mask);
+
+	ret = _apply_filter(&sensor.filter);
 	if (ret) {
-		LOG_ERR("lsm6dsv16bx_filt_settling_mask_set (%i)", ret);
+		LOG_ERR("Failed to apply filter configuration (%i)", ret);
 	}
-//	lsm6dsv16bx_filt_xl_lp2_set(&sensor.dev_ctx, PROPERTY_ENABLE);
-//	lsm6dsv16bx_filt_xl_lp2_bandwidth_set(&sensor.dev_ctx, LSM6DSV16BX_XL_STRONG);
 
 	if (enable_qvar)
 	{
@@ -226,6 +269,13 @@ int lsm6dsv16bx_start_acquisition(bool enable_gbias, bool enable_sflp, bool enab
 		sensor.state.qvar_enabled = true;
 	}
 
+	if (enable_raw_fifo && !sensor.callbacks.lsm6dsv16bx_fifo_raw_cb)
+	{
+		LOG_ERR("No raw FIFO callback defined, decoding FIFO data instead!");
+		enable_raw_fifo = false;
+	}
+	sensor.state.raw_fifo_enabled = enable_raw_fifo;
+
 	sensor.nb_samples_to_discard = CONFIG_LSM6DSV16BX_SAMPLES_TO_DISCARD;
 
 	return 0;
@@ -252,6 +302,7 @@ int lsm6dsv16bx_reset()
 		.fsm_enabled = false,
 		.calib = LSM6DSV16BX_CALIBRATION_NOT_CALIBRATING,
 		.int2_on_int1 = false,
+		.raw_fifo_enabled = false,
 	};
 	memcpy(&sensor.state, &tmp_state, sizeof(tmp_state));
 
@@ -260,7 +311,7 @@ int lsm6dsv16bx_reset()
 
 int lsm6dsv16bx_start_calibration()
 {
-	int res = lsm6dsv16bx_start_acquisition(true, false, false);
+	int res = lsm6dsv16bx_start_acquisition(true, false, false, false);
 	if (res != 0)
 	{
 		LOG_ERR("Error while starting the sensor");
@@ -344,6 +395,79 @@ void lsm6dsv16bx_set_gbias(float x, float y, float z)
 	gbias.gbias_z = z / 1000.0f;
 }
 
+/* Gyroscope bias in mdps, as given to lsm6dsv16bx_set_gbias. */
+void lsm6dsv16bx_get_gbias(float *x, float *y, float *z)
+{
+	*x = gbias.gbias_x * 1000.0f;
+	*y = gbias.gbias_y * 1000.0f;
+	*z = gbias.gbias_z * 1000.0f;
+}
+
+/* The filter configuration is applied on the next call to lsm6dsv16bx_start_acquisition. */
+void lsm6dsv16bx_set_filter(lsm6dsv16bx_filter_t filter)
+{
+	if (filter.xl_lp2_enabled && filter.xl_hp_enabled)
+	{
+		LOG_WRN("Both accelerometer LPF2 and HPF enabled, HPF takes precedence.");
+	}
+	sensor.filter = filter;
+}
+
+lsm6dsv16bx_filter_t lsm6dsv16bx_get_filter()
+{
+	return sensor.filter;
+}
+
+lsm6dsv16bx_scale_t lsm6dsv16bx_get_scale()
+{
+	return sensor.scale;
+}
+
+/* Rates set by the last call to lsm6dsv16bx_start_acquisition. */
+lsm6dsv16bx_odr_t lsm6dsv16bx_get_odr()
+{
+	return sensor.odr;
+}
+
+/* Fill the sensor related fields of a raw capture header. Call after lsm6dsv16bx_start_acquisition. */
+int lsm6dsv16bx_get_raw_header(lsm6dsv16bx_raw_header_t *header)
+{
+	memset(header, 0, sizeof(lsm6dsv16bx_raw_header_t));
+	memcpy(header->magic, LSM6DSV16BX_RAW_HEADER_MAGIC, sizeof(header->magic));
+	header->version = LSM6DSV16BX_RAW_HEADER_VERSION;
+	header->header_size = sizeof(lsm6dsv16bx_raw_header_t);
+	header->whoami = sensor.whoamI;
+	header->xl_scale = sensor.scale.xl_scale;
+	header->gy_scale = sensor.scale.gy_scale;
+	header->samples_discarded = CONFIG_LSM6DSV16BX_SAMPLES_TO_DISCARD;
+
+	int ret = lsm6dsv16bx_read_reg(&sensor.dev_ctx, LSM6DSV16BX_FIFO_CTRL1, header->regs, LSM6DSV16BX_RAW_HEADER_NB_REGS);
+	if (ret) {
+		LOG_ERR("lsm6dsv16bx_read_reg LSM6DSV16BX_FIFO_CTRL1 (%i)", ret);
+		return ret;
+	}
+
+	header->xl_sensitivity_mg = (*sensor.scale.xl_conversion_function)(1);
+	header->gy_sensitivity_mdps = (*sensor.scale.gy_conversion_function)(1);
+	header->gravity_sensitivity_mg = lsm6dsv16bx_from_sflp_to_mg(1);
+	// The QVar conversion function divides by the sensitivity, store it as such.
+	header->qvar_lsb_per_mv = roundf(1.0f / lsm6dsv16bx_from_lsb_to_mv(1));
+	header->ts_resolution_ns = lsm6dsv16bx_from_lsb_to_nsec(1);
+	header->gbias[0] = gbias.gbias_x;
+	header->gbias[1] = gbias.gbias_y;
+	header->gbias[2] = gbias.gbias_z;
+
+	header->tag_xl = LSM6DSV16BX_XL_NC_TAG;
+	header->tag_gy = LSM6DSV16BX_GY_NC_TAG;
+	header->tag_ts = LSM6DSV16BX_TIMESTAMP_TAG;
+	header->tag_game_rot = LSM6DSV16BX_SFLP_GAME_ROTATION_VECTOR_TAG;
+	header->tag_gravity = LSM6DSV16BX_SFLP_GRAVITY_VECTOR_TAG;
+	header->tag_gbias = LSM6DSV16BX_SFLP_GYROSCOPE_BIAS_TAG;
+	header->tag_qvar = LSM6DSV16BX_AH_QVAR;
+
+	return 0;
+}
+
 void lsm6dsv16bx_int2_irq(struct k_work *item)
 {
 	bool handled = false;
@@ -536,61 +660,92 @@ static bool _data_handler_calibrating(lsm6dsv16bx_fifo_out_raw_t* f_data, float_
 	return handled;
 }
 
-void lsm6dsv16bx_int1_irq(struct k_work *item)
+/* Read the FIFO and hand its words over to the data handlers. */
+static void _read_fifo()
 {
-	bool handled = false;
 	uint16_t num = 0;
     lsm6dsv16bx_fifo_status_t fifo_status;
 	float_t gbias_tmp[3];
 	bool calibration_result = false;
 
-	if (sensor.state.xl_enabled || sensor.state.gy_enabled || sensor.state.qvar_enabled)
+	/* Read watermark flag */
+	lsm6dsv16bx_fifo_status_get(&sensor.dev_ctx, &fifo_status);
+	num = fifo_status.fifo_level;
+
+	// While the application cannot keep up, leave the samples in the FIFO as long as it has room.
+	// The watermark interrupt does not fire again until the FIFO is read, so poll it.
+	if (sensor.state.calib == LSM6DSV16BX_CALIBRATION_NOT_CALIBRATING && num < FIFO_BACKPRESSURE_MAX_LEVEL &&
+	    sensor.callbacks.lsm6dsv16bx_backpressure_cb && (*sensor.callbacks.lsm6dsv16bx_backpressure_cb)())
 	{
-		handled = true;
-		/* Read watermark flag */
-		lsm6dsv16bx_fifo_status_get(&sensor.dev_ctx, &fifo_status);
-		num = fifo_status.fifo_level;
+		k_work_schedule(&imu_fifo_retry_work, K_MSEC(FIFO_BACKPRESSURE_RETRY_MS));
+		return;
+	}
 
-		if (sensor.state.calib != LSM6DSV16BX_CALIBRATION_SETTLING) {
-			LOG_DBG("Received %d samples from FIFO.", num);
-		}
+	if (sensor.state.calib != LSM6DSV16BX_CALIBRATION_SETTLING) {
+		LOG_DBG("Received %d samples from FIFO.", num);
+	}
 
-		while (num--) {
-			lsm6dsv16bx_fifo_out_raw_t f_data;
+	while (num--) {
+		lsm6dsv16bx_fifo_out_raw_t f_data;
 
-			/* Read FIFO sensor value */
-			lsm6dsv16bx_fifo_out_raw_get(&sensor.dev_ctx, &f_data);
+		/* Read FIFO sensor value */
+		lsm6dsv16bx_fifo_out_raw_get(&sensor.dev_ctx, &f_data);
 
-			if (sensor.nb_samples_to_discard) {
-				sensor.nb_samples_to_discard--;
-				continue;
-			}
+		if (sensor.nb_samples_to_discard) {
+			sensor.nb_samples_to_discard--;
+			continue;
+		}
 
-			if (sensor.state.calib == LSM6DSV16BX_CALIBRATION_NOT_CALIBRATING)
-			{
-				_data_handler_recording(&f_data);
-			} else if (sensor.state.calib == LSM6DSV16BX_CALIBRATION_RECORDING)
+		if (sensor.state.calib == LSM6DSV16BX_CALIBRATION_NOT_CALIBRATING && sensor.state.raw_fifo_enabled)
+		{
+			// Rebuild the FIFO_DATA_OUT_TAG register value and hand over the word as-is.
+			uint8_t word[FIFO_WORD_SIZE];
+			word[0] = (f_data.tag << 3) | (f_data.cnt << 1);
+			memcpy(&word[1], f_data.data, sizeof(f_data.data));
+			(*sensor.callbacks.lsm6dsv16bx_fifo_raw_cb)(word);
+		} else if (sensor.state.calib == LSM6DSV16BX_CALIBRATION_NOT_CALIBRATING)
+		{
+			_data_handler_recording(&f_data);
+		} else if (sensor.state.calib == LSM6DSV16BX_CALIBRATION_RECORDING)
+		{
+			calibration_result = _data_handler_calibrating(&f_data, gbias_tmp);
+			if (calibration_result)
 			{
-				calibration_result = _data_handler_calibrating(&f_data, gbias_tmp);
-				if (calibration_result)
-				{
-					break;
-				}
+				break;
 			}
 		}
+	}
 
-		if (sensor.state.calib == LSM6DSV16BX_CALIBRATION_RECORDING && calibration_result)
+	if (sensor.state.calib == LSM6DSV16BX_CALIBRATION_RECORDING && calibration_result)
+	{
+		k_timer_stop(&calibration_timer);
+		lsm6dsv16bx_reset();
+		if (sensor.callbacks.lsm6dsv16bx_calibration_result_cb)
 		{
-			k_timer_stop(&calibration_timer);
-			lsm6dsv16bx_reset();
-			if (sensor.callbacks.lsm6dsv16bx_calibration_result_cb)
-			{
-				(*sensor.callbacks.lsm6dsv16bx_calibration_result_cb)(calibration_result, gbias_tmp[0], gbias_tmp[1], gbias_tmp[2]);
-			} else {
-				LOG_ERR("No Calibration callback defined!");
-			}
+			(*sensor.callbacks.lsm6dsv16bx_calibration_result_cb)(calibration_result, gbias_tmp[0], gbias_tmp[1], gbias_tmp[2]);
+		} else {
+			LOG_ERR("No Calibration callback defined!");
 		}
 	}
+}
+
+static void _fifo_retry_work_cb(struct k_work *work)
+{
+	if (sensor.state.xl_enabled || sensor.state.gy_enabled || sensor.state.qvar_enabled)
+	{
+		_read_fifo();
+	}
+}
+
+void lsm6dsv16bx_int1_irq(struct k_work *item)
+{
+	bool handled = false;
+
+	if (sensor.state.xl_enabled || sensor.state.gy_enabled || sensor.state.qvar_enabled)
+	{
+		handled = true;
+		_read_fifo();
+	}
 
 	if (sensor.state.int2_on_int1)
 	{
@@ -820,6 +975,7 @@ void lsm6dsv16bx_init(lsm6dsv16bx_cb_t cb, lsm6dsv16bx_fsm_cfg_t fsm_cfg)
 	}
 
 	k_work_init(&imu_int1_work, lsm6dsv16bx_int1_irq);
+	k_work_init_delayable(&imu_fifo_retry_work, _fifo_retry_work_cb);
 
 #if DT_NODE_EXISTS(imu_int2)
 	res = attach_interrupt(imu_int_2, GPIO_INPUT, GPIO_INT_EDGE_TO_ACTIVE, &imu_int_2_cb_data, imu_int_2_cb);
@@ -858,6 +1014,20 @@ void lsm6dsv16bx_init(lsm6dsv16bx_cb_t cb, lsm6dsv16bx_fsm_cfg_t fsm_cfg)
 
 	lsm6dsv16bx_scale_init(LSM6DSV16BX_4g, LSM6DSV16BX_2000dps);
 
+	lsm6dsv16bx_filter_t filter = {
+		.xl_lp2_enabled = IS_ENABLED(CONFIG_LSM6DSV16BX_FILTER_XL_LP2),
+		.xl_hp_enabled = IS_ENABLED(CONFIG_LSM6DSV16BX_FILTER_XL_HP),
+		.xl_bandwidth = CONFIG_LSM6DSV16BX_FILTER_XL_BANDWIDTH,
+		.gy_lp1_enabled = IS_ENABLED(CONFIG_LSM6DSV16BX_FILTER_GY_LP1),
+		.gy_lp1_bandwidth = CONFIG_LSM6DSV16BX_FILTER_GY_LP1_BANDWIDTH,
+		.settling_mask = {
+			.drdy = IS_ENABLED(CONFIG_LSM6DSV16BX_FILTER_SETTLING_MASK),
+			.irq_xl = IS_ENABLED(CONFIG_LSM6DSV16BX_FILTER_SETTLING_MASK),
+			.irq_g = IS_ENABLED(CONFIG_LSM6DSV16BX_FILTER_SETTLING_MASK),
+		},
+	};
+	lsm6dsv16bx_set_filter(filter);
+
 	lsm6dsv16bx_state_t tmp_state = {
 		.xl_enabled = false,
 		.gy_enabled = false,
@@ -870,6 +1040,7 @@ void lsm6dsv16bx_init(lsm6dsv16bx_cb_t cb, lsm6dsv16bx_fsm_cfg_t fsm_cfg)
 		.fsm_enabled = false,
 		.calib = LSM6DSV16BX_CALIBRATION_NOT_CALIBRATING,
 		.int2_on_int1 = false,
+		.raw_fifo_enabled = false,
 	};
 	memcpy(&sensor.state, &tmp_state, sizeof(tmp_state));
 }
@@ -0,0 +1,255 @@
+#include "session_codec_priv.h"
+#include <zephyr/sys/byteorder.h>
+#include <string.h>
+
+typedef struct {
+	session_bin_type_t type;
+	float scale;
+} channel_desc_t;
+
+/* Storage of each channel. Integer widths are chosen so that the full sensor range fits. */
+static const channel_desc_t channel_descs[SESSION_CHANNEL_NB] = {
+	[SESSION_CHANNEL_TS] = {SESSION_BIN_TYPE_F32, 1e-3f},
+	[SESSION_CHANNEL_ACC_X ... SESSION_CHANNEL_ACC_Z] = {SESSION_BIN_TYPE_I16, 1e-3f},
+	[SESSION_CHANNEL_GYRO_X ... SESSION_CHANNEL_GYRO_Z] = {SESSION_BIN_TYPE_I32, 1e-3f},
+	[SESSION_CHANNEL_GAME_ROT_X ... SESSION_CHANNEL_GAME_ROT_W] = {SESSION_BIN_TYPE_I16, 1e-3f},
+	[SESSION_CHANNEL_GRAVITY_X ... SESSION_CHANNEL_GRAVITY_Z] = {SESSION_BIN_TYPE_I16, 1e-3f},
+	[SESSION_CHANNEL_QVAR] = {SESSION_BIN_TYPE_I16, 1e-3f},
+};
+
+static const uint8_t type_sizes[] = {
+	[SESSION_BIN_TYPE_F32] = 4,
+	[SESSION_BIN_TYPE_I16] = 2,
+	[SESSION_BIN_TYPE_I32] = 4,
+};
+
+BUILD_ASSERT(SESSION_BIN_HEADER_MIN_SIZE == 58, "Binary session header layout changed");
+
+/* Version 1 channel descriptors have no step: all values are exact. */
+#define SESSION_BIN_VERSION_1 1
+
+typedef struct __packed {
+	uint8_t id;
+	uint8_t type;
+	float scale;
+} session_bin_channel_v1_t;
+
+static int32_t _round_sat(float_t val, int32_t min, int32_t max)
+{
+	if (isnan(val)) {
+		return 0;
+	}
+	val = rintf(val); // Half to even, like the CSV format.
+	if (val <= (float_t)min) {
+		return min;
+	} else if (val >= (float_t)max) {
+		return max;
+	}
+	return (int32_t)val;
+}
+
+session_bin_type_t session_bin_channel_type(session_channel_t channel)
+{
+	return channel_descs[channel].type;
+}
+
+int32_t session_bin_to_int(session_bin_type_t type, float_t val)
+{
+	int32_t res;
+
+	switch (type) {
+	case SESSION_BIN_TYPE_F32:
+		memcpy(&res, &val, sizeof(res));
+		return res;
+	case SESSION_BIN_TYPE_I16:
+		return _round_sat(val, INT16_MIN, INT16_MAX);
+	default:
+		return _round_sat(val, INT32_MIN, INT32_MAX);
+	}
+}
+
+float_t session_bin_from_int(session_bin_type_t type, int32_t val, uint16_t step)
+{
+	float_t res;
+
+	if (type == SESSION_BIN_TYPE_F32) {
+		memcpy(&res, &val, sizeof(res));
+		return res;
+	}
+	return (float_t)((int64_t)val * step);
+}
+
+int32_t session_bin_quantize(int32_t val, uint16_t step)
+{
+	if (step <= 1) {
+		return val;
+	}
+	// Floor division of val + step / 2, so that the error is at most step / 2 on both sides.
+	int64_t num = (int64_t)val + step / 2;
+	int64_t res = num / step;
+	return (int32_t)((num % step < 0) ? res - 1 : res);
+}
+
+int session_bin_header_init(session_bin_header_t *hdr, uint32_t channel_mask)
+{
+	if (channel_mask == 0 || (channel_mask & ~BIT_MASK(SESSION_CHANNEL_NB))) {
+		return -EINVAL;
+	}
+
+	memset(hdr, 0, sizeof(session_bin_header_t));
+	memcpy(hdr->magic, SESSION_BIN_MAGIC, sizeof(hdr->magic));
+	hdr->version = SESSION_BIN_VERSION;
+	hdr->encoding = SESSION_BIN_ENCODING_RECORDS;
+
+	for (int ii = 0; ii < SESSION_CHANNEL_NB; ii++) {
+		if (channel_mask & BIT(ii)) {
+			session_bin_channel_t *ch = &hdr->channels[hdr->nb_channels++];
+			ch->id = ii;
+			ch->type = channel_descs[ii].type;
+			ch->scale = channel_descs[ii].scale;
+			ch->step = 1;
+		}
+	}
+
+	hdr->record_size = session_bin_record_size(channel_mask);
+	hdr->header_size = SESSION_BIN_HEADER_MIN_SIZE + hdr->nb_channels * sizeof(session_bin_channel_t);
+	return hdr->header_size;
+}
+
+int session_bin_header_set_max_error(session_bin_header_t *hdr, session_channel_t channel, uint16_t max_error)
+{
+	if (channel == SESSION_CHANNEL_TS || max_error > (UINT16_MAX - 1) / 2) {
+		return -EINVAL;
+	}
+
+	for (int ii = 0; ii < hdr->nb_channels; ii++) {
+		if (hdr->channels[ii].id == channel) {
+			hdr->channels[ii].step = 2 * max_error + 1;
+			return 0;
+		}
+	}
+	return -EINVAL;
+}
+
+int session_bin_header_load(session_bin_header_t *hdr, const void *data, size_t len)
+{
+	const session_bin_header_t *in = data;
+
+	if (len < SESSION_BIN_HEADER_MIN_SIZE || memcmp(in->magic, SESSION_BIN_MAGIC, sizeof(in->magic)) != 0) {
+		return -EINVAL;
+	}
+	if ((in->version != SESSION_BIN_VERSION && in->version != SESSION_BIN_VERSION_1) || in->nb_channels == 0 ||
+	    in->nb_channels > SESSION_CHANNEL_NB) {
+		return -ENOTSUP;
+	}
+
+	size_t channel_size = (in->version == SESSION_BIN_VERSION_1) ? sizeof(session_bin_channel_v1_t)
+								      : sizeof(session_bin_channel_t);
+	size_t header_size = SESSION_BIN_HEADER_MIN_SIZE + in->nb_channels * channel_size;
+	if (in->header_size != header_size || len < header_size) {
+		return -EINVAL;
+	}
+
+	memcpy(hdr, data, SESSION_BIN_HEADER_MIN_SIZE);
+	if (in->version == SESSION_BIN_VERSION_1) {
+		const session_bin_channel_v1_t *channels =
+			(const session_bin_channel_v1_t *)((const uint8_t *)data + SESSION_BIN_HEADER_MIN_SIZE);
+
+		for (int ii = 0; ii < hdr->nb_channels; ii++) {
+			hdr->channels[ii].id = channels[ii].id;
+			hdr->channels[ii].type = channels[ii].type;
+			hdr->channels[ii].scale = channels[ii].scale;
+			hdr->channels[ii].step = 1;
+		}
+		hdr->version = SESSION_BIN_VERSION;
+		hdr->header_size = SESSION_BIN_HEADER_MIN_SIZE + hdr->nb_channels * sizeof(session_bin_channel_t);
+	} else {
+		memcpy(hdr->channels, in->channels, hdr->nb_channels * sizeof(session_bin_channel_t));
+	}
+
+	size_t record_size = 0;
+	for (int ii = 0; ii < hdr->nb_channels; ii++) {
+		if (hdr->channels[ii].id >= SESSION_CHANNEL_NB || hdr->channels[ii].type >= ARRAY_SIZE(type_sizes)) {
+			return -ENOTSUP;
+		}
+		if (hdr->channels[ii].step == 0 ||
+		    (hdr->channels[ii].type == SESSION_BIN_TYPE_F32 && hdr->channels[ii].step != 1)) {
+			return -EINVAL;
+		}
+		record_size += type_sizes[hdr->channels[ii].type];
+	}
+	if (hdr->record_size != record_size) {
+		return -EINVAL;
+	}
+
+	return header_size;
+}
+
+int session_bin_header_check(const session_bin_header_t *hdr, size_t len)
+{
+	session_bin_header_t tmp;
+
+	return session_bin_header_load(&tmp, hdr, len);
+}
+
+uint32_t session_bin_header_channels(const session_bin_header_t *hdr)
+{
+	uint32_t channels = 0;
+
+	for (int ii = 0; ii < hdr->nb_channels; ii++) {
+		channels |= BIT(hdr->channels[ii].id);
+	}
+	return channels;
+}
+
+size_t session_bin_record_size(uint32_t channel_mask)
+{
+	size_t size = 0;
+
+	for (int ii = 0; ii < SESSION_CHANNEL_NB; ii++) {
+		if (channel_mask & BIT(ii)) {
+			size += type_sizes[channel_descs[ii].type];
+		}
+	}
+	return size;
+}
+
+size_t session_bin_pack_record(uint32_t channel_mask, const float_t *values, uint8_t *out)
+{
+	uint8_t *p = out;
+
+	for (int ii = 0; ii < SESSION_CHANNEL_NB; ii++) {
+		if (!(channel_mask & BIT(ii))) {
+			continue;
+		}
+
+		session_bin_type_t type = channel_descs[ii].type;
+		int32_t val = session_bin_to_int(type, values[ii]);
+		if (type_sizes[type] == 2) {
+			sys_put_le16((uint16_t)val, p);
+		} else {
+			sys_put_le32((uint32_t)val, p);
+		}
+		p += type_sizes[type];
+	}
+	return p - out;
+}
+
+size_t session_bin_unpack_record(const session_bin_header_t *hdr, const uint8_t *in, float_t *values)
+{
+	const uint8_t *p = in;
+
+	for (int ii = 0; ii < hdr->nb_channels; ii++) {
+		session_bin_type_t type = hdr->channels[ii].type;
+		int32_t val;
+
+		if (type_sizes[type] == 2) {
+			val = (int16_t)sys_get_le16(p);
+		} else {
+			val = (int32_t)sys_get_le32(p);
+		}
+		values[hdr->channels[ii].id] = session_bin_from_int(type, val, hdr->channels[ii].step);
+		p += type_sizes[type];
+	}
+	return p - in;
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <app/lib/session_codec.h>
+
+/* Storage type of a channel in binary sessions. */
+session_bin_type_t session_bin_channel_type(session_channel_t channel);
+
+/* Integer stored for val in a channel of the given type: the float bits for SESSION_BIN_TYPE_F32,
+ * the value rounded half to even and saturated otherwise.
+ */
+int32_t session_bin_to_int(session_bin_type_t type, float_t val);
+
+/* Inverse of session_bin_to_int, for an integer quantized with step (1 for exact values). */
+float_t session_bin_from_int(session_bin_type_t type, int32_t val, uint16_t step);
+
+/* Quantize val with an odd step: the nearest multiple of step, divided by step. */
+int32_t session_bin_quantize(int32_t val, uint16_t step);
+
+/* Zigzag varints of the delta and columnar encodings. */
+static inline uint32_t session_zigzag(int32_t val)
+{
+	return ((uint32_t)val << 1) ^ (uint32_t)(val >> 31);
+}
+
+static inline int32_t session_unzigzag(uint32_t val)
+{
+	return (int32_t)(val >> 1) ^ -(int32_t)(val & 1);
+}
+
+static inline uint8_t *session_put_varint(uint8_t *p, uint32_t val)
+{
+	while (val >= 0x80) {
+		*p++ = (uint8_t)val | 0x80;
+		val >>= 7;
+	}
+	*p++ = (uint8_t)val;
+	return p;
+}
+
+static inline const uint8_t *session_get_varint(const uint8_t *p, const uint8_t *end, uint32_t *val)
+{
+	uint32_t res = 0;
+
+	for (int shift = 0; shift < 35 && p < end; shift += 7) {
+		uint8_t byte = *p++;
+		res |= (uint32_t)(byte & 0x7F) << shift;
+		if (!(byte & 0x80)) {
+			*val = res;
+			return p;
+		}
+	}
+	return NULL;
+}
@@ -0,0 +1,194 @@
+#include "session_codec_priv.h"
+#include <zephyr/sys/byteorder.h>
+#include <string.h>
+
+static inline size_t _dir_size(uint8_t nb_channels)
+{
+	return SESSION_DELTA_BLOCK_HEADER_SIZE + nb_channels * SESSION_COLUMN_DIR_ENTRY_SIZE;
+}
+
+/* Part of the encoder buffer holding chunk ii until the block is finished. */
+static inline uint8_t *_chunk_area(session_column_encoder_t *enc, int ii)
+{
+	return &enc->buf[_dir_size(enc->nb_channels) + ii * enc->max_samples * SESSION_DELTA_VALUE_MAX_SIZE];
+}
+
+int session_column_encoder_init(session_column_encoder_t *enc, uint32_t channel_mask, uint16_t max_samples,
+				uint8_t *buf, size_t size)
+{
+	memset(enc, 0, sizeof(session_column_encoder_t));
+	enc->channels = channel_mask & BIT_MASK(SESSION_CHANNEL_NB);
+	enc->nb_channels = __builtin_popcount(enc->channels);
+	enc->buf = buf;
+
+	size_t fit = 0;
+	size_t dir_size = _dir_size(enc->nb_channels);
+	if (enc->nb_channels && size > dir_size) {
+		// The payload size is 16 bits, like delta blocks.
+		fit = (MIN(size, SESSION_DELTA_BLOCK_HEADER_SIZE + UINT16_MAX) - dir_size) /
+		      (enc->nb_channels * SESSION_DELTA_VALUE_MAX_SIZE);
+	}
+	enc->max_samples = MIN(max_samples, fit);
+	if (enc->max_samples == 0) {
+		return -EINVAL;
+	}
+
+	for (int ii = 0; ii < SESSION_CHANNEL_NB; ii++) {
+		enc->step[ii] = 1;
+	}
+	return 0;
+}
+
+int session_column_encoder_set_steps(session_column_encoder_t *enc, const session_bin_header_t *hdr)
+{
+	if (session_bin_header_channels(hdr) != enc->channels) {
+		return -EINVAL;
+	}
+
+	for (int ii = 0; ii < hdr->nb_channels; ii++) {
+		enc->step[hdr->channels[ii].id] = hdr->channels[ii].step;
+	}
+	return 0;
+}
+
+int session_column_encode(session_column_encoder_t *enc, const float_t *values)
+{
+	bool keyframe = (enc->nb_samples == 0);
+	int chunk = 0;
+
+	for (int ii = 0; ii < SESSION_CHANNEL_NB; ii++) {
+		if (!(enc->channels & BIT(ii))) {
+			continue;
+		}
+		int32_t val = session_bin_quantize(session_bin_to_int(session_bin_channel_type(ii), values[ii]), enc->step[ii]);
+		uint8_t *start = _chunk_area(enc, chunk) + enc->len[chunk];
+		uint8_t *p = session_put_varint(start, session_zigzag(keyframe ? val : (int32_t)((uint32_t)val - (uint32_t)enc->prev[ii])));
+		enc->len[chunk] += p - start;
+		enc->prev[ii] = val;
+		chunk++;
+	}
+
+	enc->nb_samples++;
+	return (enc->nb_samples >= enc->max_samples) ? 1 : 0;
+}
+
+size_t session_column_block_finish(session_column_encoder_t *enc)
+{
+	size_t len = 0;
+
+	if (enc->nb_samples) {
+		len = _dir_size(enc->nb_channels);
+		for (int ii = 0; ii < enc->nb_channels; ii++) {
+			// Chunks only move towards the start of the buffer, the next ones are not overwritten.
+			memmove(&enc->buf[len], _chunk_area(enc, ii), enc->len[ii]);
+			sys_put_le16(enc->len[ii], &enc->buf[SESSION_DELTA_BLOCK_HEADER_SIZE + ii * SESSION_COLUMN_DIR_ENTRY_SIZE]);
+			len += enc->len[ii];
+		}
+		sys_put_le16(len - SESSION_DELTA_BLOCK_HEADER_SIZE, &enc->buf[0]);
+		sys_put_le16(enc->nb_samples, &enc->buf[2]);
+	}
+
+	memset(enc->len, 0, sizeof(enc->len));
+	enc->nb_samples = 0;
+	return len;
+}
+
+int session_column_find_chunk(const session_bin_header_t *hdr, const uint8_t *data, size_t len,
+			      session_channel_t channel, size_t *offset, size_t *size)
+{
+	size_t dir_size = _dir_size(hdr->nb_channels);
+	if (len < dir_size) {
+		return -EAGAIN;
+	}
+
+	size_t payload = sys_get_le16(&data[0]);
+	uint16_t nb_samples = sys_get_le16(&data[2]);
+	if (nb_samples == 0 || payload < dir_size - SESSION_DELTA_BLOCK_HEADER_SIZE) {
+		return -EINVAL;
+	}
+
+	int res = -ENOENT;
+	size_t pos = dir_size;
+	for (int ii = 0; ii < hdr->nb_channels; ii++) {
+		size_t chunk_size = sys_get_le16(&data[SESSION_DELTA_BLOCK_HEADER_SIZE + ii * SESSION_COLUMN_DIR_ENTRY_SIZE]);
+		if (chunk_size < nb_samples) {
+			return -EINVAL; // At least one byte per value.
+		}
+		if (hdr->channels[ii].id == channel) {
+			*offset = pos;
+			*size = chunk_size;
+			res = 0;
+		}
+		pos += chunk_size;
+	}
+	if (pos != SESSION_DELTA_BLOCK_HEADER_SIZE + payload) {
+		return -EINVAL;
+	}
+
+	return (res < 0) ? res : (int)pos;
+}
+
+int session_column_decoder_init(session_column_decoder_t *dec, const session_bin_header_t *hdr, uint32_t channel_mask,
+				const uint8_t *data, size_t len)
+{
+	size_t offset, size;
+	int block_size = -ENOENT;
+
+	dec->hdr = hdr;
+	dec->channels = channel_mask ? channel_mask & session_bin_header_channels(hdr) : session_bin_header_channels(hdr);
+	dec->sample = 0;
+	dec->nb_samples = 0;
+	if (dec->channels == 0) {
+		return -EINVAL;
+	}
+
+	for (int ii = 0; ii < hdr->nb_channels; ii++) {
+		if (!(dec->channels & BIT(hdr->channels[ii].id))) {
+			continue;
+		}
+		block_size = session_column_find_chunk(hdr, data, len, hdr->channels[ii].id, &offset, &size);
+		if (block_size < 0) {
+			return block_size;
+		}
+		dec->p[ii] = &data[offset];
+		dec->end[ii] = &data[offset + size];
+	}
+	if ((size_t)block_size > len) {
+		return -EAGAIN;
+	}
+
+	dec->nb_samples = sys_get_le16(&data[2]);
+	return block_size;
+}
+
+int session_column_decode(session_column_decoder_t *dec, float_t *values)
+{
+	if (dec->sample >= dec->nb_samples) {
+		return -ENODATA;
+	}
+
+	for (int ii = 0; ii < dec->hdr->nb_channels; ii++) {
+		const session_bin_channel_t *ch = &dec->hdr->channels[ii];
+		uint32_t raw;
+
+		if (!(dec->channels & BIT(ch->id))) {
+			continue;
+		}
+
+		dec->p[ii] = session_get_varint(dec->p[ii], dec->end[ii], &raw);
+		if (dec->p[ii] == NULL) {
+			dec->sample = dec->nb_samples;
+			return -EINVAL;
+		}
+
+		int32_t val = session_unzigzag(raw);
+		if (dec->sample) {
+			val = (int32_t)((uint32_t)dec->prev[ii] + (uint32_t)val);
+		}
+		dec->prev[ii] = val;
+		values[ch->id] = session_bin_from_int(ch->type, val, ch->step);
+	}
+
+	dec->sample++;
+	return 0;
+}
@@ -0,0 +1,117 @@
+#include <app/lib/session_codec.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const uint32_t pow10[] = {1, 10, 100, 1000};
+
+/* Convert the magnitude of val to a fixed-point integer with the given number of decimals,
+ * rounding ties to even like printf. The conversion is exact: the float mantissa (24 bits) times
+ * 10^decimals (10 bits) always fits in 64 bits before the binary exponent is applied.
+ * Returns false if the result does not fit in 63 bits, or if val is not finite.
+ */
+static bool _to_fixed(float_t val, uint8_t decimals, uint64_t *res)
+{
+	uint32_t bits;
+	memcpy(&bits, &val, sizeof(bits));
+
+	uint32_t exp = (bits >> 23) & 0xFF;
+	uint64_t mant = bits & 0x7FFFFF;
+	int shift;
+
+	if (exp == 0xFF) {
+		return false;
+	} else if (exp == 0) {
+		shift = -149; // Subnormal
+	} else {
+		mant |= 0x800000;
+		shift = (int)exp - 150;
+	}
+
+	uint64_t scaled = mant * pow10[decimals];
+
+	if (shift >= 0) {
+		if (shift > 28) {
+			return false;
+		}
+		*res = scaled << shift;
+	} else if (-shift > 40) {
+		*res = 0; // scaled < 2^34, the value is below 0.5 LSB.
+	} else {
+		uint64_t half = BIT64(-shift - 1);
+		uint64_t rem = scaled & (2 * half - 1);
+
+		*res = scaled >> -shift;
+		if (rem > half || (rem == half && (*res & 1))) {
+			(*res)++;
+		}
+	}
+	return true;
+}
+
+char *session_csv_put_float(char *p, char *end, float_t val, uint8_t decimals)
+{
+	char digits[20];
+	uint64_t fixed;
+	int n = 0;
+
+	if (p == NULL || decimals >= ARRAY_SIZE(pow10)) {
+		return NULL;
+	}
+
+	if (!_to_fixed(val, decimals, &fixed)) {
+		// Out of range or not finite, let printf deal with it.
+		int len = snprintf(p, end - p, "%.*f", decimals, (double)val);
+		return (len < 0 || len >= end - p) ? NULL : p + len;
+	}
+
+	// Digits are produced in reverse order, at least one integer digit is always present.
+	do {
+		digits[n++] = '0' + (fixed % 10);
+		fixed /= 10;
+	} while (fixed || n <= decimals);
+
+	bool negative = signbit(val);
+	if (end - p < n + negative + (decimals ? 1 : 0)) {
+		return NULL;
+	}
+
+	if (negative) {
+		*p++ = '-';
+	}
+	while (n > decimals) {
+		*p++ = digits[--n];
+	}
+	if (decimals) {
+		*p++ = '.';
+		while (n) {
+			*p++ = digits[--n];
+		}
+	}
+	return p;
+}
+
+char *session_csv_put_field(char *p, char *end, float_t val, uint8_t decimals)
+{
+	if (p == NULL || p >= end) {
+		return NULL;
+	}
+	*p++ = ',';
+	return session_csv_put_float(p, end, val, decimals);
+}
+
+int session_csv_parse_line(char *line, float_t *values)
+{
+	int cnt = 0;
+	char *save;
+
+	for (char *pt = strtok_r(line, ",", &save); pt != NULL; pt = strtok_r(NULL, ",", &save)) {
+		if (cnt >= SESSION_CHANNEL_NB) {
+			return -E2BIG;
+		}
+		// The timestamp has decimals, the other columns are integers.
+		values[cnt] = (cnt == SESSION_CHANNEL_TS) ? strtof(pt, NULL) : (float_t)strtol(pt, NULL, 10);
+		cnt++;
+	}
+	return cnt;
+}
@@ -0,0 +1,127 @@
+#include "session_codec_priv.h"
+#include <zephyr/sys/byteorder.h>
+#include <string.h>
+
+int session_delta_encoder_init(session_delta_encoder_t *enc, uint32_t channel_mask, uint16_t max_samples,
+			       uint8_t *buf, size_t size)
+{
+	memset(enc, 0, sizeof(session_delta_encoder_t));
+	enc->channels = channel_mask & BIT_MASK(SESSION_CHANNEL_NB);
+	enc->nb_channels = __builtin_popcount(enc->channels);
+	enc->buf = buf;
+
+	size_t fit = 0;
+	if (enc->nb_channels && size > SESSION_DELTA_BLOCK_HEADER_SIZE) {
+		fit = (MIN(size, SESSION_DELTA_BLOCK_HEADER_SIZE + UINT16_MAX) - SESSION_DELTA_BLOCK_HEADER_SIZE) /
+		      (enc->nb_channels * SESSION_DELTA_VALUE_MAX_SIZE);
+	}
+	enc->max_samples = MIN(max_samples, fit);
+	if (enc->max_samples == 0) {
+		return -EINVAL;
+	}
+
+	for (int ii = 0; ii < SESSION_CHANNEL_NB; ii++) {
+		enc->step[ii] = 1;
+	}
+
+	enc->len = SESSION_DELTA_BLOCK_HEADER_SIZE;
+	return 0;
+}
+
+int session_delta_encoder_set_steps(session_delta_encoder_t *enc, const session_bin_header_t *hdr)
+{
+	if (session_bin_header_channels(hdr) != enc->channels) {
+		return -EINVAL;
+	}
+
+	for (int ii = 0; ii < hdr->nb_channels; ii++) {
+		enc->step[hdr->channels[ii].id] = hdr->channels[ii].step;
+	}
+	return 0;
+}
+
+int session_delta_encode(session_delta_encoder_t *enc, const float_t *values)
+{
+	uint8_t *p = &enc->buf[enc->len];
+	bool keyframe = (enc->nb_samples == 0);
+
+	for (int ii = 0; ii < SESSION_CHANNEL_NB; ii++) {
+		if (!(enc->channels & BIT(ii))) {
+			continue;
+		}
+		int32_t val = session_bin_quantize(session_bin_to_int(session_bin_channel_type(ii), values[ii]), enc->step[ii]);
+		// Deltas wrap around, so that any two 32-bit values have a 32-bit difference.
+		p = session_put_varint(p, session_zigzag(keyframe ? val : (int32_t)((uint32_t)val - (uint32_t)enc->prev[ii])));
+		enc->prev[ii] = val;
+	}
+
+	enc->len = p - enc->buf;
+	enc->nb_samples++;
+	return (enc->nb_samples >= enc->max_samples) ? 1 : 0;
+}
+
+size_t session_delta_block_finish(session_delta_encoder_t *enc)
+{
+	size_t len = 0;
+
+	if (enc->nb_samples) {
+		len = enc->len;
+		sys_put_le16(len - SESSION_DELTA_BLOCK_HEADER_SIZE, &enc->buf[0]);
+		sys_put_le16(enc->nb_samples, &enc->buf[2]);
+	}
+
+	enc->len = SESSION_DELTA_BLOCK_HEADER_SIZE;
+	enc->nb_samples = 0;
+	return len;
+}
+
+int session_delta_decoder_init(session_delta_decoder_t *dec, const session_bin_header_t *hdr,
+			       const uint8_t *data, size_t len)
+{
+	if (len < SESSION_DELTA_BLOCK_HEADER_SIZE) {
+		return -EAGAIN;
+	}
+
+	size_t payload = sys_get_le16(&data[0]);
+	dec->hdr = hdr;
+	dec->nb_samples = sys_get_le16(&data[2]);
+	dec->sample = 0;
+	if (dec->nb_samples == 0 || payload < dec->nb_samples * hdr->nb_channels) {
+		return -EINVAL;
+	}
+	if (len < SESSION_DELTA_BLOCK_HEADER_SIZE + payload) {
+		return -EAGAIN;
+	}
+
+	dec->p = &data[SESSION_DELTA_BLOCK_HEADER_SIZE];
+	dec->end = dec->p + payload;
+	return SESSION_DELTA_BLOCK_HEADER_SIZE + payload;
+}
+
+int session_delta_decode(session_delta_decoder_t *dec, float_t *values)
+{
+	if (dec->sample >= dec->nb_samples) {
+		return -ENODATA;
+	}
+
+	for (int ii = 0; ii < dec->hdr->nb_channels; ii++) {
+		const session_bin_channel_t *ch = &dec->hdr->channels[ii];
+		uint32_t raw;
+
+		dec->p = session_get_varint(dec->p, dec->end, &raw);
+		if (dec->p == NULL) {
+			dec->sample = dec->nb_samples;
+			return -EINVAL;
+		}
+
+		int32_t val = session_unzigzag(raw);
+		if (dec->sample) {
+			val = (int32_t)((uint32_t)dec->prev[ii] + (uint32_t)val);
+		}
+		dec->prev[ii] = val;
+		values[ch->id] = session_bin_from_int(ch->type, val, ch->step);
+	}
+
+	dec->sample++;
+	return 0;
+}
@@ -0,0 +1,31 @@
+#include <app/lib/session_index.h>
+
+int session_index_find(session_index_read_t read, void *ctx, uint32_t nb_entries, uint32_t ts_ms,
+		       session_index_entry_t *entry)
+{
+	session_index_entry_t probe;
+	uint32_t lo = 0, hi = nb_entries;
+	int res;
+
+	if (nb_entries == 0) {
+		return -ENOENT;
+	}
+
+	// The answer is lo once hi is the first entry after ts_ms, or lo is 0.
+	while (hi - lo > 1) {
+		uint32_t mid = lo + (hi - lo) / 2;
+
+		res = read(ctx, mid, &probe);
+		if (res < 0) {
+			return res;
+		}
+		if (probe.ts_ms <= ts_ms) {
+			lo = mid;
+		} else {
+			hi = mid;
+		}
+	}
+
+	res = read(ctx, lo, entry);
+	return (res < 0) ? res : (int)lo;
+}
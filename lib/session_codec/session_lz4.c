@@ -0,0 +1,207 @@
+#include <app/lib/session_codec.h>
+#include <zephyr/sys/byteorder.h>
+#include <string.h>
+
+/* LZ4 block format: sequences of a token (literal length and match length - 4, 4 bits each),
+ * extra length bytes, literals, and a 16-bit match offset. The last sequence only has literals.
+ */
+#define MIN_MATCH 4
+#define LAST_LITERALS 5 // The last 5 bytes are always literals.
+#define MF_LIMIT 12 // A match cannot start in the last 12 bytes.
+
+static inline uint32_t _hash(const uint8_t *p)
+{
+	return (sys_get_le32(p) * 2654435761U) >> (32 - SESSION_LZ4_HASH_LOG);
+}
+
+static uint8_t *_put_length(uint8_t *op, size_t len)
+{
+	while (len >= 255) {
+		*op++ = 255;
+		len -= 255;
+	}
+	*op++ = (uint8_t)len;
+	return op;
+}
+
+/* Returns the compressed size, or 0 if it would not be smaller than dst_size. */
+static size_t _compress(session_lz4_ctx_t *ctx, const uint8_t *src, size_t len, uint8_t *dst, size_t dst_size)
+{
+	const uint8_t *ip = src;
+	const uint8_t *anchor = src;
+	const uint8_t *iend = src + len;
+	const uint8_t *mflimit = iend - MF_LIMIT;
+	const uint8_t *matchlimit = iend - LAST_LITERALS;
+	uint8_t *op = dst;
+	uint8_t *oend = dst + dst_size;
+
+	memset(ctx->table, 0, sizeof(ctx->table));
+
+	if (len >= MF_LIMIT + 1) {
+		ip++;
+		while (ip < mflimit) {
+			uint32_t h = _hash(ip);
+			const uint8_t *ref = src + ctx->table[h];
+			ctx->table[h] = ip - src;
+
+			if (ref >= ip || sys_get_le32(ref) != sys_get_le32(ip)) {
+				ip++;
+				continue;
+			}
+
+			// Extend the match backwards over pending literals, then forwards.
+			while (ip > anchor && ref > src && ip[-1] == ref[-1]) {
+				ip--;
+				ref--;
+			}
+			const uint8_t *mp = ip + MIN_MATCH;
+			const uint8_t *mref = ref + MIN_MATCH;
+			while (mp < matchlimit && *mp == *mref) {
+				mp++;
+				mref++;
+			}
+
+			size_t lit = ip - anchor;
+			size_t mlen = mp - ip - MIN_MATCH;
+			// Token, lengths, literals and offset, in the worst case.
+			if (op + 1 + lit / 255 + 1 + lit + 2 + mlen / 255 + 1 > oend) {
+				return 0;
+			}
+
+			uint8_t *token = op++;
+			*token = (MIN(lit, 15) << 4) | MIN(mlen, 15);
+			if (lit >= 15) {
+				op = _put_length(op, lit - 15);
+			}
+			memcpy(op, anchor, lit);
+			op += lit;
+			sys_put_le16(ip - ref, op);
+			op += 2;
+			if (mlen >= 15) {
+				op = _put_length(op, mlen - 15);
+			}
+
+			ip = mp;
+			anchor = ip;
+			if (ip < mflimit) {
+				ctx->table[_hash(ip - 2)] = ip - 2 - src;
+			}
+		}
+	}
+
+	size_t lit = iend - anchor;
+	if (op + 1 + lit / 255 + 1 + lit > oend) {
+		return 0;
+	}
+	*op++ = MIN(lit, 15) << 4;
+	if (lit >= 15) {
+		op = _put_length(op, lit - 15);
+	}
+	memcpy(op, anchor, lit);
+	op += lit;
+
+	return op - dst;
+}
+
+int session_lz4_frame(session_lz4_ctx_t *ctx, const uint8_t *src, size_t len, uint8_t *dst)
+{
+	if (len == 0 || len > SESSION_LZ4_FRAME_MAX_DATA_SIZE) {
+		return -EINVAL;
+	}
+
+	uint8_t *data = dst + SESSION_LZ4_FRAME_HEADER_SIZE;
+	// Compressing is only worth it if it saves at least one byte.
+	size_t stored = (len > 1) ? _compress(ctx, src, len, data, len - 1) : 0;
+	uint16_t flags = 0;
+
+	if (stored == 0) {
+		memcpy(data, src, len);
+		stored = len;
+		flags = SESSION_LZ4_FRAME_STORED;
+	}
+
+	sys_put_le16(len, &dst[0]);
+	sys_put_le16(stored | flags, &dst[2]);
+	return SESSION_LZ4_FRAME_HEADER_SIZE + stored;
+}
+
+static size_t _get_length(const uint8_t **ip, const uint8_t *iend, size_t len, bool *error)
+{
+	if (len != 15) {
+		return len;
+	}
+	uint8_t byte;
+	do {
+		if (*ip >= iend) {
+			*error = true;
+			return 0;
+		}
+		byte = *(*ip)++;
+		len += byte;
+	} while (byte == 255);
+	return len;
+}
+
+int session_lz4_unframe(const uint8_t *src, size_t len, uint8_t *dst, size_t dst_size, size_t *frame_size)
+{
+	if (len < SESSION_LZ4_FRAME_HEADER_SIZE) {
+		return -EAGAIN;
+	}
+
+	size_t raw_len = sys_get_le16(&src[0]);
+	uint16_t stored = sys_get_le16(&src[2]);
+	size_t stored_len = stored & ~SESSION_LZ4_FRAME_STORED;
+
+	if (raw_len > dst_size) {
+		return -EINVAL;
+	}
+	if (len < SESSION_LZ4_FRAME_HEADER_SIZE + stored_len) {
+		return -EAGAIN;
+	}
+	*frame_size = SESSION_LZ4_FRAME_HEADER_SIZE + stored_len;
+
+	const uint8_t *ip = src + SESSION_LZ4_FRAME_HEADER_SIZE;
+	const uint8_t *iend = ip + stored_len;
+	if (stored & SESSION_LZ4_FRAME_STORED) {
+		if (stored_len != raw_len) {
+			return -EINVAL;
+		}
+		memcpy(dst, ip, raw_len);
+		return raw_len;
+	}
+
+	uint8_t *op = dst;
+	uint8_t *oend = dst + raw_len;
+	bool error = false;
+
+	while (ip < iend) {
+		uint8_t token = *ip++;
+		size_t lit = _get_length(&ip, iend, token >> 4, &error);
+		if (error || lit > (size_t)(iend - ip) || lit > (size_t)(oend - op)) {
+			return -EINVAL;
+		}
+		memcpy(op, ip, lit);
+		ip += lit;
+		op += lit;
+		if (ip == iend) {
+			break; // Last sequence.
+		}
+
+		if (iend - ip < 2) {
+			return -EINVAL;
+		}
+		size_t offset = sys_get_le16(ip);
+		ip += 2;
+		size_t mlen = _get_length(&ip, iend, token & 0x0F, &error) + MIN_MATCH;
+		if (error || offset == 0 || offset > (size_t)(op - dst) || mlen > (size_t)(oend - op)) {
+			return -EINVAL;
+		}
+		// Byte by byte, matches can overlap the data they produce.
+		const uint8_t *ref = op - offset;
+		while (mlen--) {
+			*op++ = *ref++;
+		}
+	}
+
+	return (op == oend) ? (int)raw_len : -EINVAL;
+}
@@ -0,0 +1,122 @@
+#include <app/lib/session_preview.h>
+#include <string.h>
+
+void session_preview_init(session_preview_t *preview, uint32_t channel_mask)
+{
+	memset(preview, 0, sizeof(*preview));
+	preview->channels = channel_mask | BIT(SESSION_CHANNEL_TS);
+}
+
+void session_preview_header(session_preview_header_t *hdr, int level)
+{
+	uint32_t decimation = SESSION_PREVIEW_FACTOR;
+
+	for (int ii = 0; ii < level; ii++) {
+		decimation *= SESSION_PREVIEW_FACTOR;
+	}
+	memcpy(hdr->magic, SESSION_PREVIEW_MAGIC, sizeof(hdr->magic));
+	hdr->version = SESSION_PREVIEW_VERSION;
+	hdr->level = level;
+	hdr->decimation = decimation;
+}
+
+size_t session_preview_window_size(const session_preview_t *preview)
+{
+	return 3 * session_bin_record_size(preview->channels);
+}
+
+/* Add the samples of src, a window of the level below or a single sample, to dst. */
+static void _merge(const session_preview_t *preview, session_preview_window_t *dst, const float_t *min,
+		   const float_t *max, const float_t *sum, float_t first_ts, float_t last_ts, uint32_t samples)
+{
+	bool first = (dst->count == 0);
+
+	if (first) {
+		dst->first_ts = first_ts;
+	}
+	dst->last_ts = last_ts;
+	for (uint32_t mask = preview->channels & ~BIT(SESSION_CHANNEL_TS); mask; mask &= mask - 1) {
+		int ii = __builtin_ctz(mask);
+
+		dst->min[ii] = (first || min[ii] < dst->min[ii]) ? min[ii] : dst->min[ii];
+		dst->max[ii] = (first || max[ii] > dst->max[ii]) ? max[ii] : dst->max[ii];
+		dst->sum[ii] = (first ? 0.0f : dst->sum[ii]) + sum[ii];
+	}
+	dst->samples = (first ? 0 : dst->samples) + samples;
+	dst->count++;
+}
+
+/* Add the window of level to the window of the next level. Returns the mask of levels completed. */
+static uint32_t _complete(session_preview_t *preview, int level)
+{
+	const session_preview_window_t *src = &preview->windows[level];
+	uint32_t done = BIT(level);
+
+	if (level + 1 < SESSION_PREVIEW_LEVELS) {
+		session_preview_window_t *dst = &preview->windows[level + 1];
+
+		_merge(preview, dst, src->min, src->max, src->sum, src->first_ts, src->last_ts, src->samples);
+		if (dst->count == SESSION_PREVIEW_FACTOR) {
+			done |= _complete(preview, level + 1);
+		}
+	}
+	return done;
+}
+
+uint32_t session_preview_add(session_preview_t *preview, const float_t *values)
+{
+	// Windows completed by the previous sample have been packed, start new ones.
+	for (int ii = 0; ii < SESSION_PREVIEW_LEVELS; ii++) {
+		if (preview->windows[ii].count == SESSION_PREVIEW_FACTOR) {
+			preview->windows[ii].count = 0;
+		}
+	}
+
+	float_t ts = values[SESSION_CHANNEL_TS];
+	_merge(preview, &preview->windows[0], values, values, values, ts, ts, 1);
+	return (preview->windows[0].count == SESSION_PREVIEW_FACTOR) ? _complete(preview, 0) : 0;
+}
+
+uint32_t session_preview_finish(session_preview_t *preview)
+{
+	uint32_t done = 0;
+
+	for (int ii = 0; ii < SESSION_PREVIEW_LEVELS; ii++) {
+		session_preview_window_t *window = &preview->windows[ii];
+
+		if (window->count == SESSION_PREVIEW_FACTOR) {
+			// Already complete and packed.
+			window->count = 0;
+		} else if (window->count > 0) {
+			done |= BIT(ii);
+			if (ii + 1 < SESSION_PREVIEW_LEVELS) {
+				_merge(preview, &preview->windows[ii + 1], window->min, window->max, window->sum,
+				       window->first_ts, window->last_ts, window->samples);
+			}
+		}
+	}
+	return done;
+}
+
+size_t session_preview_pack(const session_preview_t *preview, int level, uint8_t *out)
+{
+	const session_preview_window_t *window = &preview->windows[level];
+	float_t mean[SESSION_CHANNEL_NB];
+	float_t min[SESSION_CHANNEL_NB];
+	float_t max[SESSION_CHANNEL_NB];
+	size_t len = 0;
+
+	memcpy(min, window->min, sizeof(min));
+	memcpy(max, window->max, sizeof(max));
+	for (int ii = 0; ii < SESSION_CHANNEL_NB; ii++) {
+		mean[ii] = window->sum[ii] / window->samples;
+	}
+	min[SESSION_CHANNEL_TS] = window->first_ts;
+	max[SESSION_CHANNEL_TS] = window->last_ts;
+	mean[SESSION_CHANNEL_TS] = (window->first_ts + window->last_ts) / 2.0f;
+
+	len += session_bin_pack_record(preview->channels, min, &out[len]);
+	len += session_bin_pack_record(preview->channels, max, &out[len]);
+	len += session_bin_pack_record(preview->channels, mean, &out[len]);
+	return len;
+}
@@ -0,0 +1,149 @@
+#include <app/lib/session_reader.h>
+#include <string.h>
+
+int session_reader_init(session_reader_t *reader, session_reader_read_t read, void *ctx,
+			uint8_t *buf, size_t size, size_t block_size)
+{
+	if (block_size == 0 || size < block_size) {
+		return -EINVAL;
+	}
+
+	reader->read = read;
+	reader->ctx = ctx;
+	reader->buf = buf;
+	reader->size = size;
+	reader->block_size = block_size;
+	session_reader_restart(reader, 0);
+	return 0;
+}
+
+void session_reader_restart(session_reader_t *reader, uint32_t pos)
+{
+	reader->start = 0;
+	reader->end = 0;
+	reader->scanned = 0;
+	reader->pos = pos;
+	reader->eof = false;
+}
+
+/* Move the bytes not returned yet to the start of the buffer. */
+static void _compact(session_reader_t *reader)
+{
+	if (reader->start > 0) {
+		memmove(reader->buf, &reader->buf[reader->start], reader->end - reader->start);
+		reader->end -= reader->start;
+		reader->start = 0;
+	}
+}
+
+/* Read until len bytes are buffered, the buffer is full or the file ends.
+ * Returns the number of bytes buffered, or a read error.
+ */
+static int _fill(session_reader_t *reader, size_t len)
+{
+	while (reader->end - reader->start < len && !reader->eof) {
+		_compact(reader);
+		uint32_t room = reader->size - reader->end;
+		if (room == 0) {
+			break;
+		}
+
+		// End the read on a block boundary of the file, unless the room is smaller than a block.
+		uint32_t aligned_end = ROUND_DOWN(reader->pos + room, reader->block_size);
+		uint32_t n = (aligned_end > reader->pos) ? aligned_end - reader->pos : room;
+
+		int res = reader->read(reader->ctx, &reader->buf[reader->end], n);
+		if (res < 0) {
+			return res;
+		}
+		if (res == 0) {
+			reader->eof = true;
+		}
+		reader->end += res;
+		reader->pos += res;
+	}
+	return reader->end - reader->start;
+}
+
+int session_reader_peek(session_reader_t *reader, const uint8_t **data, size_t len)
+{
+	int res = _fill(reader, len);
+	if (res < 0) {
+		return res;
+	}
+
+	*data = &reader->buf[reader->start];
+	return MIN((size_t)res, len);
+}
+
+void session_reader_consume(session_reader_t *reader, size_t len)
+{
+	reader->start += len;
+	reader->scanned = (reader->scanned > len) ? reader->scanned - len : 0;
+}
+
+int session_reader_record(session_reader_t *reader, const uint8_t **record, size_t len)
+{
+	if (len > reader->size) {
+		return -E2BIG;
+	}
+
+	int res = session_reader_peek(reader, record, len);
+	if (res < 0) {
+		return res;
+	}
+	if (res < len) {
+		return -ENOENT;
+	}
+	session_reader_consume(reader, len);
+	return len;
+}
+
+int session_reader_line(session_reader_t *reader, char **line)
+{
+	uint32_t len;
+	bool newline = false;
+
+	while (true) {
+		uint8_t *p = &reader->buf[reader->start];
+		uint32_t avail = reader->end - reader->start;
+		// Only search the bytes read since the last call.
+		uint8_t *nl = memchr(&p[reader->scanned], '\n', avail - reader->scanned);
+		if (nl != NULL) {
+			len = nl - p;
+			newline = true;
+			break;
+		}
+		reader->scanned = avail;
+
+		if (reader->eof) {
+			if (avail == 0) {
+				return -ENOENT;
+			}
+			// Room for the NUL after the last line.
+			_compact(reader);
+			if (reader->end == reader->size) {
+				return -E2BIG;
+			}
+			len = avail;
+			break;
+		}
+		if (avail == reader->size) {
+			return -E2BIG;
+		}
+
+		int res = _fill(reader, avail + 1);
+		if (res < 0) {
+			return res;
+		}
+	}
+
+	char *txt = (char *)&reader->buf[reader->start];
+	session_reader_consume(reader, len + newline);
+	if (len > 0 && txt[len - 1] == '\r') {
+		len--;
+	}
+	txt[len] = 0;
+	*line = txt;
+	return len;
+}
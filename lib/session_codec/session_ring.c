@@ -0,0 +1,62 @@
+#include <app/lib/session_ring.h>
+#include <string.h>
+
+int session_ring_init(session_ring_t *ring, uint8_t *buf, size_t size)
+{
+	if (size == 0 || size > BIT(31) || (size & (size - 1)) != 0) {
+		return -EINVAL;
+	}
+
+	ring->buf = buf;
+	ring->size = size;
+	atomic_set(&ring->head, 0);
+	atomic_set(&ring->tail, 0);
+	return 0;
+}
+
+size_t session_ring_used(const session_ring_t *ring)
+{
+	return (uint32_t)atomic_get((atomic_t *)&ring->head) - (uint32_t)atomic_get((atomic_t *)&ring->tail);
+}
+
+size_t session_ring_space(const session_ring_t *ring)
+{
+	return ring->size - session_ring_used(ring);
+}
+
+int session_ring_put(session_ring_t *ring, const void *data, size_t len)
+{
+	uint32_t head = atomic_get(&ring->head);
+
+	if (len > session_ring_space(ring)) {
+		return -ENOSPC;
+	}
+
+	uint32_t start = head & (ring->size - 1);
+	size_t first = MIN(len, ring->size - start);
+	memcpy(&ring->buf[start], data, first);
+	memcpy(ring->buf, (const uint8_t *)data + first, len - first);
+
+	// Publish the data once it is in the buffer.
+	atomic_set(&ring->head, (atomic_val_t)(uint32_t)(head + len));
+	return 0;
+}
+
+size_t session_ring_peek(const session_ring_t *ring, const uint8_t **data)
+{
+	uint32_t tail = atomic_get((atomic_t *)&ring->tail);
+	uint32_t start = tail & (ring->size - 1);
+	// Read head once, MIN evaluates its arguments twice while the producer may add data.
+	size_t used = session_ring_used(ring);
+
+	*data = &ring->buf[start];
+	return MIN(used, ring->size - start);
+}
+
+void session_ring_consume(session_ring_t *ring, size_t len)
+{
+	uint32_t tail = atomic_get(&ring->tail);
+
+	// Release the room once the data has been used.
+	atomic_set(&ring->tail, (atomic_val_t)(uint32_t)(tail + len));
+}
@@ -0,0 +1,87 @@
+#include <app/lib/session_summary.h>
+#include <string.h>
+#include <math.h>
+
+void session_summary_init(session_summary_t *summary, uint32_t channel_mask)
+{
+	memset(summary, 0, sizeof(*summary));
+	summary->channels = channel_mask & ~BIT(SESSION_CHANNEL_TS);
+}
+
+void session_summary_set_clip(session_summary_t *summary, session_channel_t channel, float_t limit)
+{
+	summary->clip[channel] = limit;
+}
+
+static void _fold_block(session_summary_t *summary)
+{
+	for (int ii = 0; ii < SESSION_CHANNEL_NB; ii++) {
+		summary->sum[ii] += summary->block_sum[ii];
+		summary->sum_sq[ii] += summary->block_sum_sq[ii];
+		summary->block_sum[ii] = 0.0f;
+		summary->block_sum_sq[ii] = 0.0f;
+	}
+	summary->block_samples = 0;
+}
+
+void session_summary_add(session_summary_t *summary, const float_t *values)
+{
+	bool first = (summary->nb_samples == 0);
+
+	if (first) {
+		summary->first_ts = values[SESSION_CHANNEL_TS];
+	}
+	summary->last_ts = values[SESSION_CHANNEL_TS];
+
+	for (uint32_t mask = summary->channels; mask; mask &= mask - 1) {
+		int ii = __builtin_ctz(mask);
+		float_t val = values[ii];
+
+		if (first || val < summary->min[ii]) {
+			summary->min[ii] = val;
+		}
+		if (first || val > summary->max[ii]) {
+			summary->max[ii] = val;
+		}
+		if (summary->clip[ii] > 0.0f && fabsf(val) >= summary->clip[ii]) {
+			summary->clipped[ii]++;
+		}
+		summary->block_sum[ii] += val;
+		summary->block_sum_sq[ii] += val * val;
+	}
+
+	summary->nb_samples++;
+	if (++summary->block_samples == SESSION_SUMMARY_BLOCK_SAMPLES) {
+		_fold_block(summary);
+	}
+}
+
+void session_summary_get(const session_summary_t *summary, session_summary_record_t *record)
+{
+	memset(record, 0, sizeof(*record));
+	memcpy(record->magic, SESSION_SUMMARY_MAGIC, sizeof(record->magic));
+	record->version = SESSION_SUMMARY_VERSION;
+	record->nb_channels = SESSION_CHANNEL_NB;
+	record->size = sizeof(*record);
+	record->channels = summary->channels;
+	record->nb_samples = summary->nb_samples;
+	record->first_ts_ms = summary->first_ts;
+	record->last_ts_ms = summary->last_ts;
+	if (summary->nb_samples == 0) {
+		return;
+	}
+
+	for (uint32_t mask = summary->channels; mask; mask &= mask - 1) {
+		int ii = __builtin_ctz(mask);
+		double sum = summary->sum[ii] + summary->block_sum[ii];
+		double sum_sq = summary->sum_sq[ii] + summary->block_sum_sq[ii];
+
+		record->channel[ii] = (session_summary_channel_t){
+			.min = summary->min[ii],
+			.max = summary->max[ii],
+			.mean = sum / summary->nb_samples,
+			.rms = sqrt(sum_sq / summary->nb_samples),
+			.clipped = summary->clipped[ii],
+		};
+	}
+}
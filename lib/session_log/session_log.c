@@ -0,0 +1,311 @@
+#include <app/lib/session_log.h>
+#include <zephyr/sys/crc.h>
+#include <string.h>
+
+#define RECORD_HEADER_SIZE sizeof(session_log_record_header_t)
+#define BLOCK_HEADER_SIZE sizeof(session_log_block_header_t)
+#define CRC_CHUNK_SIZE 64
+
+static size_t _record_size(size_t len)
+{
+	return ROUND_UP(RECORD_HEADER_SIZE + len, SESSION_LOG_ALIGN);
+}
+
+static bool _is_blank(const void *data, size_t len)
+{
+	const uint8_t *p = data;
+
+	for (size_t ii = 0; ii < len; ii++) {
+		if (p[ii] != 0xff) {
+			return false;
+		}
+	}
+	return true;
+}
+
+static bool _block_header_valid(const session_log_block_header_t *hdr)
+{
+	return hdr->magic == SESSION_LOG_BLOCK_MAGIC && hdr->seq != 0 &&
+	       hdr->crc == crc32_ieee((const uint8_t *)hdr, offsetof(session_log_block_header_t, crc));
+}
+
+static uint32_t _record_crc(const session_log_record_header_t *hdr)
+{
+	return crc32_ieee((const uint8_t *)hdr, offsetof(session_log_record_header_t, crc));
+}
+
+/* Whether hdr can be a record ending before end. */
+static bool _record_header_valid(const session_log_t *log, const session_log_record_header_t *hdr,
+				 uint32_t off, uint32_t end)
+{
+	return hdr->magic == SESSION_LOG_RECORD_MAGIC && hdr->len <= session_log_record_max_size(log) &&
+	       off + _record_size(hdr->len) <= end;
+}
+
+size_t session_log_record_max_size(const session_log_t *log)
+{
+	return ROUND_DOWN(log->flash->block_size - BLOCK_HEADER_SIZE - RECORD_HEADER_SIZE, SESSION_LOG_ALIGN);
+}
+
+int session_log_mount(session_log_t *log, const session_log_flash_t *flash)
+{
+	session_log_block_header_t bhdr;
+	session_log_record_header_t rhdr;
+	int res;
+
+	if (flash->block_size < 256 || flash->block_size > 65536 || flash->size % flash->block_size != 0 ||
+	    flash->size / flash->block_size < 2) {
+		return -EINVAL;
+	}
+
+	log->flash = flash;
+	log->nb_blocks = flash->size / flash->block_size;
+	log->seq = 0;
+	// An empty log opens block 0 first.
+	log->head = log->nb_blocks - 1;
+	log->head_off = flash->block_size;
+
+	for (uint32_t block = 0; block < log->nb_blocks; block++) {
+		res = flash->read(flash->ctx, block * flash->block_size, &bhdr, sizeof(bhdr));
+		if (res) {
+			return res;
+		}
+		if (_block_header_valid(&bhdr) && bhdr.seq > log->seq) {
+			log->head = block;
+			log->seq = bhdr.seq;
+		}
+	}
+	if (log->seq == 0) {
+		return 0;
+	}
+
+	// Find the end of the records of the head block.
+	uint32_t base = log->head * flash->block_size;
+	uint32_t off = BLOCK_HEADER_SIZE;
+	while (off + RECORD_HEADER_SIZE <= flash->block_size) {
+		res = flash->read(flash->ctx, base + off, &rhdr, sizeof(rhdr));
+		if (res) {
+			return res;
+		}
+		if (_is_blank(&rhdr, sizeof(rhdr))) {
+			break;
+		}
+		if (!_record_header_valid(log, &rhdr, off, flash->block_size)) {
+			// Torn header: nothing more can be written safely in this block.
+			off = flash->block_size;
+			break;
+		}
+		off += _record_size(rhdr.len);
+	}
+	log->head_off = off;
+	return 0;
+}
+
+static int _open_block(session_log_t *log)
+{
+	const session_log_flash_t *flash = log->flash;
+	uint32_t next = (log->head + 1) % log->nb_blocks;
+	session_log_block_header_t hdr = {
+		.magic = SESSION_LOG_BLOCK_MAGIC,
+		.seq = log->seq + 1,
+		.reserved = UINT32_MAX,
+	};
+	int res;
+
+	hdr.crc = crc32_ieee((const uint8_t *)&hdr, offsetof(session_log_block_header_t, crc));
+
+	res = flash->erase(flash->ctx, next * flash->block_size, flash->block_size);
+	if (res) {
+		return res;
+	}
+	res = flash->write(flash->ctx, next * flash->block_size, &hdr, sizeof(hdr));
+	if (res) {
+		return res;
+	}
+
+	log->head = next;
+	log->seq = hdr.seq;
+	log->head_off = BLOCK_HEADER_SIZE;
+	return 0;
+}
+
+int session_log_clear(session_log_t *log)
+{
+	const session_log_flash_t *flash = log->flash;
+	session_log_block_header_t hdr;
+	int res;
+
+	// Oldest block first, so that a reset leaves the newest blocks in order.
+	for (uint32_t ii = 1; ii <= log->nb_blocks; ii++) {
+		uint32_t offset = (log->head + ii) % log->nb_blocks * flash->block_size;
+
+		res = flash->read(flash->ctx, offset, &hdr, sizeof(hdr));
+		if (res) {
+			return res;
+		}
+		if (!_is_blank(&hdr, sizeof(hdr))) {
+			res = flash->erase(flash->ctx, offset, flash->block_size);
+			if (res) {
+				return res;
+			}
+		}
+	}
+
+	log->seq = 0;
+	log->head = log->nb_blocks - 1;
+	log->head_off = flash->block_size;
+	return 0;
+}
+
+int session_log_append(session_log_t *log, session_log_record_type_t type, uint32_t session,
+		       const void *data, size_t len)
+{
+	const session_log_flash_t *flash = log->flash;
+	const uint8_t *p = data;
+	int res;
+
+	if (type == SESSION_LOG_RECORD_START && len > session_log_record_max_size(log)) {
+		return -EMSGSIZE;
+	}
+	if (type == SESSION_LOG_RECORD_DATA && len == 0) {
+		return 0;
+	}
+
+	do {
+		bool fits = log->head_off + RECORD_HEADER_SIZE <= flash->block_size;
+		size_t room = 0;
+		if (fits) {
+			room = ROUND_DOWN(flash->block_size - log->head_off - RECORD_HEADER_SIZE, SESSION_LOG_ALIGN);
+		}
+		// Data records are split, a START record needs all its room.
+		if (!fits || (type == SESSION_LOG_RECORD_START ? room < len : room == 0)) {
+			res = _open_block(log);
+			if (res) {
+				return res;
+			}
+			continue;
+		}
+
+		size_t chunk = MIN(len, room);
+		session_log_record_header_t hdr = {
+			.magic = SESSION_LOG_RECORD_MAGIC,
+			.type = type,
+			.reserved = UINT8_MAX,
+			.len = chunk,
+			.reserved2 = UINT16_MAX,
+			.session = session,
+			.flags = UINT32_MAX,
+		};
+		hdr.crc = crc32_ieee_update(_record_crc(&hdr), p, chunk);
+
+		// Header first: a reset while writing the data leaves a record with a wrong CRC,
+		// instead of data that the next record would be programmed over.
+		uint32_t offset = log->head * flash->block_size + log->head_off;
+		res = flash->write(flash->ctx, offset, &hdr, sizeof(hdr));
+		if (res) {
+			return res;
+		}
+		if (chunk > 0) {
+			res = flash->write(flash->ctx, offset + RECORD_HEADER_SIZE, p, chunk);
+			if (res) {
+				return res;
+			}
+		}
+
+		log->head_off += _record_size(chunk);
+		p += chunk;
+		len -= chunk;
+	} while (len > 0);
+
+	return 0;
+}
+
+void session_log_cursor_init(const session_log_t *log, session_log_cursor_t *cursor)
+{
+	cursor->block = (log->head + 1) % log->nb_blocks;
+	cursor->off = 0;
+	cursor->count = log->seq != 0 ? log->nb_blocks : 0;
+	cursor->record = 0;
+	cursor->len = 0;
+}
+
+static void _next_block(const session_log_t *log, session_log_cursor_t *cursor)
+{
+	cursor->block = (cursor->block + 1) % log->nb_blocks;
+	cursor->off = 0;
+	cursor->count--;
+}
+
+int session_log_next(const session_log_t *log, session_log_cursor_t *cursor, session_log_record_header_t *hdr)
+{
+	const session_log_flash_t *flash = log->flash;
+	uint8_t buf[CRC_CHUNK_SIZE];
+	int res;
+
+	while (cursor->count > 0) {
+		uint32_t base = cursor->block * flash->block_size;
+		uint32_t end = cursor->block == log->head ? log->head_off : flash->block_size;
+
+		if (cursor->off == 0) {
+			session_log_block_header_t bhdr;
+
+			res = flash->read(flash->ctx, base, &bhdr, sizeof(bhdr));
+			if (res) {
+				return res;
+			}
+			if (!_block_header_valid(&bhdr)) {
+				_next_block(log, cursor);
+				continue;
+			}
+			cursor->off = BLOCK_HEADER_SIZE;
+		}
+
+		if (cursor->off + RECORD_HEADER_SIZE > end) {
+			_next_block(log, cursor);
+			continue;
+		}
+		res = flash->read(flash->ctx, base + cursor->off, hdr, sizeof(*hdr));
+		if (res) {
+			return res;
+		}
+		if (!_record_header_valid(log, hdr, cursor->off, end)) {
+			// End of the records, or torn header ending the block.
+			_next_block(log, cursor);
+			continue;
+		}
+
+		cursor->record = base + cursor->off;
+		cursor->len = hdr->len;
+		cursor->off += _record_size(hdr->len);
+
+		uint32_t crc = _record_crc(hdr);
+		for (uint32_t done = 0; done < hdr->len; done += sizeof(buf)) {
+			size_t len = MIN(sizeof(buf), hdr->len - done);
+			res = flash->read(flash->ctx, cursor->record + RECORD_HEADER_SIZE + done, buf, len);
+			if (res) {
+				return res;
+			}
+			crc = crc32_ieee_update(crc, buf, len);
+		}
+		return crc == hdr->crc ? 0 : -EBADMSG;
+	}
+
+	return -ENOENT;
+}
+
+int session_log_read(const session_log_t *log, const session_log_cursor_t *cursor, uint32_t offset,
+		     void *data, size_t len)
+{
+	if (offset > cursor->len || len > cursor->len - offset) {
+		return -EINVAL;
+	}
+	return log->flash->read(log->flash->ctx, cursor->record + RECORD_HEADER_SIZE + offset, data, len);
+}
+
+int session_log_clear_flags(const session_log_t *log, const session_log_cursor_t *cursor, uint32_t flags)
+{
+	uint32_t value = ~flags;
+
+	return log->flash->write(log->flash->ctx, cursor->record + offsetof(session_log_record_header_t, flags),
+				 &value, sizeof(value));
+}
@@ -0,0 +1,270 @@
+#include <app/lib/session_meta_cache.h>
+#include <string.h>
+
+int session_meta_cache_init(session_meta_cache_t *cache, session_meta_cache_read_t read,
+			    session_meta_cache_write_t write, void *ctx, session_meta_cache_entry_t *entries,
+			    uint8_t *buf, uint32_t nb_entries, uint32_t sector_size, uint32_t line_sectors)
+{
+	if (nb_entries == 0 || sector_size == 0 || line_sectors == 0) {
+		return -EINVAL;
+	}
+
+	memset(cache, 0, sizeof(*cache));
+	cache->read = read;
+	cache->write = write;
+	cache->ctx = ctx;
+	cache->entries = entries;
+	cache->buf = buf;
+	cache->nb_entries = nb_entries;
+	cache->sector_size = sector_size;
+	cache->line_sectors = line_sectors;
+	memset(entries, 0, nb_entries * sizeof(*entries));
+	return 0;
+}
+
+static uint8_t *_line_buf(const session_meta_cache_t *cache, int idx)
+{
+	return &cache->buf[idx * cache->line_sectors * cache->sector_size];
+}
+
+static int _find(const session_meta_cache_t *cache, uint32_t line)
+{
+	for (uint32_t ii = 0; ii < cache->nb_entries; ii++) {
+		if (cache->entries[ii].valid && cache->entries[ii].line == line) {
+			return ii;
+		}
+	}
+	return -1;
+}
+
+static int _write_back(session_meta_cache_t *cache, int idx)
+{
+	session_meta_cache_entry_t *entry = &cache->entries[idx];
+
+	int res = cache->write(cache->ctx, _line_buf(cache, idx), entry->line * cache->line_sectors,
+			       cache->line_sectors);
+	if (res < 0) {
+		return res;
+	}
+	entry->dirty = false;
+	cache->stats.lines_written++;
+	return 0;
+}
+
+/* Find line in the cache, or read it in place of the least recently used one.
+ * Returns the index of its entry, or a negative errno.
+ */
+static int _load(session_meta_cache_t *cache, uint32_t line)
+{
+	int idx = _find(cache, line);
+
+	if (idx >= 0) {
+		cache->stats.hits++;
+	} else {
+		cache->stats.misses++;
+		idx = 0;
+		for (uint32_t ii = 0; ii < cache->nb_entries; ii++) {
+			const session_meta_cache_entry_t *entry = &cache->entries[ii];
+
+			if (!entry->valid) {
+				idx = ii;
+				break;
+			}
+			if (entry->used < cache->entries[idx].used) {
+				idx = ii;
+			}
+		}
+
+		session_meta_cache_entry_t *entry = &cache->entries[idx];
+		if (entry->valid && entry->dirty) {
+			int res = _write_back(cache, idx);
+			if (res < 0) {
+				return res;
+			}
+			cache->stats.evictions++;
+		}
+		entry->valid = false;
+		int res = cache->read(cache->ctx, _line_buf(cache, idx), line * cache->line_sectors,
+				      cache->line_sectors);
+		if (res < 0) {
+			return res;
+		}
+		entry->line = line;
+		entry->valid = true;
+		entry->dirty = false;
+	}
+	cache->entries[idx].used = ++cache->clock;
+	return idx;
+}
+
+int session_meta_cache_read(session_meta_cache_t *cache, uint8_t *buf, uint32_t sector, uint32_t count)
+{
+	const uint32_t line_size = cache->line_sectors * cache->sector_size;
+
+	while (count > 0) {
+		uint32_t line = sector / cache->line_sectors;
+		uint32_t first = sector % cache->line_sectors;
+		uint32_t n;
+
+		if (first == 0 && count >= cache->line_sectors) {
+			// Whole lines are read from the disk, but a cached line may be newer.
+			n = ROUND_DOWN(count, cache->line_sectors);
+			int res = cache->read(cache->ctx, buf, sector, n);
+			if (res < 0) {
+				return res;
+			}
+			for (uint32_t ii = 0; ii < n / cache->line_sectors; ii++) {
+				int idx = _find(cache, line + ii);
+				if (idx >= 0 && cache->entries[idx].dirty) {
+					memcpy(&buf[ii * line_size], _line_buf(cache, idx), line_size);
+				}
+			}
+			cache->stats.bypassed += n / cache->line_sectors;
+		} else {
+			n = MIN(count, cache->line_sectors - first);
+			int idx = _load(cache, line);
+			if (idx < 0) {
+				return idx;
+			}
+			memcpy(buf, &_line_buf(cache, idx)[first * cache->sector_size], n * cache->sector_size);
+		}
+
+		buf += n * cache->sector_size;
+		sector += n;
+		count -= n;
+	}
+	return 0;
+}
+
+int session_meta_cache_write(session_meta_cache_t *cache, const uint8_t *buf, uint32_t sector, uint32_t count)
+{
+	const uint32_t line_size = cache->line_sectors * cache->sector_size;
+
+	while (count > 0) {
+		uint32_t line = sector / cache->line_sectors;
+		uint32_t first = sector % cache->line_sectors;
+		uint32_t n;
+
+		if (first == 0 && count >= cache->line_sectors) {
+			// Whole lines are written to the disk, the cached copies are updated.
+			n = ROUND_DOWN(count, cache->line_sectors);
+			int res = cache->write(cache->ctx, buf, sector, n);
+			if (res < 0) {
+				return res;
+			}
+			for (uint32_t ii = 0; ii < n / cache->line_sectors; ii++) {
+				int idx = _find(cache, line + ii);
+				if (idx >= 0) {
+					memcpy(_line_buf(cache, idx), &buf[ii * line_size], line_size);
+					cache->entries[idx].dirty = false;
+				}
+			}
+			cache->stats.bypassed += n / cache->line_sectors;
+		} else {
+			n = MIN(count, cache->line_sectors - first);
+			int idx = _load(cache, line);
+			if (idx < 0) {
+				return idx;
+			}
+			memcpy(&_line_buf(cache, idx)[first * cache->sector_size], buf, n * cache->sector_size);
+			cache->entries[idx].dirty = true;
+		}
+
+		buf += n * cache->sector_size;
+		sector += n;
+		count -= n;
+	}
+	return 0;
+}
+
+int session_meta_cache_write_through(session_meta_cache_t *cache, const uint8_t *buf, uint32_t sector,
+				     uint32_t count)
+{
+	int res = cache->write(cache->ctx, buf, sector, count);
+	if (res < 0) {
+		return res;
+	}
+	cache->stats.written_through++;
+
+	while (count > 0) {
+		uint32_t first = sector % cache->line_sectors;
+		uint32_t n = MIN(count, cache->line_sectors - first);
+
+		// A dirty line keeps the other sectors it holds dirty.
+		int idx = _find(cache, sector / cache->line_sectors);
+		if (idx >= 0) {
+			memcpy(&_line_buf(cache, idx)[first * cache->sector_size], buf, n * cache->sector_size);
+		}
+
+		buf += n * cache->sector_size;
+		sector += n;
+		count -= n;
+	}
+	return 0;
+}
+
+int session_meta_cache_flush(session_meta_cache_t *cache)
+{
+	uint32_t written = 0;
+	uint32_t next = 0; // Lines below next are written, or failed.
+	int err = 0;
+
+	while (true) {
+		int idx = -1;
+
+		// Lowest dirty line not tried yet.
+		for (uint32_t ii = 0; ii < cache->nb_entries; ii++) {
+			const session_meta_cache_entry_t *entry = &cache->entries[ii];
+
+			if (entry->valid && entry->dirty && entry->line >= next &&
+			    (idx < 0 || entry->line < cache->entries[idx].line)) {
+				idx = ii;
+			}
+		}
+		if (idx < 0) {
+			break;
+		}
+
+		next = cache->entries[idx].line + 1;
+		int res = _write_back(cache, idx);
+		if (res < 0) {
+			err = err ? err : res;
+		} else {
+			written++;
+		}
+	}
+
+	if (written > 0) {
+		cache->stats.flushes++;
+	}
+	return err ? err : (int)written;
+}
+
+void session_meta_cache_invalidate(session_meta_cache_t *cache, uint32_t sector, uint32_t count)
+{
+	if (count == 0) {
+		return;
+	}
+
+	uint32_t first = sector / cache->line_sectors;
+	uint32_t last = (sector + count - 1) / cache->line_sectors;
+
+	for (uint32_t ii = 0; ii < cache->nb_entries; ii++) {
+		session_meta_cache_entry_t *entry = &cache->entries[ii];
+
+		if (entry->valid && entry->line >= first && entry->line <= last) {
+			entry->valid = false;
+			entry->dirty = false;
+		}
+	}
+}
+
+uint32_t session_meta_cache_dirty(const session_meta_cache_t *cache)
+{
+	uint32_t dirty = 0;
+
+	for (uint32_t ii = 0; ii < cache->nb_entries; ii++) {
+		dirty += cache->entries[ii].valid && cache->entries[ii].dirty;
+	}
+	return dirty;
+}
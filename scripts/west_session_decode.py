@@ -0,0 +1,560 @@
+# Copyright (c) 2022 Nordic Semiconductor ASA
+# SPDX-License-Identifier: Apache-2.0
+
+'''west_session_decode.py'''
+
+from west.commands import WestCommand  # your extension must subclass this
+from west import log                   # use this for user output
+from decimal import Decimal, ROUND_HALF_EVEN
+import bisect
+import math
+import os
+import struct
+import zlib
+
+# Must match lsm6dsv16bx_raw_header_t in include/app/lib/lsm6dsv16bx.h
+RAW_HEADER_MAGIC = b'LSMR'
+RAW_HEADER_FORMAT = '<4sBBBBBBB19sffffI3f7BB'
+RAW_HEADER_FIELDS = ('magic', 'version', 'header_size', 'whoami', 'flags', 'xl_scale', 'gy_scale',
+                     'samples_discarded', 'regs', 'xl_sensitivity_mg', 'gy_sensitivity_mdps',
+                     'gravity_sensitivity_mg', 'qvar_lsb_per_mv', 'ts_resolution_ns',
+                     'gbias_x', 'gbias_y', 'gbias_z', 'tag_xl', 'tag_gy', 'tag_ts', 'tag_game_rot',
+                     'tag_gravity', 'tag_gbias', 'tag_qvar', 'reserved')
+FIFO_WORD_SIZE = 7
+
+# Must match session_bin_header_t in include/app/lib/session_codec.h
+BIN_HEADER_MAGIC = b'XSES'
+BIN_HEADER_VERSION = 2
+BIN_HEADER_FORMAT = '<4sBBHHBBI16sHHHBB3f6B'
+BIN_HEADER_FIELDS = ('magic', 'version', 'encoding', 'header_size', 'record_size', 'nb_channels', 'reserved',
+                     'fw_version', 'fw_version_str', 'odr_xl_hz', 'odr_gy_hz', 'odr_sflp_hz', 'xl_scale', 'gy_scale',
+                     'gbias_x', 'gbias_y', 'gbias_z', 'xl_lp2_enabled', 'xl_hp_enabled', 'xl_bandwidth',
+                     'gy_lp1_enabled', 'gy_lp1_bandwidth', 'settling_mask')
+BIN_CHANNEL_FORMAT = '<BBfH'
+# Version 1 channels have no step, their values are exact
+BIN_CHANNEL_FORMAT_V1 = '<BBf'
+BIN_ENCODING_RECORDS = 0
+BIN_ENCODING_DELTA = 1
+BIN_ENCODING_COLUMNS = 2
+# session_bin_type_t to struct format
+BIN_TYPES = {0: 'f', 1: 'h', 2: 'i'}
+# session_channel_t to CSV column
+BIN_CHANNEL_NAMES = ('ts', 'ax', 'ay', 'az', 'gx', 'gy', 'gz', 'grotx', 'groty', 'grotz', 'grotw',
+                     'gravx', 'gravy', 'gravz', 'qvar')
+
+# Must match SESSION_LZ4_* in include/app/lib/session_codec.h
+LZ4_MAGIC = b'SLZ4'
+LZ4_FRAME_STORED = 1 << 15
+
+# Must match session_crc_header_t in app/src/usb_mass_storage/usb_mass_storage.h
+CRC_FILE_NAME = 'SESSION.CRC'
+CRC_MAGIC = b'XCRC'
+CRC_HEADER_FORMAT = '<4sI'
+
+# Must match session_index_header_t and session_index_entry_t in include/app/lib/session_index.h
+INDEX_FILE_NAME = 'SESSION.IDX'
+INDEX_MAGIC = b'XIDX'
+INDEX_HEADER_FORMAT = '<4sI'
+INDEX_ENTRY_FORMAT = '<II'
+
+# Must match session_preview_header_t in include/app/lib/session_preview.h
+PREVIEW_MAGIC = b'XPRV'
+PREVIEW_VERSION = 1
+PREVIEW_HEADER_FORMAT = '<4sBBH'
+PREVIEW_STATS = ('min', 'max', 'mean')
+
+# Must match SESSION_RAW_FLAG_* in app/src/usb_mass_storage/usb_mass_storage.h
+RAW_FLAG_SFLP = 1 << 0
+RAW_FLAG_QVAR = 1 << 1
+RAW_FLAG_SFLP_HEADER = 1 << 2
+RAW_FLAG_QVAR_HEADER = 1 << 3
+
+# Must match SESSION_FILE_HEADER_* in app/src/usb_mass_storage/usb_mass_storage.h
+CSV_HEADER_SIMPLE = 'ts,ax,ay,az,gx,gy,gz'
+CSV_HEADER_SFLP = ',grotx,groty,grotz,grotw,gravx,gravy,gravz'
+CSV_HEADER_QVAR = ',qvar'
+
+
+def f32(x):
+    '''Round a Python float to the nearest IEEE 754 single precision value, like float_t on the device.'''
+    return struct.unpack('<f', struct.pack('<f', x))[0]
+
+
+def fmt(value, decimals):
+    '''Format like the device printf (%.0f / %.3f): exact ties are rounded to even.'''
+    quantum = Decimal(1).scaleb(-decimals)
+    d = Decimal(value).quantize(quantum, rounding=ROUND_HALF_EVEN)
+    if d == 0 and math.copysign(1.0, value) < 0:
+        return '-' + format(abs(d), 'f')
+    return format(d, 'f')
+
+
+def sflp2q(sflp):
+    '''Port of sflp2q() from lib/lsm6dsv16bx/lsm6dsv16bx_sflp_utils.c, in single precision.'''
+    quat = [struct.unpack('<e', struct.pack('<H', h))[0] for h in sflp]
+    sumsq = 0.0
+    for q in quat:
+        sumsq = f32(sumsq + f32(q * q))
+    if sumsq > 1.0:
+        n = f32(math.sqrt(sumsq))
+        quat = [f32(q / n) for q in quat]
+        sumsq = 1.0
+    quat.append(f32(math.sqrt(f32(1.0 - sumsq))))
+    return quat
+
+
+class RawDecoder:
+    '''Rebuilds the CSV lines written by print_line_if_needed() in app/src/main.c from raw FIFO words.'''
+
+    def __init__(self, header):
+        self.h = header
+        self.gbias_mdps = [f32(f32(header[k]) * 1000.0) for k in ('gbias_x', 'gbias_y', 'gbias_z')]
+        self.sflp = bool(header['flags'] & RAW_FLAG_SFLP)
+        self.qvar = bool(header['flags'] & RAW_FLAG_QVAR)
+        self.values = {}
+        self.updated = set()
+
+    def csv_header(self):
+        line = CSV_HEADER_SIMPLE
+        if self.h['flags'] & RAW_FLAG_SFLP_HEADER:
+            line += CSV_HEADER_SFLP
+        if self.h['flags'] & RAW_FLAG_QVAR_HEADER:
+            line += CSV_HEADER_QVAR
+        return line + '\n'
+
+    def _line_if_needed(self):
+        needed = {'acc', 'gyro', 'ts'}
+        if self.sflp:
+            needed |= {'game_rot', 'gravity'}
+        if self.qvar:
+            needed |= {'qvar'}
+        if not needed <= self.updated:
+            return None
+        self.updated -= {'acc', 'gyro', 'ts', 'qvar', 'game_rot', 'gravity'}
+
+        v = self.values
+        fields = [fmt(v['ts'], 3)] + [fmt(x, 0) for x in v['acc'] + v['gyro']]
+        if self.sflp:
+            fields += [fmt(x, 0) for x in v['game_rot'] + v['gravity']]
+        if self.qvar:
+            fields.append(fmt(v['qvar'], 0))
+        return ','.join(fields) + '\n'
+
+    def decode_word(self, word):
+        h = self.h
+        tag = word[0] >> 3
+        xyz = struct.unpack('<hhh', word[1:7])
+
+        if tag == h['tag_xl']:
+            self.values['acc'] = [f32(x * h['xl_sensitivity_mg']) for x in xyz]
+            self.updated.add('acc')
+        elif tag == h['tag_gy']:
+            self.values['gyro'] = [f32(f32(x * h['gy_sensitivity_mdps']) - b) for x, b in zip(xyz, self.gbias_mdps)]
+            self.updated.add('gyro')
+        elif tag == h['tag_ts']:
+            ts = struct.unpack('<I', word[1:5])[0]
+            self.values['ts'] = f32(f32(ts * h['ts_resolution_ns']) / 1000000.0)
+            self.updated.add('ts')
+        elif tag == h['tag_gravity']:
+            self.values['gravity'] = [f32(x * h['gravity_sensitivity_mg']) for x in xyz]
+            self.updated.add('gravity')
+        elif tag == h['tag_game_rot']:
+            sflp = struct.unpack('<HHH', word[1:7])
+            self.values['game_rot'] = [f32(1000.0 * q) for q in sflp2q(sflp)]
+            self.updated.add('game_rot')
+        elif tag == h['tag_qvar']:
+            self.values['qvar'] = f32(xyz[0] / h['qvar_lsb_per_mv'])
+            self.updated.add('qvar')
+        elif tag == h['tag_gbias']:
+            pass  # Gyroscope bias is not part of the CSV.
+        else:
+            log.wrn('Unhandled data (tag {}) in raw capture'.format(tag))
+            return None
+
+        return self._line_if_needed()
+
+
+def parse_raw_header(data):
+    size = struct.calcsize(RAW_HEADER_FORMAT)
+    header = dict(zip(RAW_HEADER_FIELDS, struct.unpack(RAW_HEADER_FORMAT, data[:size])))
+    if header['magic'] != RAW_HEADER_MAGIC:
+        raise ValueError('not a raw capture session')
+    if header['header_size'] < size:
+        raise ValueError('unsupported raw header size {}'.format(header['header_size']))
+    return header
+
+
+def decode_raw(data):
+    '''Decode a SESSION.RAW file to the CSV text the device would have written.'''
+    header = parse_raw_header(data)
+    decoder = RawDecoder(header)
+    out = [decoder.csv_header()]
+    body = data[header['header_size']:]
+    if len(body) % FIFO_WORD_SIZE:
+        log.wrn('Truncated FIFO word at the end of the capture, ignoring it')
+    for off in range(0, len(body) - FIFO_WORD_SIZE + 1, FIFO_WORD_SIZE):
+        line = decoder.decode_word(body[off:off + FIFO_WORD_SIZE])
+        if line:
+            out.append(line)
+    return ''.join(out)
+
+
+def parse_bin_header(data):
+    size = struct.calcsize(BIN_HEADER_FORMAT)
+    header = dict(zip(BIN_HEADER_FIELDS, struct.unpack(BIN_HEADER_FORMAT, data[:size])))
+    if header['magic'] != BIN_HEADER_MAGIC:
+        raise ValueError('not a binary session')
+    if header['version'] not in (1, BIN_HEADER_VERSION):
+        raise ValueError('unsupported binary session version {}'.format(header['version']))
+    channel_format = BIN_CHANNEL_FORMAT_V1 if header['version'] == 1 else BIN_CHANNEL_FORMAT
+    channel_size = struct.calcsize(channel_format)
+    header['channels'] = [struct.unpack(channel_format, data[size + ii * channel_size:size + (ii + 1) * channel_size])
+                          for ii in range(header['nb_channels'])]
+    if header['version'] == 1:
+        header['channels'] = [channel + (1,) for channel in header['channels']]
+    if header['header_size'] != size + header['nb_channels'] * channel_size:
+        raise ValueError('inconsistent binary header size {}'.format(header['header_size']))
+    return header
+
+
+def read_varint(data, off):
+    value = 0
+    shift = 0
+    while True:
+        if off >= len(data) or shift > 28:
+            raise ValueError('corrupted varint at offset {}'.format(off))
+        byte = data[off]
+        off += 1
+        value |= (byte & 0x7F) << shift
+        if not byte & 0x80:
+            return value, off
+        shift += 7
+
+
+def unzigzag(value):
+    return (value >> 1) ^ -(value & 1)
+
+
+def to_int32(value):
+    return ((value + (1 << 31)) & 0xFFFFFFFF) - (1 << 31)
+
+
+def iter_delta_samples(header, body):
+    '''Yield the integer values of each sample of delta blocks, see session_delta_encoder_t.'''
+    off = 0
+    while off < len(body):
+        if off + 4 > len(body):
+            log.wrn('Truncated block header at the end of the session, ignoring it')
+            return
+        payload, nb_samples = struct.unpack_from('<HH', body, off)
+        block_end = off + 4 + payload
+        if block_end > len(body):
+            log.wrn('Truncated block at the end of the session, ignoring it')
+            return
+        block = body[:block_end]
+        off += 4
+        prev = [0] * header['nb_channels']
+        for sample in range(nb_samples):
+            for ii in range(header['nb_channels']):
+                raw, off = read_varint(block, off)
+                value = unzigzag(raw)
+                prev[ii] = to_int32(prev[ii] + value) if sample else value
+            yield list(prev)
+        off = block_end
+
+
+def iter_column_samples(header, body, positions):
+    '''Yield the integer values of the channels at positions (in the header channel list) of each
+    sample of columnar blocks, see session_column_encoder_t. Only the chunks of these channels are read.'''
+    nb_channels = header['nb_channels']
+    dir_size = 4 + 2 * nb_channels
+    off = 0
+    while off < len(body):
+        if off + dir_size > len(body):
+            log.wrn('Truncated block directory at the end of the session, ignoring it')
+            return
+        payload, nb_samples = struct.unpack_from('<HH', body, off)
+        chunk_sizes = struct.unpack_from('<{}H'.format(nb_channels), body, off + 4)
+        block_end = off + 4 + payload
+        if dir_size + sum(chunk_sizes) != 4 + payload:
+            raise ValueError('inconsistent block directory at offset {}'.format(off))
+        if block_end > len(body):
+            log.wrn('Truncated block at the end of the session, ignoring it')
+            return
+        columns = []
+        for pos in positions:
+            start = off + dir_size + sum(chunk_sizes[:pos])
+            chunk = body[start:start + chunk_sizes[pos]]
+            column = []
+            chunk_off = 0
+            for sample in range(nb_samples):
+                raw, chunk_off = read_varint(chunk, chunk_off)
+                value = unzigzag(raw)
+                column.append(to_int32(column[-1] + value) if sample else value)
+            columns.append(column)
+        for sample in range(nb_samples):
+            yield [column[sample] for column in columns]
+        off = block_end
+
+
+def int_to_value(ch_type, value, step):
+    if BIN_TYPES[ch_type] == 'f':
+        return struct.unpack('<f', struct.pack('<i', value))[0]
+    return value * step
+
+
+def decode_bin(data, channels=None):
+    '''Decode a SESSION.BIN file to the CSV text the device would have written, with only the
+    columns named in channels if it is set.'''
+    header = parse_bin_header(data)
+    ids = [ch[0] for ch in header['channels']]
+    types = [ch[1] for ch in header['channels']]
+    steps = [ch[3] for ch in header['channels']]
+    record = struct.Struct('<' + ''.join(BIN_TYPES[t] for t in types))
+    if record.size != header['record_size']:
+        raise ValueError('inconsistent record size {}'.format(header['record_size']))
+
+    positions = list(range(len(ids)))
+    if channels:
+        names = [BIN_CHANNEL_NAMES[i] for i in ids]
+        missing = [c for c in channels if c not in names]
+        if missing:
+            raise ValueError('channels not in the session: {}'.format(','.join(missing)))
+        positions = [names.index(c) for c in channels]
+
+    body = data[header['header_size']:]
+    if header['encoding'] == BIN_ENCODING_RECORDS:
+        if len(body) % record.size:
+            log.wrn('Truncated record at the end of the session, ignoring it')
+        samples = ([v * s if isinstance(v, int) else v for v, s in zip(values, steps)]
+                   for values in record.iter_unpack(body[:len(body) - len(body) % record.size]))
+    elif header['encoding'] == BIN_ENCODING_DELTA:
+        samples = ([int_to_value(t, v, s) for t, v, s in zip(types, values, steps)]
+                   for values in iter_delta_samples(header, body))
+    elif header['encoding'] == BIN_ENCODING_COLUMNS:
+        # Only the selected chunks are decoded, the samples already hold the selected columns.
+        selected = positions
+        samples = ([int_to_value(types[p], v, steps[p]) for p, v in zip(selected, values)]
+                   for values in iter_column_samples(header, body, selected))
+        ids = [ids[p] for p in selected]
+        positions = list(range(len(selected)))
+    else:
+        raise ValueError('unsupported binary session encoding {}'.format(header['encoding']))
+
+    out = [','.join(BIN_CHANNEL_NAMES[ids[p]] for p in positions) + '\n']
+    for values in samples:
+        out.append(','.join(fmt(values[p], 3) if isinstance(values[p], float) else str(values[p]) for p in positions) + '\n')
+    return ''.join(out)
+
+
+def lz4_block_decompress(src, raw_len):
+    '''Decompress an LZ4 block, as written by session_lz4_frame().'''
+    out = bytearray()
+    ip = 0
+
+    def length(ip, value):
+        if value == 15:
+            while True:
+                byte = src[ip]
+                ip += 1
+                value += byte
+                if byte != 255:
+                    break
+        return ip, value
+
+    while ip < len(src):
+        token = src[ip]
+        ip += 1
+        ip, lit = length(ip, token >> 4)
+        out += src[ip:ip + lit]
+        ip += lit
+        if ip >= len(src):
+            break
+        offset = src[ip] | (src[ip + 1] << 8)
+        ip += 2
+        ip, mlen = length(ip, token & 0x0F)
+        if offset == 0 or offset > len(out):
+            raise ValueError('corrupted LZ4 block')
+        for _ in range(mlen + 4):
+            out.append(out[-offset])
+    if len(out) != raw_len:
+        raise ValueError('corrupted LZ4 block, expected {} bytes, got {}'.format(raw_len, len(out)))
+    return bytes(out)
+
+
+def decompress(data):
+    '''Return the content of a SESSION.LZ4 file, see session_lz4_frame().'''
+    out = []
+    off = len(LZ4_MAGIC)
+    while off < len(data):
+        if off + 4 > len(data):
+            log.wrn('Truncated frame header at the end of the session, ignoring it')
+            break
+        raw_len, stored = struct.unpack_from('<HH', data, off)
+        stored_len = stored & ~LZ4_FRAME_STORED
+        frame = data[off + 4:off + 4 + stored_len]
+        if len(frame) < stored_len:
+            log.wrn('Truncated frame at the end of the session, ignoring it')
+            break
+        out.append(frame if stored & LZ4_FRAME_STORED else lz4_block_decompress(frame, raw_len))
+        off += 4 + stored_len
+    return b''.join(out)
+
+
+def verify(data, crc_data):
+    '''Check a session file against SESSION.CRC, and return the chunk size, the number of chunks
+    checked and the indexes of the corrupted ones.'''
+    header_size = struct.calcsize(CRC_HEADER_FORMAT)
+    if len(crc_data) < header_size:
+        raise ValueError('truncated CRC file')
+    magic, chunk_size = struct.unpack_from(CRC_HEADER_FORMAT, crc_data)
+    if magic != CRC_MAGIC or chunk_size == 0:
+        raise ValueError('invalid CRC file')
+
+    nb_crcs = (len(crc_data) - header_size) // 4
+    corrupted = []
+    nb_chunks = 0
+    for index, crc in enumerate(struct.unpack_from('<{}I'.format(nb_crcs), crc_data, header_size)):
+        chunk = data[index * chunk_size:(index + 1) * chunk_size]
+        if not chunk:
+            break
+        if zlib.crc32(chunk) != crc:
+            corrupted.append(index)
+        nb_chunks += 1
+    return chunk_size, nb_chunks, corrupted
+
+
+def find_index(index_data, ts_ms):
+    '''Return the timestamp and offset of the last sample indexed at or before ts_ms in SESSION.IDX,
+    or of the first one, see session_index_find.'''
+    header_size = struct.calcsize(INDEX_HEADER_FORMAT)
+    entry_size = struct.calcsize(INDEX_ENTRY_FORMAT)
+    if len(index_data) < header_size or struct.unpack_from(INDEX_HEADER_FORMAT, index_data)[0] != INDEX_MAGIC:
+        raise ValueError('invalid index file')
+    # A reset can leave a partial entry at the end.
+    end = header_size + (len(index_data) - header_size) // entry_size * entry_size
+    entries = list(struct.iter_unpack(INDEX_ENTRY_FORMAT, index_data[header_size:end]))
+    if not entries:
+        raise ValueError('empty index file')
+    pos = bisect.bisect_right([ts for ts, _ in entries], ts_ms)
+    return entries[max(pos - 1, 0)]
+
+
+def start_at(data, offset):
+    '''Keep the header of a CSV or binary session, followed by its samples from offset.'''
+    if data[:len(BIN_HEADER_MAGIC)] == BIN_HEADER_MAGIC:
+        header_size = parse_bin_header(data)['header_size']
+    elif data[:len(CSV_HEADER_SIMPLE)] == CSV_HEADER_SIMPLE.encode():
+        header_size = data.index(b'\n') + 1
+    else:
+        raise ValueError('only CSV and binary sessions are indexed')
+    if offset < header_size or offset > len(data):
+        raise ValueError('index offset {} out of the session'.format(offset))
+    return data[:header_size] + data[offset:]
+
+
+def decode_preview(data, channels=None):
+    '''Decode a PREV16.BIN or PREV256.BIN file to CSV, with a first column telling whether each line
+    holds the minimum, maximum or mean of the channels over its window.'''
+    size = struct.calcsize(PREVIEW_HEADER_FORMAT)
+    magic, version, level, decimation = struct.unpack(PREVIEW_HEADER_FORMAT, data[:size])
+    if version != PREVIEW_VERSION:
+        raise ValueError('unsupported preview version {}'.format(version))
+    lines = decode_bin(data[size:], channels).splitlines(keepends=True)
+    out = ['stat,' + lines[0]]
+    for ii, line in enumerate(lines[1:]):
+        out.append(PREVIEW_STATS[ii % len(PREVIEW_STATS)] + ',' + line)
+    return ''.join(out)
+
+
+def decode(data, channels=None):
+    if data[:len(LZ4_MAGIC)] == LZ4_MAGIC:
+        data = decompress(data)
+    if data[:len(BIN_HEADER_MAGIC)] == BIN_HEADER_MAGIC:
+        return decode_bin(data, channels)
+    if data[:len(PREVIEW_MAGIC)] == PREVIEW_MAGIC:
+        return decode_preview(data, channels)
+    if channels:
+        raise ValueError('channels can only be selected in binary sessions')
+    if data[:len(RAW_HEADER_MAGIC)] == RAW_HEADER_MAGIC:
+        return decode_raw(data)
+    if data[:len(CSV_HEADER_SIMPLE)] == CSV_HEADER_SIMPLE.encode():
+        return data.decode()
+    raise ValueError('unknown session format')
+
+
+class WestSessionDecode(WestCommand):
+
+    def __init__(self):
+        super().__init__(
+            'session-decode',               # gets stored as self.name
+            'decode a session file to CSV',  # self.help
+            # self.description:
+            '''\
+This command decodes a session file recorded by the device to the CSV
+format written by default recordings.
+
+Supported inputs: SESSION.RAW (raw FIFO capture), SESSION.BIN
+(binary session, records, delta or columnar blocks) and SESSION.LZ4
+(any of these, or a CSV session, compressed).
+
+PREV16.BIN and PREV256.BIN previews decode to the minimum, maximum
+and mean of each window of 16 or 256 samples, one per line.
+
+--channels keeps only some columns of a binary session. With columnar
+blocks, the chunks of the other channels are not decoded.
+
+--verify first checks the session file against the CRC of each of
+its chunks, stored in SESSION.CRC in the same folder, and reports
+the corrupted chunks.
+
+--start decodes the session from the last sample indexed at or before
+a time in ms, found in SESSION.IDX in the same folder.''')
+
+    def do_add_parser(self, parser_adder):
+        parser = parser_adder.add_parser(self.name,
+                                         help=self.help,
+                                         description=self.description)
+        parser.add_argument('input', help='session file to decode')
+        parser.add_argument('-o', '--output', help='output CSV file, defaults to the input file with a .CSV extension')
+        parser.add_argument('-c', '--channels', help='comma-separated CSV columns to keep, e.g. ts,ax,ay,az')
+        parser.add_argument('--verify', action='store_true', help='check the session file against its SESSION.CRC')
+        parser.add_argument('--start', type=int, metavar='MS', help='decode from this time, using SESSION.IDX')
+        return parser           # gets stored as self.parser
+
+    def do_run(self, args, unknown_args):
+        output = args.output or os.path.splitext(args.input)[0] + '.CSV'
+
+        with open(args.input, 'rb') as f:
+            data = f.read()
+
+        if args.verify:
+            crc_path = os.path.join(os.path.dirname(args.input), CRC_FILE_NAME)
+            try:
+                with open(crc_path, 'rb') as f:
+                    chunk_size, nb_chunks, corrupted = verify(data, f.read())
+            except (OSError, ValueError) as e:
+                log.die('Cannot verify {}: {}'.format(args.input, e))
+            for index in corrupted:
+                log.wrn('Chunk {} at offset {} is corrupted'.format(index, index * chunk_size))
+            log.inf('{} chunks verified, {} corrupted'.format(nb_chunks, len(corrupted)))
+
+        if args.start is not None:
+            index_path = os.path.join(os.path.dirname(args.input), INDEX_FILE_NAME)
+            try:
+                with open(index_path, 'rb') as f:
+                    ts_ms, offset = find_index(f.read(), args.start)
+                data = start_at(data, offset)
+            except (OSError, ValueError) as e:
+                log.die('Cannot start {} at {} ms: {}'.format(args.input, args.start, e))
+            log.inf('Decoding from {} ms, at offset {}'.format(ts_ms, offset))
+
+        try:
+            csv = decode(data, args.channels.split(',') if args.channels else None)
+        except ValueError as e:
+            log.die('Cannot decode {}: {}'.format(args.input, e))
+
+        with open(output, 'w', newline='\n') as f:
+            f.write(csv)
+
+        log.inf('Decoded {} to {}'.format(args.input, output))
@@ -0,0 +1,527 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+/*
+ * @file benchmark of the session storage backends
+ *
+ * This suite runs the session writer pipeline, the ring, the encoders and the chunk compression,
+ * over the flash simulator, and accounts the time of each flash operation with the timing model
+ * of the Kconfig file. It sweeps the session formats, the chunk sizes and the storage backends:
+ * FatFs on a flash disk, with or without the metadata cache, and the session log.
+ *
+ * Each run prints a line starting with "BENCH " followed by a JSON object:
+ * - data_bytes: session data encoded, and stored_bytes: bytes handed to the storage, compressed;
+ * - flash_us: time spent in flash operations, and kib_per_s: KB of data_bytes per second of it;
+ * - programmed_bytes, erased_blocks, and write_amplification: programmed_bytes / stored_bytes;
+ * - max_flush_us: longest writer pass, a chunk or the end of the session.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+#include <zephyr/ztest.h>
+#include <zephyr/drivers/disk.h>
+#include <zephyr/fs/fs.h>
+#include <zephyr/storage/disk_access.h>
+#include <zephyr/storage/flash_map.h>
+#include <ff.h>
+
+#include <app/lib/session_codec.h>
+#include <app/lib/session_ring.h>
+#include <app/lib/session_log.h>
+#include <app/lib/session_meta_cache.h>
+
+#define BENCH_PARTITION_ID FIXED_PARTITION_ID(bench_partition)
+#define BENCH_SECTOR_SIZE 512
+#define BENCH_BLOCK_SIZE 4096 // Erase block of the external flash, and flash disk cache size.
+#define BENCH_BLOCK_SECTORS (BENCH_BLOCK_SIZE / BENCH_SECTOR_SIZE)
+#define BENCH_CHUNK_MAX_SIZE 8192
+#define BENCH_META_CACHE_LINES 4
+#define BENCH_CHANNELS SESSION_CHANNELS_SIMPLE
+
+#define DISK_NAME "NAND"
+#define MOUNT_POINT "/" DISK_NAME ":"
+#define SESSION_PATH MOUNT_POINT "/SESSION.DAT"
+
+typedef enum {
+	STORE_FAT,
+	STORE_FAT_CACHE,
+	STORE_LOG,
+	STORE_NB,
+} store_t;
+
+static const char *const store_names[STORE_NB] = {"fat", "fat_cache", "log"};
+
+typedef struct {
+	const char *name;
+	bool bin;
+	bool compressed;
+} bench_format_t;
+
+static const bench_format_t formats[] = {
+	{"csv", false, false},
+	{"bin", true, false},
+	{"csv_lz4", false, true},
+	{"bin_lz4", true, true},
+};
+
+static const size_t chunk_sizes[] = {512, 1024, 2048, 4096, BENCH_CHUNK_MAX_SIZE};
+
+/* Flash operations of a run, timed with the model. */
+struct timed_flash {
+	const struct flash_area *fa;
+	uint64_t ns;
+	uint64_t programmed;
+	uint32_t erased;
+};
+
+static struct timed_flash flash;
+
+static uint64_t transfer_ns(size_t len)
+{
+	return (uint64_t)CONFIG_SESSION_BENCH_FLASH_COMMAND_US * 1000 + (uint64_t)len * CONFIG_SESSION_BENCH_FLASH_TRANSFER_NS;
+}
+
+static int flash_read(void *ctx, uint32_t offset, void *data, size_t len)
+{
+	flash.ns += transfer_ns(len);
+	return flash_area_read(flash.fa, offset, data, len);
+}
+
+static int flash_write(void *ctx, uint32_t offset, const void *data, size_t len)
+{
+	const uint32_t page = CONFIG_SESSION_BENCH_FLASH_PAGE_SIZE;
+	uint32_t pages = (offset + len - 1) / page - offset / page + 1;
+
+	// One program command per page, a partial page costs a whole one.
+	flash.ns += pages * (transfer_ns(0) + (uint64_t)CONFIG_SESSION_BENCH_FLASH_PROGRAM_US * 1000) +
+		    transfer_ns(len) - transfer_ns(0);
+	flash.programmed += len;
+	return flash_area_write(flash.fa, offset, data, len);
+}
+
+static int flash_erase(void *ctx, uint32_t offset, size_t len)
+{
+	uint32_t blocks = len / BENCH_BLOCK_SIZE;
+
+	flash.ns += blocks * (transfer_ns(0) + (uint64_t)CONFIG_SESSION_BENCH_FLASH_ERASE_US * 1000);
+	flash.erased += blocks;
+	return flash_area_erase(flash.fa, offset, len);
+}
+
+/* Flash disk, like the Zephyr driver with a 4 KB cache: every block written is read back unless
+ * written whole, erased and programmed.
+ */
+static uint8_t disk_block[BENCH_BLOCK_SIZE];
+
+static int flash_disk_read(void *ctx, uint8_t *buf, uint32_t sector, uint32_t count)
+{
+	return flash_read(ctx, sector * BENCH_SECTOR_SIZE, buf, count * BENCH_SECTOR_SIZE);
+}
+
+static int flash_disk_write(void *ctx, const uint8_t *buf, uint32_t sector, uint32_t count)
+{
+	while (count > 0) {
+		uint32_t block = sector / BENCH_BLOCK_SECTORS;
+		uint32_t first = sector % BENCH_BLOCK_SECTORS;
+		uint32_t n = MIN(count, BENCH_BLOCK_SECTORS - first);
+		int res = 0;
+
+		if (n < BENCH_BLOCK_SECTORS) {
+			res = flash_read(ctx, block * BENCH_BLOCK_SIZE, disk_block, BENCH_BLOCK_SIZE);
+		}
+		memcpy(&disk_block[first * BENCH_SECTOR_SIZE], buf, n * BENCH_SECTOR_SIZE);
+		res = res ? res : flash_erase(ctx, block * BENCH_BLOCK_SIZE, BENCH_BLOCK_SIZE);
+		res = res ? res : flash_write(ctx, block * BENCH_BLOCK_SIZE, disk_block, BENCH_BLOCK_SIZE);
+		if (res != 0) {
+			return res;
+		}
+
+		buf += n * BENCH_SECTOR_SIZE;
+		sector += n;
+		count -= n;
+	}
+	return 0;
+}
+
+/* Disk mounted by FatFs, through the metadata cache in STORE_FAT_CACHE runs. */
+static session_meta_cache_t meta_cache;
+static session_meta_cache_entry_t meta_cache_entries[BENCH_META_CACHE_LINES];
+static uint8_t meta_cache_buf[BENCH_META_CACHE_LINES * BENCH_BLOCK_SIZE];
+static bool use_meta_cache;
+static FATFS fat_fs;
+
+static int bench_disk_init(struct disk_info *disk)
+{
+	return 0;
+}
+
+static int bench_disk_status(struct disk_info *disk)
+{
+	return DISK_STATUS_OK;
+}
+
+static int bench_disk_read(struct disk_info *disk, uint8_t *buf, uint32_t sector, uint32_t count)
+{
+	if (use_meta_cache) {
+		return session_meta_cache_read(&meta_cache, buf, sector, count);
+	}
+	return flash_disk_read(NULL, buf, sector, count);
+}
+
+static int bench_disk_write(struct disk_info *disk, const uint8_t *buf, uint32_t sector, uint32_t count)
+{
+	if (use_meta_cache) {
+		// Only the FatFs window, the FAT and directories, is cached like in data_disk_write.
+		return (buf == fat_fs.win) ? session_meta_cache_write(&meta_cache, buf, sector, count)
+					   : session_meta_cache_write_through(&meta_cache, buf, sector, count);
+	}
+	return flash_disk_write(NULL, buf, sector, count);
+}
+
+static int bench_disk_ioctl(struct disk_info *disk, uint8_t cmd, void *buf)
+{
+	switch (cmd) {
+	case DISK_IOCTL_GET_SECTOR_COUNT:
+		*(uint32_t *)buf = flash.fa->fa_size / BENCH_SECTOR_SIZE;
+		return 0;
+	case DISK_IOCTL_GET_SECTOR_SIZE:
+		*(uint32_t *)buf = BENCH_SECTOR_SIZE;
+		return 0;
+	case DISK_IOCTL_GET_ERASE_BLOCK_SZ:
+		*(uint32_t *)buf = BENCH_BLOCK_SECTORS;
+		return 0;
+	case DISK_IOCTL_CTRL_SYNC:
+	case DISK_IOCTL_CTRL_INIT:
+	case DISK_IOCTL_CTRL_DEINIT:
+		return 0;
+	default:
+		return -EINVAL;
+	}
+}
+
+static const struct disk_operations bench_disk_ops = {
+	.init = bench_disk_init,
+	.status = bench_disk_status,
+	.read = bench_disk_read,
+	.write = bench_disk_write,
+	.ioctl = bench_disk_ioctl,
+};
+
+static struct disk_info bench_disk = {
+	.name = DISK_NAME,
+	.ops = &bench_disk_ops,
+};
+
+static struct fs_mount_t fs_mnt = {
+	.type = FS_FATFS,
+	.fs_data = &fat_fs,
+	.mnt_point = MOUNT_POINT,
+};
+
+static session_log_flash_t bench_log_flash = {
+	.read = flash_read,
+	.write = flash_write,
+	.erase = flash_erase,
+	.block_size = BENCH_BLOCK_SIZE,
+};
+
+static session_log_t session_log;
+
+/* Storage a run writes to, set up before its timing starts. */
+static store_t store;
+static struct fs_file_t session_file;
+
+static int store_open(store_t s)
+{
+	int res;
+
+	store = s;
+	res = flash_area_erase(flash.fa, 0, flash.fa->fa_size);
+	if (res != 0) {
+		return res;
+	}
+
+	if (store == STORE_LOG) {
+		res = session_log_mount(&session_log, &bench_log_flash);
+		return res ? res : session_log_append(&session_log, SESSION_LOG_RECORD_START, 1, "SESSION.DAT", 11);
+	}
+
+	// Formatted like usb_mass_storage_format does: a single FAT, the app's cluster size and a
+	// data area aligned on the erase blocks.
+	MKFS_PARM parm = {
+		.fmt = FM_ANY | FM_SFD,
+		.n_fat = 1,
+		.align = BENCH_BLOCK_SECTORS,
+		.au_size = CONFIG_SESSION_BENCH_FAT_CLUSTER_SIZE,
+	};
+
+	use_meta_cache = (store == STORE_FAT_CACHE);
+	session_meta_cache_init(&meta_cache, flash_disk_read, flash_disk_write, NULL, meta_cache_entries,
+				meta_cache_buf, ARRAY_SIZE(meta_cache_entries), BENCH_SECTOR_SIZE, BENCH_BLOCK_SECTORS);
+	res = fs_mkfs(FS_FATFS, (uintptr_t)&MOUNT_POINT[1], &parm, 0);
+	res = res ? res : session_meta_cache_flush(&meta_cache);
+	if (res < 0) {
+		return res;
+	}
+	res = fs_mount(&fs_mnt);
+	if (res != 0) {
+		return res;
+	}
+	fs_file_t_init(&session_file);
+	return fs_open(&session_file, SESSION_PATH, FS_O_CREATE | FS_O_WRITE);
+}
+
+static int store_write(const uint8_t *data, size_t len)
+{
+	if (store == STORE_LOG) {
+		return session_log_append(&session_log, SESSION_LOG_RECORD_DATA, 1, data, len);
+	}
+	ssize_t res = fs_write(&session_file, data, len);
+	return (res < 0) ? res : ((size_t)res == len ? 0 : -ENOSPC);
+}
+
+/* End of the session, as in usb_mass_storage_end_current_session. */
+static int store_close(void)
+{
+	if (store == STORE_LOG) {
+		return 0;
+	}
+	int res = fs_close(&session_file);
+	if (use_meta_cache) {
+		int flush_res = session_meta_cache_flush(&meta_cache);
+		res = res ? res : MIN(flush_res, 0);
+	}
+	return res;
+}
+
+static void store_unmount(void)
+{
+	if (store != STORE_LOG) {
+		fs_unmount(&fs_mnt);
+	}
+}
+
+/* Session writer, as in usb_mass_storage.c: chunks of the ring are compressed in frames, and the
+ * frames written once they fill a chunk.
+ */
+static uint8_t ring_buf[2 * BENCH_CHUNK_MAX_SIZE];
+static uint8_t session_out[BENCH_CHUNK_MAX_SIZE + SESSION_LZ4_FRAME_MAX_SIZE(BENCH_CHUNK_MAX_SIZE)];
+static session_lz4_ctx_t lz4_ctx;
+
+struct bench_run {
+	const bench_format_t *format;
+	size_t chunk_size;
+	session_ring_t ring;
+	size_t out_len;
+	uint64_t data_bytes;
+	uint64_t stored_bytes;
+	uint64_t max_flush_ns;
+};
+
+static int write_stored(struct bench_run *run, const uint8_t *data, size_t len)
+{
+	run->stored_bytes += len;
+	return store_write(data, len);
+}
+
+static int write_chunk(struct bench_run *run, const uint8_t *chunk, size_t len)
+{
+	if (!run->format->compressed) {
+		return write_stored(run, chunk, len);
+	}
+
+	int res = session_lz4_frame(&lz4_ctx, chunk, len, &session_out[run->out_len]);
+	if (res < 0) {
+		return res;
+	}
+	run->out_len += res;
+
+	while (run->out_len >= run->chunk_size) {
+		res = write_stored(run, session_out, run->chunk_size);
+		run->out_len -= run->chunk_size;
+		memmove(session_out, &session_out[run->chunk_size], run->out_len);
+		if (res < 0) {
+			return res;
+		}
+	}
+	return 0;
+}
+
+/* One pass of the writer thread: the whole chunks of the ring, or all of it at the end. */
+static int writer_pass(struct bench_run *run, bool all)
+{
+	size_t min_len = all ? 1 : run->chunk_size;
+	uint64_t start = flash.ns;
+	int res = 0;
+
+	while (res == 0 && session_ring_used(&run->ring) >= min_len) {
+		const uint8_t *data;
+		size_t len = MIN(session_ring_peek(&run->ring, &data), run->chunk_size);
+
+		res = write_chunk(run, data, len);
+		session_ring_consume(&run->ring, len);
+	}
+	if (res == 0 && all) {
+		if (run->out_len > 0) {
+			res = write_stored(run, session_out, run->out_len);
+			run->out_len = 0;
+		}
+		res = res ? res : store_close();
+	}
+
+	run->max_flush_ns = MAX(run->max_flush_ns, flash.ns - start);
+	return res;
+}
+
+static int session_put(struct bench_run *run, const void *data, size_t len)
+{
+	run->data_bytes += len;
+	if (session_ring_space(&run->ring) < len) {
+		int res = writer_pass(run, false);
+		if (res < 0) {
+			return res;
+		}
+	}
+	int res = session_ring_put(&run->ring, data, len);
+	if (res == 0 && session_ring_used(&run->ring) >= run->chunk_size) {
+		res = writer_pass(run, false);
+	}
+	return res;
+}
+
+static uint32_t lcg_state;
+
+static uint32_t lcg_next(void)
+{
+	lcg_state = lcg_state * 1664525U + 1013904223U;
+	return lcg_state;
+}
+
+/* A slowly moving device at 120 Hz, with some sensor noise: mg and mdps. */
+static void make_sample(uint32_t ii, float_t *values)
+{
+	float_t t = ii / 120.0f;
+
+	values[SESSION_CHANNEL_TS] = ii * 1000.0f / 120.0f;
+	for (int ch = SESSION_CHANNEL_ACC_X; ch <= SESSION_CHANNEL_GYRO_Z; ch++) {
+		float_t noise = (float_t)(int32_t)(lcg_next() % 64) - 32.0f;
+		float_t amplitude = (ch <= SESSION_CHANNEL_ACC_Z) ? 1000.0f : 20000.0f;
+
+		values[ch] = amplitude * sinf(t * (0.5f + 0.3f * ch)) + noise;
+	}
+}
+
+static int record_session(struct bench_run *run)
+{
+	float_t values[SESSION_CHANNEL_NB] = {0};
+	uint8_t record[SESSION_BIN_RECORD_MAX_SIZE];
+	char line[8 * SESSION_CSV_FIELD_MAX_SIZE];
+	int res;
+
+	if (run->format->compressed) {
+		res = write_stored(run, (const uint8_t *)SESSION_LZ4_MAGIC, strlen(SESSION_LZ4_MAGIC));
+		if (res < 0) {
+			return res;
+		}
+	}
+
+	if (run->format->bin) {
+		session_bin_header_t hdr;
+		int size = session_bin_header_init(&hdr, BENCH_CHANNELS);
+
+		res = session_put(run, &hdr, size);
+	} else {
+		static const char header[] = "Time[ms],AccX[mg],AccY[mg],AccZ[mg],GyroX[mdps],GyroY[mdps],GyroZ[mdps]\n";
+
+		res = session_put(run, header, strlen(header));
+	}
+
+	lcg_state = 1;
+	for (uint32_t ii = 0; res == 0 && ii < CONFIG_SESSION_BENCH_SAMPLES; ii++) {
+		make_sample(ii, values);
+		if (run->format->bin) {
+			res = session_put(run, record, session_bin_pack_record(BENCH_CHANNELS, values, record));
+		} else {
+			char *end = line + sizeof(line) - 1;
+			char *p = session_csv_put_float(line, end, values[SESSION_CHANNEL_TS], 3);
+
+			for (int ch = SESSION_CHANNEL_ACC_X; ch <= SESSION_CHANNEL_GYRO_Z; ch++) {
+				p = session_csv_put_field(p, end, values[ch], 0);
+			}
+			*p++ = '\n';
+			res = session_put(run, line, p - line);
+		}
+	}
+	return res ? res : writer_pass(run, true);
+}
+
+static void run_bench(store_t s, const bench_format_t *format, size_t chunk_size)
+{
+	struct bench_run run = {
+		.format = format,
+		.chunk_size = chunk_size,
+	};
+
+	zassert_ok(session_ring_init(&run.ring, ring_buf, 2 * chunk_size), "Ring init failed");
+	zassert_ok(store_open(s), "Failed to set up %s", store_names[s]);
+	flash.ns = 0;
+	flash.programmed = 0;
+	flash.erased = 0;
+
+	int res = record_session(&run);
+	store_unmount();
+	zassert_ok(res, "%s %s %u: session failed", store_names[s], format->name, (uint32_t)chunk_size);
+
+	uint32_t flash_us = flash.ns / 1000;
+	uint32_t amplification = flash.programmed * 100 / run.stored_bytes;
+
+	TC_PRINT("BENCH {\"store\":\"%s\",\"format\":\"%s\",\"chunk\":%u,\"samples\":%u,\"data_bytes\":%u,"
+		 "\"stored_bytes\":%u,\"flash_us\":%u,\"kib_per_s\":%u,\"programmed_bytes\":%u,\"erased_blocks\":%u,"
+		 "\"write_amplification\":%u.%02u,\"max_flush_us\":%u}\n",
+		 store_names[s], format->name, (uint32_t)chunk_size, CONFIG_SESSION_BENCH_SAMPLES,
+		 (uint32_t)run.data_bytes, (uint32_t)run.stored_bytes, flash_us,
+		 (uint32_t)(run.data_bytes * 1000000 / 1024 / MAX(flash_us, 1)), (uint32_t)flash.programmed,
+		 flash.erased, amplification / 100, amplification % 100, (uint32_t)(run.max_flush_ns / 1000));
+
+	zassert_true(flash.programmed >= run.stored_bytes, "Stored data must be programmed");
+}
+
+static void *setup(void)
+{
+	zassert_ok(flash_area_open(BENCH_PARTITION_ID, &flash.fa), "Unable to open the bench partition");
+	bench_log_flash.size = ROUND_DOWN(flash.fa->fa_size, BENCH_BLOCK_SIZE);
+	zassert_ok(disk_access_register(&bench_disk), "Unable to register the disk");
+	return NULL;
+}
+
+ZTEST(session_storage, test_fat)
+{
+	for (size_t ii = 0; ii < ARRAY_SIZE(formats); ii++) {
+		for (size_t jj = 0; jj < ARRAY_SIZE(chunk_sizes); jj++) {
+			run_bench(STORE_FAT, &formats[ii], chunk_sizes[jj]);
+		}
+	}
+}
+
+ZTEST(session_storage, test_fat_meta_cache)
+{
+	for (size_t ii = 0; ii < ARRAY_SIZE(formats); ii++) {
+		for (size_t jj = 0; jj < ARRAY_SIZE(chunk_sizes); jj++) {
+			run_bench(STORE_FAT_CACHE, &formats[ii], chunk_sizes[jj]);
+		}
+	}
+}
+
+ZTEST(session_storage, test_log)
+{
+	for (size_t ii = 0; ii < ARRAY_SIZE(formats); ii++) {
+		for (size_t jj = 0; jj < ARRAY_SIZE(chunk_sizes); jj++) {
+			run_bench(STORE_LOG, &formats[ii], chunk_sizes[jj]);
+		}
+	}
+}
+
+ZTEST_SUITE(session_storage, NULL, setup, NULL, NULL, NULL);
@@ -0,0 +1,1315 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+/*
+ * @file test session_codec library
+ *
+ * This suite verifies that the session encoders produce the same output as the
+ * formats they replace, and measures their cost.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+#include <zephyr/ztest.h>
+
+#include <app/lib/session_codec.h>
+#include <app/lib/session_ring.h>
+#include <app/lib/session_reader.h>
+#include <app/lib/session_index.h>
+#include <app/lib/session_summary.h>
+#include <app/lib/session_preview.h>
+
+#define TXT_SIZE 200
+#define NB_LINES 500
+
+static uint32_t lcg_state;
+
+static uint32_t lcg_next(void)
+{
+	lcg_state = lcg_state * 1664525U + 1013904223U;
+	return lcg_state;
+}
+
+/* Values looking like the ones recorded: mg, mdps, quaternions x1000 and ms timestamps. */
+static float_t random_sample(int kind)
+{
+	int32_t r = (int32_t)(lcg_next() >> 8);
+
+	switch (kind % 4) {
+	case 0:
+		return (float_t)(r % 32768) * 0.122f;
+	case 1:
+		return (float_t)(r % 32768) * 70.0f - 12.25f;
+	case 2:
+		return 1000.0f * ((float_t)(r % 10000) / 10000.0f);
+	default:
+		return (float_t)((uint32_t)r % 100000000U) * 21750.0f / 1000000.0f;
+	}
+}
+
+static void check_csv_float(float_t val, uint8_t decimals)
+{
+	char expected[TXT_SIZE];
+	char txt[TXT_SIZE];
+
+	char *end = session_csv_put_float(txt, txt + TXT_SIZE, val, decimals);
+	zassert_not_null(end, "No room for %f", (double)val);
+	*end = 0;
+	snprintf(expected, TXT_SIZE, "%.*f", decimals, (double)val);
+	zassert_str_equal(txt, expected, "Got %s, expected %s", txt, expected);
+}
+
+ZTEST(session_codec, test_csv_matches_printf)
+{
+	lcg_state = 1;
+	for (int ii = 0; ii < 20000; ii++) {
+		check_csv_float(random_sample(ii), (ii & 1) ? 3 : 0);
+	}
+}
+
+ZTEST(session_codec, test_csv_rounding)
+{
+	char txt[TXT_SIZE];
+	char *end;
+
+	// Exact ties, both parities and signs, and a negative value rounded to 0.
+	check_csv_float(12.5f, 0);
+	check_csv_float(13.5f, 0);
+	check_csv_float(-2.5f, 0);
+	check_csv_float(0.5f, 0);
+	check_csv_float(-0.25f, 0);
+	check_csv_float(1.0625f, 3);
+	check_csv_float(1.0635f, 3);
+	check_csv_float(0.0005f, 3);
+
+	end = session_csv_put_field(txt, txt + TXT_SIZE, 1e30f, 0);
+	zassert_not_null(end, "Out of range values are formatted by printf");
+	zassert_equal(end - txt, 32, "Out of range fallback failed");
+
+	zassert_is_null(session_csv_put_float(txt, txt + 4, 123.456f, 3), "Field must not overflow");
+}
+
+/* Line formatting as done by print_line_if_needed before the fixed-point formatter. */
+static int format_line_snprintf(char *txt, const float_t *v)
+{
+	char tmp_txt[TXT_SIZE];
+
+	snprintf(txt, TXT_SIZE, "%.3f,%.0f,%.0f,%.0f,%.0f,%.0f,%.0f", (double)v[0], (double)v[1],
+		 (double)v[2], (double)v[3], (double)v[4], (double)v[5], (double)v[6]);
+	memset(tmp_txt, 0, TXT_SIZE);
+	memcpy(tmp_txt, txt, strlen(txt));
+	snprintf(txt, TXT_SIZE, "%s,%.0f,%.0f,%.0f,%.0f,%.0f,%.0f,%.0f", tmp_txt, (double)v[7],
+		 (double)v[8], (double)v[9], (double)v[10], (double)v[11], (double)v[12],
+		 (double)v[13]);
+	memset(tmp_txt, 0, TXT_SIZE);
+	memcpy(tmp_txt, txt, strlen(txt));
+	return snprintf(txt, TXT_SIZE, "%s\n", tmp_txt);
+}
+
+static int format_line_fixed(char *txt, const float_t *v)
+{
+	char *end = txt + TXT_SIZE - 1;
+	char *p = session_csv_put_float(txt, end, v[0], 3);
+
+	for (int ii = 1; ii < 14; ii++) {
+		p = session_csv_put_field(p, end, v[ii], 0);
+	}
+	*p++ = '\n';
+	*p = 0;
+	return p - txt;
+}
+
+ZTEST(session_codec, test_csv_benchmark)
+{
+	static float_t lines[NB_LINES][14];
+	char txt[TXT_SIZE];
+	uint32_t start;
+	uint32_t cycles_snprintf, cycles_fixed;
+
+	lcg_state = 2;
+	for (int ii = 0; ii < NB_LINES; ii++) {
+		lines[ii][0] = random_sample(3);
+		for (int jj = 1; jj < 14; jj++) {
+			lines[ii][jj] = random_sample(jj);
+		}
+	}
+
+	start = k_cycle_get_32();
+	for (int ii = 0; ii < NB_LINES; ii++) {
+		format_line_snprintf(txt, lines[ii]);
+	}
+	cycles_snprintf = k_cycle_get_32() - start;
+
+	start = k_cycle_get_32();
+	for (int ii = 0; ii < NB_LINES; ii++) {
+		format_line_fixed(txt, lines[ii]);
+	}
+	cycles_fixed = k_cycle_get_32() - start;
+
+	TC_PRINT("SFLP line (14 fields): snprintf %u cycles/line, fixed-point %u cycles/line\n",
+		 cycles_snprintf / NB_LINES, cycles_fixed / NB_LINES);
+}
+
+ZTEST(session_codec, test_bin_roundtrip)
+{
+	session_bin_header_t hdr;
+	float_t values[SESSION_CHANNEL_NB];
+	float_t decoded[SESSION_CHANNEL_NB];
+	uint8_t record[SESSION_BIN_RECORD_MAX_SIZE];
+	uint32_t channels = SESSION_CHANNELS_SIMPLE | SESSION_CHANNELS_SFLP | SESSION_CHANNELS_QVAR;
+
+	int size = session_bin_header_init(&hdr, channels);
+	zassert_equal(size, SESSION_BIN_HEADER_MIN_SIZE + SESSION_CHANNEL_NB * sizeof(session_bin_channel_t),
+		      "Wrong header size %d", size);
+	zassert_equal(session_bin_header_check(&hdr, size), size, "Header must be valid");
+	zassert_true(session_bin_header_check(&hdr, size - 1) < 0, "Truncated header must be rejected");
+	zassert_equal(hdr.record_size, SESSION_BIN_RECORD_MAX_SIZE, "Wrong record size %u", hdr.record_size);
+
+	lcg_state = 3;
+	for (int ii = 0; ii < NB_LINES; ii++) {
+		values[SESSION_CHANNEL_TS] = random_sample(3);
+		for (int jj = 1; jj < SESSION_CHANNEL_NB; jj++) {
+			values[jj] = random_sample(jj);
+		}
+
+		zassert_equal(session_bin_pack_record(channels, values, record), hdr.record_size, "Pack size");
+		zassert_equal(session_bin_unpack_record(&hdr, record, decoded), hdr.record_size, "Unpack size");
+		zassert_equal(decoded[SESSION_CHANNEL_TS], values[SESSION_CHANNEL_TS], "Timestamps are stored as-is");
+		for (int jj = 1; jj < SESSION_CHANNEL_NB; jj++) {
+			float_t expected = CLAMP(rintf(values[jj]), INT16_MIN, INT16_MAX);
+			if (jj >= SESSION_CHANNEL_GYRO_X && jj <= SESSION_CHANNEL_GYRO_Z) {
+				expected = rintf(values[jj]);
+			}
+			zassert_equal(decoded[jj], expected, "Channel %d: got %f, expected %f", jj,
+				      (double)decoded[jj], (double)expected);
+		}
+	}
+}
+
+ZTEST(session_codec, test_bin_size)
+{
+	zassert_equal(session_bin_record_size(SESSION_CHANNELS_SIMPLE), 22, "Simple record size");
+	zassert_equal(session_bin_record_size(SESSION_CHANNELS_SIMPLE | SESSION_CHANNELS_SFLP), 36, "SFLP record size");
+	zassert_equal(session_bin_header_init(&(session_bin_header_t){0}, 0), -EINVAL, "Empty channel list must be rejected");
+}
+
+/* Smooth random walk looking like a recorded session: 240 Hz timestamps in ms, slowly changing
+ * accelerations, angular rates, quaternions and gravity with some sensor noise.
+ */
+static void walk_sample(float_t *values, int ii)
+{
+	values[SESSION_CHANNEL_TS] = 3456.789f + (float_t)ii * 4.1667f;
+	for (int jj = 1; jj < SESSION_CHANNEL_NB; jj++) {
+		int32_t step = (int32_t)(lcg_next() >> 24) - 128; // -128 to 127
+		values[jj] += (float_t)step / 16.0f;
+	}
+}
+
+static uint32_t all_channels = SESSION_CHANNELS_SIMPLE | SESSION_CHANNELS_SFLP | SESSION_CHANNELS_QVAR;
+
+ZTEST(session_codec, test_delta_roundtrip)
+{
+	static uint8_t block[SESSION_DELTA_BLOCK_MAX_SIZE(32, SESSION_CHANNEL_NB)];
+	static float_t expected[NB_LINES][SESSION_CHANNEL_NB];
+	session_delta_encoder_t enc;
+	session_delta_decoder_t dec;
+	session_bin_header_t hdr;
+	float_t values[SESSION_CHANNEL_NB] = {0};
+	float_t decoded[SESSION_CHANNEL_NB];
+	uint8_t record[SESSION_BIN_RECORD_MAX_SIZE];
+	int first = 0;
+
+	session_bin_header_init(&hdr, all_channels);
+	zassert_ok(session_delta_encoder_init(&enc, all_channels, 32, block, sizeof(block)), "Init failed");
+
+	lcg_state = 4;
+	for (int ii = 0; ii < NB_LINES; ii++) {
+		walk_sample(values, ii);
+		if (ii == 100) {
+			values[SESSION_CHANNEL_GYRO_X] = 2e9f; // Largest possible jump.
+			values[SESSION_CHANNEL_GYRO_Y] = -2e9f;
+		}
+		// The delta encoding must decode to the values of the record encoding.
+		session_bin_pack_record(all_channels, values, record);
+		session_bin_unpack_record(&hdr, record, expected[ii]);
+
+		bool full = session_delta_encode(&enc, values) > 0;
+		if (!full && ii < NB_LINES - 1) {
+			continue;
+		}
+
+		size_t len = session_delta_block_finish(&enc);
+		zassert_equal(session_delta_decoder_init(&dec, &hdr, block, len), len, "Wrong block size");
+		zassert_equal(session_delta_decoder_init(&dec, &hdr, block, len - 1), -EAGAIN, "Truncated block");
+		session_delta_decoder_init(&dec, &hdr, block, len);
+		for (int jj = first; jj <= ii; jj++) {
+			zassert_ok(session_delta_decode(&dec, decoded), "Decoding sample %d failed", jj);
+			zassert_mem_equal(decoded, expected[jj], sizeof(decoded), "Sample %d differs", jj);
+		}
+		zassert_equal(session_delta_decode(&dec, decoded), -ENODATA, "Block must be over");
+		first = ii + 1;
+	}
+	zassert_equal(session_delta_block_finish(&enc), 0, "Empty block must not be written");
+}
+
+ZTEST(session_codec, test_delta_limits)
+{
+	uint8_t block[SESSION_DELTA_BLOCK_MAX_SIZE(4, 7)];
+	session_delta_encoder_t enc;
+	session_delta_decoder_t dec;
+	session_bin_header_t hdr;
+	float_t values[SESSION_CHANNEL_NB] = {0};
+
+	zassert_equal(session_delta_encoder_init(&enc, SESSION_CHANNELS_SIMPLE, 8, block, 10), -EINVAL,
+		      "A buffer too small for one sample must be rejected");
+	zassert_ok(session_delta_encoder_init(&enc, SESSION_CHANNELS_SIMPLE, 8, block, sizeof(block)), "Init failed");
+	zassert_equal(enc.max_samples, 4, "Block size must be limited by the buffer");
+
+	for (int ii = 0; ii < 3; ii++) {
+		zassert_equal(session_delta_encode(&enc, values), 0, "Block is not full yet");
+	}
+	zassert_equal(session_delta_encode(&enc, values), 1, "Block must be full");
+
+	session_bin_header_init(&hdr, SESSION_CHANNELS_SIMPLE);
+	size_t len = session_delta_block_finish(&enc);
+	block[len - 1] |= 0x80; // Last varint never ends.
+	session_delta_decoder_init(&dec, &hdr, block, len);
+	for (int ii = 0; ii < 3; ii++) {
+		zassert_ok(session_delta_decode(&dec, values), "Sample %d is valid", ii);
+	}
+	zassert_equal(session_delta_decode(&dec, values), -EINVAL, "Corruption must be detected");
+}
+
+ZTEST(session_codec, test_delta_benchmark)
+{
+	static uint8_t block[SESSION_DELTA_BLOCK_MAX_SIZE(32, SESSION_CHANNEL_NB)];
+	session_delta_encoder_t enc;
+	float_t values[SESSION_CHANNEL_NB] = {0};
+	uint32_t cycles = 0;
+	size_t encoded = 0;
+
+	lcg_state = 5;
+	session_delta_encoder_init(&enc, all_channels, 32, block, sizeof(block));
+	for (int ii = 0; ii < NB_LINES; ii++) {
+		walk_sample(values, ii);
+
+		uint32_t start = k_cycle_get_32();
+		if (session_delta_encode(&enc, values) > 0) {
+			encoded += session_delta_block_finish(&enc);
+		}
+		cycles += k_cycle_get_32() - start;
+	}
+	encoded += session_delta_block_finish(&enc);
+
+	size_t records = NB_LINES * session_bin_record_size(all_channels);
+	TC_PRINT("Delta blocks of 32 samples (15 channels): %u bytes for %u bytes of records (ratio %u%%), %u cycles/sample\n",
+		 (uint32_t)encoded, (uint32_t)records, (uint32_t)(100 * records / encoded), cycles / NB_LINES);
+	zassert_true(encoded < records, "Slowly changing data must compress");
+}
+
+static session_lz4_ctx_t lz4_ctx;
+
+/* Frame len bytes of src, check that they decode back, and return the frame size. */
+static int lz4_roundtrip(const uint8_t *src, size_t len)
+{
+	static uint8_t frame[SESSION_LZ4_FRAME_MAX_SIZE(2048)];
+	static uint8_t out[2048];
+	size_t frame_size;
+
+	int size = session_lz4_frame(&lz4_ctx, src, len, frame);
+	zassert_true(size > 0 && size <= SESSION_LZ4_FRAME_MAX_SIZE(len), "Bad frame size %d", size);
+	zassert_equal(session_lz4_unframe(frame, size, out, sizeof(out), &frame_size), len, "Bad uncompressed size");
+	zassert_equal(frame_size, size, "Frame size mismatch");
+	zassert_mem_equal(out, src, len, "Data mismatch");
+	return size;
+}
+
+ZTEST(session_codec, test_lz4_roundtrip)
+{
+	static uint8_t data[2048];
+	char *p = (char *)data;
+	char *end = p + sizeof(data);
+	float_t values[SESSION_CHANNEL_NB] = {0};
+
+	lcg_state = 11;
+	while (end - p > 128) {
+		walk_sample(values, p - (char *)data);
+		p = session_csv_put_float(p, end, values[SESSION_CHANNEL_TS], 3);
+		for (int jj = SESSION_CHANNEL_ACC_X; jj <= SESSION_CHANNEL_GYRO_Z; jj++) {
+			p = session_csv_put_field(p, end, values[jj], 0);
+		}
+		*p++ = '\n';
+	}
+	size_t len = p - (char *)data;
+	zassert_true(lz4_roundtrip(data, len) < len, "CSV text must compress");
+
+	for (size_t ii = 0; ii < sizeof(data); ii++) {
+		data[ii] = lcg_next() >> 24;
+	}
+	zassert_equal(lz4_roundtrip(data, sizeof(data)), SESSION_LZ4_FRAME_MAX_SIZE(sizeof(data)),
+		      "Random data must be stored");
+
+	memset(data, 0, sizeof(data));
+	zassert_true(lz4_roundtrip(data, sizeof(data)) < 32, "Zeros must compress");
+	zassert_true(lz4_roundtrip(data, 1) > 0, "A single byte must be framed");
+}
+
+ZTEST(session_codec, test_lz4_limits)
+{
+	static uint8_t data[256];
+	static uint8_t frame[SESSION_LZ4_FRAME_MAX_SIZE(sizeof(data))];
+	static uint8_t out[sizeof(data)];
+	size_t frame_size;
+
+	memset(data, 'a', sizeof(data));
+	int size = session_lz4_frame(&lz4_ctx, data, sizeof(data), frame);
+	zassert_true(size > SESSION_LZ4_FRAME_HEADER_SIZE, "Frame must not be empty");
+
+	zassert_equal(session_lz4_unframe(frame, size - 1, out, sizeof(out), &frame_size), -EAGAIN,
+		      "Truncated frame must be detected");
+	zassert_equal(session_lz4_unframe(frame, 2, out, sizeof(out), &frame_size), -EAGAIN,
+		      "Truncated frame header must be detected");
+	zassert_equal(session_lz4_unframe(frame, size, out, sizeof(out) - 1, &frame_size), -EINVAL,
+		      "Frame larger than the output must be rejected");
+
+	frame[0]++;
+	zassert_equal(session_lz4_unframe(frame, size, out, sizeof(out), &frame_size), -EINVAL,
+		      "Wrong uncompressed size must be detected");
+	frame[0]--;
+	frame[size - 1] ^= 0xFF;
+	frame[SESSION_LZ4_FRAME_HEADER_SIZE + 2] = 0xFF; // Match offset before the start of the data
+	zassert_equal(session_lz4_unframe(frame, size, out, sizeof(out), &frame_size), -EINVAL,
+		      "Corrupted frame must be detected");
+
+	zassert_equal(session_lz4_frame(&lz4_ctx, data, 0, frame), -EINVAL, "Empty input must be rejected");
+	zassert_equal(session_lz4_frame(&lz4_ctx, data, SESSION_LZ4_FRAME_MAX_DATA_SIZE + 1, frame), -EINVAL,
+		      "Oversized input must be rejected");
+}
+
+/* Compress len bytes of data in chunks of the session buffer flush size, like the device does.
+ * Returns the compressed size.
+ */
+static size_t lz4_benchmark(const char *name, const uint8_t *data, size_t len)
+{
+	static uint8_t frame[SESSION_LZ4_FRAME_MAX_SIZE(1024)];
+	uint32_t cycles = 0;
+	size_t compressed = 0;
+
+	for (size_t off = 0; off < len; off += 1024) {
+		size_t chunk = MIN(len - off, 1024);
+		uint32_t start = k_cycle_get_32();
+		compressed += session_lz4_frame(&lz4_ctx, data + off, chunk, frame);
+		cycles += k_cycle_get_32() - start;
+	}
+	TC_PRINT("LZ4 %s: %u bytes for %u bytes (ratio %u%%), %u cycles/kB\n", name, (uint32_t)compressed,
+		 (uint32_t)len, (uint32_t)(100 * len / compressed), (uint32_t)(1024ULL * cycles / len));
+	return compressed;
+}
+
+ZTEST(session_codec, test_lz4_benchmark)
+{
+	static uint8_t csv[NB_LINES * 64];
+	static uint8_t records[NB_LINES * SESSION_BIN_RECORD_MAX_SIZE];
+	static uint8_t delta[NB_LINES * SESSION_BIN_RECORD_MAX_SIZE];
+	static uint8_t block[SESSION_DELTA_BLOCK_MAX_SIZE(32, SESSION_CHANNEL_NB)];
+	session_delta_encoder_t enc;
+	float_t values[SESSION_CHANNEL_NB] = {0};
+	char *p = (char *)csv;
+	char *end = p + sizeof(csv);
+	size_t records_len = 0;
+	size_t delta_len = 0;
+
+	lcg_state = 5;
+	session_delta_encoder_init(&enc, all_channels, 32, block, sizeof(block));
+	for (int ii = 0; ii < NB_LINES; ii++) {
+		walk_sample(values, ii);
+
+		if (end - p > 64) {
+			p = session_csv_put_float(p, end, values[SESSION_CHANNEL_TS], 3);
+			for (int jj = SESSION_CHANNEL_ACC_X; jj <= SESSION_CHANNEL_GYRO_Z; jj++) {
+				p = session_csv_put_field(p, end, values[jj], 0);
+			}
+			*p++ = '\n';
+		}
+		records_len += session_bin_pack_record(all_channels, values, records + records_len);
+
+		if (session_delta_encode(&enc, values) > 0) {
+			size_t size = session_delta_block_finish(&enc);
+			memcpy(delta + delta_len, block, size);
+			delta_len += size;
+		}
+	}
+	size_t size = session_delta_block_finish(&enc);
+	memcpy(delta + delta_len, block, size);
+	delta_len += size;
+
+	zassert_true(lz4_benchmark("CSV", csv, p - (char *)csv) < (size_t)(p - (char *)csv), "CSV must compress");
+	zassert_true(lz4_benchmark("records", records, records_len) < records_len, "Records must compress");
+	// Delta blocks are already dense, the frames only have to bound their growth.
+	zassert_true(lz4_benchmark("delta", delta, delta_len) <= SESSION_LZ4_FRAME_MAX_SIZE(delta_len) +
+		     delta_len / 1024 * SESSION_LZ4_FRAME_HEADER_SIZE, "Delta blocks must not grow");
+}
+
+/* Like walk_sample with larger steps, closer to the noise of the sensor, and a full scale jump. */
+static void noisy_sample(float_t *values, int ii)
+{
+	values[SESSION_CHANNEL_TS] = (float_t)ii * 4.1667f;
+	for (int jj = 1; jj < SESSION_CHANNEL_NB; jj++) {
+		bool gyro = (jj >= SESSION_CHANNEL_GYRO_X && jj <= SESSION_CHANNEL_GYRO_Z);
+		values[jj] += (float_t)((int32_t)(lcg_next() >> 24) - 128) / (gyro ? 0.25f : 8.0f);
+	}
+	if (ii == 100) {
+		// Larger values are not exact as floats, so the error bound could not be checked.
+		values[SESSION_CHANNEL_GYRO_X] = 4e6f;
+		values[SESSION_CHANNEL_GYRO_Y] = -4e6f;
+	}
+}
+
+ZTEST(session_codec, test_lossy_roundtrip)
+{
+	static uint8_t block[SESSION_DELTA_BLOCK_MAX_SIZE(32, SESSION_CHANNEL_NB)];
+	static const uint16_t max_errors[SESSION_CHANNEL_NB] = {
+		[SESSION_CHANNEL_ACC_X ... SESSION_CHANNEL_ACC_Z] = 5,
+		[SESSION_CHANNEL_GYRO_X ... SESSION_CHANNEL_GYRO_Z] = 500,
+		[SESSION_CHANNEL_GAME_ROT_X ... SESSION_CHANNEL_GAME_ROT_W] = 1,
+		[SESSION_CHANNEL_GRAVITY_X ... SESSION_CHANNEL_GRAVITY_Z] = 5,
+	};
+	session_delta_encoder_t exact_enc, lossy_enc;
+	session_delta_decoder_t dec;
+	session_bin_header_t exact_hdr, lossy_hdr;
+	float_t values[SESSION_CHANNEL_NB] = {0};
+	float_t expected[SESSION_CHANNEL_NB];
+	float_t decoded[SESSION_CHANNEL_NB];
+	uint8_t record[SESSION_BIN_RECORD_MAX_SIZE];
+	size_t exact_size = 0, lossy_size = 0;
+
+	session_bin_header_init(&exact_hdr, all_channels);
+	session_bin_header_init(&lossy_hdr, all_channels);
+	for (int ii = SESSION_CHANNEL_ACC_X; ii < SESSION_CHANNEL_NB; ii++) {
+		zassert_ok(session_bin_header_set_max_error(&lossy_hdr, ii, max_errors[ii]), "Channel %d", ii);
+	}
+	session_delta_encoder_init(&exact_enc, all_channels, 32, block, sizeof(block));
+	session_delta_encoder_init(&lossy_enc, all_channels, 32, block, sizeof(block));
+	zassert_ok(session_delta_encoder_set_steps(&lossy_enc, &lossy_hdr), "Steps must match the encoder");
+
+	lcg_state = 6;
+	for (int ii = 0; ii < NB_LINES; ii++) {
+		noisy_sample(values, ii);
+		session_bin_pack_record(all_channels, values, record);
+		session_bin_unpack_record(&exact_hdr, record, expected);
+
+		if (session_delta_encode(&exact_enc, values) > 0) {
+			exact_size += session_delta_block_finish(&exact_enc);
+		}
+		session_delta_encode(&lossy_enc, values);
+		size_t len = session_delta_block_finish(&lossy_enc);
+		lossy_size += len;
+
+		zassert_equal(session_delta_decoder_init(&dec, &lossy_hdr, block, len), len, "Wrong block size");
+		zassert_ok(session_delta_decode(&dec, decoded), "Decoding sample %d failed", ii);
+		zassert_equal(decoded[SESSION_CHANNEL_TS], expected[SESSION_CHANNEL_TS], "Timestamps are exact");
+		for (int jj = SESSION_CHANNEL_ACC_X; jj < SESSION_CHANNEL_NB; jj++) {
+			zassert_true(fabsf(decoded[jj] - expected[jj]) <= max_errors[jj], "Sample %d channel %d: %f instead of %f",
+				     ii, jj, (double)decoded[jj], (double)expected[jj]);
+		}
+	}
+	exact_size += session_delta_block_finish(&exact_enc);
+
+	// Blocks of one sample only hold keyframes, measure the reduction with full blocks.
+	session_delta_encoder_init(&lossy_enc, all_channels, 32, block, sizeof(block));
+	session_delta_encoder_set_steps(&lossy_enc, &lossy_hdr);
+	lcg_state = 6;
+	memset(values, 0, sizeof(values));
+	lossy_size = 0;
+	for (int ii = 0; ii < NB_LINES; ii++) {
+		noisy_sample(values, ii);
+		if (session_delta_encode(&lossy_enc, values) > 0) {
+			lossy_size += session_delta_block_finish(&lossy_enc);
+		}
+	}
+	lossy_size += session_delta_block_finish(&lossy_enc);
+
+	TC_PRINT("Lossy delta (5 mg, 500 mdps, 0.001): %u bytes for %u bytes exact (%u%% smaller)\n", (uint32_t)lossy_size,
+		 (uint32_t)exact_size, (uint32_t)(100 * (exact_size - lossy_size) / exact_size));
+	zassert_true(lossy_size < exact_size, "Quantized data must be smaller");
+}
+
+ZTEST(session_codec, test_lossy_limits)
+{
+	session_bin_header_t hdr;
+	session_delta_encoder_t enc;
+	uint8_t block[SESSION_DELTA_BLOCK_MAX_SIZE(1, SESSION_CHANNEL_NB)];
+
+	session_bin_header_init(&hdr, SESSION_CHANNELS_SIMPLE);
+	zassert_equal(session_bin_header_set_max_error(&hdr, SESSION_CHANNEL_TS, 1), -EINVAL, "Timestamps are exact");
+	zassert_equal(session_bin_header_set_max_error(&hdr, SESSION_CHANNEL_QVAR, 1), -EINVAL, "Channel not recorded");
+	zassert_equal(session_bin_header_set_max_error(&hdr, SESSION_CHANNEL_ACC_X, 32768), -EINVAL, "Step overflow");
+	zassert_ok(session_bin_header_set_max_error(&hdr, SESSION_CHANNEL_ACC_X, 32767), "Largest step");
+	zassert_equal(hdr.channels[1].step, UINT16_MAX, "Wrong step");
+	zassert_equal(session_bin_header_check(&hdr, hdr.header_size), hdr.header_size, "Lossy header must be valid");
+
+	hdr.channels[1].step = 0;
+	zassert_equal(session_bin_header_check(&hdr, hdr.header_size), -EINVAL, "Null step");
+	hdr.channels[1].step = 1;
+	hdr.channels[0].step = 3;
+	zassert_equal(session_bin_header_check(&hdr, hdr.header_size), -EINVAL, "Timestamps cannot be quantized");
+
+	session_bin_header_init(&hdr, SESSION_CHANNELS_SIMPLE);
+	session_delta_encoder_init(&enc, SESSION_CHANNELS_SIMPLE | SESSION_CHANNELS_QVAR, 1, block, sizeof(block));
+	zassert_equal(session_delta_encoder_set_steps(&enc, &hdr), -EINVAL, "Channels must match");
+}
+
+ZTEST(session_codec, test_bin_header_v1)
+{
+	session_bin_header_t hdr;
+	session_bin_header_t loaded;
+	uint8_t v1[sizeof(session_bin_header_t)];
+
+	// Version 1 channel descriptors are the current ones without the step.
+	int size = session_bin_header_init(&hdr, SESSION_CHANNELS_SIMPLE);
+	size_t v1_size = SESSION_BIN_HEADER_MIN_SIZE + hdr.nb_channels * 6;
+	memcpy(v1, &hdr, SESSION_BIN_HEADER_MIN_SIZE);
+	for (int ii = 0; ii < hdr.nb_channels; ii++) {
+		memcpy(v1 + SESSION_BIN_HEADER_MIN_SIZE + ii * 6, &hdr.channels[ii], 6);
+	}
+	session_bin_header_t *v1_hdr = (session_bin_header_t *)v1;
+	v1_hdr->version = 1;
+	v1_hdr->header_size = v1_size;
+
+	zassert_equal(session_bin_header_check(v1_hdr, v1_size), v1_size, "Version 1 is supported");
+	zassert_equal(session_bin_header_load(&loaded, v1, v1_size), v1_size, "Version 1 header size");
+	zassert_equal(loaded.version, SESSION_BIN_VERSION, "Header must be converted");
+	zassert_equal(loaded.header_size, size, "Wrong converted header size %u", loaded.header_size);
+	zassert_mem_equal(&loaded, &hdr, size, "Version 1 channels are exact");
+	zassert_true(session_bin_header_load(&loaded, v1, v1_size - 1) < 0, "Truncated header must be rejected");
+
+	v1_hdr->version = SESSION_BIN_VERSION + 1;
+	zassert_equal(session_bin_header_load(&loaded, v1, v1_size), -ENOTSUP, "Unknown version");
+}
+
+ZTEST(session_codec, test_column_roundtrip)
+{
+	static uint8_t block[SESSION_COLUMN_BLOCK_MAX_SIZE(32, SESSION_CHANNEL_NB)];
+	static float_t expected[NB_LINES][SESSION_CHANNEL_NB];
+	const uint32_t acc = GENMASK(SESSION_CHANNEL_ACC_Z, SESSION_CHANNEL_ACC_X);
+	session_column_encoder_t enc;
+	session_column_decoder_t dec;
+	session_bin_header_t hdr;
+	float_t values[SESSION_CHANNEL_NB] = {0};
+	float_t decoded[SESSION_CHANNEL_NB];
+	uint8_t record[SESSION_BIN_RECORD_MAX_SIZE];
+	size_t offset, size;
+	int first = 0;
+
+	session_bin_header_init(&hdr, all_channels);
+	zassert_ok(session_column_encoder_init(&enc, all_channels, 32, block, sizeof(block)), "Init failed");
+
+	lcg_state = 4;
+	for (int ii = 0; ii < NB_LINES; ii++) {
+		walk_sample(values, ii);
+		if (ii == 100) {
+			values[SESSION_CHANNEL_GYRO_X] = 2e9f;
+			values[SESSION_CHANNEL_GYRO_Y] = -2e9f;
+		}
+		session_bin_pack_record(all_channels, values, record);
+		session_bin_unpack_record(&hdr, record, expected[ii]);
+
+		bool full = session_column_encode(&enc, values) > 0;
+		if (!full && ii < NB_LINES - 1) {
+			continue;
+		}
+
+		size_t len = session_column_block_finish(&enc);
+		zassert_equal(session_column_decoder_init(&dec, &hdr, 0, block, len), len, "Wrong block size");
+		zassert_equal(session_column_decoder_init(&dec, &hdr, 0, block, len - 1), -EAGAIN, "Truncated block");
+		session_column_decoder_init(&dec, &hdr, 0, block, len);
+		for (int jj = first; jj <= ii; jj++) {
+			zassert_ok(session_column_decode(&dec, decoded), "Decoding sample %d failed", jj);
+			zassert_mem_equal(decoded, expected[jj], sizeof(decoded), "Sample %d differs", jj);
+		}
+		zassert_equal(session_column_decode(&dec, decoded), -ENODATA, "Block must be over");
+
+		// The accelerometer can be decoded from its chunks alone.
+		zassert_equal(session_column_find_chunk(&hdr, block, SESSION_DELTA_BLOCK_HEADER_SIZE + 2 * SESSION_CHANNEL_NB,
+							SESSION_CHANNEL_ACC_X, &offset, &size), len, "Directory must be enough");
+		zassert_equal(session_column_decoder_init(&dec, &hdr, acc, block, len), len, "Partial init failed");
+		for (int jj = first; jj <= ii; jj++) {
+			memset(decoded, 0, sizeof(decoded));
+			zassert_ok(session_column_decode(&dec, decoded), "Decoding sample %d failed", jj);
+			for (int kk = 0; kk < SESSION_CHANNEL_NB; kk++) {
+				zassert_equal(decoded[kk], (acc & BIT(kk)) ? expected[jj][kk] : 0.0f, "Sample %d channel %d", jj, kk);
+			}
+		}
+		first = ii + 1;
+	}
+	zassert_equal(session_column_block_finish(&enc), 0, "Empty block must not be written");
+}
+
+ZTEST(session_codec, test_column_limits)
+{
+	static uint8_t block[SESSION_COLUMN_BLOCK_MAX_SIZE(4, 7)];
+	session_column_encoder_t enc;
+	session_column_decoder_t dec;
+	session_bin_header_t hdr;
+	float_t values[SESSION_CHANNEL_NB] = {0};
+	size_t offset, size;
+
+	zassert_equal(session_column_encoder_init(&enc, SESSION_CHANNELS_SIMPLE, 4, block, SESSION_DELTA_BLOCK_HEADER_SIZE + 14),
+		      -EINVAL, "The directory must leave room for a sample");
+	zassert_ok(session_column_encoder_init(&enc, SESSION_CHANNELS_SIMPLE, 100, block, sizeof(block)), "Init failed");
+	zassert_equal(enc.max_samples, 4, "Blocks must be limited by the buffer size");
+
+	session_bin_header_init(&hdr, SESSION_CHANNELS_SIMPLE);
+	session_column_encode(&enc, values);
+	size_t len = session_column_block_finish(&enc);
+	zassert_equal(len, SESSION_DELTA_BLOCK_HEADER_SIZE + 14 + 7, "One byte per value of a null sample");
+
+	zassert_equal(session_column_find_chunk(&hdr, block, len, SESSION_CHANNEL_QVAR, &offset, &size), -ENOENT,
+		      "Channel not recorded");
+	zassert_equal(session_column_find_chunk(&hdr, block, 5, SESSION_CHANNEL_TS, &offset, &size), -EAGAIN,
+		      "Truncated directory");
+	zassert_equal(session_column_find_chunk(&hdr, block, len, SESSION_CHANNEL_TS, &offset, &size), len, "TS chunk");
+	zassert_equal(offset, SESSION_DELTA_BLOCK_HEADER_SIZE + 14, "TS chunk comes first");
+
+	block[SESSION_DELTA_BLOCK_HEADER_SIZE]++;
+	zassert_equal(session_column_decoder_init(&dec, &hdr, 0, block, len), -EINVAL, "Directory must match the payload");
+	block[SESSION_DELTA_BLOCK_HEADER_SIZE]--;
+	block[len - 1] = 0x80;
+	zassert_equal(session_column_decoder_init(&dec, &hdr, 0, block, len), len, "Init failed");
+	zassert_equal(session_column_decode(&dec, values), -EINVAL, "Truncated varint");
+}
+
+ZTEST(session_codec, test_column_benchmark)
+{
+	static uint8_t delta_block[SESSION_DELTA_BLOCK_MAX_SIZE(32, SESSION_CHANNEL_NB)];
+	static uint8_t column_block[SESSION_COLUMN_BLOCK_MAX_SIZE(32, SESSION_CHANNEL_NB)];
+	session_delta_encoder_t delta_enc;
+	session_column_encoder_t column_enc;
+	float_t values[SESSION_CHANNEL_NB] = {0};
+	size_t delta_size = 0, column_size = 0;
+	uint32_t cycles = 0;
+
+	lcg_state = 5;
+	session_delta_encoder_init(&delta_enc, all_channels, 32, delta_block, sizeof(delta_block));
+	session_column_encoder_init(&column_enc, all_channels, 32, column_block, sizeof(column_block));
+	for (int ii = 0; ii < NB_LINES; ii++) {
+		walk_sample(values, ii);
+		if (session_delta_encode(&delta_enc, values) > 0) {
+			delta_size += session_delta_block_finish(&delta_enc);
+		}
+
+		uint32_t start = k_cycle_get_32();
+		if (session_column_encode(&column_enc, values) > 0) {
+			column_size += session_column_block_finish(&column_enc);
+		}
+		cycles += k_cycle_get_32() - start;
+	}
+	delta_size += session_delta_block_finish(&delta_enc);
+	column_size += session_column_block_finish(&column_enc);
+
+	TC_PRINT("Columnar blocks of 32 samples (15 channels): %u bytes, %u bytes as delta blocks, %u cycles/sample\n",
+		 (uint32_t)column_size, (uint32_t)delta_size, cycles / NB_LINES);
+	// Same values, plus the directory of each block.
+	zassert_equal(column_size, delta_size + DIV_ROUND_UP(NB_LINES, 32) * 2 * SESSION_CHANNEL_NB, "Unexpected overhead");
+}
+
+ZTEST(session_codec, test_ring)
+{
+	static uint8_t buf[256];
+	static uint8_t data[200];
+	session_ring_t ring;
+	const uint8_t *p;
+	size_t next_put = 0, next_get = 0; // Data bytes are the low bits of their position.
+
+	zassert_equal(session_ring_init(&ring, buf, 100), -EINVAL, "Size must be a power of two");
+	zassert_ok(session_ring_init(&ring, buf, sizeof(buf)), "Init failed");
+	zassert_equal(session_ring_peek(&ring, &p), 0, "Ring must be empty");
+	zassert_equal(session_ring_space(&ring), sizeof(buf), "Ring must be empty");
+
+	// Puts and gets of varying sizes, so that data wraps around at every position.
+	lcg_state = 7;
+	for (int ii = 0; ii < 2000; ii++) {
+		size_t len = lcg_next() % sizeof(data);
+		for (size_t jj = 0; jj < len; jj++) {
+			data[jj] = (uint8_t)(next_put + jj);
+		}
+
+		size_t space = session_ring_space(&ring);
+		int res = session_ring_put(&ring, data, len);
+		if (len > space) {
+			zassert_equal(res, -ENOSPC, "Put must be all or nothing");
+			zassert_equal(session_ring_space(&ring), space, "Nothing must be put");
+		} else {
+			zassert_ok(res, "Put failed");
+			next_put += len;
+		}
+
+		size_t take = lcg_next() % sizeof(buf);
+		while (take > 0) {
+			size_t avail = session_ring_peek(&ring, &p);
+			if (avail == 0) {
+				break;
+			}
+			avail = MIN(avail, take);
+			for (size_t jj = 0; jj < avail; jj++) {
+				zassert_equal(p[jj], (uint8_t)(next_get + jj), "Byte %u of get %d differs", (uint32_t)jj, ii);
+			}
+			session_ring_consume(&ring, avail);
+			next_get += avail;
+			take -= avail;
+		}
+		zassert_equal(session_ring_used(&ring), next_put - next_get, "Wrong fill level");
+	}
+}
+
+#define DISK_SECTOR_SIZE 512
+#define DISK_BLOCK_SIZE 4096 // Erase block of the external flash, and disk cache size.
+
+struct write_cost {
+	size_t writes;
+	size_t partial_sectors; // Read, modified and written back by FatFs.
+	size_t blocks;			// Erased and programmed, if the disk cache is written back after each write.
+};
+
+static void count_write(struct write_cost *cost, size_t offset, size_t len)
+{
+	size_t end = offset + len;
+
+	cost->writes++;
+	if (offset % DISK_SECTOR_SIZE) {
+		cost->partial_sectors++;
+	}
+	if (end % DISK_SECTOR_SIZE && (offset % DISK_SECTOR_SIZE == 0 || (end - 1) / DISK_SECTOR_SIZE != offset / DISK_SECTOR_SIZE)) {
+		cost->partial_sectors++;
+	}
+	cost->blocks += (end - 1) / DISK_BLOCK_SIZE - offset / DISK_BLOCK_SIZE + 1;
+}
+
+/* Write pattern of a CSV session flushed every 1 KB, against the session writer, which writes
+ * whole 4 KB chunks of a 16 KB ring.
+ */
+ZTEST(session_codec, test_write_alignment_benchmark)
+{
+	static uint8_t ring_buf[16384];
+	static char line[TXT_SIZE];
+	session_ring_t ring;
+	struct write_cost flushes = {0}, chunks = {0};
+	size_t buffered = 0, total = 0, written = 0;
+	const uint8_t *p;
+
+	zassert_ok(session_ring_init(&ring, ring_buf, sizeof(ring_buf)), "Init failed");
+
+	lcg_state = 8;
+	for (int ii = 0; ii < 20 * NB_LINES; ii++) {
+		size_t len = 45 + lcg_next() % 40; // Simple CSV lines.
+		memset(line, '0' + ii % 10, len);
+
+		buffered += len;
+		if (buffered >= 1024) {
+			count_write(&flushes, total + len - buffered, buffered);
+			buffered = 0;
+		}
+		while (session_ring_space(&ring) < len) {
+			size_t chunk = session_ring_peek(&ring, &p);
+			zassert_true(chunk >= 4096, "Chunk wraps around");
+			count_write(&chunks, written, 4096);
+			session_ring_consume(&ring, 4096);
+			written += 4096;
+		}
+		zassert_ok(session_ring_put(&ring, line, len), "Put failed");
+		total += len;
+	}
+	// End of the session.
+	count_write(&flushes, total - buffered, buffered);
+	while (session_ring_used(&ring) > 0) {
+		size_t chunk = MIN(session_ring_peek(&ring, &p), 4096);
+		count_write(&chunks, written, chunk);
+		session_ring_consume(&ring, chunk);
+		written += chunk;
+	}
+	zassert_equal(written, total, "Data lost");
+
+	TC_PRINT("%u bytes in 1 KB flushes: %u writes, %u partial sectors, %u KB programmed (x%u.%02u)\n",
+		 (uint32_t)total, (uint32_t)flushes.writes, (uint32_t)flushes.partial_sectors,
+		 (uint32_t)(flushes.blocks * DISK_BLOCK_SIZE / 1024),
+		 (uint32_t)(flushes.blocks * DISK_BLOCK_SIZE / total), (uint32_t)(flushes.blocks * DISK_BLOCK_SIZE * 100 / total % 100));
+	TC_PRINT("%u bytes in 4 KB chunks: %u writes, %u partial sectors, %u KB programmed (x%u.%02u)\n",
+		 (uint32_t)total, (uint32_t)chunks.writes, (uint32_t)chunks.partial_sectors,
+		 (uint32_t)(chunks.blocks * DISK_BLOCK_SIZE / 1024),
+		 (uint32_t)(chunks.blocks * DISK_BLOCK_SIZE / total), (uint32_t)(chunks.blocks * DISK_BLOCK_SIZE * 100 / total % 100));
+	zassert_true(chunks.partial_sectors <= 1, "Only the last chunk may end in a sector");
+	zassert_equal(chunks.blocks, DIV_ROUND_UP(total, DISK_BLOCK_SIZE), "Each block must be written once");
+	zassert_true(flushes.blocks > chunks.blocks * 3, "Flushes must program about 4 times more");
+}
+
+ZTEST(session_codec, test_csv_parse)
+{
+	char line[] = "1234.567,-12,0,980,-70,35,1400";
+	float_t values[SESSION_CHANNEL_NB];
+
+	zassert_equal(session_csv_parse_line(line, values), 7, "Wrong number of columns");
+	zassert_equal(values[SESSION_CHANNEL_TS], 1234.567f, "Wrong timestamp");
+	zassert_equal(values[SESSION_CHANNEL_ACC_X], -12.0f, "Wrong acceleration");
+	zassert_equal(values[SESSION_CHANNEL_GYRO_Z], 1400.0f, "Wrong angular rate");
+}
+
+/* File in memory, read in pieces of at most max_read bytes. */
+struct mem_file {
+	const uint8_t *data;
+	size_t size;
+	size_t pos;
+	size_t max_read;
+	size_t reads;
+	size_t unaligned_reads; // Reads not asked to end on a 64-byte block.
+};
+
+static int mem_file_read(void *ctx, void *data, size_t len)
+{
+	struct mem_file *f = ctx;
+	size_t n = MIN(MIN(len, f->max_read), f->size - f->pos);
+
+	if ((f->pos + len) % 64 != 0) {
+		f->unaligned_reads++;
+	}
+	memcpy(data, &f->data[f->pos], n);
+	f->pos += n;
+	f->reads++;
+	return n;
+}
+
+static char reader_txt[NB_LINES * 64];
+
+/* CSV lines of simple samples, the first one ending with CRLF and the last one without newline.
+ * Returns the length of the text.
+ */
+static size_t make_csv(void)
+{
+	char *p = reader_txt;
+	char *end = &reader_txt[sizeof(reader_txt)];
+
+	lcg_state = 9;
+	for (int ii = 0; ii < NB_LINES; ii++) {
+		p = session_csv_put_float(p, end, random_sample(3), 3);
+		for (int jj = 1; jj < 7; jj++) {
+			p = session_csv_put_field(p, end, random_sample(jj), 0);
+		}
+		if (ii == 0) {
+			*p++ = '\r';
+		}
+		*p++ = '\n';
+	}
+	return p - 1 - reader_txt;
+}
+
+ZTEST(session_codec, test_reader_lines)
+{
+	static uint8_t buf[256];
+	session_reader_t reader;
+	struct mem_file f = {0};
+	char *line;
+	int res, nb = 0;
+
+	f.data = (const uint8_t *)reader_txt;
+	f.size = make_csv();
+	f.max_read = 100; // Short reads, like at the end of a FAT cluster.
+
+	zassert_equal(session_reader_init(&reader, mem_file_read, &f, buf, 32, 64), -EINVAL, "Buffer smaller than a block");
+	zassert_ok(session_reader_init(&reader, mem_file_read, &f, buf, sizeof(buf), 64), "Init failed");
+
+	const char *expected = reader_txt;
+	while ((res = session_reader_line(&reader, &line)) >= 0) {
+		const char *nl = strchr(expected, '\n');
+		size_t len = (nl != NULL) ? nl - expected : strlen(expected);
+		if (nb == 0) {
+			len--; // CR.
+		}
+		zassert_equal(res, len, "Wrong length of line %d", nb);
+		zassert_mem_equal(line, expected, len, "Line %d differs", nb);
+		zassert_equal(line[len], 0, "Line %d not terminated", nb);
+		zassert_true((uint8_t *)line >= buf && (uint8_t *)line < &buf[sizeof(buf)], "Line must be in the buffer");
+		expected = (nl != NULL) ? nl + 1 : expected + len;
+		nb++;
+	}
+	zassert_equal(res, -ENOENT, "Unexpected error");
+	zassert_equal(nb, NB_LINES, "Lines missing");
+	zassert_equal(session_reader_line(&reader, &line), -ENOENT, "End must be sticky");
+	zassert_equal(f.unaligned_reads, 0, "Reads must end on blocks");
+}
+
+ZTEST(session_codec, test_reader_records)
+{
+	static uint8_t data[1000];
+	static uint8_t buf[128];
+	session_reader_t reader;
+	struct mem_file f = {.data = data, .size = sizeof(data), .max_read = SIZE_MAX};
+	const uint8_t *record;
+	int res;
+	size_t pos = 0;
+
+	for (size_t ii = 0; ii < sizeof(data); ii++) {
+		data[ii] = (uint8_t)ii;
+	}
+	zassert_ok(session_reader_init(&reader, mem_file_read, &f, buf, sizeof(buf), 64), "Init failed");
+	zassert_equal(session_reader_record(&reader, &record, sizeof(buf) + 1), -E2BIG, "Record larger than the buffer");
+
+	// Records of 30 bytes, the last 10 bytes are a partial record.
+	while ((res = session_reader_record(&reader, &record, 30)) > 0) {
+		zassert_equal(res, 30, "Wrong record size");
+		zassert_mem_equal(record, &data[pos], 30, "Record at %u differs", (uint32_t)pos);
+		pos += 30;
+	}
+	zassert_equal(res, -ENOENT, "Partial record must be the end");
+	zassert_equal(pos, sizeof(data) - sizeof(data) % 30, "Records missing");
+
+	const uint8_t *p;
+	zassert_equal(session_reader_peek(&reader, &p, 30), sizeof(data) % 30, "Partial record must stay buffered");
+	zassert_mem_equal(p, &data[pos], sizeof(data) % 30, "Partial record differs");
+}
+
+ZTEST(session_codec, test_reader_limits)
+{
+	static char txt[] = "short\nthis line is longer than the buffer of the reader\nend";
+	static uint8_t buf[16];
+	session_reader_t reader;
+	struct mem_file f = {.data = (const uint8_t *)txt, .size = strlen(txt), .max_read = SIZE_MAX};
+	char *line;
+
+	zassert_ok(session_reader_init(&reader, mem_file_read, &f, buf, sizeof(buf), 8), "Init failed");
+	zassert_equal(session_reader_line(&reader, &line), 5, "Wrong length");
+	zassert_equal(strcmp(line, "short"), 0, "Wrong line");
+	zassert_equal(session_reader_line(&reader, &line), -E2BIG, "Line longer than the buffer");
+
+	// A last line filling the whole buffer leaves no room for its NUL.
+	static char full[] = "0123456789abcdef";
+	f = (struct mem_file){.data = (const uint8_t *)full, .size = strlen(full), .max_read = SIZE_MAX};
+	zassert_ok(session_reader_init(&reader, mem_file_read, &f, buf, sizeof(buf), 8), "Init failed");
+	zassert_equal(session_reader_line(&reader, &line), -E2BIG, "No room for the NUL");
+
+	f = (struct mem_file){.data = (const uint8_t *)full, .size = 0, .max_read = SIZE_MAX};
+	zassert_ok(session_reader_init(&reader, mem_file_read, &f, buf, sizeof(buf), 8), "Init failed");
+	zassert_equal(session_reader_line(&reader, &line), -ENOENT, "Empty file");
+}
+
+/* Reads and seeks of a CSV session read line by line with 200-byte reads, seeking back after
+ * each line, against the reader with a 4 KB buffer.
+ */
+ZTEST(session_codec, test_reader_benchmark)
+{
+	static uint8_t buf[4096];
+	session_reader_t reader;
+	struct mem_file f = {.data = (const uint8_t *)reader_txt, .max_read = SIZE_MAX};
+	float_t values[SESSION_CHANNEL_NB];
+	size_t seeks = 0, reads = 0;
+	char *line;
+	int res;
+
+	f.size = make_csv();
+
+	// Line by line: one read and one seek per line.
+	for (size_t pos = 0; pos < f.size; reads++) {
+		const char *nl = memchr(&reader_txt[pos], '\n', MIN(TXT_SIZE, f.size - pos));
+		if (nl == NULL) {
+			break;
+		}
+		pos = nl + 1 - reader_txt;
+		seeks++;
+	}
+
+	uint32_t start = k_cycle_get_32();
+	zassert_ok(session_reader_init(&reader, mem_file_read, &f, buf, sizeof(buf), 512), "Init failed");
+	size_t nb = 0;
+	while ((res = session_reader_line(&reader, &line)) >= 0) {
+		zassert_equal(session_csv_parse_line(line, values), 7, "Wrong line %u", (uint32_t)nb);
+		nb++;
+	}
+	uint32_t cycles = k_cycle_get_32() - start;
+
+	TC_PRINT("%u lines, %u bytes: %u reads and %u seeks line by line, %u reads with the reader, %u cycles/line\n",
+		 (uint32_t)NB_LINES, (uint32_t)f.size, (uint32_t)reads, (uint32_t)seeks, (uint32_t)f.reads,
+		 (uint32_t)(cycles / NB_LINES));
+	zassert_equal(res, -ENOENT, "Unexpected error");
+	zassert_equal(nb, NB_LINES, "Lines missing");
+	zassert_true(f.reads * 50 < reads, "The reader must read at least 50 times less often");
+}
+
+struct mem_index {
+	const session_index_entry_t *entries;
+	size_t reads;
+};
+
+static int mem_index_read(void *ctx, uint32_t index, session_index_entry_t *entry)
+{
+	struct mem_index *idx = ctx;
+
+	*entry = idx->entries[index];
+	idx->reads++;
+	return 0;
+}
+
+ZTEST(session_codec, test_index_find)
+{
+	static session_index_entry_t entries[1000];
+	struct mem_index idx = {.entries = entries};
+	session_index_entry_t entry;
+	uint32_t ts = 5000;
+
+	lcg_state = 10;
+	for (uint32_t ii = 0; ii < ARRAY_SIZE(entries); ii++) {
+		entries[ii] = (session_index_entry_t){.ts_ms = ts, .offset = ii * 4096};
+		ts += 1000 + lcg_next() % 50; // Entries are at least the interval apart.
+	}
+
+	zassert_equal(session_index_find(mem_index_read, &idx, 0, 1000, &entry), -ENOENT, "Empty index");
+	zassert_equal(session_index_find(mem_index_read, &idx, ARRAY_SIZE(entries), 0, &entry), 0, "Before the first entry");
+	zassert_equal(entry.ts_ms, 5000, "Wrong entry");
+	zassert_equal(session_index_find(mem_index_read, &idx, ARRAY_SIZE(entries), UINT32_MAX, &entry),
+		      ARRAY_SIZE(entries) - 1, "After the last entry");
+	zassert_equal(session_index_find(mem_index_read, &idx, 1, 100000, &entry), 0, "Single entry");
+
+	for (uint32_t ii = 0; ii < ARRAY_SIZE(entries); ii++) {
+		uint32_t target = entries[ii].ts_ms + (ii % 3) * 400; // On the entry, or before the next one.
+
+		idx.reads = 0;
+		zassert_equal(session_index_find(mem_index_read, &idx, ARRAY_SIZE(entries), target, &entry), ii,
+			      "Wrong entry for %u ms", target);
+		zassert_equal(entry.offset, ii * 4096, "Wrong offset for %u ms", target);
+		zassert_true(idx.reads <= 11, "%u reads for %u entries", (uint32_t)idx.reads, (uint32_t)ARRAY_SIZE(entries));
+	}
+}
+
+/* Index a CSV session every 10 lines, then start reading it at a timestamp. The timestamps of
+ * make_csv are random, the entries are given one every second instead.
+ */
+ZTEST(session_codec, test_index_seek)
+{
+	static session_index_entry_t entries[NB_LINES / 10];
+	static uint8_t buf[256];
+	struct mem_index idx = {.entries = entries};
+	struct mem_file f = {.data = (const uint8_t *)reader_txt, .max_read = SIZE_MAX};
+	session_reader_t reader;
+	session_index_entry_t entry;
+	float_t values[SESSION_CHANNEL_NB];
+	uint32_t offset = 0;
+	char *line;
+	int nb = 0;
+
+	f.size = make_csv();
+	zassert_ok(session_reader_init(&reader, mem_file_read, &f, buf, sizeof(buf), 64), "Init failed");
+	while (session_reader_line(&reader, &line) >= 0) {
+		if (nb % 10 == 0) {
+			entries[nb / 10] = (session_index_entry_t){.ts_ms = nb * 100, .offset = offset};
+		}
+		// Offset in the file of the next line.
+		offset = reader.pos - (reader.end - reader.start);
+		nb++;
+	}
+	zassert_equal(nb, NB_LINES, "Lines missing");
+
+	int res = session_index_find(mem_index_read, &idx, ARRAY_SIZE(entries), 20500, &entry);
+	zassert_equal(res, 20, "Wrong entry");
+	zassert_equal(entry.ts_ms, 20000, "Wrong timestamp");
+
+	f.pos = entry.offset;
+	session_reader_restart(&reader, entry.offset);
+	zassert_true(session_reader_line(&reader, &line) > 0, "Nothing read after the seek");
+	zassert_true(entry.offset == 0 || reader_txt[entry.offset - 1] == '\n', "Seek must land on a line");
+	zassert_mem_equal(line, &reader_txt[entry.offset], strlen(line), "Wrong line");
+	zassert_equal(session_csv_parse_line(line, values), 7, "Wrong number of columns");
+}
+
+ZTEST(session_codec, test_summary)
+{
+	static session_summary_t summary;
+	session_summary_record_t record;
+	float_t values[SESSION_CHANNEL_NB];
+	double sum[SESSION_CHANNEL_NB] = {0}, sum_sq[SESSION_CHANNEL_NB] = {0};
+	float_t min[SESSION_CHANNEL_NB], max[SESSION_CHANNEL_NB];
+	uint32_t clipped = 0;
+	int nb = 20 * NB_LINES + 17; // Not a multiple of the block size.
+
+	session_summary_init(&summary, all_channels);
+	session_summary_get(&summary, &record);
+	zassert_equal(record.nb_samples, 0, "Summary must be empty");
+	zassert_equal(record.channel[SESSION_CHANNEL_ACC_X].max, 0.0f, "Empty channels must be zero");
+
+	session_summary_set_clip(&summary, SESSION_CHANNEL_ACC_X, 3000.0f);
+	lcg_state = 11;
+	for (int ii = 0; ii < nb; ii++) {
+		values[SESSION_CHANNEL_TS] = 1000.0f + ii * 2.5f;
+		for (int jj = 1; jj < SESSION_CHANNEL_NB; jj++) {
+			values[jj] = random_sample(jj) + 10000.0f; // An offset, so that the mean is not 0.
+			if (ii == 0 || values[jj] < min[jj]) {
+				min[jj] = values[jj];
+			}
+			if (ii == 0 || values[jj] > max[jj]) {
+				max[jj] = values[jj];
+			}
+			sum[jj] += values[jj];
+			sum_sq[jj] += (double)values[jj] * values[jj];
+		}
+		clipped += (fabsf(values[SESSION_CHANNEL_ACC_X]) >= 3000.0f);
+		session_summary_add(&summary, values);
+	}
+
+	session_summary_get(&summary, &record);
+	zassert_mem_equal(record.magic, SESSION_SUMMARY_MAGIC, 4, "Wrong magic");
+	zassert_equal(record.size, sizeof(record), "Wrong size");
+	zassert_equal(record.channels, all_channels & ~BIT(SESSION_CHANNEL_TS), "The timestamp is not summarized");
+	zassert_equal(record.nb_samples, nb, "Wrong number of samples");
+	zassert_equal(record.first_ts_ms, 1000.0f, "Wrong first timestamp");
+	zassert_equal(record.last_ts_ms, 1000.0f + (nb - 1) * 2.5f, "Wrong last timestamp");
+	zassert_equal(record.channel[SESSION_CHANNEL_ACC_X].clipped, clipped, "Wrong clip count");
+	zassert_true(clipped > 0, "Nothing clipped");
+	zassert_equal(record.channel[SESSION_CHANNEL_GYRO_X].clipped, 0, "The gyroscope has no limit");
+
+	for (int jj = 1; jj < SESSION_CHANNEL_NB; jj++) {
+		double mean = sum[jj] / nb;
+		double rms = sqrt(sum_sq[jj] / nb);
+		const session_summary_channel_t *ch = &record.channel[jj];
+
+		zassert_equal(ch->min, min[jj], "Wrong min of channel %d", jj);
+		zassert_equal(ch->max, max[jj], "Wrong max of channel %d", jj);
+		zassert_true(fabs(ch->mean - mean) <= 1e-5 * fabs(mean), "Mean of channel %d: %f, expected %f", jj,
+			     (double)ch->mean, mean);
+		zassert_true(fabs(ch->rms - rms) <= 1e-5 * rms, "RMS of channel %d: %f, expected %f", jj,
+			     (double)ch->rms, rms);
+	}
+}
+
+ZTEST(session_codec, test_summary_benchmark)
+{
+	static float_t lines[NB_LINES][SESSION_CHANNEL_NB];
+	static session_summary_t summary;
+	session_summary_record_t record;
+
+	lcg_state = 12;
+	for (int ii = 0; ii < NB_LINES; ii++) {
+		walk_sample(lines[ii], ii);
+	}
+
+	session_summary_init(&summary, all_channels);
+	uint32_t start = k_cycle_get_32();
+	for (int ii = 0; ii < NB_LINES; ii++) {
+		session_summary_add(&summary, lines[ii]);
+	}
+	uint32_t cycles = k_cycle_get_32() - start;
+	session_summary_get(&summary, &record);
+
+	TC_PRINT("Summary of %u channels: %u cycles/sample, %u bytes of state, %u bytes stored\n",
+		 (uint32_t)__builtin_popcount(record.channels), cycles / NB_LINES, (uint32_t)sizeof(summary),
+		 (uint32_t)sizeof(record));
+	zassert_equal(record.nb_samples, NB_LINES, "Samples missing");
+}
+
+#define PREVIEW_SAMPLES (2 * 256 + 40) // Partial windows at both levels.
+
+static float_t preview_samples[PREVIEW_SAMPLES][SESSION_CHANNEL_NB];
+static uint8_t preview_out[SESSION_PREVIEW_LEVELS][PREVIEW_SAMPLES / SESSION_PREVIEW_FACTOR + 1]
+			  [3 * SESSION_BIN_RECORD_MAX_SIZE];
+
+/* Check the records of window nb of level against the samples it covers. */
+static void check_preview_window(const session_bin_header_t *hdr, int level, int nb, const uint8_t *records)
+{
+	int decimation = (level == 0) ? SESSION_PREVIEW_FACTOR : SESSION_PREVIEW_FACTOR * SESSION_PREVIEW_FACTOR;
+	int first = nb * decimation;
+	int last = MIN(first + decimation, PREVIEW_SAMPLES) - 1;
+	float_t min[SESSION_CHANNEL_NB], max[SESSION_CHANNEL_NB], mean[SESSION_CHANNEL_NB];
+	float_t expected[SESSION_CHANNEL_NB];
+	uint8_t packed[SESSION_BIN_RECORD_MAX_SIZE];
+	size_t len = session_bin_unpack_record(hdr, records, min);
+
+
+	session_bin_unpack_record(hdr, &records[len], max);
+	session_bin_unpack_record(hdr, &records[2 * len], mean);
+	zassert_equal(min[SESSION_CHANNEL_TS], preview_samples[first][SESSION_CHANNEL_TS],
+		      "Level %d window %d: wrong first timestamp", level, nb);
+	zassert_equal(max[SESSION_CHANNEL_TS], preview_samples[last][SESSION_CHANNEL_TS],
+		      "Level %d window %d: wrong last timestamp", level, nb);
+
+	// The minimum and maximum records hold sample values, packed the same way.
+	for (int ii = 0; ii < 2; ii++) {
+		for (int jj = 1; jj < SESSION_CHANNEL_NB; jj++) {
+			expected[jj] = preview_samples[first][jj];
+			for (int kk = first + 1; kk <= last; kk++) {
+				float_t val = preview_samples[kk][jj];
+				expected[jj] = ((ii == 0) == (val < expected[jj])) ? val : expected[jj];
+			}
+		}
+		expected[SESSION_CHANNEL_TS] = preview_samples[(ii == 0) ? first : last][SESSION_CHANNEL_TS];
+		session_bin_pack_record(all_channels, expected, packed);
+		zassert_mem_equal(&records[ii * len], packed, len, "Level %d window %d: wrong %s", level, nb,
+				  (ii == 0) ? "minimum" : "maximum");
+	}
+
+	for (int jj = 1; jj < SESSION_CHANNEL_NB; jj++) {
+		double sum = 0.0;
+
+		for (int kk = first; kk <= last; kk++) {
+			sum += preview_samples[kk][jj];
+		}
+		expected[jj] = sum / (last - first + 1);
+	}
+	// Integer channels are rounded and saturated.
+	session_bin_pack_record(all_channels, expected, packed);
+	session_bin_unpack_record(hdr, packed, expected);
+	for (int jj = 1; jj < SESSION_CHANNEL_NB; jj++) {
+		zassert_true(fabsf(mean[jj] - expected[jj]) <= 1.0f + 1e-5f * fabsf(expected[jj]),
+			     "Level %d window %d: mean of channel %d %f, expected %f", level, nb, jj, (double)mean[jj],
+			     (double)expected[jj]);
+	}
+}
+
+ZTEST(session_codec, test_preview)
+{
+	static session_preview_t preview;
+	session_preview_header_t phdr;
+	session_bin_header_t hdr;
+	int nb_windows[SESSION_PREVIEW_LEVELS] = {0};
+
+	session_preview_init(&preview, all_channels & ~BIT(SESSION_CHANNEL_TS));
+	zassert_equal(preview.channels, all_channels, "The timestamp must always be previewed");
+	zassert_equal(session_preview_window_size(&preview), 3 * session_bin_record_size(all_channels),
+		      "Wrong window size");
+	zassert_true(session_bin_header_init(&hdr, preview.channels) > 0, "Invalid header");
+	session_preview_header(&phdr, 1);
+	zassert_mem_equal(phdr.magic, SESSION_PREVIEW_MAGIC, 4, "Wrong magic");
+	zassert_equal(phdr.decimation, 256, "Wrong decimation of level 1");
+
+	lcg_state = 12;
+	for (int ii = 0; ii < PREVIEW_SAMPLES; ii++) {
+		float_t *values = preview_samples[ii];
+
+		values[SESSION_CHANNEL_TS] = 500.0f + ii * 4.0f;
+		for (int jj = 1; jj < SESSION_CHANNEL_NB; jj++) {
+			values[jj] = random_sample(jj);
+		}
+
+		uint32_t levels = session_preview_add(&preview, values);
+		zassert_equal(levels & BIT(0), ((ii + 1) % 16 == 0) ? BIT(0) : 0, "Sample %d: wrong level 0 window", ii);
+		zassert_equal(levels & BIT(1), ((ii + 1) % 256 == 0) ? BIT(1) : 0, "Sample %d: wrong level 1 window", ii);
+		for (int level = 0; level < SESSION_PREVIEW_LEVELS; level++) {
+			if (levels & BIT(level)) {
+				session_preview_pack(&preview, level, preview_out[level][nb_windows[level]++]);
+			}
+		}
+	}
+
+	uint32_t levels = session_preview_finish(&preview);
+	zassert_equal(levels, BIT(0) | BIT(1), "Both levels end with a partial window");
+	for (int level = 0; level < SESSION_PREVIEW_LEVELS; level++) {
+		session_preview_pack(&preview, level, preview_out[level][nb_windows[level]++]);
+	}
+	zassert_equal(nb_windows[0], DIV_ROUND_UP(PREVIEW_SAMPLES, 16), "Wrong number of level 0 windows");
+	zassert_equal(nb_windows[1], DIV_ROUND_UP(PREVIEW_SAMPLES, 256), "Wrong number of level 1 windows");
+
+	for (int level = 0; level < SESSION_PREVIEW_LEVELS; level++) {
+		for (int nb = 0; nb < nb_windows[level]; nb++) {
+			check_preview_window(&hdr, level, nb, preview_out[level][nb]);
+		}
+	}
+}
+
+ZTEST_SUITE(session_codec, NULL, NULL, NULL, NULL, NULL);
@@ -0,0 +1,300 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+/*
+ * @file test session_log library
+ *
+ * This suite runs the session log on a RAM area behaving like NOR flash, and checks that
+ * sessions read back as written across remounts, wrap-around and interrupted writes.
+ */
+
+#include <string.h>
+
+#include <zephyr/ztest.h>
+
+#include <app/lib/session_log.h>
+
+#define BLOCK_SIZE 4096
+#define NB_BLOCKS 8
+
+struct ram_flash {
+	uint8_t mem[NB_BLOCKS * BLOCK_SIZE];
+	size_t reads;
+	size_t erases;
+	size_t write_budget; // Bytes programmed before a simulated reset, SIZE_MAX for none.
+};
+
+static struct ram_flash ram;
+
+static int ram_read(void *ctx, uint32_t offset, void *data, size_t len)
+{
+	struct ram_flash *flash = ctx;
+
+	zassert_true(offset + len <= sizeof(flash->mem), "Read out of the area");
+	memcpy(data, &flash->mem[offset], len);
+	flash->reads++;
+	return 0;
+}
+
+static int ram_write(void *ctx, uint32_t offset, const void *data, size_t len)
+{
+	struct ram_flash *flash = ctx;
+	const uint8_t *p = data;
+
+	zassert_true(offset + len <= sizeof(flash->mem), "Write out of the area");
+	for (size_t ii = 0; ii < len; ii++) {
+		if (flash->write_budget == 0) {
+			return -EIO;
+		}
+		if (flash->write_budget != SIZE_MAX) {
+			flash->write_budget--;
+		}
+		// Programming only clears bits.
+		flash->mem[offset + ii] &= p[ii];
+	}
+	return 0;
+}
+
+static int ram_erase(void *ctx, uint32_t offset, size_t len)
+{
+	struct ram_flash *flash = ctx;
+
+	zassert_equal(offset % BLOCK_SIZE, 0, "Erase not aligned");
+	zassert_equal(len % BLOCK_SIZE, 0, "Erase not aligned");
+	memset(&flash->mem[offset], 0xff, len);
+	flash->erases++;
+	return 0;
+}
+
+static const session_log_flash_t ram_log_flash = {
+	.read = ram_read,
+	.write = ram_write,
+	.erase = ram_erase,
+	.ctx = &ram,
+	.size = sizeof(ram.mem),
+	.block_size = BLOCK_SIZE,
+};
+
+static uint8_t data[3 * BLOCK_SIZE];
+
+static void fill_data(uint32_t seed)
+{
+	for (size_t ii = 0; ii < sizeof(data); ii++) {
+		data[ii] = (uint8_t)(ii * 7 + seed);
+	}
+}
+
+static size_t bad_records;
+
+/* Read back every record of session into buf, and return the data length. Corrupted records
+ * are skipped and counted in bad_records.
+ */
+static int read_session(const session_log_t *log, uint32_t session, uint8_t *buf, size_t size)
+{
+	session_log_cursor_t cursor;
+	session_log_record_header_t hdr;
+	size_t len = 0;
+	int res;
+
+	session_log_cursor_init(log, &cursor);
+	while ((res = session_log_next(log, &cursor, &hdr)) != -ENOENT) {
+		if (res == -EBADMSG) {
+			bad_records++;
+			continue;
+		}
+		zassert_ok(res, "Read failed");
+		if (hdr.session != session || hdr.type != SESSION_LOG_RECORD_DATA) {
+			continue;
+		}
+		zassert_true(len + hdr.len <= size, "Session larger than written");
+		zassert_ok(session_log_read(log, &cursor, 0, &buf[len], hdr.len), "Read failed");
+		len += hdr.len;
+	}
+	return len;
+}
+
+static void before(void *fixture)
+{
+	ARG_UNUSED(fixture);
+	memset(ram.mem, 0xff, sizeof(ram.mem));
+	ram.reads = 0;
+	ram.erases = 0;
+	ram.write_budget = SIZE_MAX;
+	bad_records = 0;
+}
+
+ZTEST(session_log, test_roundtrip)
+{
+	static uint8_t buf[sizeof(data)];
+	session_log_t log;
+	session_log_cursor_t cursor;
+	session_log_record_header_t hdr;
+
+	zassert_ok(session_log_mount(&log, &ram_log_flash), "Mount failed");
+	zassert_equal(log.seq, 0, "Log must be empty");
+	session_log_cursor_init(&log, &cursor);
+	zassert_equal(session_log_next(&log, &cursor, &hdr), -ENOENT, "Log must be empty");
+
+	fill_data(1);
+	zassert_ok(session_log_append(&log, SESSION_LOG_RECORD_START, 12, "CSV", 3), "Append failed");
+	for (size_t done = 0; done < sizeof(data); done += 1000) {
+		zassert_ok(session_log_append(&log, SESSION_LOG_RECORD_DATA, 12, &data[done], MIN(1000, sizeof(data) - done)),
+			   "Append failed");
+	}
+	zassert_ok(session_log_append(&log, SESSION_LOG_RECORD_START, 13, "BIN", 3), "Append failed");
+	zassert_ok(session_log_append(&log, SESSION_LOG_RECORD_DATA, 13, data, 10), "Append failed");
+
+	// Records never straddle blocks, the session needs a 4th block.
+	zassert_equal(log.seq, 4, "Unexpected number of blocks");
+
+	session_log_t mounted;
+	zassert_ok(session_log_mount(&mounted, &ram_log_flash), "Mount failed");
+	zassert_equal(mounted.head, log.head, "Wrong head block");
+	zassert_equal(mounted.head_off, log.head_off, "Wrong head offset");
+
+	session_log_cursor_init(&mounted, &cursor);
+	zassert_ok(session_log_next(&mounted, &cursor, &hdr), "First record missing");
+	zassert_equal(hdr.type, SESSION_LOG_RECORD_START, "Wrong record type");
+	zassert_equal(hdr.session, 12, "Wrong session");
+	zassert_equal(hdr.len, 3, "Wrong metadata length");
+	zassert_ok(session_log_read(&mounted, &cursor, 0, buf, 3), "Read failed");
+	zassert_mem_equal(buf, "CSV", 3, "Wrong metadata");
+	zassert_equal(session_log_read(&mounted, &cursor, 1, buf, 3), -EINVAL, "Read past the record");
+
+	zassert_equal(read_session(&mounted, 12, buf, sizeof(buf)), sizeof(data), "Wrong session length");
+	zassert_mem_equal(buf, data, sizeof(data), "Wrong session data");
+	zassert_equal(read_session(&mounted, 13, buf, sizeof(buf)), 10, "Wrong session length");
+	zassert_mem_equal(buf, data, 10, "Wrong session data");
+}
+
+ZTEST(session_log, test_mount_resumes)
+{
+	static uint8_t buf[sizeof(data)];
+	session_log_t log;
+
+	fill_data(2);
+	zassert_ok(session_log_mount(&log, &ram_log_flash), "Mount failed");
+	zassert_ok(session_log_append(&log, SESSION_LOG_RECORD_DATA, 1, data, 5000), "Append failed");
+
+	// Appending after a remount continues the same block.
+	zassert_ok(session_log_mount(&log, &ram_log_flash), "Mount failed");
+	uint32_t seq = log.seq;
+	zassert_ok(session_log_append(&log, SESSION_LOG_RECORD_DATA, 1, &data[5000], 100), "Append failed");
+	zassert_equal(log.seq, seq, "A block was opened");
+
+	zassert_equal(read_session(&log, 1, buf, sizeof(buf)), 5100, "Wrong session length");
+	zassert_mem_equal(buf, data, 5100, "Wrong session data");
+
+	// Mounting reads one header per block, then the records of the head block.
+	ram.reads = 0;
+	zassert_ok(session_log_mount(&log, &ram_log_flash), "Mount failed");
+	zassert_equal(ram.reads, NB_BLOCKS + 3, "Mount must not read the whole log");
+}
+
+ZTEST(session_log, test_wrap)
+{
+	static uint8_t buf[sizeof(data)];
+	session_log_t log;
+	session_log_cursor_t cursor;
+	session_log_record_header_t hdr;
+	uint32_t session = 0;
+
+	zassert_ok(session_log_mount(&log, &ram_log_flash), "Mount failed");
+	// Twice the size of the log, the first sessions are overwritten.
+	for (session = 0; session < 2 * NB_BLOCKS; session++) {
+		fill_data(session);
+		zassert_ok(session_log_append(&log, SESSION_LOG_RECORD_START, session, NULL, 0), "Append failed");
+		zassert_ok(session_log_append(&log, SESSION_LOG_RECORD_DATA, session, data, BLOCK_SIZE - 100), "Append failed");
+	}
+	zassert_true(log.seq > NB_BLOCKS, "Log must wrap around");
+	zassert_equal(ram.erases, log.seq, "Each block must be erased once when opened");
+
+	zassert_ok(session_log_mount(&log, &ram_log_flash), "Mount failed");
+	session_log_cursor_init(&log, &cursor);
+	uint32_t prev = 0;
+	bool first = true;
+	while (session_log_next(&log, &cursor, &hdr) == 0) {
+		zassert_true(first || hdr.session >= prev, "Records must be read oldest first");
+		prev = hdr.session;
+		first = false;
+	}
+	zassert_false(first, "Log must not be empty");
+	zassert_equal(prev, session - 1, "Last session missing");
+
+	fill_data(session - 1);
+	zassert_equal(read_session(&log, session - 1, buf, sizeof(buf)), BLOCK_SIZE - 100, "Wrong session length");
+	zassert_mem_equal(buf, data, BLOCK_SIZE - 100, "Wrong session data");
+	zassert_equal(read_session(&log, 0, buf, sizeof(buf)), 0, "First session must be overwritten");
+}
+
+ZTEST(session_log, test_torn_record)
+{
+	static uint8_t buf[sizeof(data)];
+	session_log_t log;
+
+	fill_data(3);
+	zassert_ok(session_log_mount(&log, &ram_log_flash), "Mount failed");
+	zassert_ok(session_log_append(&log, SESSION_LOG_RECORD_DATA, 1, data, 1000), "Append failed");
+
+	// Reset while writing the data of the next record.
+	ram.write_budget = sizeof(session_log_record_header_t) + 200;
+	zassert_equal(session_log_append(&log, SESSION_LOG_RECORD_DATA, 1, &data[1000], 1000), -EIO,
+		      "Write must fail");
+	ram.write_budget = SIZE_MAX;
+
+	zassert_ok(session_log_mount(&log, &ram_log_flash), "Mount failed");
+	zassert_equal(read_session(&log, 1, buf, sizeof(buf)), 1000, "Wrong session length");
+	zassert_equal(bad_records, 1, "Torn record must be reported");
+
+	// The torn record is skipped, and the next ones are readable.
+	session_log_cursor_t cursor;
+	session_log_record_header_t hdr;
+	zassert_ok(session_log_append(&log, SESSION_LOG_RECORD_DATA, 2, data, 500), "Append failed");
+	session_log_cursor_init(&log, &cursor);
+	zassert_ok(session_log_next(&log, &cursor, &hdr), "First record must be valid");
+	zassert_equal(session_log_next(&log, &cursor, &hdr), -EBADMSG, "Torn record must fail its CRC");
+	zassert_ok(session_log_next(&log, &cursor, &hdr), "Next record must be valid");
+	zassert_equal(hdr.session, 2, "Wrong session");
+	zassert_equal(session_log_next(&log, &cursor, &hdr), -ENOENT, "No more records");
+
+	// Reset while writing the magic of a record header: the block is closed.
+	ram.write_budget = 1;
+	zassert_equal(session_log_append(&log, SESSION_LOG_RECORD_DATA, 3, data, 100), -EIO, "Write must fail");
+	ram.write_budget = SIZE_MAX;
+	zassert_ok(session_log_mount(&log, &ram_log_flash), "Mount failed");
+	uint32_t seq = log.seq;
+	zassert_ok(session_log_append(&log, SESSION_LOG_RECORD_DATA, 3, data, 100), "Append failed");
+	zassert_equal(log.seq, seq + 1, "A block must be opened");
+	zassert_equal(read_session(&log, 3, buf, sizeof(buf)), 100, "Wrong session length");
+}
+
+ZTEST(session_log, test_flags_and_clear)
+{
+	session_log_t log;
+	session_log_cursor_t cursor;
+	session_log_record_header_t hdr;
+
+	fill_data(4);
+	zassert_ok(session_log_mount(&log, &ram_log_flash), "Mount failed");
+	zassert_equal(session_log_append(&log, SESSION_LOG_RECORD_START, 1, data, BLOCK_SIZE), -EMSGSIZE,
+		      "Metadata must fit in a record");
+	zassert_ok(session_log_append(&log, SESSION_LOG_RECORD_DATA, 1, data, 300), "Append failed");
+
+	session_log_cursor_init(&log, &cursor);
+	zassert_ok(session_log_next(&log, &cursor, &hdr), "Record missing");
+	zassert_equal(hdr.flags, UINT32_MAX, "Flags must be erased");
+	zassert_ok(session_log_clear_flags(&log, &cursor, SESSION_LOG_FLAG_EXPORTED), "Clear flags failed");
+
+	session_log_cursor_init(&log, &cursor);
+	zassert_ok(session_log_next(&log, &cursor, &hdr), "Flags must not change the CRC");
+	zassert_equal(hdr.flags, UINT32_MAX & ~SESSION_LOG_FLAG_EXPORTED, "Flag not cleared");
+
+	zassert_ok(session_log_clear(&log), "Clear failed");
+	zassert_ok(session_log_mount(&log, &ram_log_flash), "Mount failed");
+	zassert_equal(log.seq, 0, "Log must be empty");
+	zassert_ok(session_log_append(&log, SESSION_LOG_RECORD_DATA, 2, data, 300), "Append failed");
+	zassert_equal(log.head, 0, "Empty log must start at the first block");
+}
+
+ZTEST_SUITE(session_log, NULL, NULL, before, NULL, NULL);
@@ -0,0 +1,130 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+/*
+ * @file test session_meta_cache library
+ *
+ * This suite runs the metadata cache in front of a disk in memory, and checks that it writes each
+ * erase block once per flush while the disk reads back what was written.
+ */
+
+#include <string.h>
+
+#include <zephyr/ztest.h>
+
+#include <app/lib/session_meta_cache.h>
+
+#define DISK_SECTOR_SIZE 512
+#define DISK_LINE_SECTORS 8
+#define DISK_SECTORS (16 * DISK_LINE_SECTORS)
+#define CACHE_LINES 3
+
+/* A flash disk in memory, which counts the erase blocks it writes. */
+struct mem_disk {
+	uint8_t data[DISK_SECTORS * DISK_SECTOR_SIZE];
+	uint32_t reads;
+	uint32_t blocks_written;
+};
+
+static int mem_disk_read(void *ctx, uint8_t *buf, uint32_t sector, uint32_t count)
+{
+	struct mem_disk *disk = ctx;
+
+	memcpy(buf, &disk->data[sector * DISK_SECTOR_SIZE], count * DISK_SECTOR_SIZE);
+	disk->reads++;
+	return 0;
+}
+
+static int mem_disk_write(void *ctx, const uint8_t *buf, uint32_t sector, uint32_t count)
+{
+	struct mem_disk *disk = ctx;
+
+	memcpy(&disk->data[sector * DISK_SECTOR_SIZE], buf, count * DISK_SECTOR_SIZE);
+	disk->blocks_written += (sector + count - 1) / DISK_LINE_SECTORS - sector / DISK_LINE_SECTORS + 1;
+	return 0;
+}
+
+static struct mem_disk meta_disk;
+static uint8_t meta_cache_buf[CACHE_LINES * DISK_LINE_SECTORS * DISK_SECTOR_SIZE];
+static session_meta_cache_entry_t meta_cache_entries[CACHE_LINES];
+static uint8_t meta_sector[DISK_LINE_SECTORS * 2 * DISK_SECTOR_SIZE];
+
+ZTEST(session_meta_cache, test_meta_cache)
+{
+	static session_meta_cache_t cache;
+	static uint8_t expected[DISK_SECTORS * DISK_SECTOR_SIZE];
+
+	memset(&meta_disk, 0, sizeof(meta_disk));
+	zassert_equal(session_meta_cache_init(&cache, mem_disk_read, mem_disk_write, &meta_disk, meta_cache_entries,
+					      meta_cache_buf, 0, DISK_SECTOR_SIZE, DISK_LINE_SECTORS),
+		      -EINVAL, "A cache needs lines");
+	zassert_ok(session_meta_cache_init(&cache, mem_disk_read, mem_disk_write, &meta_disk, meta_cache_entries,
+					   meta_cache_buf, CACHE_LINES, DISK_SECTOR_SIZE, DISK_LINE_SECTORS),
+		   "Init failed");
+
+	// Updates of the same sectors, like a FAT during a recording, are written back once.
+	for (int ii = 0; ii < 100; ii++) {
+		memset(meta_sector, ii, DISK_SECTOR_SIZE);
+		zassert_ok(session_meta_cache_write(&cache, meta_sector, 1 + ii % 2, 1), "Write failed");
+		memcpy(&expected[(1 + ii % 2) * DISK_SECTOR_SIZE], meta_sector, DISK_SECTOR_SIZE);
+	}
+	zassert_equal(meta_disk.blocks_written, 0, "Nothing is written before a flush");
+	zassert_equal(cache.stats.misses, 1, "Only the first write reads its line");
+	zassert_equal(cache.stats.hits, 99, "Wrong number of hits");
+	zassert_equal(session_meta_cache_dirty(&cache), 1, "One dirty line");
+	zassert_ok(session_meta_cache_read(&cache, meta_sector, 2, 1), "Read failed");
+	zassert_mem_equal(meta_sector, &expected[2 * DISK_SECTOR_SIZE], DISK_SECTOR_SIZE, "The cache holds the last write");
+	zassert_equal(session_meta_cache_flush(&cache), 1, "One line flushed");
+	zassert_equal(meta_disk.blocks_written, 1, "The updates cost one erase block");
+	zassert_mem_equal(meta_disk.data, expected, sizeof(expected), "Disk differs after the flush");
+	zassert_equal(session_meta_cache_flush(&cache), 0, "Nothing left to flush");
+
+	// Whole lines bypass the cache, the lines they overlap stay coherent.
+	memset(meta_sector, 0xA5, sizeof(meta_sector));
+	zassert_ok(session_meta_cache_write(&cache, meta_sector, 0, 2 * DISK_LINE_SECTORS), "Write failed");
+	memcpy(expected, meta_sector, sizeof(meta_sector));
+	zassert_equal(cache.stats.bypassed, 2, "Whole lines go to the disk");
+	zassert_ok(session_meta_cache_read(&cache, meta_sector, 3, 1), "Read failed");
+	zassert_mem_equal(meta_sector, &expected[3 * DISK_SECTOR_SIZE], DISK_SECTOR_SIZE, "Stale cached line");
+	memset(meta_sector, 0x5A, DISK_SECTOR_SIZE);
+	zassert_ok(session_meta_cache_write(&cache, meta_sector, DISK_LINE_SECTORS + 7, 1), "Write failed");
+	memcpy(&expected[(DISK_LINE_SECTORS + 7) * DISK_SECTOR_SIZE], meta_sector, DISK_SECTOR_SIZE);
+	zassert_ok(session_meta_cache_read(&cache, meta_sector, 0, 2 * DISK_LINE_SECTORS), "Read failed");
+	zassert_mem_equal(meta_sector, expected, sizeof(meta_sector), "Whole line reads must see dirty lines");
+
+	// Least recently used lines are evicted, and written back when dirty.
+	uint32_t written = meta_disk.blocks_written;
+	for (int line = 2; line < 2 + CACHE_LINES; line++) {
+		memset(meta_sector, line, DISK_SECTOR_SIZE);
+		zassert_ok(session_meta_cache_write(&cache, meta_sector, line * DISK_LINE_SECTORS, 1), "Write failed");
+		memcpy(&expected[line * DISK_LINE_SECTORS * DISK_SECTOR_SIZE], meta_sector, DISK_SECTOR_SIZE);
+	}
+	zassert_equal(cache.stats.evictions, 1, "Line 1 must be evicted");
+	zassert_equal(meta_disk.blocks_written, written + 1, "The evicted line is written back");
+	zassert_equal(session_meta_cache_flush(&cache), CACHE_LINES, "All the lines are dirty");
+	zassert_mem_equal(meta_disk.data, expected, sizeof(expected), "Disk differs after the evictions");
+
+	// Data written through reaches the disk at once, and the cached line it overlaps follows.
+	written = meta_disk.blocks_written;
+	memset(meta_sector, 0x3C, DISK_SECTOR_SIZE);
+	zassert_ok(session_meta_cache_write_through(&cache, meta_sector, 3 * DISK_LINE_SECTORS + 2, 1), "Write failed");
+	memcpy(&expected[(3 * DISK_LINE_SECTORS + 2) * DISK_SECTOR_SIZE], meta_sector, DISK_SECTOR_SIZE);
+	zassert_equal(meta_disk.blocks_written, written + 1, "Data must be written at once");
+	zassert_equal(cache.stats.written_through, 1, "Wrong number of writes through");
+	zassert_equal(session_meta_cache_dirty(&cache), 0, "Data written through is not dirty");
+	zassert_ok(session_meta_cache_read(&cache, meta_sector, 3 * DISK_LINE_SECTORS + 2, 1), "Read failed");
+	zassert_mem_equal(meta_sector, &expected[(3 * DISK_LINE_SECTORS + 2) * DISK_SECTOR_SIZE], DISK_SECTOR_SIZE,
+			  "Stale cached line");
+	zassert_mem_equal(meta_disk.data, expected, sizeof(expected), "Disk differs after the write through");
+
+	// A line written behind the cache is dropped.
+	zassert_ok(session_meta_cache_write(&cache, meta_sector, 2 * DISK_LINE_SECTORS + 1, 1), "Write failed");
+	memset(&meta_disk.data[2 * DISK_LINE_SECTORS * DISK_SECTOR_SIZE], 0xFF, DISK_LINE_SECTORS * DISK_SECTOR_SIZE);
+	session_meta_cache_invalidate(&cache, 2 * DISK_LINE_SECTORS, DISK_LINE_SECTORS);
+	zassert_equal(session_meta_cache_dirty(&cache), 0, "The invalidated line must not be flushed");
+	zassert_ok(session_meta_cache_read(&cache, meta_sector, 2 * DISK_LINE_SECTORS, 1), "Read failed");
+	zassert_equal(meta_sector[0], 0xFF, "The line must be read again");
+}
+
+ZTEST_SUITE(session_meta_cache, NULL, NULL, NULL, NULL, NULL);